@@ -2,16 +2,31 @@
 #include <linux/types.h>
 
 /* Define constants if headers are being difficult */
+#define AF_INET 2
+#define AF_INET6 10
 #define IPPROTO_ICMP 1
+#define IPPROTO_TCP 6
 #define IPPROTO_UDP 17
+#define IPPROTO_ICMPV6 58
+#define ICMP_ECHOREPLY 0
 #define ICMP_DEST_UNREACH 3
+#define ICMP_ECHO 8
 #define ICMP_TIME_EXCEEDED 11
+#define ICMPV6_DEST_UNREACH 1
+#define ICMPV6_TIME_EXCEED 3
+#define ICMPV6_ECHO_REQUEST 128
+#define ICMPV6_ECHO_REPLY 129
+#define TCP_FLAG_SYN 0x02
+#define TCP_FLAG_RST 0x04
+#define TCP_FLAG_ACK 0x10
 
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_endian.h>
 #include <bpf/bpf_tracing.h>
 #include <bpf/bpf_core_read.h>
 
+#include "probe_event.h"
+
 char LICENSE[] SEC("license") = "GPL";
 
 /* Minimal pt_regs for x86_64 to satisfy BPF_KPROBE */
@@ -44,6 +59,7 @@ struct sock;
 
 /* Forward declarations for CO-RE */
 struct sk_buff {
+    unsigned char* head;
     unsigned char* data;
     __u16 network_header;
     __u16 transport_header;
@@ -70,6 +86,29 @@ struct udphdr {
     __sum16 check;
 } __attribute__((preserve_access_index));
 
+/* Wire formats only, read into copies: no CO-RE relocations wanted */
+struct ipv6hdr_wire {
+    __u8 priority_version;
+    __u8 flow_lbl[3];
+    __be16 payload_len;
+    __u8 nexthdr;
+    __u8 hop_limit;
+    __u32 saddr[4];
+    __u32 daddr[4];
+};
+
+struct tcphdr_wire {
+    __be16 source;
+    __be16 dest;
+    __be32 seq;
+    __be32 ack_seq;
+    __u8 doff;
+    __u8 flags;
+    __be16 window;
+    __sum16 check;
+    __be16 urg_ptr;
+};
+
 struct icmphdr {
     __u8 type;
     __u8 code;
@@ -107,52 +146,30 @@ struct {
     __type(value, struct probe_value);
 } probes SEC(".maps");
 
-struct probe_event {
-    __u32 saddr[4];
-    __u32 daddr[4];
-    __u16 sport;
-    __u16 dport;
-    __u8 protocol;
-    __u8 ttl;
-    __u64 send_time_ns;
-    __u64 recv_time_ns;
-    __u8 icmp_type;
-    __u8 icmp_code;
-    __u32 ifindex;
-    __u8 is_reply;
-};
-
 struct {
     __uint(type, BPF_MAP_TYPE_RINGBUF);
     __uint(max_entries, 256 * 1024);
 } events SEC(".maps");
 
-#define NUM_BUCKETS 64
-struct histogram {
-    __u64 buckets[NUM_BUCKETS];
-};
-
+/* Per-cpu, so each cpu counts into its own copy without atomics */
 struct {
-    __uint(type, BPF_MAP_TYPE_ARRAY);
-    __uint(max_entries, 256);
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, BPF_HIST_HOPS);
     __type(key, __u32);
-    __type(value, struct histogram);
+    __type(value, struct probe_hist);
 } hop_histograms SEC(".maps");
 
-static __always_inline void fill_key_ipv4(struct probe_key* key,
-                                          __u32 saddr,
-                                          __u32 daddr,
-                                          __u16 sport,
-                                          __u16 dport,
-                                          __u8 proto) {
-    key->saddr[0] = saddr;
-    key->saddr[1] = 0;
-    key->saddr[2] = 0;
-    key->saddr[3] = 0;
-    key->daddr[0] = daddr;
-    key->daddr[1] = 0;
-    key->daddr[2] = 0;
-    key->daddr[3] = 0;
+/* IPv4 addresses take the first word   */
+static __always_inline void fill_key(struct probe_key* key,
+                                     const __u32* saddr,
+                                     const __u32* daddr,
+                                     __u16 sport,
+                                     __u16 dport,
+                                     __u8 proto) {
+    for (int i = 0; i < 4; i++) {
+        key->saddr[i] = saddr[i];
+        key->daddr[i] = daddr[i];
+    }
     key->sport = sport;
     key->dport = dport;
     key->protocol = proto;
@@ -160,72 +177,243 @@ static __always_inline void fill_key_ipv4(struct probe_key* key,
 
 static __always_inline void update_histogram(__u32 ttl, __u64 rtt_ns) {
     __u32 hop = ttl;
-    if (hop >= 256)
-        return;
+    __u32 bucket;
 
-    struct histogram* hist = bpf_map_lookup_elem(&hop_histograms, &hop);
+    struct probe_hist* hist = bpf_map_lookup_elem(&hop_histograms, &hop);
     if (!hist)
         return;
 
-    // log2 bucket
-    __u64 bucket = 0;
-    __u64 val = rtt_ns / 1000000;  // ms
-    if (val > 0) {
-        bucket = 64 - __builtin_clzll(val);
-        if (bucket >= NUM_BUCKETS)
-            bucket = NUM_BUCKETS - 1;
+    bucket = bpf_hist_index(rtt_ns / 1000);
+    if (bucket >= BPF_HIST_BUCKETS)
+        return;
+
+    hist->counts[bucket]++;
+}
+
+/*
+ * Reads the ports of a probe of `proto' at `l4' (the id and the sequence
+ * for icmp echo). Returns 0 if it is not a probe. The flags of a quoted
+ * tcp header may be cut off by the router, so only the outgoing ones are
+ * checked for a bare SYN.
+ */
+static __always_inline int read_ports(const unsigned char* l4, __u8 proto, int outgoing, __u16* sport, __u16* dport) {
+    if (proto == IPPROTO_UDP) {
+        struct udphdr udp;
+
+        if (bpf_probe_read_kernel(&udp, sizeof(udp), l4) < 0)
+            return 0;
+        *sport = bpf_ntohs(udp.source);
+        *dport = bpf_ntohs(udp.dest);
+        return 1;
     }
 
-    __sync_fetch_and_add(&hist->buckets[bucket], 1);
+    if (proto == IPPROTO_TCP) {
+        struct tcphdr_wire tcp;
+
+        if (bpf_probe_read_kernel(&tcp, 8, l4) < 0)
+            return 0;
+        if (outgoing) {
+            if (bpf_probe_read_kernel(&tcp, sizeof(tcp), l4) < 0)
+                return 0;
+            if ((tcp.flags & (TCP_FLAG_SYN | TCP_FLAG_ACK)) != TCP_FLAG_SYN)
+                return 0;
+        }
+        *sport = bpf_ntohs(tcp.source);
+        *dport = bpf_ntohs(tcp.dest);
+        return 1;
+    }
+
+    if (proto == IPPROTO_ICMP || proto == IPPROTO_ICMPV6) {
+        struct icmphdr icmp;
+
+        if (bpf_probe_read_kernel(&icmp, sizeof(icmp), l4) < 0)
+            return 0;
+        if (icmp.type != (proto == IPPROTO_ICMP ? ICMP_ECHO : ICMPV6_ECHO_REQUEST))
+            return 0;
+        *sport = bpf_ntohs(icmp.un.echo.id);
+        *dport = bpf_ntohs(icmp.un.echo.sequence);
+        return 1;
+    }
+
+    return 0;
+}
+
+static __always_inline int probe_sent(__u8 family,
+                                      const __u32* saddr,
+                                      const __u32* daddr,
+                                      __u8 proto,
+                                      __u8 ttl,
+                                      const unsigned char* l4) {
+    struct probe_key key = {};
+    struct probe_value val = {};
+    __u16 sport, dport;
+
+    if (!read_ports(l4, proto, 1, &sport, &dport))
+        return 0;
+
+    fill_key(&key, saddr, daddr, sport, dport, proto);
+
+    val.send_time_ns = bpf_ktime_get_ns();
+    val.ttl = ttl;
+
+    bpf_map_update_elem(&probes, &key, &val, BPF_ANY);
+
+    struct probe_event* ev = bpf_ringbuf_reserve(&events, sizeof(*ev), 0);
+    if (!ev)
+        return 0;
+
+    __builtin_memset(ev, 0, sizeof(*ev));
+    for (int i = 0; i < 4; i++) {
+        ev->saddr[i] = saddr[i];
+        ev->daddr[i] = daddr[i];
+    }
+    ev->sport = sport;
+    ev->dport = dport;
+    ev->protocol = proto;
+    ev->ttl = ttl;
+    ev->send_time_ns = val.send_time_ns;
+    ev->is_reply = 0;
+    ev->family = family;
+
+    bpf_ringbuf_submit(ev, 0);
+
+    return 0;
+}
+
+/* `from' has answered to the probe of `key'   */
+static __always_inline int probe_replied(__u8 family,
+                                         struct probe_key* key,
+                                         const __u32* from,
+                                         __u8 type,
+                                         __u8 code) {
+    struct probe_value* val = bpf_map_lookup_elem(&probes, key);
+    if (!val)
+        return 0;
+
+    __u64 recv_time_ns = bpf_ktime_get_ns();
+    __u64 rtt_ns = recv_time_ns - val->send_time_ns;
+
+    update_histogram(val->ttl, rtt_ns);
+
+    struct probe_event* ev = bpf_ringbuf_reserve(&events, sizeof(*ev), 0);
+    if (!ev)
+        return 0;
+
+    __builtin_memset(ev, 0, sizeof(*ev));
+    for (int i = 0; i < 4; i++) {
+        ev->saddr[i] = from[i];
+        ev->daddr[i] = key->daddr[i]; /* the probe's, not ours */
+    }
+    ev->sport = key->sport;
+    ev->dport = key->dport;
+    ev->protocol = key->protocol;
+    ev->ttl = val->ttl;
+    ev->send_time_ns = val->send_time_ns;
+    ev->recv_time_ns = recv_time_ns;
+    ev->icmp_type = type;
+    ev->icmp_code = code;
+    ev->is_reply = 1;
+    ev->family = family;
+
+    bpf_ringbuf_submit(ev, 0);
+
+    return 0;
 }
 
 SEC("kprobe/ip_output")
 int BPF_KPROBE(handle_ip_output, struct net* net, struct sock* sk, struct sk_buff* skb) {
     unsigned char* data = BPF_CORE_READ(skb, data);
+    __u32 saddr[4] = {}, daddr[4] = {};
     struct iphdr ip;
-    struct udphdr udp;
 
     if (bpf_probe_read_kernel(&ip, sizeof(ip), data) < 0)
         return 0;
 
-    if (ip.protocol != IPPROTO_UDP)
+    if (ip.protocol != IPPROTO_UDP && ip.protocol != IPPROTO_TCP && ip.protocol != IPPROTO_ICMP)
+        return 0;
+
+    saddr[0] = ip.saddr;
+    daddr[0] = ip.daddr;
+
+    return probe_sent(AF_INET, saddr, daddr, ip.protocol, ip.ttl, data + (ip.ihl << 2));
+}
+
+SEC("kprobe/ip6_output")
+int BPF_KPROBE(handle_ip6_output, struct net* net, struct sock* sk, struct sk_buff* skb) {
+    unsigned char* data = BPF_CORE_READ(skb, data);
+    struct ipv6hdr_wire ip6;
+
+    if (bpf_probe_read_kernel(&ip6, sizeof(ip6), data) < 0)
         return 0;
 
-    if (bpf_probe_read_kernel(&udp, sizeof(udp), data + (ip.ihl << 2)) < 0)
+    /* Probes with extension headers (`-g') are left to userspace */
+    if (ip6.nexthdr != IPPROTO_UDP && ip6.nexthdr != IPPROTO_TCP && ip6.nexthdr != IPPROTO_ICMPV6)
         return 0;
 
+    return probe_sent(AF_INET6, ip6.saddr, ip6.daddr, ip6.nexthdr, ip6.hop_limit, data + sizeof(ip6));
+}
+
+/* On receive skb->data is past the network header already   */
+static __always_inline unsigned char* network_header(struct sk_buff* skb) {
+    return BPF_CORE_READ(skb, head) + BPF_CORE_READ(skb, network_header);
+}
+
+static __always_inline unsigned char* transport_header(struct sk_buff* skb) {
+    return BPF_CORE_READ(skb, head) + BPF_CORE_READ(skb, transport_header);
+}
+
+/*
+ * The destination answering a tcp SYN probe, by a SYN-ACK or a RST
+ * (no icmp type and code then). `from' is the destination, `to' us.
+ */
+static __always_inline int tcp_answered(__u8 family, struct sk_buff* skb, const __u32* from, const __u32* to) {
     struct probe_key key = {};
-    fill_key_ipv4(&key, ip.saddr, ip.daddr, bpf_ntohs(udp.source), bpf_ntohs(udp.dest), IPPROTO_UDP);
+    struct tcphdr_wire tcp;
 
-    struct probe_value val = {};
-    val.send_time_ns = bpf_ktime_get_ns();
-    val.ttl = ip.ttl;
+    if (bpf_probe_read_kernel(&tcp, sizeof(tcp), transport_header(skb)) < 0)
+        return 0;
 
-    bpf_map_update_elem(&probes, &key, &val, BPF_ANY);
+    if ((tcp.flags & (TCP_FLAG_SYN | TCP_FLAG_ACK)) != (TCP_FLAG_SYN | TCP_FLAG_ACK) && !(tcp.flags & TCP_FLAG_RST))
+        return 0;
 
-    struct probe_event* ev = bpf_ringbuf_reserve(&events, sizeof(*ev), 0);
-    if (!ev)
+    fill_key(&key, to, from, bpf_ntohs(tcp.dest), bpf_ntohs(tcp.source), IPPROTO_TCP);
+
+    return probe_replied(family, &key, from, 0, 0);
+}
+
+SEC("kprobe/tcp_v4_rcv")
+int BPF_KPROBE(handle_tcp_v4_rcv, struct sk_buff* skb) {
+    __u32 from[4] = {}, to[4] = {};
+    struct iphdr ip;
+
+    if (bpf_probe_read_kernel(&ip, sizeof(ip), network_header(skb)) < 0)
         return 0;
 
-    ev->saddr[0] = ip.saddr;
-    ev->daddr[0] = ip.daddr;
-    ev->sport = bpf_ntohs(udp.source);
-    ev->dport = bpf_ntohs(udp.dest);
-    ev->protocol = IPPROTO_UDP;
-    ev->ttl = ip.ttl;
-    ev->send_time_ns = val.send_time_ns;
-    ev->is_reply = 0;
+    from[0] = ip.saddr;
+    to[0] = ip.daddr;
 
-    bpf_ringbuf_submit(ev, 0);
+    return tcp_answered(AF_INET, skb, from, to);
+}
 
-    return 0;
+SEC("kprobe/tcp_v6_rcv")
+int BPF_KPROBE(handle_tcp_v6_rcv, struct sk_buff* skb) {
+    struct ipv6hdr_wire ip6;
+
+    if (bpf_probe_read_kernel(&ip6, sizeof(ip6), network_header(skb)) < 0)
+        return 0;
+
+    return tcp_answered(AF_INET6, skb, ip6.saddr, ip6.daddr);
 }
 
 SEC("kprobe/icmp_rcv")
 int BPF_KPROBE(handle_icmp_rcv, struct sk_buff* skb) {
-    unsigned char* data = BPF_CORE_READ(skb, data);
-    struct iphdr ip;
+    unsigned char* data = network_header(skb);
+    __u32 from[4] = {}, to[4] = {};
+    __u32 saddr[4] = {}, daddr[4] = {};
+    struct probe_key key = {};
+    struct iphdr ip, inner_ip;
     struct icmphdr icmp;
+    __u16 sport, dport;
 
     if (bpf_probe_read_kernel(&ip, sizeof(ip), data) < 0)
         return 0;
@@ -236,51 +424,66 @@ int BPF_KPROBE(handle_icmp_rcv, struct sk_buff* skb) {
     if (bpf_probe_read_kernel(&icmp, sizeof(icmp), data + (ip.ihl << 2)) < 0)
         return 0;
 
+    from[0] = ip.saddr;
+    to[0] = ip.daddr;
+
+    /* The destination answering an icmp echo probe   */
+    if (icmp.type == ICMP_ECHOREPLY) {
+        fill_key(&key, to, from, bpf_ntohs(icmp.un.echo.id), bpf_ntohs(icmp.un.echo.sequence), IPPROTO_ICMP);
+        return probe_replied(AF_INET, &key, from, icmp.type, icmp.code);
+    }
+
     if (icmp.type != ICMP_TIME_EXCEEDED && icmp.type != ICMP_DEST_UNREACH)
         return 0;
 
     // Inner packet starts after ICMP header (8 bytes)
-    struct iphdr inner_ip;
     if (bpf_probe_read_kernel(&inner_ip, sizeof(inner_ip), data + (ip.ihl << 2) + 8) < 0)
         return 0;
 
-    if (inner_ip.protocol != IPPROTO_UDP)
+    if (!read_ports(data + (ip.ihl << 2) + 8 + (inner_ip.ihl << 2), inner_ip.protocol, 0, &sport, &dport))
         return 0;
 
-    struct udphdr inner_udp;
-    if (bpf_probe_read_kernel(&inner_udp, sizeof(inner_udp), data + (ip.ihl << 2) + 8 + (inner_ip.ihl << 2)) < 0)
-        return 0;
+    saddr[0] = inner_ip.saddr;
+    daddr[0] = inner_ip.daddr;
+    fill_key(&key, saddr, daddr, sport, dport, inner_ip.protocol);
 
+    return probe_replied(AF_INET, &key, from, icmp.type, icmp.code);
+}
+
+SEC("kprobe/icmpv6_rcv")
+int BPF_KPROBE(handle_icmpv6_rcv, struct sk_buff* skb) {
+    unsigned char* data = network_header(skb);
     struct probe_key key = {};
-    fill_key_ipv4(&key, inner_ip.saddr, inner_ip.daddr, bpf_ntohs(inner_udp.source), bpf_ntohs(inner_udp.dest),
-                  IPPROTO_UDP);
+    struct ipv6hdr_wire ip6, inner_ip6;
+    struct icmphdr icmp;
+    __u16 sport, dport;
 
-    struct probe_value* val = bpf_map_lookup_elem(&probes, &key);
-    if (!val)
+    if (bpf_probe_read_kernel(&ip6, sizeof(ip6), data) < 0)
         return 0;
 
-    __u64 recv_time_ns = bpf_ktime_get_ns();
-    __u64 rtt_ns = recv_time_ns - val->send_time_ns;
+    /* Replies with extension headers are left to userspace */
+    if (ip6.nexthdr != IPPROTO_ICMPV6)
+        return 0;
 
-    update_histogram(val->ttl, rtt_ns);
+    if (bpf_probe_read_kernel(&icmp, sizeof(icmp), data + sizeof(ip6)) < 0)
+        return 0;
 
-    struct probe_event* ev = bpf_ringbuf_reserve(&events, sizeof(*ev), 0);
-    if (!ev)
+    if (icmp.type == ICMPV6_ECHO_REPLY) {
+        fill_key(&key, ip6.daddr, ip6.saddr, bpf_ntohs(icmp.un.echo.id), bpf_ntohs(icmp.un.echo.sequence),
+                 IPPROTO_ICMPV6);
+        return probe_replied(AF_INET6, &key, ip6.saddr, icmp.type, icmp.code);
+    }
+
+    if (icmp.type != ICMPV6_TIME_EXCEED && icmp.type != ICMPV6_DEST_UNREACH)
         return 0;
 
-    ev->saddr[0] = ip.saddr;
-    ev->daddr[0] = ip.daddr;
-    ev->sport = bpf_ntohs(inner_udp.source);
-    ev->dport = bpf_ntohs(inner_udp.dest);
-    ev->protocol = IPPROTO_UDP;
-    ev->ttl = val->ttl;
-    ev->send_time_ns = val->send_time_ns;
-    ev->recv_time_ns = recv_time_ns;
-    ev->icmp_type = icmp.type;
-    ev->icmp_code = icmp.code;
-    ev->is_reply = 1;
+    if (bpf_probe_read_kernel(&inner_ip6, sizeof(inner_ip6), data + sizeof(ip6) + 8) < 0)
+        return 0;
 
-    bpf_ringbuf_submit(ev, 0);
+    if (!read_ports(data + 2 * sizeof(ip6) + 8, inner_ip6.nexthdr, 0, &sport, &dport))
+        return 0;
 
-    return 0;
+    fill_key(&key, inner_ip6.saddr, inner_ip6.daddr, sport, dport, inner_ip6.nexthdr);
+
+    return probe_replied(AF_INET6, &key, ip6.saddr, icmp.type, icmp.code);
 }
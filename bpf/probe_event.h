@@ -0,0 +1,72 @@
+#ifndef TRACEROUTE_BPF_PROBE_EVENT_H
+#define TRACEROUTE_BPF_PROBE_EVENT_H
+
+#include <linux/types.h>
+
+/*
+ * Shared between probe.bpf.c and userspace.
+ *
+ * Sent by probe.bpf.c through the `events' ring buffer, for each probe
+ * sent and each reply to one. The ports are in the host byte order,
+ * for icmp echo probes they are the id and the sequence. A tcp probe
+ * answered by the destination itself (SYN-ACK or RST) has no icmp
+ * type and code.
+ */
+struct probe_event {
+    __u32 saddr[4]; /* the replying router, or the prober */
+    __u32 daddr[4]; /* the probe's destination */
+    __u16 sport;
+    __u16 dport;
+    __u8 protocol; /* of the probe */
+    __u8 ttl;
+    __u64 send_time_ns;
+    __u64 recv_time_ns;
+    __u8 icmp_type;
+    __u8 icmp_code;
+    __u32 ifindex;
+    __u8 is_reply; /* 1 for reply, 0 for sent probe */
+    __u8 family;   /* AF_INET or AF_INET6 */
+};
+
+/*
+ * Per hop RTT histograms (the `hop_histograms' per-cpu array, indexed
+ * by ttl), in microseconds: values below BPF_HIST_SUB are counted one
+ * by one, each next power of two range is split into BPF_HIST_SUB
+ * linear buckets, so a bucket is within 1/BPF_HIST_SUB of its values.
+ * Values of 2^(BPF_HIST_MAX_BIT + 1) and more go to the last bucket.
+ */
+#define BPF_HIST_SUB_BITS 3
+#define BPF_HIST_SUB (1 << BPF_HIST_SUB_BITS)
+#define BPF_HIST_MAX_BIT 26 /* about a minute */
+#define BPF_HIST_BUCKETS ((BPF_HIST_MAX_BIT - BPF_HIST_SUB_BITS + 2) * BPF_HIST_SUB)
+#define BPF_HIST_HOPS 256
+
+struct probe_hist {
+    __u32 counts[BPF_HIST_BUCKETS];
+};
+
+static inline __u32 bpf_hist_index(__u64 us) {
+    __u32 bit;
+
+    if (us < BPF_HIST_SUB)
+        return us;
+
+    bit = 63 - __builtin_clzll(us);
+    if (bit > BPF_HIST_MAX_BIT)
+        return BPF_HIST_BUCKETS - 1;
+
+    return (bit - BPF_HIST_SUB_BITS + 1) * BPF_HIST_SUB + ((us >> (bit - BPF_HIST_SUB_BITS)) & (BPF_HIST_SUB - 1));
+}
+
+/* The lowest value counted by bucket `index' */
+static inline __u64 bpf_hist_lowest(__u32 index) {
+    __u32 group = index >> BPF_HIST_SUB_BITS;
+    __u32 bit = group + BPF_HIST_SUB_BITS - 1;
+
+    if (!group)
+        return index;
+
+    return (1ULL << bit) + ((__u64)(index & (BPF_HIST_SUB - 1)) << (bit - BPF_HIST_SUB_BITS));
+}
+
+#endif /* TRACEROUTE_BPF_PROBE_EVENT_H */
@@ -3,14 +3,24 @@
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_endian.h>
 
+#include "xdp_probe.h"
+
 #define ETH_P_IP 0x0800
 #define ETH_P_IPV6 0x86DD
+#define AF_INET 2
+#define AF_INET6 10
 #define IPPROTO_ICMP 1
+#define IPPROTO_TCP 6
+#define IPPROTO_UDP 17
+#define IPPROTO_DCCP 33
 #define IPPROTO_ICMPV6 58
+#define IPPROTO_UDPLITE 136
 #define ICMP_DEST_UNREACH 3
+#define ICMP_ECHO 8
 #define ICMP_TIME_EXCEEDED 11
 #define ICMPV6_DEST_UNREACH 1
 #define ICMPV6_TIME_EXCEED 3
+#define ICMPV6_ECHO_REQUEST 128
 
 struct ethhdr {
     unsigned char h_dest[6];
@@ -58,11 +68,77 @@ struct icmp6hdr {
 
 struct {
     __uint(type, BPF_MAP_TYPE_XSKMAP);
-    __uint(max_entries, 64);
+    __uint(max_entries, XDP_MAX_QUEUES);
     __type(key, __u32);
     __type(value, __u32);
 } xsks SEC(".maps");
 
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, XDP_INFLIGHT_MAX);
+    __type(key, struct xdp_probe_key);
+    __type(value, __u64);
+} inflight SEC(".maps");
+
+/* The ports (or the echo id and sequence) of the quoted probe */
+static __always_inline int quoted_ports(void* l4, void* data_end, __u8 protocol, __u8 echo_type,
+                                        struct xdp_probe_key* key) {
+    __be16* w = l4;
+
+    /* at least 8 bytes are always quoted */
+    if ((void*)(w + 4) > data_end)
+        return -1;
+
+    switch (protocol) {
+    case IPPROTO_UDP:
+    case IPPROTO_TCP:
+    case IPPROTO_DCCP:
+    case IPPROTO_UDPLITE:
+        key->sport = w[0];
+        key->dport = w[1];
+        break;
+    case IPPROTO_ICMP:
+    case IPPROTO_ICMPV6:
+        if (*(__u8*)l4 != echo_type)
+            return -1;
+        key->sport = w[2];
+        key->dport = w[3];
+        break;
+    }
+
+    return 0;
+}
+
+/* Whether the quoted probe is ours and still waited for */
+static __always_inline int in_flight(struct xdp_probe_key* key) {
+    __u64* expires = bpf_map_lookup_elem(&inflight, key);
+
+    if (!expires || *expires < bpf_ktime_get_ns())
+        return 0;
+
+    bpf_map_delete_elem(&inflight, key);
+
+    return 1;
+}
+
+/* Stamps the receive time and hands the frame to the XSK of its queue */
+static __always_inline int redirect(struct xdp_md* ctx) {
+    __u64 now = bpf_ktime_get_ns();
+
+    if (bpf_xdp_adjust_meta(ctx, -(int)sizeof(struct xdp_rx_meta)) == 0) {
+        void* data = (void*)(long)ctx->data;
+        struct xdp_rx_meta* meta = (void*)(long)ctx->data_meta;
+
+        if ((void*)(meta + 1) <= data) {
+            meta->magic = XDP_RX_META_MAGIC;
+            meta->pad = 0;
+            meta->rx_time_ns = now;
+        }
+    }
+
+    return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+}
+
 SEC("xdp")
 int xdp_prog(struct xdp_md* ctx) {
     void* data_end = (void*)(long)ctx->data_end;
@@ -84,7 +160,23 @@ int xdp_prog(struct xdp_md* ctx) {
                 return XDP_PASS;
 
             if (icmp->type == ICMP_TIME_EXCEEDED || icmp->type == ICMP_DEST_UNREACH) {
-                return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+                struct iphdr* inner = (void*)(icmp + 1);
+                struct xdp_probe_key key = {};
+                __u32 ihl;
+
+                if ((void*)(inner + 1) > data_end)
+                    return XDP_PASS;
+                ihl = inner->ihl * 4;
+                if (ihl < sizeof(*inner))
+                    return XDP_PASS;
+
+                key.daddr[0] = inner->daddr;
+                key.protocol = inner->protocol;
+                key.family = AF_INET;
+
+                if (quoted_ports((__u8*)inner + ihl, data_end, inner->protocol, ICMP_ECHO, &key) == 0 &&
+                    in_flight(&key))
+                    return redirect(ctx);
             }
         }
     }
@@ -99,7 +191,19 @@ int xdp_prog(struct xdp_md* ctx) {
                 return XDP_PASS;
 
             if (icmp6->icmp6_type == ICMPV6_TIME_EXCEED || icmp6->icmp6_type == ICMPV6_DEST_UNREACH) {
-                return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+                struct ipv6hdr* inner = (void*)(icmp6 + 1);
+                struct xdp_probe_key key = {};
+
+                if ((void*)(inner + 1) > data_end)
+                    return XDP_PASS;
+
+                __builtin_memcpy(key.daddr, &inner->daddr, sizeof(key.daddr));
+                key.protocol = inner->nexthdr; /* quoted extension headers go the kernel way */
+                key.family = AF_INET6;
+
+                if (quoted_ports(inner + 1, data_end, inner->nexthdr, ICMPV6_ECHO_REQUEST, &key) == 0 &&
+                    in_flight(&key))
+                    return redirect(ctx);
             }
         }
     }
@@ -0,0 +1,44 @@
+#ifndef TRACEROUTE_BPF_XDP_PROBE_H
+#define TRACEROUTE_BPF_XDP_PROBE_H
+
+#include <linux/types.h>
+
+/*
+ * Shared between xdp_probe.bpf.c and userspace.
+ *
+ * Put in the metadata area, right before each frame redirected to the
+ * XSK: the receive time at the driver, by the monotonic clock. The magic
+ * tells it from whatever the headroom had, as not all the drivers (and
+ * not the copy mode) keep the metadata.
+ */
+#define XDP_RX_META_MAGIC 0x74727863 /* "trxc" */
+
+struct xdp_rx_meta {
+    __u32 magic;
+    __u32 pad;
+    __u64 rx_time_ns;
+};
+
+/* Entries of the `xsks' map, one XSK per rx queue */
+#define XDP_MAX_QUEUES 64
+
+/*
+ * The `inflight' map: the probes sent and not answered yet, by what an
+ * icmp error quotes of them. Only the errors quoting one of these are
+ * redirected to the XSK (the entry goes away then), all the others are
+ * passed on to the kernel. The value is when the probe expires, by the
+ * monotonic clock, in ns. The source is not there, as the kernel picks
+ * it for the unbound sockets.
+ */
+#define XDP_INFLIGHT_MAX 65536
+
+struct xdp_probe_key {
+    __u32 daddr[4]; /* IPv4 in the first word */
+    __be16 sport;   /* for icmp echo the id */
+    __be16 dport;   /* for icmp echo the sequence */
+    __u8 protocol;
+    __u8 family; /* AF_INET or AF_INET6 */
+    __u16 pad;
+};
+
+#endif /* TRACEROUTE_BPF_XDP_PROBE_H */
@@ -0,0 +1,517 @@
+#include "annot_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define STR_MAX 254
+#define DATA_ROOM 65536           // initial room for the records
+#define COMPACT_SLACK (1 << 20)  // dead bytes tolerated before compaction
+
+static AnnotHeader* header(const AnnotCache* c) {
+    return (AnnotHeader*)c->map;
+}
+
+static uint64_t* slots(const AnnotCache* c) {
+    return (uint64_t*)(c->map + sizeof(AnnotHeader));
+}
+
+static size_t data_start(uint64_t num_slots) {
+    return sizeof(AnnotHeader) + num_slots * sizeof(uint64_t);
+}
+
+static int addr_key(const sockaddr_any* sa, uint8_t key[16], uint16_t* family) {
+    memset(key, 0, 16);
+    *family = sa->sa.sa_family;
+
+    if (sa->sa.sa_family == AF_INET) {
+        memcpy(key, &sa->sin.sin_addr, 4);
+        return 1;
+    }
+    else if (sa->sa.sa_family == AF_INET6) {
+        memcpy(key, &sa->sin6.sin6_addr, 16);
+        return 1;
+    }
+    return 0;
+}
+
+static uint64_t hash_key(const uint8_t key[16], uint16_t family) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ family;  // FNV-1a
+
+    for (int i = 0; i < 16; i++) {
+        h ^= key[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    // splitmix64 finalizer
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+
+    return h;
+}
+
+static const char* rec_name(const AnnotRecord* r) {
+    return r->name_len == ANNOT_NONE ? NULL : (const char*)(r + 1);
+}
+
+static const char* rec_as(const AnnotRecord* r) {
+    const char* p = (const char*)(r + 1);
+
+    if (r->as_len == ANNOT_NONE)
+        return NULL;
+    return r->name_len == ANNOT_NONE ? p : p + r->name_len + 1;
+}
+
+static int map_file(AnnotCache* c) {
+    struct stat st;
+
+    if (c->map)
+        munmap(c->map, c->map_len);
+    c->map = NULL;
+    c->map_len = 0;
+
+    if (fstat(c->fd, &st) < 0)
+        return -1;
+    if ((size_t)st.st_size < sizeof(AnnotHeader)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    void* m = mmap(NULL, st.st_size, PROT_READ | (c->writable ? PROT_WRITE : 0), MAP_SHARED, c->fd, 0);
+    if (m == MAP_FAILED)
+        return -1;
+    c->map = m;
+    c->map_len = st.st_size;
+
+    const AnnotHeader* h = header(c);
+    if (memcmp(h->magic, ANNOT_MAGIC, sizeof(h->magic)) || h->version != ANNOT_VERSION || !h->num_slots ||
+        (h->num_slots & (h->num_slots - 1)) || h->num_slots > (c->map_len - sizeof(AnnotHeader)) / sizeof(uint64_t)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Creates a new empty (locked) file aside of `path', to be linked or renamed there
+static int create_tmp(const char* path, uint64_t num_slots, char** tmpname) {
+    AnnotHeader h;
+    char* name = malloc(strlen(path) + sizeof(".XXXXXX"));
+    if (!name)
+        return -1;
+    sprintf(name, "%s.XXXXXX", path);
+
+    int fd = mkstemp(name);
+    if (fd < 0) {
+        free(name);
+        return -1;
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, ANNOT_MAGIC, sizeof(h.magic));
+    h.version = ANNOT_VERSION;
+    h.num_slots = num_slots;
+    h.data_len = data_start(num_slots);
+
+    if (fchmod(fd, 0644) < 0 || flock(fd, LOCK_EX) < 0 || ftruncate(fd, h.data_len + DATA_ROOM) < 0 ||
+        pwrite(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+        int err = errno;
+        unlink(name);
+        close(fd);
+        free(name);
+        errno = err;
+        return -1;
+    }
+
+    *tmpname = name;
+    return fd;
+}
+
+static int open_path(AnnotCache* c) {
+    for (;;) {
+        c->fd = open(c->path, (c->writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+        if (c->fd >= 0)
+            break;
+        if (errno != ENOENT || !c->writable)
+            return -1;
+
+        // Create it complete under another name, so that nobody sees it half done
+        char* tmpname;
+        int fd = create_tmp(c->path, ANNOT_MIN_SLOTS, &tmpname);
+        if (fd < 0)
+            return -1;
+
+        int ret = link(tmpname, c->path);
+        int err = errno;
+        unlink(tmpname);
+        free(tmpname);
+        close(fd);
+        if (ret < 0 && err != EEXIST) {  // EEXIST: someone was faster
+            errno = err;
+            return -1;
+        }
+    }
+
+    return map_file(c);
+}
+
+static int reopen(AnnotCache* c) {
+    if (c->map)
+        munmap(c->map, c->map_len);
+    c->map = NULL;
+    c->map_len = 0;
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+
+    return open_path(c);
+}
+
+// Follows the file being compacted away or grown by some writer
+static int refresh(AnnotCache* c) {
+    if (!c->map || __atomic_load_n(&header(c)->obsolete, __ATOMIC_ACQUIRE))
+        return reopen(c);
+
+    if (__atomic_load_n(&header(c)->data_len, __ATOMIC_ACQUIRE) > c->map_len)
+        return map_file(c);
+
+    return 0;
+}
+
+// Returns the record of the key, or NULL with `*slot_p' set to the empty slot it would take
+static AnnotRecord* find(AnnotCache* c, const uint8_t key[16], uint16_t family, uint64_t** slot_p) {
+    int remapped = 0;
+
+again:;
+    uint64_t mask = header(c)->num_slots - 1;
+    uint64_t i = hash_key(key, family) & mask;
+    size_t start = data_start(mask + 1);
+
+    for (uint64_t n = 0; n <= mask; n++, i = (i + 1) & mask) {
+        uint64_t* slot = &slots(c)[i];
+        uint64_t off = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+        if (!off) {
+            if (slot_p)
+                *slot_p = slot;
+            return NULL;
+        }
+
+        AnnotRecord* r = (AnnotRecord*)(c->map + off);
+        if (off < start || off + sizeof(AnnotRecord) > c->map_len || off + r->size > c->map_len) {
+            // appended after we have mapped the file
+            if (!remapped++ && map_file(c) == 0)
+                goto again;
+            break;
+        }
+
+        if (r->family == family && !memcmp(r->addr, key, sizeof(r->addr))) {
+            if (slot_p)
+                *slot_p = slot;
+            return r;
+        }
+    }
+
+    if (slot_p)
+        *slot_p = NULL;
+    return NULL;
+}
+
+static int lock_file(AnnotCache* c) {
+    if (!c->map && reopen(c) < 0)
+        return -1;
+
+    for (;;) {
+        if (flock(c->fd, LOCK_EX) < 0)
+            return -1;
+        if (!__atomic_load_n(&header(c)->obsolete, __ATOMIC_ACQUIRE))
+            break;
+
+        flock(c->fd, LOCK_UN);
+        if (reopen(c) < 0)
+            return -1;
+    }
+
+    if (header(c)->data_len > c->map_len && map_file(c) < 0) {
+        flock(c->fd, LOCK_UN);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int ensure_room(AnnotCache* c, size_t size) {
+    uint64_t need = header(c)->data_len + size;
+    struct stat st;
+
+    if (need <= c->map_len)
+        return 0;
+
+    if (fstat(c->fd, &st) < 0)
+        return -1;
+
+    if ((uint64_t)st.st_size < need) {
+        uint64_t len = st.st_size;
+
+        while (len < need)
+            len *= 2;
+        if (ftruncate(c->fd, len) < 0)
+            return -1;
+    }
+
+    return map_file(c);
+}
+
+// Appends a record and publishes it in the slot (found with find())
+static void append(AnnotCache* c, const AnnotRecord* r, uint64_t* slot, const AnnotRecord* prev) {
+    AnnotHeader* h = header(c);
+    uint64_t off = h->data_len;
+
+    memcpy(c->map + off, r, r->size);
+    __atomic_store_n(&h->data_len, off + r->size, __ATOMIC_RELEASE);
+
+    if (prev)
+        h->live_bytes -= prev->size;
+    else
+        h->used_slots++;
+    h->live_bytes += r->size;
+
+    __atomic_store_n(slot, off, __ATOMIC_RELEASE);
+}
+
+static int compact_locked(AnnotCache* c, uint64_t now) {
+    const AnnotHeader* h = header(c);
+    uint64_t live = 0;
+
+    for (uint64_t i = 0; i < h->num_slots; i++) {
+        if (slots(c)[i])
+            live++;
+    }
+
+    uint64_t num_slots = ANNOT_MIN_SLOTS;
+    while (num_slots < (live + 1) * 4)
+        num_slots *= 2;
+
+    char* tmpname;
+    AnnotCache n = {.path = c->path, .writable = 1};
+    n.fd = create_tmp(c->path, num_slots, &tmpname);
+    if (n.fd < 0)
+        return -1;
+    if (map_file(&n) < 0)
+        goto fail;
+
+    for (uint64_t i = 0; i < header(c)->num_slots; i++) {
+        uint64_t off = slots(c)[i];
+        uint64_t* slot;
+
+        if (!off)
+            continue;
+
+        AnnotRecord* r = (AnnotRecord*)(c->map + off);
+        if (r->expiry && now && now > r->expiry)
+            continue;
+
+        if (ensure_room(&n, r->size) < 0)
+            goto fail;
+        find(&n, r->addr, r->family, &slot);
+        append(&n, r, slot, NULL);
+    }
+
+    if (rename(tmpname, c->path) < 0)
+        goto fail;
+    free(tmpname);
+
+    __atomic_store_n(&header(c)->obsolete, 1, __ATOMIC_RELEASE);
+
+    // Go on with the new file, still locked
+    munmap(c->map, c->map_len);
+    close(c->fd);
+    c->fd = n.fd;
+    c->map = n.map;
+    c->map_len = n.map_len;
+
+    return 0;
+
+fail:;
+    int err = errno;
+    if (n.map)
+        munmap(n.map, n.map_len);
+    unlink(tmpname);
+    free(tmpname);
+    close(n.fd);
+    errno = err;
+    return -1;
+}
+
+AnnotCache* annot_open(const char* path, int writable) {
+    AnnotCache* c = calloc(1, sizeof(AnnotCache));
+    if (!c)
+        return NULL;
+
+    c->fd = -1;
+    c->writable = writable;
+    c->path = strdup(path);
+
+    if (!c->path || open_path(c) < 0) {
+        int err = errno;
+        annot_close(c);
+        errno = err;
+        return NULL;
+    }
+
+    return c;
+}
+
+void annot_close(AnnotCache* c) {
+    if (!c)
+        return;
+    if (c->map)
+        munmap(c->map, c->map_len);
+    if (c->fd >= 0)
+        close(c->fd);
+    free(c->path);
+    free(c);
+}
+
+int annot_lookup(AnnotCache* c, const sockaddr_any* addr, uint64_t now, const char** name, const char** asn) {
+    uint8_t key[16];
+    uint16_t family;
+
+    if (name)
+        *name = NULL;
+    if (asn)
+        *asn = NULL;
+
+    if (!c || !addr || !addr_key(addr, key, &family) || refresh(c) < 0)
+        return 0;
+
+    const AnnotRecord* r = find(c, key, family, NULL);
+    if (!r || (r->expiry && now > r->expiry))
+        return 0;
+
+    if (name)
+        *name = rec_name(r);
+    if (asn)
+        *asn = rec_as(r);
+
+    return 1;
+}
+
+static size_t str_len(const char* s) {
+    return s ? strnlen(s, STR_MAX) : 0;
+}
+
+int annot_store(AnnotCache* c,
+                const sockaddr_any* addr,
+                const char* name,
+                const char* asn,
+                uint64_t now,
+                uint64_t ttl_sec) {
+    uint8_t key[16];
+    uint16_t family;
+    char name_buf[STR_MAX + 1], as_buf[STR_MAX + 1];
+    union {
+        AnnotRecord r;
+        char buf[sizeof(AnnotRecord) + 2 * (STR_MAX + 1) + 8];
+    } rec;
+
+    if (!c || !addr || !c->writable) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!addr_key(addr, key, &family)) {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    if (lock_file(c) < 0)
+        return -1;
+
+    uint64_t* slot;
+    AnnotRecord* prev = find(c, key, family, &slot);
+    if (!c->map)
+        goto fail;
+
+    // Keep what is known already (it may move as the file does)
+    if (prev && !name && rec_name(prev)) {
+        strcpy(name_buf, rec_name(prev));
+        name = name_buf;
+    }
+    if (prev && !asn && rec_as(prev)) {
+        strcpy(as_buf, rec_as(prev));
+        asn = as_buf;
+    }
+
+    size_t nl = str_len(name), al = str_len(asn);
+    char* p = (char*)(&rec.r + 1);
+
+    memset(&rec, 0, sizeof(rec));
+    memcpy(rec.r.addr, key, sizeof(rec.r.addr));
+    rec.r.family = family;
+    rec.r.expiry = ttl_sec ? now + ttl_sec : 0;
+    rec.r.name_len = name ? nl : ANNOT_NONE;
+    rec.r.as_len = asn ? al : ANNOT_NONE;
+    if (name) {
+        memcpy(p, name, nl);
+        p += nl + 1;
+    }
+    if (asn) {
+        memcpy(p, asn, al);
+        p += al + 1;
+    }
+    rec.r.size = (p - rec.buf + 7) & ~7;
+
+    const AnnotHeader* h = header(c);
+    uint64_t dead = h->data_len - data_start(h->num_slots) - h->live_bytes;
+
+    if ((!prev && (h->used_slots + 1) * 2 > h->num_slots) || dead > h->live_bytes + COMPACT_SLACK) {
+        if (compact_locked(c, now) < 0)
+            goto fail;
+    }
+
+    if (ensure_room(c, rec.r.size) < 0)
+        goto fail;
+
+    prev = find(c, key, family, &slot);  // moved with the above
+    if (!c->map)
+        goto fail;
+    if (!slot) {
+        errno = ENOSPC;  // a broken file, no empty slots
+        goto fail;
+    }
+    append(c, &rec.r, slot, prev);
+
+    flock(c->fd, LOCK_UN);
+    return 0;
+
+fail:;
+    int err = errno;
+    flock(c->fd, LOCK_UN);
+    errno = err;
+    return -1;
+}
+
+int annot_compact(AnnotCache* c, uint64_t now) {
+    if (!c || !c->writable) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (lock_file(c) < 0)
+        return -1;
+
+    int ret = compact_locked(c, now);
+    int err = errno;
+
+    flock(c->fd, LOCK_UN);
+    errno = err;
+    return ret;
+}
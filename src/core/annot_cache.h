@@ -0,0 +1,86 @@
+#ifndef TRACEROUTE_CORE_ANNOT_CACHE_H
+#define TRACEROUTE_CORE_ANNOT_CACHE_H
+
+#include "types.h"
+#include <stddef.h>
+
+#define ANNOT_MAGIC "TRANNOT"
+#define ANNOT_VERSION 1
+#define ANNOT_MIN_SLOTS 4096
+#define ANNOT_NONE 0xff  // field not known
+
+/**
+ * On-disk layout: the header, then a hash table of `num_slots` record
+ * offsets (0 for empty), then the records, appended only.
+ *
+ * Writers serialize on flock(). A record is written in full before its
+ * offset is published in a slot, so readers need no locks. Once the file
+ * gets too full or too wasteful, a writer compacts the live records into
+ * a new file, renames it over and marks the old one obsolete, so that
+ * the readers mapping it reopen the path.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t obsolete;
+    uint64_t num_slots;   // power of 2
+    uint64_t used_slots;
+    uint64_t data_len;    // records are committed up to here
+    uint64_t live_bytes;  // of the records in the slots
+    uint64_t reserved[2];
+} AnnotHeader;
+
+typedef struct {
+    uint8_t addr[16];
+    uint16_t family;
+    uint8_t name_len;  // ANNOT_NONE when not known
+    uint8_t as_len;    // ditto
+    uint32_t size;     // of the whole record, 8 bytes aligned
+    uint64_t expiry;   // 0 for never
+    // followed by the name and the AS, both nul terminated
+} AnnotRecord;
+
+typedef struct {
+    char* path;
+    int fd;
+    int writable;
+    uint8_t* map;
+    size_t map_len;
+} AnnotCache;
+
+/**
+ * Opens (and with `writable` creates if needed) a cache file.
+ * Returns NULL on error, with errno set (EINVAL for a file of some other
+ * format or version).
+ */
+AnnotCache* annot_open(const char* path, int writable);
+void annot_close(AnnotCache* c);
+
+/**
+ * Looks up the annotations of an address. `name` and `asn` may be NULL
+ * if not wanted, and are set to NULL for the fields not known.
+ * Returns 1 if the address has a record not expired by `now`, 0 otherwise.
+ * The strings point into the mapping and are valid until the next call.
+ */
+int annot_lookup(AnnotCache* c, const sockaddr_any* addr, uint64_t now, const char** name, const char** asn);
+
+/**
+ * Records the annotations of an address, keeping the known ones
+ * for which NULL is passed. Strings longer than 254 bytes are truncated.
+ * ttl_sec: how long the record is valid (0 for permanent)
+ * Returns 0 on success, -1 on error (errno set).
+ */
+int annot_store(AnnotCache* c,
+                const sockaddr_any* addr,
+                const char* name,
+                const char* asn,
+                uint64_t now,
+                uint64_t ttl_sec);
+
+/**
+ * Rewrites the file with only the records not expired by `now`.
+ * Returns 0 on success, -1 on error (errno set).
+ */
+int annot_compact(AnnotCache* c, uint64_t now);
+
+#endif /* TRACEROUTE_CORE_ANNOT_CACHE_H */
@@ -0,0 +1,520 @@
+#include "as_db.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define KEY_LEN 17  // 16 address bytes, and one more for the last chunk to read
+#define NIL 0
+
+// Plain binary trie, to collect the prefixes before compiling them
+typedef struct {
+    uint32_t child[2];
+    uint32_t asn;
+    uint32_t has_asn;
+} BinNode;
+
+typedef struct {
+    BinNode* nodes;  // [0] is unused, [1] is the root
+    uint32_t num;
+    uint32_t max;
+} BinTrie;
+
+typedef struct {
+    AsDbNode* nodes;
+    uint32_t num_nodes;
+    uint32_t max_nodes;
+    uint32_t* leaves;
+    uint32_t num_leaves;
+    uint32_t max_leaves;
+} Compiled;
+
+static int family_index(int family) {
+    return family == AF_INET6;
+}
+
+static unsigned int chunk(const uint8_t key[KEY_LEN], unsigned int bit) {
+    unsigned int v = (key[bit >> 3] << 8) | key[(bit >> 3) + 1];
+
+    return (v >> (16 - (bit & 7) - AS_DB_STRIDE)) & ((1 << AS_DB_STRIDE) - 1);
+}
+
+uint32_t as_db_lookup(const AsDb* db, const sockaddr_any* addr) {
+    uint8_t key[KEY_LEN] = {0};
+    int f;
+
+    if (addr->sa.sa_family == AF_INET)
+        memcpy(key, &addr->sin.sin_addr, 4);
+    else if (addr->sa.sa_family == AF_INET6)
+        memcpy(key, &addr->sin6.sin6_addr, 16);
+    else
+        return 0;
+    f = family_index(addr->sa.sa_family);
+
+    const AsDbNode* nodes = db->nodes[f];
+    const AsDbNode* n = &nodes[0];
+
+    for (unsigned int bit = 0; bit < 128; bit += AS_DB_STRIDE) {
+        uint64_t mask = 1ULL << chunk(key, bit);
+
+        if (!(n->vector & mask))
+            return db->leaves[f][n->base0 + __builtin_popcountll(n->leafvec & ((mask << 1) - 1)) - 1];
+
+        n = &nodes[n->base1 + __builtin_popcountll(n->vector & (mask - 1))];
+    }
+
+    return 0;
+}
+
+static int bin_insert(BinTrie* t, const uint8_t* key, unsigned int len, uint32_t asn) {
+    uint32_t cur = 1;
+
+    for (unsigned int i = 0; i < len; i++) {
+        int b = (key[i >> 3] >> (7 - (i & 7))) & 1;
+
+        if (t->nodes[cur].child[b] == NIL) {
+            if (t->num == t->max) {
+                uint32_t max = t->max * 2;
+                BinNode* nodes = realloc(t->nodes, max * sizeof(*nodes));
+                if (!nodes)
+                    return -1;
+                t->nodes = nodes;
+                t->max = max;
+            }
+            memset(&t->nodes[t->num], 0, sizeof(BinNode));
+            t->nodes[cur].child[b] = t->num++;
+        }
+        cur = t->nodes[cur].child[b];
+    }
+
+    if (!t->nodes[cur].has_asn) {  // the first one wins
+        t->nodes[cur].asn = asn;
+        t->nodes[cur].has_asn = 1;
+    }
+
+    return 0;
+}
+
+static int reserve(void** arr, uint32_t* max, uint32_t need, size_t size) {
+    if (need <= *max)
+        return 0;
+
+    uint32_t n = *max ? *max : 64;
+    while (n < need)
+        n *= 2;
+
+    void* p = realloc(*arr, (size_t)n * size);
+    if (!p)
+        return -1;
+    *arr = p;
+    *max = n;
+    return 0;
+}
+
+// Fills the node `at' for the subtrie of `bn', with `inherit' as the best match above
+static int compile(const BinTrie* t, uint32_t bn, uint32_t inherit, Compiled* out, uint32_t at) {
+    uint32_t child[1 << AS_DB_STRIDE], value[1 << AS_DB_STRIDE];
+    AsDbNode node = {0, 0, 0, 0};
+    uint32_t num_children = 0, last = 0;
+
+    for (unsigned int s = 0; s < (1 << AS_DB_STRIDE); s++) {
+        uint32_t cur = bn, best = inherit;
+
+        for (int j = AS_DB_STRIDE - 1; j >= 0 && cur != NIL; j--) {
+            cur = t->nodes[cur].child[(s >> j) & 1];
+            if (cur != NIL && t->nodes[cur].has_asn)
+                best = t->nodes[cur].asn;
+        }
+
+        value[s] = best;
+        child[s] = NIL;
+        if (cur != NIL && (t->nodes[cur].child[0] != NIL || t->nodes[cur].child[1] != NIL)) {
+            child[s] = cur;
+            node.vector |= 1ULL << s;
+            num_children++;
+        }
+    }
+
+    node.base0 = out->num_leaves;
+    node.base1 = out->num_nodes;
+
+    for (unsigned int s = 0; s < (1 << AS_DB_STRIDE); s++) {
+        if (child[s] != NIL)
+            continue;
+        if (!node.leafvec || value[s] != last) {
+            if (reserve((void**)&out->leaves, &out->max_leaves, out->num_leaves + 1, sizeof(uint32_t)) < 0)
+                return -1;
+            out->leaves[out->num_leaves++] = value[s];
+            node.leafvec |= 1ULL << s;
+            last = value[s];
+        }
+    }
+
+    // All the children are contiguous
+    if (reserve((void**)&out->nodes, &out->max_nodes, out->num_nodes + num_children, sizeof(AsDbNode)) < 0)
+        return -1;
+    out->num_nodes += num_children;
+    out->nodes[at] = node;
+
+    for (unsigned int s = 0, i = 0; s < (1 << AS_DB_STRIDE); s++) {
+        if (child[s] != NIL && compile(t, child[s], value[s], out, node.base1 + i++) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int compile_trie(const BinTrie* t, Compiled* out) {
+    memset(out, 0, sizeof(*out));
+
+    if (reserve((void**)&out->nodes, &out->max_nodes, 1, sizeof(AsDbNode)) < 0)
+        return -1;
+    out->num_nodes = 1;
+
+    return compile(t, 1, t->nodes[1].has_asn ? t->nodes[1].asn : 0, out, 0);
+}
+
+// Checks a table not to lead out of its arrays, and sets the pointers into it
+static int setup(AsDb* db) {
+    const AsDbHeader* h = (const AsDbHeader*)db->map;
+    size_t off = sizeof(AsDbHeader);
+
+    if (db->map_len < sizeof(AsDbHeader) || memcmp(h->magic, AS_DB_MAGIC, sizeof(h->magic)) ||
+        h->version != AS_DB_VERSION || !h->num_nodes[0] || !h->num_nodes[1])
+        goto inval;
+
+    if ((uint64_t)h->num_nodes[0] + h->num_nodes[1] > (db->map_len - off) / sizeof(AsDbNode))
+        goto inval;
+    db->nodes[0] = (const AsDbNode*)(db->map + off);
+    db->nodes[1] = db->nodes[0] + h->num_nodes[0];
+    off += ((size_t)h->num_nodes[0] + h->num_nodes[1]) * sizeof(AsDbNode);
+
+    if ((uint64_t)h->num_leaves[0] + h->num_leaves[1] != (db->map_len - off) / sizeof(uint32_t))
+        goto inval;
+    db->leaves[0] = (const uint32_t*)(db->map + off);
+    db->leaves[1] = db->leaves[0] + h->num_leaves[0];
+
+    for (int f = 0; f < 2; f++) {
+        for (uint32_t i = 0; i < h->num_nodes[f]; i++) {
+            const AsDbNode* n = &db->nodes[f][i];
+            uint64_t children = __builtin_popcountll(n->vector);
+
+            // Children after their parent, so that lookups always end
+            if ((children && (n->base1 <= i || n->base1 + children > h->num_nodes[f])) ||
+                (!n->leafvec && n->vector != ~0ULL) ||
+                n->base0 + (uint64_t)__builtin_popcountll(n->leafvec) > h->num_leaves[f])
+                goto inval;
+        }
+    }
+
+    return 0;
+
+inval:
+    errno = EINVAL;
+    return -1;
+}
+
+static char* skip_space(char* s) {
+    while (isspace((unsigned char)*s))
+        s++;
+    return s;
+}
+
+static int parse_asn(const char* s, uint32_t* asn) {
+    if (*s == '{')  // AS set
+        s++;
+    if (!strncasecmp(s, "AS", 2))
+        s += 2;
+    if (!isdigit((unsigned char)*s))
+        return -1;
+
+    unsigned long v = strtoul(s, NULL, 10);
+    if (v == 0 || v > UINT32_MAX)
+        return -1;
+    // Anything after, like in "64500_64501" or "64500,64501}", is other origins
+    *asn = v;
+    return 0;
+}
+
+static int parse_prefix(const char* addr, const char* len_str, uint8_t key[16], unsigned int* len_p, int* family) {
+    char* end;
+
+    memset(key, 0, 16);
+    if (inet_pton(AF_INET, addr, key) == 1)
+        *family = AF_INET;
+    else if (inet_pton(AF_INET6, addr, key) == 1)
+        *family = AF_INET6;
+    else
+        return -1;
+
+    unsigned long len = strtoul(len_str, &end, 10);
+    if (end == len_str || *skip_space(end) || len > (*family == AF_INET ? 32 : 128))
+        return -1;
+    *len_p = len;
+    return 0;
+}
+
+// Parses one text line into the prefix and its origin. Returns 1 for a prefix, 0 for nothing
+static int parse_line(char* line, uint8_t key[16], unsigned int* len, int* family, uint32_t* asn) {
+    char *fields[8], *saveptr, *tok, *slash;
+    int num = 0;
+
+    line = skip_space(line);
+    if (!*line || *line == '#')
+        return 0;
+
+    if (strchr(line, '|')) {
+        // bgpdump -m: TYPE|time|B|peer_ip|peer_as|prefix|as_path|...
+        for (tok = line; tok && num < 8;) {
+            fields[num++] = tok;
+            tok = strchr(tok, '|');
+            if (tok)
+                *tok++ = '\0';
+        }
+        if (num < 7 || (strcmp(fields[2], "B") && strcmp(fields[2], "A")))
+            return 0;  // withdrawals, state changes...
+
+        char* path = fields[6];
+        char* origin = NULL;
+        for (tok = strtok_r(path, " \t\r\n", &saveptr); tok; tok = strtok_r(NULL, " \t\r\n", &saveptr))
+            origin = tok;
+
+        slash = strchr(fields[5], '/');
+        if (!origin || !slash)
+            return -1;
+        *slash = '\0';
+        if (parse_prefix(fields[5], slash + 1, key, len, family) < 0 || parse_asn(origin, asn) < 0)
+            return -1;
+        return 1;
+    }
+
+    for (tok = strtok_r(line, " \t\r\n", &saveptr); tok && num < 4; tok = strtok_r(NULL, " \t\r\n", &saveptr))
+        fields[num++] = tok;
+
+    if (num == 2 && (slash = strchr(fields[0], '/')) != NULL) {
+        *slash = '\0';
+        if (parse_prefix(fields[0], slash + 1, key, len, family) < 0 || parse_asn(fields[1], asn) < 0)
+            return -1;
+        return 1;
+    }
+    if (num == 3) {
+        if (parse_prefix(fields[0], fields[1], key, len, family) < 0 || parse_asn(fields[2], asn) < 0)
+            return -1;
+        return 1;
+    }
+
+    return -1;
+}
+
+static AsDb* load_text(FILE* fp) {
+    BinTrie tries[2];
+    Compiled out[2];
+    AsDb* db = NULL;
+    char* line = NULL;
+    size_t line_size = 0;
+    uint32_t num_prefixes = 0;
+    int err = 0;
+
+    memset(out, 0, sizeof(out));
+    for (int f = 0; f < 2; f++) {
+        tries[f].max = 1024;
+        tries[f].num = 2;
+        tries[f].nodes = calloc(tries[f].max, sizeof(BinNode));
+        if (!tries[f].nodes)
+            err = errno;
+    }
+
+    while (!err && getline(&line, &line_size, fp) >= 0) {
+        uint8_t key[16];
+        unsigned int len;
+        int family;
+        uint32_t asn;
+        int ret = parse_line(line, key, &len, &family, &asn);
+
+        if (ret < 0)
+            err = EINVAL;
+        else if (ret > 0) {
+            if (bin_insert(&tries[family_index(family)], key, len, asn) < 0)
+                err = errno;
+            num_prefixes++;
+        }
+    }
+    if (!err && ferror(fp))
+        err = errno;
+
+    for (int f = 0; f < 2 && !err; f++) {
+        if (compile_trie(&tries[f], &out[f]) < 0)
+            err = errno;
+    }
+
+    if (!err) {
+        AsDbHeader h;
+        size_t nodes_len = ((size_t)out[0].num_nodes + out[1].num_nodes) * sizeof(AsDbNode);
+        size_t leaves_len = ((size_t)out[0].num_leaves + out[1].num_leaves) * sizeof(uint32_t);
+
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, AS_DB_MAGIC, sizeof(h.magic));
+        h.version = AS_DB_VERSION;
+        h.num_prefixes = num_prefixes;
+
+        db = calloc(1, sizeof(*db));
+        if (db)
+            db->map = malloc(sizeof(h) + nodes_len + leaves_len);
+        if (db && db->map) {
+            uint8_t* p = db->map + sizeof(h);
+
+            for (int f = 0; f < 2; f++) {
+                h.num_nodes[f] = out[f].num_nodes;
+                h.num_leaves[f] = out[f].num_leaves;
+                memcpy(p, out[f].nodes, out[f].num_nodes * sizeof(AsDbNode));
+                p += out[f].num_nodes * sizeof(AsDbNode);
+            }
+            for (int f = 0; f < 2; f++) {
+                memcpy(p, out[f].leaves, out[f].num_leaves * sizeof(uint32_t));
+                p += out[f].num_leaves * sizeof(uint32_t);
+            }
+            memcpy(db->map, &h, sizeof(h));
+            db->map_len = sizeof(h) + nodes_len + leaves_len;
+
+            if (setup(db) < 0)
+                err = errno;
+        }
+        else
+            err = ENOMEM;
+    }
+
+    for (int f = 0; f < 2; f++) {
+        free(tries[f].nodes);
+        free(out[f].nodes);
+        free(out[f].leaves);
+    }
+    free(line);
+
+    if (err) {
+        as_db_close(db);
+        errno = err;
+        return NULL;
+    }
+
+    return db;
+}
+
+AsDb* as_db_open(const char* path) {
+    char magic[sizeof(((AsDbHeader*)0)->magic)];
+    struct stat st;
+    AsDb* db;
+    int err;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0)
+        goto fail;
+
+    if (read(fd, magic, sizeof(magic)) != (ssize_t)sizeof(magic) || memcmp(magic, AS_DB_MAGIC, sizeof(magic))) {
+        FILE* fp;
+
+        // The text form
+        if (lseek(fd, 0, SEEK_SET) < 0 || !(fp = fdopen(fd, "r")))
+            goto fail;
+        db = load_text(fp);
+        err = errno;
+        fclose(fp);
+        errno = err;
+        return db;
+    }
+
+    db = calloc(1, sizeof(*db));
+    if (!db)
+        goto fail;
+
+    void* m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        free(db);
+        goto fail;
+    }
+    db->map = m;
+    db->map_len = st.st_size;
+    db->mapped = 1;
+    close(fd);
+
+    if (setup(db) < 0) {
+        as_db_close(db);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return db;
+
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+}
+
+void as_db_close(AsDb* db) {
+    if (!db)
+        return;
+
+    if (db->mapped)
+        munmap(db->map, db->map_len);
+    else
+        free(db->map);
+    free(db);
+}
+
+int as_db_save(const AsDb* db, const char* path) {
+    char* tmpname = malloc(strlen(path) + sizeof(".XXXXXX"));
+    size_t done = 0;
+    int err;
+
+    if (!tmpname)
+        return -1;
+    sprintf(tmpname, "%s.XXXXXX", path);
+
+    int fd = mkstemp(tmpname);
+    if (fd < 0) {
+        free(tmpname);
+        return -1;
+    }
+
+    while (done < db->map_len) {
+        ssize_t n = write(fd, db->map + done, db->map_len - done);
+        if (n < 0)
+            goto fail;
+        done += n;
+    }
+
+    if (fchmod(fd, 0644) < 0)
+        goto fail;
+    if (close(fd) < 0) {
+        fd = -1;
+        goto fail;
+    }
+    fd = -1;
+
+    // Readers having the old one mapped keep it
+    if (rename(tmpname, path) < 0)
+        goto fail;
+
+    free(tmpname);
+    return 0;
+
+fail:
+    err = errno;
+    if (fd >= 0)
+        close(fd);
+    unlink(tmpname);
+    free(tmpname);
+    errno = err;
+    return -1;
+}
@@ -0,0 +1,66 @@
+#ifndef TRACEROUTE_CORE_AS_DB_H
+#define TRACEROUTE_CORE_AS_DB_H
+
+#include "types.h"
+#include <stddef.h>
+
+#define AS_DB_MAGIC "TRAS_DB"
+#define AS_DB_VERSION 1
+#define AS_DB_STRIDE 6  // address bits per node
+
+/**
+ * Prefix to origin AS table, one multibit trie per address family
+ * (poptrie style: each node covers AS_DB_STRIDE bits, its 64 children and
+ * the leaves below it are packed in arrays and found by popcount).
+ *
+ * On-disk layout, in the host byte order: the header, then the nodes
+ * of both families, then their leaves. The root of each family is its
+ * first node. A compiled file is mapped as it is.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_prefixes;
+    uint32_t num_nodes[2];   // IPv4, IPv6
+    uint32_t num_leaves[2];  // ditto
+} AsDbHeader;
+
+typedef struct {
+    uint64_t vector;   // bit set for the slots having a child node
+    uint64_t leafvec;  // bit set for the slots starting a run of leaves
+    uint32_t base0;    // first leaf
+    uint32_t base1;    // first child node
+} AsDbNode;
+
+typedef struct {
+    uint8_t* map;
+    size_t map_len;
+    int mapped;  // else malloc'ed
+    const AsDbNode* nodes[2];
+    const uint32_t* leaves[2];
+} AsDb;
+
+/**
+ * Loads a table, either compiled by as_db_save() or in the text form:
+ * one prefix per line, as "prefix/len asn", as "addr len asn" (CAIDA
+ * pfx2as) or as bgpdump -m output (the origin being the last AS of the
+ * path). For an AS set or a multi-origin prefix the first AS is taken.
+ * Empty lines and lines starting with '#' are ignored.
+ * Returns NULL on error, with errno set (EINVAL for a malformed file).
+ */
+AsDb* as_db_open(const char* path);
+void as_db_close(AsDb* db);
+
+/**
+ * Writes the table in the compiled form.
+ * Returns 0 on success, -1 on error (errno set).
+ */
+int as_db_save(const AsDb* db, const char* path);
+
+/**
+ * Returns the origin AS of the longest prefix covering `addr`,
+ * or 0 when there is none.
+ */
+uint32_t as_db_lookup(const AsDb* db, const sockaddr_any* addr);
+
+#endif /* TRACEROUTE_CORE_AS_DB_H */
@@ -2,101 +2,433 @@
 #include <stdlib.h>
 #include <string.h>
 
-// Helper to compare addresses
-static int addr_equal(const sockaddr_any* a, const sockaddr_any* b) {
-    if (a->sa.sa_family != b->sa.sa_family)
-        return 0;
+// Entries are found through an open addressing index keyed by family and
+// address (linear probing, backward shift deletion), and kept in an
+// intrusive LRU list, so that lookup, insert and eviction are all O(1).
+//
+// Names are interned label by label, from the top level domain down: a name
+// is the leaf of its chain of labels, and names under the same domain share
+// the nodes of the domain. Nodes are reference counted and freed (with their
+// labels) once no entry or longer name uses them anymore.
+
+#define LABEL_CHUNK 8
 
-    if (a->sa.sa_family == AF_INET) {
-        return a->sin.sin_addr.s_addr == b->sin.sin_addr.s_addr;
+static int addr_key(const sockaddr_any* sa, uint8_t key[16], uint16_t* family) {
+    memset(key, 0, 16);
+    *family = sa->sa.sa_family;
+
+    if (sa->sa.sa_family == AF_INET) {
+        memcpy(key, &sa->sin.sin_addr, 4);
+        return 1;
     }
-    else if (a->sa.sa_family == AF_INET6) {
-        return memcmp(&a->sin6.sin6_addr, &b->sin6.sin6_addr, sizeof(a->sin6.sin6_addr)) == 0;
+    else if (sa->sa.sa_family == AF_INET6) {
+        memcpy(key, &sa->sin6.sin6_addr, 16);
+        return 1;
     }
     return 0;
 }
 
+static uint32_t hash_bytes(uint32_t seed, const void* data, size_t len) {
+    const uint8_t* p = data;
+    uint32_t h = 2166136261u ^ seed;  // FNV-1a
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+
+    // murmur3 finalizer, FNV alone is weak in the low bits
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static size_t entry_home(const DNSCache* c, const DNSCacheEntry* e) {
+    return hash_bytes(e->family, e->addr, sizeof(e->addr)) & c->index_mask;
+}
+
+// Label pool: 8 byte chunks, with free lists per size class
+
+static uint32_t label_alloc(DNSCache* c, size_t len) {
+    size_t cls = (len + LABEL_CHUNK - 1) / LABEL_CHUNK;
+    size_t size = cls * LABEL_CHUNK;
+    uint32_t off;
+
+    if (c->free_labels[cls] != DNS_NIL) {
+        off = c->free_labels[cls];
+        memcpy(&c->free_labels[cls], c->labels + off, sizeof(uint32_t));
+        return off;
+    }
+
+    if (c->labels_len + size > c->labels_cap) {
+        size_t cap = c->labels_cap ? c->labels_cap * 2 : 4096;
+        while (cap < c->labels_len + size)
+            cap *= 2;
+        if (cap > DNS_NIL)
+            return DNS_NIL;
+
+        char* p = realloc(c->labels, cap);
+        if (!p)
+            return DNS_NIL;
+        c->labels = p;
+        c->labels_cap = cap;
+    }
+
+    off = (uint32_t)c->labels_len;
+    c->labels_len += size;
+    return off;
+}
+
+static void label_free(DNSCache* c, uint32_t off, size_t len) {
+    size_t cls = (len + LABEL_CHUNK - 1) / LABEL_CHUNK;
+
+    if (!cls)
+        return;  // empty labels take no space
+
+    memcpy(c->labels + off, &c->free_labels[cls], sizeof(uint32_t));
+    c->free_labels[cls] = off;
+}
+
+// Name nodes
+
+static int node_buckets_grow(DNSCache* c) {
+    size_t n = c->node_buckets ? (c->node_mask + 1) * 2 : 1024;
+    uint32_t* b = malloc(n * sizeof(uint32_t));
+    if (!b)
+        return 0;
+
+    memset(b, 0xff, n * sizeof(uint32_t));  // all DNS_NIL
+
+    // Rehash the live nodes
+    for (size_t i = 0; i < c->num_nodes; i++) {
+        DNSNameNode* nd = &c->nodes[i];
+
+        if (!nd->refs)
+            continue;
+        size_t h = hash_bytes(nd->parent, c->labels + nd->label, nd->len) & (n - 1);
+        nd->next = b[h];
+        b[h] = (uint32_t)i;
+    }
+
+    free(c->node_buckets);
+    c->node_buckets = b;
+    c->node_mask = n - 1;
+    return 1;
+}
+
+static void node_release(DNSCache* c, uint32_t n) {
+    while (n != DNS_NIL) {
+        DNSNameNode* nd = &c->nodes[n];
+        uint32_t parent = nd->parent;
+
+        if (--nd->refs)
+            return;
+
+        uint32_t* p = &c->node_buckets[hash_bytes(parent, c->labels + nd->label, nd->len) & c->node_mask];
+        while (*p != n)
+            p = &c->nodes[*p].next;
+        *p = nd->next;
+
+        label_free(c, nd->label, nd->len);
+        nd->next = c->free_nodes;
+        c->free_nodes = n;
+        c->live_nodes--;
+
+        n = parent;  // drop the reference it held
+    }
+}
+
+// Returns the node of `label' under `parent' with a new reference to it.
+// The caller's reference to `parent' is taken over (or dropped when the
+// node exists already, as it holds its own).
+static uint32_t node_intern(DNSCache* c, uint32_t parent, const char* label, size_t len) {
+    uint32_t h = hash_bytes(parent, label, len);
+
+    if (c->node_buckets) {
+        for (uint32_t n = c->node_buckets[h & c->node_mask]; n != DNS_NIL; n = c->nodes[n].next) {
+            DNSNameNode* nd = &c->nodes[n];
+
+            if (nd->parent == parent && nd->len == len && !memcmp(c->labels + nd->label, label, len)) {
+                nd->refs++;
+                node_release(c, parent);
+                return n;
+            }
+        }
+    }
+
+    if (c->live_nodes + 1 > (c->node_buckets ? c->node_mask + 1 : 0) && !node_buckets_grow(c))
+        return DNS_NIL;
+
+    uint32_t n = c->free_nodes;
+    if (n != DNS_NIL) {
+        c->free_nodes = c->nodes[n].next;
+    }
+    else {
+        if (c->num_nodes == c->max_nodes) {
+            size_t max = c->max_nodes ? c->max_nodes * 2 : 1024;
+            if (max >= DNS_NIL)
+                return DNS_NIL;
+            DNSNameNode* p = realloc(c->nodes, max * sizeof(DNSNameNode));
+            if (!p)
+                return DNS_NIL;
+            c->nodes = p;
+            c->max_nodes = max;
+        }
+        n = (uint32_t)c->num_nodes++;
+    }
+
+    uint32_t off = len ? label_alloc(c, len) : 0;
+    if (off == DNS_NIL) {
+        c->nodes[n].refs = 0;
+        c->nodes[n].next = c->free_nodes;
+        c->free_nodes = n;
+        return DNS_NIL;
+    }
+    if (len)
+        memcpy(c->labels + off, label, len);
+
+    DNSNameNode* nd = &c->nodes[n];
+    nd->label = off;
+    nd->len = (uint16_t)len;
+    nd->parent = parent;
+    nd->refs = 1;
+    nd->next = c->node_buckets[h & c->node_mask];
+    c->node_buckets[h & c->node_mask] = n;
+    c->live_nodes++;
+
+    return n;
+}
+
+static uint32_t name_intern(DNSCache* c, const char* name) {
+    size_t len = strnlen(name, DNS_MAX_NAME_LEN - 1);
+    uint32_t n = DNS_NIL;
+    size_t end = len;
+
+    // From the top level down, `n' holds our reference
+    for (;;) {
+        size_t start = end;
+        while (start > 0 && name[start - 1] != '.')
+            start--;
+
+        uint32_t next = node_intern(c, n, name + start, end - start);
+        if (next == DNS_NIL) {
+            node_release(c, n);
+            return DNS_NIL;
+        }
+        n = next;
+
+        if (!start)
+            return n;
+        end = start - 1;
+    }
+}
+
+static const char* name_string(DNSCache* c, uint32_t n) {
+    size_t pos = 0;
+
+    for (; n != DNS_NIL; n = c->nodes[n].parent) {
+        const DNSNameNode* nd = &c->nodes[n];
+
+        if (pos)
+            c->name_buf[pos++] = '.';
+        memcpy(c->name_buf + pos, c->labels + nd->label, nd->len);
+        pos += nd->len;
+    }
+    c->name_buf[pos] = '\0';
+
+    return c->name_buf;
+}
+
+// Entries
+
+static void lru_unlink(DNSCache* c, uint32_t idx) {
+    DNSCacheEntry* e = &c->entries[idx];
+
+    if (e->lru_prev != DNS_NIL)
+        c->entries[e->lru_prev].lru_next = e->lru_next;
+    else
+        c->lru_head = e->lru_next;
+
+    if (e->lru_next != DNS_NIL)
+        c->entries[e->lru_next].lru_prev = e->lru_prev;
+    else
+        c->lru_tail = e->lru_prev;
+}
+
+static void lru_push_head(DNSCache* c, uint32_t idx) {
+    DNSCacheEntry* e = &c->entries[idx];
+
+    e->lru_prev = DNS_NIL;
+    e->lru_next = c->lru_head;
+
+    if (c->lru_head != DNS_NIL)
+        c->entries[c->lru_head].lru_prev = idx;
+    else
+        c->lru_tail = idx;
+
+    c->lru_head = idx;
+}
+
+static void lru_push_tail(DNSCache* c, uint32_t idx) {
+    DNSCacheEntry* e = &c->entries[idx];
+
+    e->lru_next = DNS_NIL;
+    e->lru_prev = c->lru_tail;
+
+    if (c->lru_tail != DNS_NIL)
+        c->entries[c->lru_tail].lru_next = idx;
+    else
+        c->lru_head = idx;
+
+    c->lru_tail = idx;
+}
+
+// Returns the index slot holding the entry, or the empty slot it would take
+static size_t index_find(const DNSCache* c, const uint8_t key[16], uint16_t family) {
+    size_t i = hash_bytes(family, key, 16) & c->index_mask;
+
+    for (; c->index[i] != DNS_NIL; i = (i + 1) & c->index_mask) {
+        const DNSCacheEntry* e = &c->entries[c->index[i]];
+
+        if (e->family == family && !memcmp(e->addr, key, 16))
+            break;
+    }
+
+    return i;
+}
+
+static void index_remove(DNSCache* c, uint32_t idx) {
+    DNSCacheEntry* e = &c->entries[idx];
+    size_t mask = c->index_mask;
+    size_t i = index_find(c, e->addr, e->family);
+
+    // Move back the entries of the run which would be unreachable with the hole at `i'
+    for (size_t j = (i + 1) & mask; c->index[j] != DNS_NIL; j = (j + 1) & mask) {
+        size_t home = entry_home(c, &c->entries[c->index[j]]);
+
+        // stays if its home is cyclically within (i, j]
+        if (i <= j ? (home > i && home <= j) : (home > i || home <= j))
+            continue;
+
+        c->index[i] = c->index[j];
+        i = j;
+    }
+
+    c->index[i] = DNS_NIL;
+}
+
 DNSCache* dns_cache_create(size_t capacity) {
+    if (capacity >= DNS_NIL / 2)
+        return NULL;
+
     DNSCache* c = calloc(1, sizeof(DNSCache));
     if (!c)
         return NULL;
 
+    // Keep the index at most half full
+    size_t index_size = 16;
+    while (index_size < capacity * 2)
+        index_size <<= 1;
+
     c->capacity = capacity;
+    c->index_mask = index_size - 1;
+    c->lru_head = DNS_NIL;
+    c->lru_tail = DNS_NIL;
+    c->free_nodes = DNS_NIL;
+    memset(c->free_labels, 0xff, sizeof(c->free_labels));
+
     c->entries = calloc(capacity, sizeof(DNSCacheEntry));
-    if (!c->entries) {
-        free(c);
+    c->index = malloc(index_size * sizeof(uint32_t));
+    if (!c->entries || !c->index) {
+        dns_cache_destroy(c);
         return NULL;
     }
 
+    memset(c->index, 0xff, index_size * sizeof(uint32_t));  // all DNS_NIL
+
     return c;
 }
 
 void dns_cache_destroy(DNSCache* cache) {
     if (!cache)
         return;
-    if (cache->entries)
-        free(cache->entries);
+    free(cache->entries);
+    free(cache->index);
+    free(cache->nodes);
+    free(cache->node_buckets);
+    free(cache->labels);
     free(cache);
 }
 
 void dns_cache_insert(DNSCache* cache, const sockaddr_any* addr, const char* name, uint64_t now, uint64_t ttl_sec) {
-    if (!cache || !addr || !name)
+    uint8_t key[16];
+    uint16_t family;
+
+    if (!cache || !addr || !name || !cache->capacity || !addr_key(addr, key, &family))
         return;
 
-    cache->current_tick++;
+    uint32_t node = name_intern(cache, name);
+    if (node == DNS_NIL)
+        return;
 
-    // Check if exists
-    for (size_t i = 0; i < cache->count; i++) {
-        if (addr_equal(&cache->entries[i].addr, addr)) {
-            strncpy(cache->entries[i].name, name, DNS_MAX_NAME_LEN - 1);
-            cache->entries[i].name[DNS_MAX_NAME_LEN - 1] = '\0';
-            cache->entries[i].expiry = now + ttl_sec;
-            cache->entries[i].last_used = cache->current_tick;
-            cache->entries[i].is_valid = 1;
-            return;
-        }
-    }
+    size_t slot = index_find(cache, key, family);
+    uint32_t idx = cache->index[slot];
 
-    size_t idx;
-    if (cache->count < cache->capacity) {
-        idx = cache->count++;
+    if (idx != DNS_NIL) {
+        // Update in place
+        lru_unlink(cache, idx);
+        node_release(cache, cache->entries[idx].name);
     }
     else {
-        // Evict LRU
-        uint64_t min_tick = -1;  // Max uint64
-        idx = 0;
-        for (size_t i = 0; i < cache->capacity; i++) {
-            if (cache->entries[i].last_used < min_tick) {
-                min_tick = cache->entries[i].last_used;
-                idx = i;
-            }
+        if (cache->count < cache->capacity) {
+            idx = (uint32_t)cache->count++;
+        }
+        else {
+            // Evict LRU
+            idx = cache->lru_tail;
+            lru_unlink(cache, idx);
+            index_remove(cache, idx);
+            node_release(cache, cache->entries[idx].name);
+            slot = index_find(cache, key, family);  // the run might have moved
         }
+
+        memcpy(cache->entries[idx].addr, key, sizeof(key));
+        cache->entries[idx].family = family;
+        cache->index[slot] = idx;
     }
 
-    cache->entries[idx].addr = *addr;
-    strncpy(cache->entries[idx].name, name, DNS_MAX_NAME_LEN - 1);
-    cache->entries[idx].name[DNS_MAX_NAME_LEN - 1] = '\0';
-    cache->entries[idx].expiry = now + ttl_sec;
-    cache->entries[idx].last_used = cache->current_tick;
-    cache->entries[idx].is_valid = 1;
+    DNSCacheEntry* e = &cache->entries[idx];
+    e->name = node;
+    e->expiry = ttl_sec ? now + ttl_sec : 0;
+    e->is_valid = 1;
+    lru_push_head(cache, idx);
 }
 
 const char* dns_cache_lookup(DNSCache* cache, const sockaddr_any* addr, uint64_t now) {
-    if (!cache || !addr)
+    uint8_t key[16];
+    uint16_t family;
+
+    if (!cache || !addr || !cache->count || !addr_key(addr, key, &family))
         return NULL;
 
-    cache->current_tick++;
+    uint32_t idx = cache->index[index_find(cache, key, family)];
+    if (idx == DNS_NIL || !cache->entries[idx].is_valid)
+        return NULL;
 
-    for (size_t i = 0; i < cache->count; i++) {
-        if (cache->entries[i].is_valid && addr_equal(&cache->entries[i].addr, addr)) {
-            if (cache->entries[i].expiry > 0 && now > cache->entries[i].expiry) {
-                cache->entries[i].is_valid = 0;  // Expired
-                return NULL;
-            }
-            cache->entries[i].last_used = cache->current_tick;
-            return cache->entries[i].name;
-        }
+    DNSCacheEntry* e = &cache->entries[idx];
+    if (e->expiry > 0 && now > e->expiry) {
+        e->is_valid = 0;  // Expired, to be reused first
+        lru_unlink(cache, idx);
+        lru_push_tail(cache, idx);
+        return NULL;
     }
 
-    return NULL;
+    lru_unlink(cache, idx);
+    lru_push_head(cache, idx);
+
+    return name_string(cache, e->name);
 }
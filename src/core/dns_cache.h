@@ -5,20 +5,54 @@
 #include <stddef.h>
 
 #define DNS_MAX_NAME_LEN 256
+#define DNS_NIL UINT32_MAX
 
 typedef struct {
-    sockaddr_any addr;
-    char name[DNS_MAX_NAME_LEN];
+    uint8_t addr[16];  // 4 bytes used for AF_INET
+    uint16_t family;
+    uint16_t is_valid;
+    uint32_t name;  // leaf node of the interned name
+    uint32_t lru_prev;
+    uint32_t lru_next;
     uint64_t expiry;
-    uint64_t last_used;
-    int is_valid;
 } DNSCacheEntry;
 
+/**
+ * One label of an interned name. A name is the chain of its labels
+ * up from the leaf, so that the common suffixes (domains) are shared.
+ */
+typedef struct {
+    uint32_t label;   // offset in the label pool
+    uint32_t parent;  // the rest of the name, DNS_NIL at the top
+    uint32_t refs;    // entries and child labels using it
+    uint32_t next;    // hash chain, or free list
+    uint16_t len;
+} DNSNameNode;
+
 typedef struct {
     DNSCacheEntry* entries;
     size_t capacity;
     size_t count;
-    uint64_t current_tick;
+
+    uint32_t* index;  // open addressing, entry numbers
+    size_t index_mask;
+    uint32_t lru_head;  // most recently used
+    uint32_t lru_tail;
+
+    DNSNameNode* nodes;
+    size_t num_nodes;
+    size_t max_nodes;
+    uint32_t free_nodes;
+    uint32_t* node_buckets;
+    size_t node_mask;
+    size_t live_nodes;
+
+    char* labels;
+    size_t labels_len;
+    size_t labels_cap;
+    uint32_t free_labels[DNS_MAX_NAME_LEN / 8 + 1];  // per 8 bytes size class
+
+    char name_buf[DNS_MAX_NAME_LEN];
 } DNSCache;
 
 DNSCache* dns_cache_create(size_t capacity);
@@ -33,6 +67,7 @@ void dns_cache_insert(DNSCache* cache, const sockaddr_any* addr, const char* nam
 /**
  * Looks up a name for an address.
  * Returns pointer to name if found and not expired, NULL otherwise.
+ * The name is valid until the next call on the cache.
  */
 const char* dns_cache_lookup(DNSCache* cache, const sockaddr_any* addr, uint64_t now);
 
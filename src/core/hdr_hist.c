@@ -0,0 +1,153 @@
+#include "hdr_hist.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+int hdr_init(HdrHist* h, uint64_t max_value, int digits) {
+    uint64_t largest, smallest_untrackable;
+    int magnitude;
+
+    memset(h, 0, sizeof(*h));
+
+    if (digits < HDR_MIN_DIGITS || digits > HDR_MAX_DIGITS || max_value < 2) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Enough sub-buckets for 1 unit resolution up to 2 * 10^digits
+    largest = 2;
+    for (int i = 0; i < digits; i++)
+        largest *= 10;
+    for (magnitude = 0; (1ULL << magnitude) < largest; magnitude++)
+        ;
+
+    h->max_value = max_value;
+    h->digits = digits;
+    h->sub_bucket_half_count_magnitude = magnitude - 1;
+    h->sub_bucket_count = 1U << magnitude;
+    h->sub_bucket_half_count = h->sub_bucket_count / 2;
+    h->sub_bucket_mask = h->sub_bucket_count - 1;
+
+    // Each next bucket covers twice the range of the previous one
+    smallest_untrackable = h->sub_bucket_count;
+    h->bucket_count = 1;
+    while (smallest_untrackable <= max_value) {
+        if (smallest_untrackable > UINT64_MAX / 2) {
+            h->bucket_count++;
+            break;
+        }
+        smallest_untrackable <<= 1;
+        h->bucket_count++;
+    }
+
+    h->counts_len = (h->bucket_count + 1) * h->sub_bucket_half_count;
+    h->counts = calloc(h->counts_len, sizeof(*h->counts));
+    if (!h->counts)
+        return -1;
+
+    return 0;
+}
+
+void hdr_free(HdrHist* h) {
+    free(h->counts);
+    h->counts = NULL;
+}
+
+static int bucket_of(const HdrHist* h, uint64_t value) {
+    int pow2ceiling = 64 - __builtin_clzll(value | h->sub_bucket_mask);
+
+    return pow2ceiling - (h->sub_bucket_half_count_magnitude + 1);
+}
+
+uint32_t hdr_index(const HdrHist* h, uint64_t value) {
+    int bucket = bucket_of(h, value);
+    uint32_t sub_bucket = (uint32_t)(value >> bucket);
+
+    return ((uint32_t)(bucket + 1) << h->sub_bucket_half_count_magnitude) + (sub_bucket - h->sub_bucket_half_count);
+}
+
+uint64_t hdr_lowest(const HdrHist* h, uint32_t index) {
+    int bucket = (int)(index >> h->sub_bucket_half_count_magnitude) - 1;
+    uint32_t sub_bucket = (index & (h->sub_bucket_half_count - 1)) + h->sub_bucket_half_count;
+
+    if (bucket < 0) {
+        sub_bucket -= h->sub_bucket_half_count;
+        bucket = 0;
+    }
+
+    return (uint64_t)sub_bucket << bucket;
+}
+
+uint64_t hdr_highest(const HdrHist* h, uint32_t index) {
+    uint64_t lowest = hdr_lowest(h, index);
+    int bucket = bucket_of(h, lowest);
+
+    // The first half of the first bucket has the same unit
+    if ((lowest >> bucket) >= h->sub_bucket_count)
+        bucket++;
+
+    return lowest + (1ULL << bucket) - 1;
+}
+
+static void count_add(uint32_t* c, uint64_t n) {
+    *c = n > UINT32_MAX - *c ? UINT32_MAX : *c + (uint32_t)n;
+}
+
+void hdr_record(HdrHist* h, uint64_t value, uint64_t count) {
+    if (!count)
+        return;
+    if (value > h->max_value)
+        value = h->max_value;
+    if (!value)
+        value = 1;
+
+    count_add(&h->counts[hdr_index(h, value)], count);
+
+    if (!h->total || value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->total += count;
+}
+
+int hdr_merge(HdrHist* dst, const HdrHist* src) {
+    if (dst->max_value != src->max_value || dst->digits != src->digits)
+        return -1;
+    if (!src->total)
+        return 0;
+
+    for (uint32_t i = 0; i < dst->counts_len; i++)
+        count_add(&dst->counts[i], src->counts[i]);
+
+    if (!dst->total || src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->total += src->total;
+
+    return 0;
+}
+
+uint64_t hdr_percentile(const HdrHist* h, double percentile) {
+    uint64_t wanted, seen = 0;
+
+    if (!h->total)
+        return 0;
+
+    if (percentile > 100)
+        percentile = 100;
+    wanted = (uint64_t)(percentile / 100 * h->total + 0.5);
+    if (wanted < 1)
+        wanted = 1;
+
+    for (uint32_t i = 0; i < h->counts_len; i++) {
+        seen += h->counts[i];
+        if (seen >= wanted) {
+            uint64_t value = hdr_highest(h, i);
+
+            return value < h->max ? value : h->max;
+        }
+    }
+
+    return h->max;
+}
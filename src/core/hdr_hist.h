@@ -0,0 +1,70 @@
+#ifndef TRACEROUTE_CORE_HDR_HIST_H
+#define TRACEROUTE_CORE_HDR_HIST_H
+
+#include <stdint.h>
+
+#define HDR_MIN_DIGITS 1
+#define HDR_MAX_DIGITS 5
+
+/**
+ * Log-linear histogram (the HdrHistogram layout): values from 1 to
+ * max_value are counted with `digits` significant decimal digits, i.e.
+ * each power of two range is split into the same number of linear
+ * sub-buckets. Values are integers, in whatever unit the caller uses
+ * (microseconds for RTTs). Histograms of the same parameters add up
+ * bucket by bucket, and a bucket's lowest value recorded again lands
+ * in the same bucket, so exported buckets can be merged exactly.
+ * Bucket counts are 32 bits (saturating), to halve the room per hop,
+ * the total is 64 bits.
+ */
+typedef struct {
+    uint64_t max_value;
+    int digits;
+    int sub_bucket_half_count_magnitude;
+    uint32_t sub_bucket_count;
+    uint32_t sub_bucket_half_count;
+    uint64_t sub_bucket_mask;
+    int bucket_count;
+    uint32_t counts_len;
+    uint32_t* counts;
+
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+} HdrHist;
+
+/**
+ * Returns 0 on success, -1 on error (errno set, EINVAL for bad parameters).
+ */
+int hdr_init(HdrHist* h, uint64_t max_value, int digits);
+void hdr_free(HdrHist* h);
+
+/**
+ * Counts `value` `count` times. Values above max_value count as max_value,
+ * 0 as 1.
+ */
+void hdr_record(HdrHist* h, uint64_t value, uint64_t count);
+
+/**
+ * Adds all of `src` to `dst`. Returns 0, or -1 if the parameters differ.
+ */
+int hdr_merge(HdrHist* dst, const HdrHist* src);
+
+/**
+ * Returns the index of the bucket counting `value`.
+ */
+uint32_t hdr_index(const HdrHist* h, uint64_t value);
+
+/**
+ * Returns the lowest and the highest value counted by bucket `index`.
+ */
+uint64_t hdr_lowest(const HdrHist* h, uint32_t index);
+uint64_t hdr_highest(const HdrHist* h, uint32_t index);
+
+/**
+ * Returns the (highest equivalent) value below which `percentile` percent
+ * of the values are, 0 for an empty histogram.
+ */
+uint64_t hdr_percentile(const HdrHist* h, double percentile);
+
+#endif /* TRACEROUTE_CORE_HDR_HIST_H */
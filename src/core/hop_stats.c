@@ -0,0 +1,155 @@
+#include "hop_stats.h"
+#include <math.h>
+#include <string.h>
+
+const double hop_stats_quantile_p[HOP_STATS_QUANTILES] = {0.5, 0.9, 0.99};
+
+void p2_init(P2Quantile* pq, double p) {
+    memset(pq, 0, sizeof(*pq));
+    pq->p = p;
+}
+
+static double p2_parabolic(const P2Quantile* pq, int i, double d) {
+    const double* q = pq->q;
+    const double* n = pq->n;
+
+    return q[i] + d / (n[i + 1] - n[i - 1]) *
+                      ((n[i] - n[i - 1] + d) * (q[i + 1] - q[i]) / (n[i + 1] - n[i]) +
+                       (n[i + 1] - n[i] - d) * (q[i] - q[i - 1]) / (n[i] - n[i - 1]));
+}
+
+static double p2_linear(const P2Quantile* pq, int i, int d) {
+    return pq->q[i] + d * (pq->q[i + d] - pq->q[i]) / (pq->n[i + d] - pq->n[i]);
+}
+
+void p2_add(P2Quantile* pq, double x) {
+    double p = pq->p;
+    int i, k;
+
+    // The first five samples are just kept sorted
+    if (pq->count < 5) {
+        for (i = pq->count; i > 0 && pq->q[i - 1] > x; i--)
+            pq->q[i] = pq->q[i - 1];
+        pq->q[i] = x;
+
+        if (++pq->count == 5) {
+            for (i = 0; i < 5; i++)
+                pq->n[i] = i;
+            pq->np[0] = 0;
+            pq->np[1] = 2 * p;
+            pq->np[2] = 4 * p;
+            pq->np[3] = 2 + 2 * p;
+            pq->np[4] = 4;
+        }
+        return;
+    }
+    pq->count++;
+
+    if (x < pq->q[0]) {
+        pq->q[0] = x;
+        k = 0;
+    }
+    else if (x >= pq->q[4]) {
+        pq->q[4] = x;
+        k = 3;
+    }
+    else {
+        for (k = 0; k < 3 && x >= pq->q[k + 1]; k++)
+            ;
+    }
+
+    for (i = k + 1; i < 5; i++)
+        pq->n[i]++;
+
+    pq->np[1] += p / 2;
+    pq->np[2] += p;
+    pq->np[3] += (1 + p) / 2;
+    pq->np[4] += 1;
+
+    for (i = 1; i < 4; i++) {
+        double d = pq->np[i] - pq->n[i];
+
+        if ((d >= 1 && pq->n[i + 1] - pq->n[i] > 1) || (d <= -1 && pq->n[i - 1] - pq->n[i] < -1)) {
+            int s = d > 0 ? 1 : -1;
+            double q = p2_parabolic(pq, i, s);
+
+            if (pq->q[i - 1] < q && q < pq->q[i + 1])
+                pq->q[i] = q;
+            else
+                pq->q[i] = p2_linear(pq, i, s);
+            pq->n[i] += s;
+        }
+    }
+}
+
+double p2_value(const P2Quantile* pq) {
+    if (!pq->count)
+        return 0;
+    if (pq->count < 5)
+        return pq->q[(int)lround((pq->count - 1) * pq->p)];  // the exact one
+
+    return pq->q[2];
+}
+
+void hop_stats_init(HopStats* hs) {
+    memset(hs, 0, sizeof(*hs));
+
+    for (int i = 0; i < HOP_STATS_QUANTILES; i++)
+        p2_init(&hs->quantiles[i], hop_stats_quantile_p[i]);
+}
+
+void hop_stats_add(HopStats* hs, double rtt) {
+    double* slot = &hs->ring[hs->ring_next];
+
+    // Evict the oldest one
+    if (hs->ring_count == HOP_STATS_RING) {
+        if (*slot < 0)
+            hs->ring_lost--;
+        else
+            hs->ring_sum -= *slot;
+    }
+    else
+        hs->ring_count++;
+
+    *slot = rtt;
+    hs->ring_next = (hs->ring_next + 1) % HOP_STATS_RING;
+
+    hs->sent++;
+
+    if (rtt < 0) {
+        hs->ring_lost++;
+        return;
+    }
+    hs->ring_sum += rtt;
+
+    if (!hs->received) {
+        hs->ewma = hs->min = hs->max = rtt;
+    }
+    else {
+        hs->ewma += HOP_STATS_EWMA_GAIN * (rtt - hs->ewma);
+        hs->jitter += HOP_STATS_JITTER_GAIN * (fabs(rtt - hs->last) - hs->jitter);
+        if (rtt < hs->min)
+            hs->min = rtt;
+        if (rtt > hs->max)
+            hs->max = rtt;
+    }
+    hs->last = rtt;
+    hs->received++;
+
+    for (int i = 0; i < HOP_STATS_QUANTILES; i++)
+        p2_add(&hs->quantiles[i], rtt);
+}
+
+double hop_stats_loss(const HopStats* hs) {
+    return hs->ring_count ? (double)hs->ring_lost / hs->ring_count : 0;
+}
+
+double hop_stats_mean(const HopStats* hs) {
+    unsigned int n = hs->ring_count - hs->ring_lost;
+
+    return n ? hs->ring_sum / n : 0;
+}
+
+double hop_stats_quantile(const HopStats* hs, int i) {
+    return p2_value(&hs->quantiles[i]);
+}
@@ -0,0 +1,74 @@
+#ifndef TRACEROUTE_CORE_HOP_STATS_H
+#define TRACEROUTE_CORE_HOP_STATS_H
+
+#include <stdint.h>
+
+#define HOP_STATS_RING 64  // latest results kept, for the rolling loss and mean
+#define HOP_STATS_QUANTILES 3
+#define HOP_STATS_EWMA_GAIN 0.125     // as for the SRTT of RFC 6298
+#define HOP_STATS_JITTER_GAIN 0.0625  // as for the interarrival jitter of RFC 3550
+
+/**
+ * Streaming quantile estimate (the P-square algorithm of Jain and
+ * Chlamtac): five markers, moved by a parabolic step on each sample,
+ * no samples stored.
+ */
+typedef struct {
+    double p;
+    double q[5];   // marker heights
+    double n[5];   // marker positions
+    double np[5];  // desired positions
+    int count;
+} P2Quantile;
+
+/**
+ * Per hop statistics of a continuous run, every update in O(1).
+ * The RTTs are in seconds. The loss and the mean are over the latest
+ * HOP_STATS_RING results, the rest over the whole run.
+ */
+typedef struct {
+    double ring[HOP_STATS_RING];  // RTTs, negative for losses
+    unsigned int ring_next;
+    unsigned int ring_count;
+    unsigned int ring_lost;
+    double ring_sum;  // of the RTTs there
+
+    uint64_t sent;
+    uint64_t received;
+    double last;
+    double ewma;
+    double jitter;
+    double min;
+    double max;
+    P2Quantile quantiles[HOP_STATS_QUANTILES];  // p50, p90, p99
+} HopStats;
+
+extern const double hop_stats_quantile_p[HOP_STATS_QUANTILES];
+
+void hop_stats_init(HopStats* hs);
+
+/**
+ * Adds the result of one probe: its RTT, or a negative value for a loss.
+ */
+void hop_stats_add(HopStats* hs, double rtt);
+
+/**
+ * Returns the loss fraction over the ring, 0 when empty.
+ */
+double hop_stats_loss(const HopStats* hs);
+
+/**
+ * Returns the mean RTT over the ring, 0 when nothing received there.
+ */
+double hop_stats_mean(const HopStats* hs);
+
+/**
+ * Returns the estimate of hop_stats_quantile_p[i], 0 before any sample.
+ */
+double hop_stats_quantile(const HopStats* hs, int i);
+
+void p2_init(P2Quantile* pq, double p);
+void p2_add(P2Quantile* pq, double x);
+double p2_value(const P2Quantile* pq);
+
+#endif /* TRACEROUTE_CORE_HOP_STATS_H */
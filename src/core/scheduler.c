@@ -10,10 +10,7 @@ void token_bucket_init(TokenBucket* tb, double rate, double burst, double now) {
     tb->last_refill = now;
 }
 
-int token_bucket_consume(TokenBucket* tb, double amount, double now) {
-    if (!tb)
-        return 0;
-
+static void token_bucket_refill(TokenBucket* tb, double now) {
     double elapsed = now - tb->last_refill;
     if (elapsed > 0) {
         double new_tokens = elapsed * tb->rate;
@@ -23,6 +20,13 @@ int token_bucket_consume(TokenBucket* tb, double amount, double now) {
         }
         tb->last_refill = now;
     }
+}
+
+int token_bucket_consume(TokenBucket* tb, double amount, double now) {
+    if (!tb)
+        return 0;
+
+    token_bucket_refill(tb, now);
 
     if (tb->tokens >= amount) {
         tb->tokens -= amount;
@@ -32,15 +36,92 @@ int token_bucket_consume(TokenBucket* tb, double amount, double now) {
     return 0;
 }
 
+double token_bucket_delay(TokenBucket* tb, double amount, double now) {
+    if (!tb)
+        return 0;
+
+    token_bucket_refill(tb, now);
+
+    if (tb->tokens >= amount)
+        return 0;
+    if (tb->rate <= 0)
+        return INFINITY;
+
+    return (amount - tb->tokens) / tb->rate;
+}
+
+void token_bucket_charge(TokenBucket* tb, double amount, double now) {
+    if (!tb)
+        return;
+
+    token_bucket_refill(tb, now);
+    tb->tokens -= amount;
+}
+
+void token_bucket_refund(TokenBucket* tb, double amount, double now) {
+    if (!tb)
+        return;
+
+    token_bucket_refill(tb, now);
+    tb->tokens += amount;
+    if (tb->tokens > tb->burst)
+        tb->tokens = tb->burst;
+}
+
 void scheduler_init(ProbeScheduler* sched, int max_ttl, int probes_per_ttl, int parallel_probes, double deadline) {
     if (!sched)
         return;
     sched->max_ttl = max_ttl;
     sched->probes_per_ttl = probes_per_ttl;
-    sched->parallel_probes = parallel_probes;  // Not used in this simple logic yet, but good for future
+    sched->parallel_probes = parallel_probes;
     sched->deadline = deadline;
     sched->current_ttl = 1;
     sched->current_probe = 0;
+
+    sched->min_window = 1;
+    sched->max_window = (parallel_probes > 0 ? parallel_probes : 1) * 64;
+    sched->window = parallel_probes > 0 ? parallel_probes : 1;
+    sched->ssthresh = sched->max_window;
+    sched->recover_time = 0;
+}
+
+void scheduler_set_window_limits(ProbeScheduler* sched, int min_window, int max_window) {
+    if (!sched || min_window < 1 || max_window < min_window)
+        return;
+    sched->min_window = min_window;
+    sched->max_window = max_window;
+    sched->window = fmin(fmax(sched->window, min_window), max_window);
+    sched->ssthresh = fmin(sched->ssthresh, max_window);
+}
+
+int scheduler_window(const ProbeScheduler* sched) {
+    if (!sched)
+        return 1;
+    return (int)sched->window;
+}
+
+void scheduler_on_reply(ProbeScheduler* sched) {
+    if (!sched)
+        return;
+
+    if (sched->window < sched->ssthresh)
+        sched->window += 1;
+    else
+        sched->window += 1 / sched->window;
+
+    if (sched->window > sched->max_window)
+        sched->window = sched->max_window;
+}
+
+void scheduler_on_loss(ProbeScheduler* sched, double sent, double now) {
+    if (!sched || sent < sched->recover_time)
+        return;
+
+    sched->window /= 2;
+    if (sched->window < sched->min_window)
+        sched->window = sched->min_window;
+    sched->ssthresh = sched->window;
+    sched->recover_time = now;
 }
 
 int scheduler_next_probe(ProbeScheduler* sched, int* ttl_out, int* probe_idx_out, double now) {
@@ -13,16 +13,63 @@ typedef struct {
 void token_bucket_init(TokenBucket* tb, double rate, double burst, double now);
 int token_bucket_consume(TokenBucket* tb, double amount, double now);
 
+/**
+ * Returns the time (in seconds from `now`) until `amount` tokens are
+ * available, 0 if they already are.
+ */
+double token_bucket_delay(TokenBucket* tb, double amount, double now);
+
+/**
+ * Takes `amount` tokens even if there are not so many, leaving the bucket
+ * in debt. For the spending not known in advance.
+ */
+void token_bucket_charge(TokenBucket* tb, double amount, double now);
+
+/**
+ * Gives back `amount` tokens taken for nothing, no more than the burst.
+ */
+void token_bucket_refund(TokenBucket* tb, double amount, double now);
+
 typedef struct {
     int current_ttl;
     int max_ttl;
     int probes_per_ttl;
     int current_probe;
-    int parallel_probes;
+    int parallel_probes;  // initial window
     double deadline;
+
+    // In-flight window, grown by replies and shrunk by losses (AIMD)
+    double window;
+    double ssthresh;      // slow start below it
+    int min_window;
+    int max_window;
+    double recover_time;  // losses of probes sent before are of the same event
 } ProbeScheduler;
 
 void scheduler_init(ProbeScheduler* sched, int max_ttl, int probes_per_ttl, int parallel_probes, double deadline);
 int scheduler_next_probe(ProbeScheduler* sched, int* ttl_out, int* probe_idx_out, double now);
 
+/**
+ * Bounds the window (by default 1 to parallel_probes * 64).
+ * Equal bounds make it fixed.
+ */
+void scheduler_set_window_limits(ProbeScheduler* sched, int min_window, int max_window);
+
+/**
+ * Returns the number of probes allowed in flight now.
+ */
+int scheduler_window(const ProbeScheduler* sched);
+
+/**
+ * A reply has come: one more probe in flight per reply while slow
+ * starting, about one more per window of replies after.
+ */
+void scheduler_on_reply(ProbeScheduler* sched);
+
+/**
+ * A probe sent at `sent` is lost (or a router signals rate limiting):
+ * halves the window, once for all the probes sent before the last cut.
+ */
+void scheduler_on_loss(ProbeScheduler* sched, double sent, double now);
+
 #endif /* TRACEROUTE_CORE_SCHEDULER_H */
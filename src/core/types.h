@@ -6,7 +6,8 @@
 #include <stdint.h>
 #include <stddef.h>
 
-typedef union {
+// Named, so that the traceroute/ code shares this very type
+typedef union common_sockaddr {
     struct sockaddr sa;
     struct sockaddr_in sin;
     struct sockaddr_in6 sin6;
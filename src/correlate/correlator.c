@@ -3,81 +3,282 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Entries are chained in a hash table keyed by the identity fields that
+// correlate_match() always compares: protocol, dst_port, src_port and, for
+// TCP, the sequence. A probe sent with src_port 0 matches any source port,
+// so it is hashed with src_port 0 and looked up by a second probe of the
+// wildcard key. Candidates on a chain are still verified by correlate_match().
+//
+// LRU order is an intrusive doubly linked list over slot indices, so that
+// insert, match and eviction are all O(1).
+//
+// Payloads live in an arena of fixed-size slots allocated at create time,
+// slot i belonging to entries[i], so that a slot is reused as its entry is.
+// A payload truncated to its slot still compares by its original length and
+// the hash of the whole. Without a slot size, each entry owns a heap buffer
+// instead, kept across reuse and grown only for a longer payload.
+
+static uint64_t payload_hash(const void* data, size_t len) {
+    const uint8_t* p = data;
+    uint64_t h = 0xcbf29ce484222325ULL;  // FNV-1a
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static uint32_t corr_hash(uint8_t protocol, uint16_t dst_port, uint16_t src_port, uint16_t sequence) {
+    uint64_t key = (uint64_t)protocol << 48 | (uint64_t)dst_port << 32 | (uint64_t)src_port << 16;
+
+    if (protocol == IPPROTO_TCP)
+        key |= sequence;
+
+    // splitmix64 finalizer
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+
+    return (uint32_t)key;
+}
+
+static uint32_t* corr_bucket(Correlator* c, const ProbeIdentity* id) {
+    return &c->buckets[corr_hash(id->protocol, id->dst_port, id->src_port, id->sequence) & c->bucket_mask];
+}
+
+static void lru_unlink(Correlator* c, uint32_t idx) {
+    CorrLink* l = &c->links[idx];
+
+    if (l->lru_prev != CORR_NIL)
+        c->links[l->lru_prev].lru_next = l->lru_next;
+    else
+        c->lru_head = l->lru_next;
+
+    if (l->lru_next != CORR_NIL)
+        c->links[l->lru_next].lru_prev = l->lru_prev;
+    else
+        c->lru_tail = l->lru_prev;
+}
+
+static void lru_push_head(Correlator* c, uint32_t idx) {
+    CorrLink* l = &c->links[idx];
+
+    l->lru_prev = CORR_NIL;
+    l->lru_next = c->lru_head;
+
+    if (c->lru_head != CORR_NIL)
+        c->links[c->lru_head].lru_prev = idx;
+    else
+        c->lru_tail = idx;
+
+    c->lru_head = idx;
+}
+
+static void hash_unlink(Correlator* c, uint32_t idx) {
+    uint32_t* p = corr_bucket(c, &c->entries[idx].id);
+
+    while (*p != CORR_NIL) {
+        if (*p == idx) {
+            *p = c->links[idx].hash_next;
+            return;
+        }
+        p = &c->links[*p].hash_next;
+    }
+}
+
 Correlator* corr_create(size_t capacity) {
+    return corr_create_ex(capacity, 0, CORR_PAYLOAD_COPY);
+}
+
+Correlator* corr_create_ex(size_t capacity, size_t payload_slot, CorrPayloadMode mode) {
+    if (capacity >= CORR_NIL)
+        return NULL;
+    if (mode == CORR_PAYLOAD_COPY && payload_slot && capacity > SIZE_MAX / payload_slot)
+        return NULL;
+
     Correlator* c = calloc(1, sizeof(Correlator));
     if (!c)
         return NULL;
 
+    // Power of two buckets, at least as many as entries
+    size_t num_buckets = 16;
+    while (num_buckets < capacity)
+        num_buckets <<= 1;
+
     c->capacity = capacity;
+    c->bucket_mask = num_buckets - 1;
+    c->lru_head = CORR_NIL;
+    c->lru_tail = CORR_NIL;
     c->entries = calloc(capacity, sizeof(Probe));
-    c->last_used = calloc(capacity, sizeof(uint64_t));
+    c->links = calloc(capacity, sizeof(CorrLink));
+    c->buckets = malloc(num_buckets * sizeof(uint32_t));
+    c->payload_mode = mode;
+
+    if (mode == CORR_PAYLOAD_HASH) {
+        c->payload_hash = calloc(capacity, sizeof(uint64_t));
+        if (!c->payload_hash) {
+            corr_destroy(c);
+            return NULL;
+        }
+    }
+    else if (payload_slot && capacity) {
+        c->payload_slot = payload_slot;
+        c->payload_arena = malloc(capacity * payload_slot);
+        c->payload_full_len = calloc(capacity, sizeof(size_t));
+        c->payload_hash = calloc(capacity, sizeof(uint64_t));
+        if (!c->payload_arena || !c->payload_full_len || !c->payload_hash) {
+            corr_destroy(c);
+            return NULL;
+        }
+    }
+    else {
+        c->payload_cap = calloc(capacity, sizeof(size_t));
+        if (!c->payload_cap && capacity) {
+            corr_destroy(c);
+            return NULL;
+        }
+    }
 
-    if (!c->entries || !c->last_used) {
+    if (!c->entries || !c->links || !c->buckets) {
         corr_destroy(c);
         return NULL;
     }
 
+    memset(c->buckets, 0xff, num_buckets * sizeof(uint32_t));  // all CORR_NIL
+
     return c;
 }
 
 void corr_destroy(Correlator* c) {
     if (!c)
         return;
-    if (c->entries) {
-        for (size_t i = 0; i < c->capacity; i++) {
-            if (c->entries[i].payload)
-                free(c->entries[i].payload);
-        }
-        free(c->entries);
+    if (c->payload_cap) {
+        for (size_t i = 0; i < c->capacity; i++)
+            free(c->entries[i].payload);
     }
-    if (c->last_used)
-        free(c->last_used);
+    free(c->entries);
+    free(c->payload_arena);
+    free(c->payload_cap);
+    free(c->payload_full_len);
+    free(c->payload_hash);
+    free(c->links);
+    free(c->buckets);
     free(c);
 }
 
 void corr_insert_probe(Correlator* c, const Probe* probe) {
-    if (!c || !probe)
+    if (!c || !probe || !c->capacity)
         return;
 
-    size_t idx = 0;
+    uint32_t idx;
     if (c->count < c->capacity) {
-        idx = c->count++;
+        idx = (uint32_t)c->count++;
     }
     else {
-        // Find oldest entry
-        uint64_t min_tick = c->last_used[0];
-        for (size_t i = 1; i < c->capacity; i++) {
-            if (c->last_used[i] < min_tick) {
-                min_tick = c->last_used[i];
-                idx = i;
+        // Evict the least recently used
+        idx = c->lru_tail;
+        lru_unlink(c, idx);
+        hash_unlink(c, idx);
+    }
+
+    Probe* e = &c->entries[idx];
+    void* buf = e->payload;  // the heap copy of the previous one, if any
+
+    *e = *probe;
+    e->payload = NULL;
+    if (!probe->payload)
+        e->payload_len = 0;
+
+    if (c->payload_mode == CORR_PAYLOAD_HASH) {
+        c->payload_hash[idx] = payload_hash(probe->payload, e->payload_len);
+    }
+    else if (c->payload_arena) {
+        c->payload_full_len[idx] = e->payload_len;
+        c->payload_hash[idx] = payload_hash(probe->payload, e->payload_len);
+        e->payload = c->payload_arena + (size_t)idx * c->payload_slot;
+        if (e->payload_len > c->payload_slot)
+            e->payload_len = c->payload_slot;
+        if (e->payload_len)
+            memcpy(e->payload, probe->payload, e->payload_len);
+        else
+            e->payload = NULL;
+    }
+    else if (c->payload_cap) {
+        if (e->payload_len > c->payload_cap[idx]) {
+            void* grown = realloc(buf, e->payload_len);
+
+            if (grown) {
+                buf = grown;
+                c->payload_cap[idx] = e->payload_len;
+            }
+            else {
+                e->payload_len = 0;  // no copy, as for no payload at all
             }
         }
-        if (c->entries[idx].payload) {
-            free(c->entries[idx].payload);
-            c->entries[idx].payload = NULL;
-        }
+        e->payload = buf;
+        if (e->payload_len)
+            memcpy(e->payload, probe->payload, e->payload_len);
     }
 
-    c->entries[idx] = *probe;
-    if (probe->payload && probe->payload_len > 0) {
-        c->entries[idx].payload = malloc(probe->payload_len);
-        if (c->entries[idx].payload) {
-            memcpy(c->entries[idx].payload, probe->payload, probe->payload_len);
+    uint32_t* bucket = corr_bucket(c, &c->entries[idx].id);
+    c->links[idx].hash_next = *bucket;
+    *bucket = idx;
+
+    lru_push_head(c, idx);
+}
+
+static Probe* corr_lookup(Correlator* c, const PacketResult* res, uint16_t src_port) {
+    const ProbeIdentity* req = &res->original_req;
+    uint32_t idx = c->buckets[corr_hash(req->protocol, req->dst_port, src_port, req->sequence) & c->bucket_mask];
+
+    for (; idx != CORR_NIL; idx = c->links[idx].hash_next) {
+        Probe* p = &c->entries[idx];
+
+        if (p->id.src_port == src_port && correlate_match(res, p)) {
+            lru_unlink(c, idx);  // Update LRU
+            lru_push_head(c, idx);
+            return p;
         }
     }
-    c->last_used[idx] = ++c->current_time_tick;
+
+    return NULL;
 }
 
 Probe* corr_match(Correlator* c, const PacketResult* res) {
-    if (!c || !res)
+    if (!c || !res || !c->count)
         return NULL;
 
-    for (size_t i = 0; i < c->count; i++) {
-        if (correlate_match(res, &c->entries[i])) {
-            c->last_used[i] = ++c->current_time_tick;  // Update LRU
-            return &c->entries[i];
-        }
+    Probe* p = corr_lookup(c, res, res->original_req.src_port);
+    if (!p && res->original_req.src_port != 0)
+        p = corr_lookup(c, res, 0);  // probes sent with any source port
+
+    return p;
+}
+
+int corr_payload_equal(const Correlator* c, const Probe* probe, const void* payload, size_t len) {
+    if (!c || !probe || probe < c->entries || probe >= c->entries + c->count)
+        return 0;
+    if (!payload)
+        len = 0;
+
+    if (c->payload_mode == CORR_PAYLOAD_HASH) {
+        size_t idx = (size_t)(probe - c->entries);
+        return len == probe->payload_len && payload_hash(payload, len) == c->payload_hash[idx];
     }
 
-    return NULL;
+    if (c->payload_arena) {
+        size_t idx = (size_t)(probe - c->entries);
+
+        if (len != c->payload_full_len[idx])
+            return 0;
+        if (len > probe->payload_len)  // truncated, the hash vouches for the rest
+            return memcmp(payload, probe->payload, probe->payload_len) == 0 &&
+                   payload_hash(payload, len) == c->payload_hash[idx];
+    }
+
+    return len == probe->payload_len && (!len || memcmp(payload, probe->payload, len) == 0);
 }
@@ -4,15 +4,56 @@
 #include "../core/types.h"
 #include "../io/net.h"
 
+#define CORR_NIL UINT32_MAX
+
+typedef enum {
+    CORR_PAYLOAD_COPY = 0, /**< keep the payload bytes in the arena */
+    CORR_PAYLOAD_HASH = 1, /**< keep only a hash of the payload */
+} CorrPayloadMode;
+
+/**
+ * Per-slot links: the hash chain the slot is on, and its place
+ * in the LRU list (head is the most recently used).
+ */
+typedef struct {
+    uint32_t hash_next;
+    uint32_t lru_prev;
+    uint32_t lru_next;
+} CorrLink;
+
 typedef struct {
     Probe* entries;
     size_t capacity;
     size_t count;
-    uint64_t* last_used;
-    uint64_t current_time_tick;
+    CorrLink* links;
+    uint32_t* buckets;
+    size_t bucket_mask;
+    uint32_t lru_head;
+    uint32_t lru_tail;
+    CorrPayloadMode payload_mode;
+    size_t payload_slot;       /**< 0 for unbounded, heap copies */
+    uint8_t* payload_arena;    /**< capacity * payload_slot bytes, slot i belongs to entries[i] */
+    size_t* payload_cap;       /**< per entry heap copy size, unbounded slots only */
+    size_t* payload_full_len;  /**< per entry length before truncation, arena slots only */
+    uint64_t* payload_hash;    /**< per entry, of the whole payload (unless unbounded) */
 } Correlator;
 
+/**
+ * Creates a correlator for up to `capacity` inflight probes,
+ * keeping a full copy of each payload (as corr_create_ex() with no slot).
+ */
 Correlator* corr_create(size_t capacity);
+
+/**
+ * Creates a correlator with an explicit payload slot size and mode.
+ * With a `payload_slot`, all the memory is allocated here, insert and match
+ * never allocate. Payloads longer than it are truncated (payload_len is
+ * clamped too), but their original length and hash are kept to compare with.
+ * A zero `payload_slot` keeps whole payloads in per entry heap buffers, grown
+ * on insert as needed. In CORR_PAYLOAD_HASH mode no payload is kept at all,
+ * entries have a NULL payload and keep the original payload_len.
+ */
+Correlator* corr_create_ex(size_t capacity, size_t payload_slot, CorrPayloadMode mode);
 void corr_destroy(Correlator* c);
 
 /**
@@ -28,4 +69,13 @@ void corr_insert_probe(Correlator* c, const Probe* probe);
  */
 Probe* corr_match(Correlator* c, const PacketResult* res);
 
+/**
+ * Checks a payload (e.g. quoted in an ICMP error) against the one stored for
+ * `probe`, which must be an entry of `c`. Compares the bytes kept, and the
+ * hash of the rest for a truncated payload, or only the hash in
+ * CORR_PAYLOAD_HASH mode.
+ * Returns 1 if they are the same, 0 otherwise.
+ */
+int corr_payload_equal(const Correlator* c, const Probe* probe, const void* payload, size_t len);
+
 #endif /* TRACEROUTE_CORRELATE_CORRELATOR_H */
@@ -0,0 +1,270 @@
+#include "mda.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_STOP 100000  // give up the stopping rule beyond, cannot be met anyway
+
+int mda_stopping_point(int k, double alpha) {
+    double p[MDA_MAX_BRANCH + 2] = {0};
+    int K, n;
+
+    if (k < 1)
+        k = 1;
+    if (k > MDA_MAX_BRANCH)
+        k = MDA_MAX_BRANCH;
+    K = k + 1;  // the hypothesis to rule out
+
+    // p[d]: probability to have seen d of K even successors after n probes
+    p[0] = 1;
+    for (n = 1; n < MAX_STOP; n++) {
+        for (int d = K; d > 0; d--)
+            p[d] = p[d] * d / K + p[d - 1] * (K - d + 1) / K;
+        p[0] = 0;
+
+        if (1 - p[K] <= alpha)
+            break;
+    }
+
+    return n;
+}
+
+Mda* mda_create(int first_ttl, int max_ttl, int max_flows, double alpha) {
+    if (first_ttl < 1 || max_ttl < first_ttl || max_flows < 1 || max_flows > INT16_MAX || alpha <= 0 || alpha >= 1)
+        return NULL;
+
+    Mda* m = calloc(1, sizeof(*m));
+    if (!m)
+        return NULL;
+
+    m->first_ttl = first_ttl;
+    m->max_ttl = max_ttl;
+    m->max_flows = max_flows;
+    m->cur = first_ttl;
+
+    m->hops = calloc(max_ttl, sizeof(*m->hops));
+    if (!m->hops)
+        goto fail;
+    for (int i = 0; i < max_ttl; i++) {
+        m->hops[i].flow_state = calloc(max_flows, sizeof(int16_t));
+        if (!m->hops[i].flow_state)
+            goto fail;
+    }
+
+    m->stop[0] = MDA_SILENT_PROBES;
+    for (int k = 1; k <= MDA_MAX_BRANCH; k++)
+        m->stop[k] = mda_stopping_point(k, alpha);
+
+    return m;
+
+fail:
+    mda_destroy(m);
+    return NULL;
+}
+
+void mda_destroy(Mda* m) {
+    if (!m)
+        return;
+
+    if (m->hops) {
+        for (int i = 0; i < m->max_ttl; i++) {
+            free(m->hops[i].flow_state);
+            free(m->hops[i].ifaces);
+            free(m->hops[i].links);
+        }
+        free(m->hops);
+    }
+    free(m);
+}
+
+static MdaHop* hop(Mda* m, int ttl) {
+    return &m->hops[ttl - 1];
+}
+
+static int need(const Mda* m, int succ) {
+    return m->stop[succ < MDA_MAX_BRANCH ? succ : MDA_MAX_BRANCH];
+}
+
+static int grow(void** arr, int* max, int num, size_t size) {
+    if (num < *max)
+        return 0;
+
+    int n = *max ? *max * 2 : 8;
+    void* p = realloc(*arr, n * size);
+    if (!p)
+        return -1;
+    *arr = p;
+    *max = n;
+    return 0;
+}
+
+static int same_addr(const sockaddr_any* a, const sockaddr_any* b) {
+    if (a->sa.sa_family != b->sa.sa_family)
+        return 0;
+    if (a->sa.sa_family == AF_INET6)
+        return !memcmp(&a->sin6.sin6_addr, &b->sin6.sin6_addr, sizeof(a->sin6.sin6_addr));
+    return !memcmp(&a->sin.sin_addr, &b->sin.sin_addr, sizeof(a->sin.sin_addr));
+}
+
+static int take_flow(MdaHop* h, int flow) {
+    h->flow_state[flow] = MDA_PENDING;
+    h->pending++;
+    return flow;
+}
+
+// Counts the successors at `h' and the flows sent there, of the flows passing `prev_state' before
+static void successors(const Mda* m, const MdaHop* p, const MdaHop* h, int prev_state, int* succ, int* probed,
+                       int* unused) {
+    uint8_t seen[INT16_MAX / 8 + 1];
+    int n = 0;
+
+    memset(seen, 0, h->num_ifaces / 8 + 1);
+    *succ = *probed = 0;
+    *unused = -1;
+
+    for (int f = 0; f < m->next_flow; f++) {
+        int s = h->flow_state[f];
+
+        if (p && p->flow_state[f] != prev_state)
+            continue;
+
+        if (s == MDA_UNPROBED) {
+            if (*unused < 0)
+                *unused = f;
+            continue;
+        }
+        (*probed)++;
+
+        if (s > 0 && !(seen[(s - 1) / 8] & (1 << ((s - 1) % 8)))) {
+            seen[(s - 1) / 8] |= 1 << ((s - 1) % 8);
+            n++;
+        }
+    }
+
+    *succ = n;
+}
+
+int mda_next_probe(Mda* m, int* ttl, int* flow) {
+    while (m->cur <= m->max_ttl) {
+        MdaHop* h = hop(m, m->cur);
+        MdaHop* p = m->cur > m->first_ttl ? hop(m, m->cur - 1) : NULL;
+        int succ, probed, unused;
+        int wanting = 0;
+
+        if (p && !p->num_ifaces)
+            p = NULL;  // a silent hop before: just any flows
+
+        if (!p) {
+            successors(m, NULL, h, 0, &succ, &probed, &unused);
+
+            if (probed < need(m, succ)) {
+                if (unused < 0) {
+                    if (m->next_flow >= m->max_flows)
+                        goto wait;
+                    unused = m->next_flow++;
+                }
+                *ttl = m->cur;
+                *flow = take_flow(h, unused);
+                m->num_probes++;
+                return 1;
+            }
+        }
+        else {
+            for (int i = 0; i < p->num_ifaces; i++) {
+                if (p->ifaces[i].final)
+                    continue;
+
+                successors(m, p, h, i + 1, &succ, &probed, &unused);
+
+                if (probed >= need(m, succ))
+                    continue;
+
+                if (unused >= 0) {
+                    *ttl = m->cur;
+                    *flow = take_flow(h, unused);
+                    m->num_probes++;
+                    return 1;
+                }
+
+                wanting += need(m, succ) - probed;
+            }
+
+            // Node control: more flows to the previous hop, to find ones passing the interfaces short of them
+            if (wanting > p->pending && m->next_flow < m->max_flows) {
+                *ttl = m->cur - 1;
+                *flow = take_flow(p, m->next_flow++);
+                m->num_probes++;
+                return 1;
+            }
+        }
+
+    wait:
+        if (h->pending || (p && p->pending))
+            return 0;
+
+        // The hop is done
+        int final = h->num_ifaces > 0;
+        for (int i = 0; i < h->num_ifaces; i++)
+            final &= h->ifaces[i].final;
+
+        m->cur = final ? m->max_ttl + 1 : m->cur + 1;
+    }
+
+    return -1;
+}
+
+void mda_record(Mda* m, int ttl, int flow, const sockaddr_any* from, int final) {
+    int i;
+
+    if (ttl < m->first_ttl || ttl > m->max_ttl || flow < 0 || flow >= m->max_flows)
+        return;
+
+    MdaHop* h = hop(m, ttl);
+    if (h->flow_state[flow] != MDA_PENDING)
+        return;
+    h->pending--;
+
+    if (!from || !from->sa.sa_family) {
+        h->flow_state[flow] = MDA_NO_REPLY;
+        return;
+    }
+
+    for (i = 0; i < h->num_ifaces; i++) {
+        if (same_addr(&h->ifaces[i].addr, from))
+            break;
+    }
+    if (i == h->num_ifaces) {
+        if (i >= INT16_MAX - 1 || grow((void**)&h->ifaces, &h->max_ifaces, h->num_ifaces, sizeof(MdaIface)) < 0) {
+            h->flow_state[flow] = MDA_NO_REPLY;
+            return;
+        }
+        memset(&h->ifaces[i], 0, sizeof(MdaIface));
+        h->ifaces[i].addr = *from;
+        h->num_ifaces++;
+    }
+    h->ifaces[i].final |= final;
+    h->ifaces[i].flows++;
+    h->flow_state[flow] = i + 1;
+
+    // The link the flow has shown, if its previous interface is known
+    if (ttl > m->first_ttl) {
+        int prev = hop(m, ttl - 1)->flow_state[flow] - 1;
+        int l;
+
+        if (prev < 0)
+            return;
+
+        for (l = 0; l < h->num_links; l++) {
+            if (h->links[l].prev == prev && h->links[l].next == i)
+                break;
+        }
+        if (l == h->num_links) {
+            if (grow((void**)&h->links, &h->max_links, h->num_links, sizeof(MdaLink)) < 0)
+                return;
+            h->links[l].prev = prev;
+            h->links[l].next = i;
+            h->links[l].flows = 0;
+            h->num_links++;
+        }
+        h->links[l].flows++;
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef TRACEROUTE_CORRELATE_MDA_H
+#define TRACEROUTE_CORRELATE_MDA_H
+
+#include "../core/types.h"
+#include <stdint.h>
+
+#define MDA_MAX_BRANCH 64  // successors told apart per interface
+#define MDA_SILENT_PROBES 3  // probes to give a silent hop up
+
+/**
+ * Multipath Detection Algorithm (Paris traceroute): the flows are the
+ * header variations load balancers hash on, each one following a fixed
+ * path. For each interface of the previous hop, flows known to pass it
+ * are sent one hop further until, with k successors seen, the stopping
+ * rule says a (k+1)th one would have shown up with the confidence asked.
+ * When an interface has not enough flows passing it, new flows are sent
+ * to the previous hop to find some (node control).
+ */
+
+typedef struct {
+    sockaddr_any addr;
+    int final;  // the destination
+    int flows;  // seen with
+} MdaIface;
+
+typedef struct {
+    int prev;  // interface index at the previous hop
+    int next;  // at this hop
+    int flows;
+} MdaLink;
+
+typedef struct {
+    int16_t* flow_state;  // per flow: MDA_UNPROBED etc., or the interface index + 1
+    MdaIface* ifaces;
+    int num_ifaces;
+    int max_ifaces;
+    MdaLink* links;
+    int num_links;
+    int max_links;
+    int pending;
+} MdaHop;
+
+#define MDA_UNPROBED 0
+#define MDA_PENDING (-1)
+#define MDA_NO_REPLY (-2)
+
+typedef struct {
+    MdaHop* hops;  // [ttl - 1]
+    int first_ttl;
+    int max_ttl;
+    int max_flows;
+    int next_flow;  // all below have been used at some hop
+    int cur;        // the hop being enumerated
+    int num_probes;
+    int stop[MDA_MAX_BRANCH + 1];  // probes to rule out one more successor of k
+} Mda;
+
+/**
+ * Probes ttls from first_ttl to max_ttl, using no more than max_flows
+ * flows (at most 32767), and failing to see a successor with probability
+ * no more than `alpha` per interface (0.05 for 95% confidence).
+ */
+Mda* mda_create(int first_ttl, int max_ttl, int max_flows, double alpha);
+void mda_destroy(Mda* m);
+
+/**
+ * Gets the next probe to send.
+ * Returns 1 with `ttl` and `flow` set, 0 when replies are to be
+ * waited for first, -1 when the whole path is done.
+ */
+int mda_next_probe(Mda* m, int* ttl, int* flow);
+
+/**
+ * Records the outcome of a probe: the interface answered (NULL for none)
+ * and whether it is the destination.
+ */
+void mda_record(Mda* m, int ttl, int flow, const sockaddr_any* from, int final);
+
+/**
+ * Probes needed to see, with confidence 1 - alpha, one more successor
+ * than k if there is one and flows are spread evenly among them.
+ */
+int mda_stopping_point(int k, double alpha);
+
+#endif /* TRACEROUTE_CORRELATE_MDA_H */
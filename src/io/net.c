@@ -1,4 +1,7 @@
+#define _GNU_SOURCE  // sendmmsg()
+
 #include "net.h"
+#include "parse.h"
 #include "../correlate/match.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -65,17 +68,76 @@ int net_enable_recverr(int fd, int family) {
     return -1;
 }
 
+#define NET_SEND_BATCH 64  // messages per sendmmsg() call
+
+typedef struct {
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+} NetSendSlot;
+
+// Fill a message for an unconnected socket: the destination goes into
+// msg_name and the TTL (hop limit) into a cmsg, so no connect() is needed.
+static void net_fill_msg(struct msghdr* msg, NetSendSlot* slot, Probe* probe) {
+    memset(msg, 0, sizeof(*msg));
+    memset(slot, 0, sizeof(*slot));
+
+    slot->iov.iov_base = probe->payload;
+    slot->iov.iov_len = probe->payload_len;
+    msg->msg_iov = &slot->iov;
+    msg->msg_iovlen = 1;
+    msg->msg_name = &probe->dst_addr;
+    msg->msg_namelen = probe->dst_addr.sa.sa_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                                                 : sizeof(struct sockaddr_in);
+
+    if (probe->id.ttl)
+        put_ttl_cmsg(msg, slot->control, sizeof(slot->control), probe->dst_addr.sa.sa_family, probe->id.ttl);
+}
+
 int net_send_probe(int fd, Probe* probe) {
+    struct msghdr msg;
+    NetSendSlot slot;
+
     if (!probe)
         return -1;
 
-    // For IP_RECVERR to work on UDP, we generally need to connect.
-    // Re-connecting on UDP is allowed.
-    if (connect(fd, &probe->dst_addr.sa, sizeof(sockaddr_any)) < 0) {
+    net_fill_msg(&msg, &slot, probe);
+
+    return sendmsg(fd, &msg, 0);
+}
+
+int net_send_batch(int fd, Probe** probes, size_t n) {
+    struct mmsghdr msgs[NET_SEND_BATCH];
+    NetSendSlot slots[NET_SEND_BATCH];
+    size_t sent = 0;
+
+    if (!probes)
         return -1;
+
+    while (sent < n) {
+        size_t i, chunk = n - sent;
+        int res;
+
+        if (chunk > NET_SEND_BATCH)
+            chunk = NET_SEND_BATCH;
+
+        for (i = 0; i < chunk; i++) {
+            net_fill_msg(&msgs[i].msg_hdr, &slots[i], probes[sent + i]);
+            msgs[i].msg_len = 0;
+        }
+
+        res = sendmmsg(fd, msgs, chunk, 0);
+        if (res <= 0)
+            break;
+
+        sent += res;
+        if ((size_t)res < chunk)
+            break;  // the next one would fail, let the caller decide
     }
 
-    return send(fd, probe->payload, probe->payload_len, 0);
+    if (!sent && n)
+        return -1;
+
+    return sent;
 }
 
 int net_recv_packet(int fd, int check_err_queue, PacketResult* result) {
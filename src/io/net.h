@@ -38,9 +38,14 @@ int net_configure_socket(int fd, int family, int ttl);
 // Enable IP_RECVERR
 int net_enable_recverr(int fd, int family);
 
-// Send the probe
+// Send the probe to its dst_addr, with its id.ttl (if set) passed per packet
 int net_send_probe(int fd, Probe* probe);
 
+// Send several probes by as few sendmmsg() calls as possible, each one with
+// its own destination and TTL. Returns the number of probes sent (the rest
+// can be retried later), or -1 if none could be sent.
+int net_send_batch(int fd, Probe** probes, size_t n);
+
 // Receive a packet
 // check_err_queue: 1 to read MSG_ERRQUEUE, 0 for normal
 int net_recv_packet(int fd, int check_err_queue, PacketResult* result);
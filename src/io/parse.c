@@ -302,3 +302,26 @@ int parse_cmsgs(struct msghdr* msg, CMSGInfo* out) {
 
     return 0;
 }
+
+int put_ttl_cmsg(struct msghdr* msg, void* control, size_t size, int family, int ttl) {
+    if (size < CMSG_SPACE(sizeof(ttl)))
+        return -ENOBUFS;
+
+    memset(control, 0, CMSG_SPACE(sizeof(ttl)));
+    msg->msg_control = control;
+    msg->msg_controllen = CMSG_SPACE(sizeof(ttl));
+
+    struct cmsghdr* cm = CMSG_FIRSTHDR(msg);
+    if (family == AF_INET6) {
+        cm->cmsg_level = SOL_IPV6;
+        cm->cmsg_type = IPV6_HOPLIMIT;
+    }
+    else {
+        cm->cmsg_level = SOL_IP;
+        cm->cmsg_type = IP_TTL;
+    }
+    cm->cmsg_len = CMSG_LEN(sizeof(ttl));
+    memcpy(CMSG_DATA(cm), &ttl, sizeof(ttl));
+
+    return 0;
+}
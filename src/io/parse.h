@@ -123,4 +123,11 @@ typedef struct {
  */
 int parse_cmsgs(struct msghdr* msg, CMSGInfo* out);
 
+/**
+ * Makes the TTL (hop limit for IPv6) the only control message of an
+ * outgoing msg, stored in `control` of `size` bytes (CMSG_SPACE(sizeof(int))
+ * is enough). Returns 0 on success, -ENOBUFS if `size` is too small.
+ */
+int put_ttl_cmsg(struct msghdr* msg, void* control, size_t size, int family, int ttl);
+
 #endif /* TRACEROUTE_IO_PARSE_H */
@@ -0,0 +1,30 @@
+#include "core/as_db.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+// Compiles a text prefix table (see as_db_open()) for `traceroute --as-db',
+// which then just maps it instead of parsing
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s TEXT_FILE OUTPUT_FILE\n", argv[0]);
+        return 2;
+    }
+
+    AsDb* db = as_db_open(argv[1]);
+    if (!db) {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    const AsDbHeader* h = (const AsDbHeader*)db->map;
+    int ret = as_db_save(db, argv[2]);
+    if (ret < 0)
+        fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+    else
+        printf("%u prefixes, %u + %u nodes, %zu bytes\n", h->num_prefixes, h->num_nodes[0], h->num_nodes[1],
+               db->map_len);
+
+    as_db_close(db);
+    return ret < 0;
+}
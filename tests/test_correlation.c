@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -105,6 +107,7 @@ int mock_clock_gettime(clockid_t clk_id, struct timespec* tp) {
 
 // Include the source files directly
 #include "../src/correlate/match.c"
+#include "../src/io/parse.c"
 #include "../src/io/net.c"
 
 int main() {
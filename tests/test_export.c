@@ -37,6 +37,15 @@ static void stop_capture(void) {
 unsigned int probes_per_hop = 3;
 probe* probes = NULL;
 
+// Mock probe_trace, one trace over the whole table
+trace* probe_trace(const probe* pb) {
+    static trace tr;
+
+    (void)pb;
+    tr.probes = probes;
+    return &tr;
+}
+
 // Mock addr2str
 const char* addr2str(const sockaddr_any* addr) {
     if (addr->sa.sa_family == AF_INET)
@@ -138,8 +147,10 @@ int main() {
 
     // Test End
     printf("End test:\n");
+    trace tr;
+    memset(&tr, 0, sizeof(tr));
     start_capture();
-    tr_export_jsonl_end();
+    tr_export_jsonl_end(&tr);
     stop_capture();
     EXPECT_TRUE(strstr(capture_buf, "\"type\":\"end\"") != NULL, "FAIL: end missing type");
 
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -12,6 +14,12 @@
 static int mock_socket_fd = 100;
 static int mock_connect_called = 0;
 static int mock_send_called = 0;
+static int mock_sendmsg_ttl = 0;
+static unsigned short mock_sendmsg_port = 0;
+static int mock_sendmmsg_calls = 0;
+static unsigned int mock_sendmmsg_msgs = 0;
+static unsigned int mock_sendmmsg_limit = 0;  // 0 means accept all
+static int mock_sendmmsg_ttls[128];
 static int mock_setsockopt_ttl_val = 0;
 static int mock_recverr_enabled = 0;
 static int mock_ipv6_supported = 1;
@@ -45,6 +53,38 @@ ssize_t mock_send(int fd, const void* buf, size_t len, int flags) {
     return len;
 }
 
+static int cmsg_ttl(const struct msghdr* msg) {
+    struct cmsghdr* cm;
+
+    for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR((struct msghdr*)msg, cm)) {
+        if (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_TTL)
+            return *(int*)CMSG_DATA(cm);
+    }
+    return 0;
+}
+
+ssize_t mock_sendmsg(int fd, const struct msghdr* msg, int flags) {
+    mock_sendmsg_ttl = cmsg_ttl(msg);
+    mock_sendmsg_port = ntohs(((const struct sockaddr_in*)msg->msg_name)->sin_port);
+    return msg->msg_iov[0].iov_len;
+}
+
+int mock_sendmmsg(int fd, struct mmsghdr* msgvec, unsigned int vlen, int flags) {
+    unsigned int i;
+
+    mock_sendmmsg_calls++;
+    if (mock_sendmmsg_limit && vlen > mock_sendmmsg_limit)
+        vlen = mock_sendmmsg_limit;
+
+    for (i = 0; i < vlen; i++) {
+        if (mock_sendmmsg_msgs < sizeof(mock_sendmmsg_ttls) / sizeof(mock_sendmmsg_ttls[0]))
+            mock_sendmmsg_ttls[mock_sendmmsg_msgs] = cmsg_ttl(&msgvec[i].msg_hdr);
+        mock_sendmmsg_msgs++;
+        msgvec[i].msg_len = msgvec[i].msg_hdr.msg_iov[0].iov_len;
+    }
+    return vlen;
+}
+
 // Mocking recvmsg to return a fake ICMP error
 ssize_t mock_recvmsg(int fd, struct msghdr* msg, int flags) {
     if (flags & MSG_ERRQUEUE) {
@@ -82,11 +122,14 @@ int mock_clock_gettime(clockid_t clk_id, struct timespec* tp) {
 #define setsockopt mock_setsockopt
 #define connect mock_connect
 #define send mock_send
+#define sendmsg mock_sendmsg
+#define sendmmsg mock_sendmmsg
 #define recvmsg mock_recvmsg
 #define clock_gettime mock_clock_gettime
 
 // Include the source files directly
 #include "../src/correlate/match.c"
+#include "../src/io/parse.c"
 #include "../src/io/net.c"
 #include "../src/probe/udp.c"
 
@@ -136,12 +179,57 @@ int main() {
         printf("FAIL: net_send_probe\n");
         return 1;
     }
-    if (mock_connect_called != 1) {
-        printf("FAIL: net_send_probe did not connect\n");
+    if (mock_connect_called != 0) {
+        printf("FAIL: net_send_probe should not connect\n");
+        return 1;
+    }
+    if (mock_sendmsg_ttl != 1 || mock_sendmsg_port != 33434) {
+        printf("FAIL: net_send_probe bad ttl %d or port %u\n", mock_sendmsg_ttl, mock_sendmsg_port);
         return 1;
     }
     printf("PASS: Send Probe\n");
 
+    // Test 3b: Send Batch (more than fits in one sendmmsg call)
+    {
+        enum { NUM = 100 };
+        Probe batch[NUM];
+        Probe* ptrs[NUM];
+        int i;
+
+        for (i = 0; i < NUM; i++) {
+            if (udp_probe_init(&batch[i], &dst, 1000, 33434 + i, i % 30 + 1, 0) != 0) {
+                printf("FAIL: udp_probe_init for batch\n");
+                return 1;
+            }
+            ptrs[i] = &batch[i];
+        }
+
+        if (net_send_batch(fd, ptrs, NUM) != NUM) {
+            printf("FAIL: net_send_batch did not send all\n");
+            return 1;
+        }
+        if (mock_sendmmsg_calls != 2 || mock_sendmmsg_msgs != NUM) {
+            printf("FAIL: net_send_batch used %d calls for %u msgs\n", mock_sendmmsg_calls, mock_sendmmsg_msgs);
+            return 1;
+        }
+        for (i = 0; i < NUM; i++) {
+            if (mock_sendmmsg_ttls[i] != i % 30 + 1) {
+                printf("FAIL: net_send_batch bad ttl %d at %d\n", mock_sendmmsg_ttls[i], i);
+                return 1;
+            }
+        }
+
+        // A short write is reported as such
+        mock_sendmmsg_limit = 10;
+        mock_sendmmsg_calls = 0;
+        if (net_send_batch(fd, ptrs, NUM) != 10 || mock_sendmmsg_calls != 1) {
+            printf("FAIL: net_send_batch partial send\n");
+            return 1;
+        }
+        mock_sendmmsg_limit = 0;
+    }
+    printf("PASS: Send Batch\n");
+
     // Test 4: Recv Error
     PacketResult res;
     // Check normal queue (should be empty/EAGAIN)
@@ -3,11 +3,17 @@
 #include <arpa/inet.h>
 #include <netinet/ip_icmp.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 int debug = 0;
 unsigned int probes_per_hop = 3;
 probe* probes = NULL;
 
+void error(const char* str) {
+    perror(str);
+    exit(1);
+}
+
 static char addr2str_buf[INET6_ADDRSTRLEN];
 
 const char* addr2str(const sockaddr_any* addr) {
@@ -27,8 +33,20 @@ void add_poll(int fd, int events) {
     (void)fd;
     (void)events;
 }
+int mock_poll_fd = -1;
+int mock_poll_events = 0;
+poll_handler_t mock_poll_handler = NULL;
+void* mock_poll_data = NULL;
+
+void add_poll_handler(int fd, int events, poll_handler_t handler, void* data) {
+    mock_poll_fd = fd;
+    mock_poll_events = events;
+    mock_poll_handler = handler;
+    mock_poll_data = data;
+}
 void del_poll(int fd) {
-    (void)fd;
+    if (fd == mock_poll_fd)
+        mock_poll_fd = -1;
 }
 
 probe* probe_by_seq(int seq) {
@@ -52,6 +70,14 @@ probe* probe_by_sk(int sk) {
     return NULL;
 }
 
+trace* probe_trace(const probe* pb) {
+    static trace tr;
+
+    (void)pb;
+    tr.probes = probes; /*  just one trace over the whole table   */
+    return &tr;
+}
+
 void probe_done(probe* pb) {
     pb->done = 1;
 }
@@ -62,3 +88,79 @@ void parse_icmp_res(probe* pb, int type, int code, int info) {
         pb->final = 1;
     }
 }
+
+int equal_addr(const sockaddr_any* a, const sockaddr_any* b) {
+    if (!a->sa.sa_family || a->sa.sa_family != b->sa.sa_family)
+        return 0;
+
+    if (a->sa.sa_family == AF_INET6)
+        return !memcmp(&a->sin6.sin6_addr, &b->sin6.sin6_addr, sizeof(a->sin6.sin6_addr));
+    return !memcmp(&a->sin.sin_addr, &b->sin.sin_addr, sizeof(a->sin.sin_addr));
+}
+
+double get_time(void) {
+    return 0;
+}
+
+int mock_quote_calls = 0;
+sockaddr_any mock_quote_from;
+sockaddr_any mock_quote_dest;
+size_t mock_quote_len = 0;
+int mock_quote_type = -1;
+int mock_quote_code = -1;
+double mock_quote_time = 0;
+
+void recv_quote(const sockaddr_any* from, sockaddr_any* dest, char* buf, size_t len, int type, int code, int info,
+                double recv_time) {
+    (void)buf;
+    (void)info;
+    mock_quote_calls++;
+    mock_quote_from = *from;
+    mock_quote_dest = *dest;
+    mock_quote_len = len;
+    mock_quote_type = type;
+    mock_quote_code = code;
+    mock_quote_time = recv_time;
+}
+
+/*  for the modules included by the tests   */
+
+double wait_secs = 5.0;
+
+void tune_socket(int sk, probe* pb) {
+    (void)sk;
+    (void)pb;
+}
+
+void lease_flowlabel(int sk, probe* pb) {
+    (void)sk;
+    (void)pb;
+}
+
+void use_recverr(int sk) {
+    (void)sk;
+}
+
+void set_ttl(int sk, int ttl) {
+    (void)sk;
+    (void)ttl;
+}
+
+unsigned int flow_index(const probe* pb) {
+    (void)pb;
+    return 0;
+}
+
+void recv_reply(int sk, int err, check_reply_t check_reply) {
+    (void)sk;
+    (void)err;
+    (void)check_reply;
+}
+
+int raw_can_connect(void) {
+    return 1;
+}
+
+void tr_register_module(tr_module* module) {
+    (void)module;
+}
@@ -6,13 +6,43 @@
 extern int debug;
 extern unsigned int probes_per_hop;
 extern probe* probes;
+extern double wait_secs;
+
+/*  as registered by the last add_poll_handler()   */
+extern int mock_poll_fd;
+extern int mock_poll_events;
+extern poll_handler_t mock_poll_handler;
+extern void* mock_poll_data;
+
+/*  as given to the last recv_quote()   */
+extern int mock_quote_calls;
+extern sockaddr_any mock_quote_from;
+extern sockaddr_any mock_quote_dest;
+extern size_t mock_quote_len;
+extern int mock_quote_type;
+extern int mock_quote_code;
+extern double mock_quote_time;
 
 const char* addr2str(const sockaddr_any* addr);
 void add_poll(int fd, int events);
+void add_poll_handler(int fd, int events, poll_handler_t handler, void* data);
 void del_poll(int fd);
 probe* probe_by_seq(int seq);
 probe* probe_by_sk(int sk);
+trace* probe_trace(const probe* pb);
 void probe_done(probe* pb);
 void parse_icmp_res(probe* pb, int type, int code, int info);
+int equal_addr(const sockaddr_any* a, const sockaddr_any* b);
+double get_time(void);
+void tune_socket(int sk, probe* pb);
+void lease_flowlabel(int sk, probe* pb);
+void use_recverr(int sk);
+void set_ttl(int sk, int ttl);
+unsigned int flow_index(const probe* pb);
+void recv_reply(int sk, int err, check_reply_t check_reply);
+int raw_can_connect(void);
+void tr_register_module(tr_module* module);
+void recv_quote(const sockaddr_any* from, sockaddr_any* dest, char* buf, size_t len, int type, int code, int info,
+                double recv_time);
 
 #endif /* TEST_UNIT_COMMON_MOCKS_H */
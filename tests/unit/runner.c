@@ -15,16 +15,28 @@ int main(int argc, char** argv) {
     register_test_cmsg();
     register_test_correlator();
     register_test_flow();
+    register_test_mda();
     register_test_rtt();
     register_test_scheduler();
+    register_test_hop_stats();
+    register_test_hdr_hist();
+    register_test_ratelimit();
     register_test_dns_cache();
+    register_test_annot_cache();
+    register_test_as_db();
     register_test_json_writer();
     register_test_render();
     register_test_cli();
     register_test_bpf();
+    register_test_xdp();
     register_test_extension();
     register_test_export();
     register_test_property();
+    register_test_batch();
+    register_test_send_batch();
+    register_test_probe_index();
+    register_test_as_lookups();
+    register_test_csum();
 
     printf("All unit tests passed!\n");
     return 0;
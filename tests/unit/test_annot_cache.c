@@ -0,0 +1,158 @@
+#include "common/assert.h"
+#include "core/annot_cache.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void make_addr(sockaddr_any* sa, uint32_t ip) {
+    memset(sa, 0, sizeof(*sa));
+    sa->sin.sin_family = AF_INET;
+    sa->sin.sin_addr.s_addr = htonl(ip);
+}
+
+static void make_path(char* path, size_t len) {
+    char dir[] = "/tmp/annot_cache_XXXXXX";
+
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    snprintf(path, len, "%s/cache", dir);
+}
+
+static void remove_path(const char* path) {
+    char dir[256];
+
+    unlink(path);
+    snprintf(dir, sizeof(dir), "%s", path);
+    *strrchr(dir, '/') = '\0';
+    rmdir(dir);
+}
+
+void test_annot_store_lookup_and_merge(void) {
+    char path[256];
+    make_path(path, sizeof(path));
+
+    AnnotCache* c = annot_open(path, 1);
+    ASSERT_TRUE(c != NULL);
+
+    sockaddr_any sa;
+    const char *name, *asn;
+    make_addr(&sa, 0xc0000201);
+
+    ASSERT_EQ_INT(annot_lookup(c, &sa, 100, &name, &asn), 0);
+
+    ASSERT_OK(annot_store(c, &sa, "r1.example.net", NULL, 100, 3600));
+    ASSERT_EQ_INT(annot_lookup(c, &sa, 101, &name, &asn), 1);
+    ASSERT_EQ_STR(name, "r1.example.net");
+    ASSERT_EQ_PTR(asn, NULL);
+
+    // The name is kept when only the AS is known later
+    ASSERT_OK(annot_store(c, &sa, NULL, "AS64500", 102, 3600));
+    ASSERT_EQ_INT(annot_lookup(c, &sa, 103, &name, &asn), 1);
+    ASSERT_EQ_STR(name, "r1.example.net");
+    ASSERT_EQ_STR(asn, "AS64500");
+
+    // Negative entries are just empty names
+    ASSERT_OK(annot_store(c, &sa, "", NULL, 104, 3600));
+    ASSERT_EQ_INT(annot_lookup(c, &sa, 105, &name, &asn), 1);
+    ASSERT_EQ_STR(name, "");
+    ASSERT_EQ_STR(asn, "AS64500");
+
+    ASSERT_EQ_INT(annot_lookup(c, &sa, 104 + 3601, &name, &asn), 0);  // expired
+
+    annot_close(c);
+    remove_path(path);
+}
+
+void test_annot_persists_and_shared_between_handles(void) {
+    char path[256];
+    make_path(path, sizeof(path));
+
+    sockaddr_any sa;
+    const char* name;
+    make_addr(&sa, 0x0a000001);
+
+    AnnotCache* w = annot_open(path, 1);
+    ASSERT_OK(annot_store(w, &sa, "gw.example.net", "AS64501", 100, 0));
+    annot_close(w);
+
+    AnnotCache* r = annot_open(path, 0);
+    ASSERT_TRUE(r != NULL);
+    ASSERT_EQ_INT(annot_lookup(r, &sa, 200, &name, NULL), 1);
+    ASSERT_EQ_STR(name, "gw.example.net");
+
+    // Records appended (and the file grown, and compacted away)
+    // by a writer are seen by the reader mapping the old file
+    w = annot_open(path, 1);
+    for (uint32_t i = 0; i < 20000; i++) {
+        sockaddr_any a;
+        char buf[64];
+
+        make_addr(&a, 0x0b000000 + i);
+        snprintf(buf, sizeof(buf), "r%u.example.net", i);
+        ASSERT_OK(annot_store(w, &a, buf, NULL, 300, 0));
+    }
+
+    sockaddr_any last;
+    make_addr(&last, 0x0b000000 + 19999);
+    ASSERT_EQ_INT(annot_lookup(r, &last, 400, &name, NULL), 1);
+    ASSERT_EQ_STR(name, "r19999.example.net");
+    ASSERT_EQ_INT(annot_lookup(r, &sa, 400, &name, NULL), 1);
+    ASSERT_EQ_STR(name, "gw.example.net");
+
+    ASSERT_EQ_INT(annot_store(r, &sa, "ro", NULL, 400, 0), -1);  // read only
+
+    annot_close(w);
+    annot_close(r);
+    remove_path(path);
+}
+
+void test_annot_compact_drops_expired_and_dead(void) {
+    char path[256];
+    make_path(path, sizeof(path));
+
+    AnnotCache* c = annot_open(path, 1);
+    sockaddr_any sa1, sa2;
+    const char* name;
+    make_addr(&sa1, 0x01010101);
+    make_addr(&sa2, 0x02020202);
+
+    ASSERT_OK(annot_store(c, &sa1, "old", NULL, 100, 10));
+    ASSERT_OK(annot_store(c, &sa2, "two", NULL, 100, 0));
+    ASSERT_OK(annot_store(c, &sa2, "two again", NULL, 100, 0));
+
+    ASSERT_OK(annot_compact(c, 200));
+
+    const AnnotHeader* h = (const AnnotHeader*)c->map;
+    ASSERT_EQ_U64(h->used_slots, 1);
+    ASSERT_EQ_U64(h->data_len - sizeof(AnnotHeader) - h->num_slots * sizeof(uint64_t), h->live_bytes);
+
+    ASSERT_EQ_INT(annot_lookup(c, &sa1, 50, &name, NULL), 0);
+    ASSERT_EQ_INT(annot_lookup(c, &sa2, 200, &name, NULL), 1);
+    ASSERT_EQ_STR(name, "two again");
+
+    annot_close(c);
+    remove_path(path);
+}
+
+void test_annot_rejects_foreign_files(void) {
+    char path[256];
+    make_path(path, sizeof(path));
+
+    FILE* fp = fopen(path, "w");
+    fprintf(fp, "127.0.0.1 localhost\n");
+    fclose(fp);
+
+    ASSERT_EQ_PTR(annot_open(path, 1), NULL);
+    ASSERT_EQ_INT(errno, EINVAL);
+
+    remove_path(path);
+}
+
+void register_test_annot_cache(void) {
+    test_annot_store_lookup_and_merge();
+    test_annot_persists_and_shared_between_handles();
+    test_annot_compact_drops_expired_and_dead();
+    test_annot_rejects_foreign_files();
+}
@@ -0,0 +1,196 @@
+#include "common/assert.h"
+#include "core/as_db.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void make_path(char* path, size_t len, const char* name) {
+    char dir[] = "/tmp/as_db_XXXXXX";
+
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    snprintf(path, len, "%s/%s", dir, name);
+}
+
+static void remove_path(const char* path) {
+    char dir[256];
+
+    unlink(path);
+    snprintf(dir, sizeof(dir), "%s", path);
+    *strrchr(dir, '/') = '\0';
+    rmdir(dir);
+}
+
+static void write_file(const char* path, const char* text) {
+    FILE* fp = fopen(path, "w");
+    ASSERT_TRUE(fp != NULL);
+    fputs(text, fp);
+    fclose(fp);
+}
+
+static uint32_t lookup(const AsDb* db, const char* ip) {
+    sockaddr_any sa;
+
+    memset(&sa, 0, sizeof(sa));
+    if (inet_pton(AF_INET, ip, &sa.sin.sin_addr) == 1)
+        sa.sin.sin_family = AF_INET;
+    else {
+        ASSERT_EQ_INT(inet_pton(AF_INET6, ip, &sa.sin6.sin6_addr), 1);
+        sa.sin6.sin6_family = AF_INET6;
+    }
+
+    return as_db_lookup(db, &sa);
+}
+
+static void check_table(const AsDb* db) {
+    ASSERT_EQ_U64(lookup(db, "10.1.2.3"), 64500);
+    ASSERT_EQ_U64(lookup(db, "10.200.0.1"), 64501);  // the /9 over the /8
+    ASSERT_EQ_U64(lookup(db, "10.128.0.0"), 64501);
+    ASSERT_EQ_U64(lookup(db, "10.127.255.255"), 64500);
+    ASSERT_EQ_U64(lookup(db, "192.0.2.1"), 64502);
+    ASSERT_EQ_U64(lookup(db, "192.0.2.130"), 64503);  // bgpdump, AS path origin
+    ASSERT_EQ_U64(lookup(db, "192.0.2.129"), 64504);  // host route
+    ASSERT_EQ_U64(lookup(db, "198.51.100.1"), 64505);  // the first of a set
+    ASSERT_EQ_U64(lookup(db, "203.0.113.1"), 0);
+    ASSERT_EQ_U64(lookup(db, "2001:db8::1"), 64510);
+    ASSERT_EQ_U64(lookup(db, "2001:db8:1::1"), 64511);
+    ASSERT_EQ_U64(lookup(db, "2001:db8:1::ff"), 64512);
+    ASSERT_EQ_U64(lookup(db, "2001:db9::1"), 0);
+}
+
+void test_as_db_longest_prefix_text_and_compiled(void) {
+    char text[256], bin[256];
+    make_path(text, sizeof(text), "rib.txt");
+    snprintf(bin, sizeof(bin), "%s", text);
+    strcpy(strrchr(bin, '/'), "/rib.asdb");
+
+    write_file(text,
+               "# prefix asn\n"
+               "10.0.0.0/8 64500\n"
+               "10.128.0.0/9 AS64501\n"
+               "10.128.0.0/9 64599\n"  // the first origin wins
+               "\n"
+               "192.0.2.0\t24\t64502\n"
+               "TABLE_DUMP2|1700000000|B|203.0.113.254|64496|192.0.2.128/25|64496 65000 64503|IGP\n"
+               "BGP4MP|1700000000|W|203.0.113.254|64496|192.0.2.0/24\n"
+               "192.0.2.129/32 64504\n"
+               "198.51.100.0/24 {64505,64506}\n"
+               "2001:db8::/32 64510\n"
+               "2001:db8:1::/48 64511\n"
+               "2001:db8:1::ff/128 64512\n");
+
+    AsDb* db = as_db_open(text);
+    ASSERT_TRUE(db != NULL);
+    ASSERT_EQ_INT(db->mapped, 0);
+    ASSERT_EQ_U64(((const AsDbHeader*)db->map)->num_prefixes, 10);
+    check_table(db);
+
+    ASSERT_OK(as_db_save(db, bin));
+    as_db_close(db);
+
+    db = as_db_open(bin);
+    ASSERT_TRUE(db != NULL);
+    ASSERT_EQ_INT(db->mapped, 1);
+    check_table(db);
+    as_db_close(db);
+
+    // A default route covers all the rest
+    write_file(text, "0.0.0.0/0 64496\n10.0.0.0/8 64500\n");
+    db = as_db_open(text);
+    ASSERT_TRUE(db != NULL);
+    ASSERT_EQ_U64(lookup(db, "203.0.113.1"), 64496);
+    ASSERT_EQ_U64(lookup(db, "10.0.0.1"), 64500);
+    ASSERT_EQ_U64(lookup(db, "::1"), 0);
+    as_db_close(db);
+
+    unlink(text);
+    remove_path(bin);
+}
+
+static uint32_t rnd(uint64_t* state) {
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *state >> 32;
+}
+
+void test_as_db_matches_linear_search(void) {
+    enum { N = 3000, LOOKUPS = 20000 };
+    static uint32_t nets[N], lens[N], asns[N];
+    uint64_t state = 42;
+    char path[256];
+    make_path(path, sizeof(path), "rib.txt");
+
+    FILE* fp = fopen(path, "w");
+    ASSERT_TRUE(fp != NULL);
+    for (int i = 0; i < N; i++) {
+        // Clustered, for prefixes to nest
+        lens[i] = 8 + rnd(&state) % 25;
+        nets[i] = (0x0a000000 | (rnd(&state) & 0x00ffffff)) & (0xffffffffU << (32 - lens[i]));
+        asns[i] = 1 + i;
+
+        struct in_addr in = {htonl(nets[i])};
+        fprintf(fp, "%s/%u %u\n", inet_ntoa(in), lens[i], asns[i]);
+    }
+    fclose(fp);
+
+    AsDb* db = as_db_open(path);
+    ASSERT_TRUE(db != NULL);
+
+    for (int n = 0; n < LOOKUPS; n++) {
+        uint32_t ip = nets[rnd(&state) % N] ^ (rnd(&state) & 0xff);
+        uint32_t expect = 0, best_len = 0;
+
+        for (int i = 0; i < N; i++) {
+            uint32_t mask = 0xffffffffU << (32 - lens[i]);
+
+            // The first of the same prefix wins
+            if ((ip & mask) == nets[i] && (!expect || lens[i] > best_len)) {
+                expect = asns[i];
+                best_len = lens[i];
+            }
+        }
+
+        sockaddr_any sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin.sin_family = AF_INET;
+        sa.sin.sin_addr.s_addr = htonl(ip);
+        ASSERT_EQ_U64(as_db_lookup(db, &sa), expect);
+    }
+
+    as_db_close(db);
+    remove_path(path);
+}
+
+void test_as_db_rejects_malformed(void) {
+    char path[256];
+    make_path(path, sizeof(path), "rib");
+
+    write_file(path, "10.0.0.0/33 64500\n");
+    ASSERT_EQ_PTR(as_db_open(path), NULL);
+    ASSERT_EQ_INT(errno, EINVAL);
+
+    write_file(path, "10.0.0.0/8 notanas\n");
+    ASSERT_EQ_PTR(as_db_open(path), NULL);
+    ASSERT_EQ_INT(errno, EINVAL);
+
+    // A compiled file cut short
+    write_file(path, "10.0.0.0/8 64500\n");
+    AsDb* db = as_db_open(path);
+    ASSERT_TRUE(db != NULL);
+    ASSERT_OK(as_db_save(db, path));
+    ASSERT_OK(truncate(path, db->map_len - 8));
+    as_db_close(db);
+
+    ASSERT_EQ_PTR(as_db_open(path), NULL);
+    ASSERT_EQ_INT(errno, EINVAL);
+
+    remove_path(path);
+}
+
+void register_test_as_db(void) {
+    test_as_db_longest_prefix_text_and_compiled();
+    test_as_db_matches_linear_search();
+    test_as_db_rejects_malformed();
+}
@@ -0,0 +1,169 @@
+#include "common/assert.h"
+#include "common/mocks.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// A stand-in whois (IRRd) server: one connection only, answers `!r' queries
+// in order. The number of queries it got is its exit status.
+static void whois_server(int lsk) {
+    static const char route[] =
+        "route:      192.0.2.0/24\n"
+        "origin:     AS64500\n"
+        "route:      192.0.0.0/16\n"
+        "origin:     AS64499\n"
+        "route:      192.0.2.0/24\n"
+        "origin:     AS64501\n";
+    char buf[4096], out[1024];
+    size_t len = 0;
+    int queries = 0, persistent = 0;
+
+    int sk = accept(lsk, NULL, NULL);
+    close(lsk);
+    if (sk < 0)
+        _exit(100);
+
+    for (;;) {
+        ssize_t n = read(sk, buf + len, sizeof(buf) - 1 - len);
+        char *line, *nl;
+
+        if (n <= 0)
+            break;
+        len += n;
+        buf[len] = '\0';
+
+        while ((nl = strchr(buf, '\n')) != NULL) {
+            *nl = '\0';
+            line = buf;
+
+            if (!strcmp(line, "!!")) {
+                persistent = 1;
+            }
+            else if (!strncmp(line, "!r", 2)) {
+                queries++;
+                if (!strncmp(line, "!r192.0.2.", 10))
+                    snprintf(out, sizeof(out), "A%zu\n%sC\n", sizeof(route) - 1, route);
+                else if (!strncmp(line, "!r198.51.100.", 13))
+                    snprintf(out, sizeof(out), "D\n");
+                else
+                    snprintf(out, sizeof(out), "F unknown\n");
+                if (write(sk, out, strlen(out)) < 0)
+                    _exit(101);
+            }
+
+            len -= nl + 1 - buf;
+            memmove(buf, nl + 1, len + 1);
+        }
+    }
+
+    _exit(persistent ? queries : 102);
+}
+
+static void make_addr(sockaddr_any* sa, const char* ip) {
+    memset(sa, 0, sizeof(*sa));
+    sa->sin.sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &sa->sin.sin_addr);
+}
+
+// Runs the registered handler until `addr' is answered
+static const char* wait_path(const sockaddr_any* addr) {
+    double until;
+    const char* path;
+
+    for (int i = 0; i < 100; i++) {
+        if ((path = as_path(addr, &until)) != NULL)
+            return path;
+        ASSERT_TRUE(until > 0);  // still expected
+
+        struct pollfd pfd = {mock_poll_fd, (short)mock_poll_events, 0};
+        ASSERT_TRUE(poll(&pfd, 1, 1000) > 0);
+        mock_poll_handler(pfd.fd, pfd.revents, mock_poll_data);
+    }
+
+    return NULL;
+}
+
+void test_as_lookups_pipelined_over_one_connection(void) {
+    struct sockaddr_in sin = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t slen = sizeof(sin);
+    char port[16];
+    int status;
+
+    int lsk = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_OK(lsk);
+    ASSERT_OK(bind(lsk, (struct sockaddr*)&sin, sizeof(sin)));
+    ASSERT_OK(listen(lsk, 4));
+    ASSERT_OK(getsockname(lsk, (struct sockaddr*)&sin, &slen));
+
+    pid_t pid = fork();
+    ASSERT_OK(pid);
+    if (!pid)
+        whois_server(lsk);
+    close(lsk);
+
+    snprintf(port, sizeof(port), "%u", ntohs(sin.sin_port));
+    setenv("RA_SERVER", "127.0.0.1", 1);
+    setenv("RA_SERVICE", port, 1);
+    ASSERT_OK(as_init());
+
+    sockaddr_any a1, a2, a3, a4, a5;
+    make_addr(&a1, "192.0.2.1");
+    make_addr(&a2, "198.51.100.7");
+    make_addr(&a3, "203.0.113.9");
+    make_addr(&a4, "192.0.2.200");
+    make_addr(&a5, "203.0.113.50");  // failed with no server, see below
+
+    // All sent before any answer
+    as_query(&a1, 1e12);
+    as_query(&a2, 1e12);
+    as_query(&a3, 1e12);
+    as_query(&a1, 1e12);  // in progress already
+    as_query(&a5, 1e12);  // asked again, not cached as failed
+
+    ASSERT_EQ_STR(wait_path(&a3), "!!");
+    ASSERT_EQ_STR(wait_path(&a1), "AS64500/AS64501");  // the best prefix only
+    ASSERT_EQ_STR(wait_path(&a2), "*");
+    ASSERT_EQ_STR(wait_path(&a5), "!!");
+
+    // Cached for the whole /24, no query
+    as_query(&a4, 1e12);
+    double until;
+    ASSERT_EQ_STR(as_path(&a4, &until), "AS64500/AS64501");
+
+    // Done with it: the server sees EOF
+    mock_poll_handler = NULL;
+    shutdown(mock_poll_fd, SHUT_WR);
+    ASSERT_EQ_INT(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ_INT(WEXITSTATUS(status), 4);
+
+    unsetenv("RA_SERVER");
+    unsetenv("RA_SERVICE");
+}
+
+void test_as_lookups_without_server(void) {
+    setenv("RA_SERVER", "127.0.0.1", 1);
+    setenv("RA_SERVICE", "no-such-whois-service", 1);
+
+    // Not fatal, just no answers
+    ASSERT_TRUE(as_init() < 0);
+
+    sockaddr_any addr;
+    double until;
+    make_addr(&addr, "203.0.113.50");
+    as_query(&addr, 1e12);
+    ASSERT_EQ_STR(as_path(&addr, &until), "!!");
+
+    unsetenv("RA_SERVER");
+    unsetenv("RA_SERVICE");
+}
+
+void register_test_as_lookups(void) {
+    test_as_lookups_without_server();
+    test_as_lookups_pipelined_over_one_connection();
+}
@@ -0,0 +1,58 @@
+#include "common/assert.h"
+#include "traceroute.h"
+#include <string.h>
+
+void test_batch_host_only(void) {
+    char line[] = "example.com\n";
+    char* host = NULL;
+    unsigned int first, max;
+
+    ASSERT_EQ_INT(parse_target_line(line, &host, &first, &max), 1);
+    ASSERT_EQ_STR(host, "example.com");
+    ASSERT_EQ_INT(first, 0);
+    ASSERT_EQ_INT(max, 0);
+}
+
+void test_batch_ttl_range(void) {
+    char line[] = "  192.0.2.1\t3 20   # core router\n";
+    char* host = NULL;
+    unsigned int first, max;
+
+    ASSERT_EQ_INT(parse_target_line(line, &host, &first, &max), 1);
+    ASSERT_EQ_STR(host, "192.0.2.1");
+    ASSERT_EQ_INT(first, 3);
+    ASSERT_EQ_INT(max, 20);
+}
+
+void test_batch_empty_and_comment(void) {
+    char empty[] = "   \n";
+    char comment[] = "# nothing here\n";
+    char* host = NULL;
+    unsigned int first, max;
+
+    ASSERT_EQ_INT(parse_target_line(empty, &host, &first, &max), 0);
+    ASSERT_EQ_INT(parse_target_line(comment, &host, &first, &max), 0);
+}
+
+void test_batch_malformed(void) {
+    char bad_ttl[] = "example.com x\n";
+    char zero_ttl[] = "example.com 0\n";
+    char big_ttl[] = "example.com 1 256\n";
+    char inverted[] = "example.com 10 5\n";
+    char garbage[] = "example.com 1 30 extra\n";
+    char* host = NULL;
+    unsigned int first, max;
+
+    ASSERT_EQ_INT(parse_target_line(bad_ttl, &host, &first, &max), -1);
+    ASSERT_EQ_INT(parse_target_line(zero_ttl, &host, &first, &max), -1);
+    ASSERT_EQ_INT(parse_target_line(big_ttl, &host, &first, &max), -1);
+    ASSERT_EQ_INT(parse_target_line(inverted, &host, &first, &max), -1);
+    ASSERT_EQ_INT(parse_target_line(garbage, &host, &first, &max), -1);
+}
+
+void register_test_batch(void) {
+    test_batch_host_only();
+    test_batch_ttl_range();
+    test_batch_empty_and_comment();
+    test_batch_malformed();
+}
@@ -5,33 +5,31 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
 #include <stdlib.h>
 
-/* Use common mocks */
-
-/* The struct from bpf.c (we have to redefine it here or move it to a header) */
-struct probe_event {
-    uint32_t saddr[4];
-    uint32_t daddr[4];
-    uint16_t sport;
-    uint16_t dport;
-    uint8_t protocol;
-    uint8_t ttl;
-    uint64_t send_time_ns;
-    uint64_t recv_time_ns;
-    uint8_t icmp_type;
-    uint8_t icmp_code;
-    uint32_t ifindex;
-    uint8_t is_reply;
-};
+#include "../../bpf/probe_event.h"
+
+/*  The events are checked against the destination of the (mock) trace   */
+static void set_dest4(struct probe_event* ev, const char* ip) {
+    sockaddr_any* addr = &probe_trace(NULL)->addr;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin.sin_family = AF_INET;
+    addr->sin.sin_addr.s_addr = inet_addr(ip);
+    ev->daddr[0] = addr->sin.sin_addr.s_addr;
+}
 
 void test_bpf_event_decode_probe_sent(void) {
     probes = calloc(10, sizeof(probe));
     memset(&probes[0], 0, sizeof(probe));
-    probes[0].seq = 33434;
+    probes[0].seq = htons(33434);
 
     struct probe_event ev = {0};
     ev.dport = 33434;
+    ev.protocol = 17;  // UDP
+    ev.family = AF_INET;
+    set_dest4(&ev, "192.0.2.1");
     ev.send_time_ns = 1000000000ULL;  // 1s
     ev.is_reply = 0;
 
@@ -45,11 +43,13 @@ void test_bpf_event_decode_probe_sent(void) {
 void test_bpf_event_decode_hop_reply(void) {
     probes = calloc(10, sizeof(probe));
     memset(&probes[0], 0, sizeof(probe));
-    probes[0].seq = 33435;
+    probes[0].seq = htons(33435);
 
     struct probe_event ev = {0};
     ev.dport = 33435;
     ev.protocol = 17;  // UDP
+    ev.family = AF_INET;
+    set_dest4(&ev, "192.0.2.1");
     ev.saddr[0] = inet_addr("1.2.3.4");
     ev.send_time_ns = 2000000000ULL;  // 2s
     ev.recv_time_ns = 2500000000ULL;  // 2.5s
@@ -66,6 +66,133 @@ void test_bpf_event_decode_hop_reply(void) {
     probes = NULL;
 }
 
+void test_bpf_event_decode_tcp_reply(void) {
+    probes = calloc(10, sizeof(probe));
+    probes[1].seq = htons(40001);
+
+    struct probe_event ev = {0};
+    ev.sport = 40001;  // tcp probes are told by the source port
+    ev.dport = 80;
+    ev.protocol = 6;  // TCP
+    ev.family = AF_INET;
+    set_dest4(&ev, "192.0.2.1");
+    ev.saddr[0] = inet_addr("5.6.7.8");
+    ev.send_time_ns = 1000000000ULL;
+    ev.recv_time_ns = 1200000000ULL;
+    ev.icmp_type = ICMP_TIME_EXCEEDED;
+    ev.is_reply = 1;
+
+    ASSERT_OK(bpf_decode_event(&ev, sizeof(ev)));
+    ASSERT_EQ_INT(probes[1].done, 1);
+    ASSERT_EQ_INT(probes[1].res.sin.sin_addr.s_addr, inet_addr("5.6.7.8"));
+
+    // The SYN-ACK (or RST) of the destination itself
+    probes[2].seq = htons(40002);
+    ev.sport = 40002;
+    ev.saddr[0] = ev.daddr[0];
+    ev.icmp_type = 0;
+
+    ASSERT_OK(bpf_decode_event(&ev, sizeof(ev)));
+    ASSERT_EQ_INT(probes[2].done, 1);
+    ASSERT_EQ_INT(probes[2].final, 1);
+    ASSERT_EQ_INT(probes[2].res.sin.sin_addr.s_addr, inet_addr("192.0.2.1"));
+    free(probes);
+    probes = NULL;
+}
+
+void test_bpf_event_decode_icmp6_echo_reply(void) {
+    struct in6_addr addr;
+
+    probes = calloc(10, sizeof(probe));
+    probes[0].seq = 7;
+
+    inet_pton(AF_INET6, "2001:db8::1", &addr);
+
+    struct probe_event ev = {0};
+    ev.sport = 1234;  // echo id
+    ev.dport = 7;     // echo sequence
+    ev.protocol = 58;  // ICMPv6
+    ev.family = AF_INET6;
+    memcpy(ev.saddr, &addr, sizeof(addr));
+    memcpy(ev.daddr, &addr, sizeof(addr));
+    memset(&probe_trace(NULL)->addr, 0, sizeof(sockaddr_any));
+    probe_trace(NULL)->addr.sin6.sin6_family = AF_INET6;
+    probe_trace(NULL)->addr.sin6.sin6_addr = addr;
+    bpf_set_echo_ident(1234);
+    ev.send_time_ns = 3000000000ULL;
+    ev.recv_time_ns = 3100000000ULL;
+    ev.icmp_type = ICMP6_ECHO_REPLY;
+    ev.is_reply = 1;
+
+    ASSERT_OK(bpf_decode_event(&ev, sizeof(ev)));
+    ASSERT_EQ_INT(probes[0].done, 1);
+    ASSERT_EQ_INT(probes[0].final, 1);
+    ASSERT_EQ_INT(probes[0].res.sa.sa_family, AF_INET6);
+    ASSERT_TRUE(memcmp(&probes[0].res.sin6.sin6_addr, &addr, sizeof(addr)) == 0);
+    free(probes);
+    probes = NULL;
+}
+
+void test_bpf_event_decode_others_ignored(void) {
+    probes = calloc(10, sizeof(probe));
+    probes[0].seq = 9;
+
+    struct probe_event ev = {0};
+    ev.sport = 4321;  // another ping's echo id
+    ev.dport = 9;
+    ev.protocol = 1;  // ICMP
+    ev.family = AF_INET;
+    set_dest4(&ev, "192.0.2.1");
+    ev.saddr[0] = inet_addr("192.0.2.1");
+    ev.send_time_ns = 1000000000ULL;
+    ev.recv_time_ns = 1100000000ULL;
+    ev.icmp_type = ICMP_ECHOREPLY;
+    ev.is_reply = 1;
+
+    bpf_set_echo_ident(1234);
+    ASSERT_OK(bpf_decode_event(&ev, sizeof(ev)));
+    ASSERT_EQ_INT(probes[0].done, 0);
+
+    // Ours by the id, but to some other destination
+    ev.sport = 1234;
+    ev.daddr[0] = inet_addr("198.51.100.1");
+    ASSERT_OK(bpf_decode_event(&ev, sizeof(ev)));
+    ASSERT_EQ_INT(probes[0].done, 0);
+
+    // Nor are the sent ones
+    ev.is_reply = 0;
+    ASSERT_OK(bpf_decode_event(&ev, sizeof(ev)));
+    ASSERT_TRUE(probes[0].send_time == 0);
+
+    // Ours indeed
+    ev.is_reply = 1;
+    ev.daddr[0] = inet_addr("192.0.2.1");
+    ASSERT_OK(bpf_decode_event(&ev, sizeof(ev)));
+    ASSERT_EQ_INT(probes[0].done, 1);
+    ASSERT_EQ_INT(probes[0].final, 1);
+
+    free(probes);
+    probes = NULL;
+}
+
+void test_bpf_hist_buckets(void) {
+    uint32_t b;
+
+    ASSERT_EQ_INT(bpf_hist_index(0), 0);
+    ASSERT_EQ_INT(bpf_hist_index(7), 7);
+    ASSERT_EQ_INT(bpf_hist_index(8), 8);
+    ASSERT_EQ_INT(bpf_hist_index(16), 16);
+    ASSERT_EQ_INT(bpf_hist_index(17), 16);
+    ASSERT_EQ_INT(bpf_hist_index(18), 17);
+    ASSERT_EQ_INT(bpf_hist_index(~0ULL), BPF_HIST_BUCKETS - 1);
+
+    /*  each bucket starts right after the previous one   */
+    for (b = 1; b < BPF_HIST_BUCKETS; b++) {
+        ASSERT_EQ_INT(bpf_hist_index(bpf_hist_lowest(b)), b);
+        ASSERT_EQ_INT(bpf_hist_index(bpf_hist_lowest(b) - 1), b - 1);
+    }
+}
+
 void test_bpf_event_decode_bounds_checks(void) {
     char small_buf[10];
     ASSERT_ERR_CODE(bpf_decode_event(small_buf, sizeof(small_buf)), EINVAL);
@@ -74,5 +201,9 @@ void test_bpf_event_decode_bounds_checks(void) {
 void register_test_bpf(void) {
     test_bpf_event_decode_probe_sent();
     test_bpf_event_decode_hop_reply();
+    test_bpf_event_decode_tcp_reply();
+    test_bpf_event_decode_icmp6_echo_reply();
+    test_bpf_event_decode_others_ignored();
+    test_bpf_hist_buckets();
     test_bpf_event_decode_bounds_checks();
 }
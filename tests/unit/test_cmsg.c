@@ -102,9 +102,34 @@ void test_cmsg_parse_scm_timestampns(void) {
     }
 }
 
+void test_cmsg_put_ttl(void) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg = {0};
+    struct cmsghdr* cm;
+    int ttl;
+
+    ASSERT_OK(put_ttl_cmsg(&msg, control, sizeof(control), AF_INET, 7));
+    cm = CMSG_FIRSTHDR(&msg);
+    ASSERT_EQ_INT(cm->cmsg_level, SOL_IP);
+    ASSERT_EQ_INT(cm->cmsg_type, IP_TTL);
+    memcpy(&ttl, CMSG_DATA(cm), sizeof(ttl));
+    ASSERT_EQ_INT(ttl, 7);
+    ASSERT_EQ_PTR(CMSG_NXTHDR(&msg, cm), NULL);
+
+    ASSERT_OK(put_ttl_cmsg(&msg, control, sizeof(control), AF_INET6, 64));
+    cm = CMSG_FIRSTHDR(&msg);
+    ASSERT_EQ_INT(cm->cmsg_level, SOL_IPV6);
+    ASSERT_EQ_INT(cm->cmsg_type, IPV6_HOPLIMIT);
+    memcpy(&ttl, CMSG_DATA(cm), sizeof(ttl));
+    ASSERT_EQ_INT(ttl, 64);
+
+    ASSERT_EQ_INT(put_ttl_cmsg(&msg, control, CMSG_LEN(0), AF_INET, 1), -ENOBUFS);
+}
+
 void register_test_cmsg(void) {
     test_cmsg_parse_sock_extended_err_basic();
     test_cmsg_parse_reject_truncated_cmsg();
     test_cmsg_parse_handles_multiple_cmsgs_order_independent();
     test_cmsg_parse_scm_timestampns();
+    test_cmsg_put_ttl();
 }
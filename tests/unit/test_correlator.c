@@ -87,9 +87,209 @@ void test_corr_capacity_limits_enforced_no_alloc_growth(void) {
     corr_destroy(c);
 }
 
+void test_corr_match_refreshes_lru_before_eviction(void) {
+    Correlator* c = corr_create(2);
+
+    Probe p1 = {0};
+    p1.id.dst_port = 1;
+    Probe p2 = {0};
+    p2.id.dst_port = 2;
+    Probe p3 = {0};
+    p3.id.dst_port = 3;
+
+    corr_insert_probe(c, &p1);
+    corr_insert_probe(c, &p2);
+
+    PacketResult res1 = {0};
+    res1.original_req.dst_port = 1;
+    ASSERT_EQ_PTR(corr_match(c, &res1), &c->entries[0]);  // p2 is the oldest now
+
+    corr_insert_probe(c, &p3);  // Should evict p2
+
+    PacketResult res2 = {0};
+    res2.original_req.dst_port = 2;
+    ASSERT_EQ_PTR(corr_match(c, &res2), NULL);
+    ASSERT_EQ_PTR(corr_match(c, &res1), &c->entries[0]);
+
+    PacketResult res3 = {0};
+    res3.original_req.dst_port = 3;
+    ASSERT_EQ_PTR(corr_match(c, &res3), &c->entries[1]);
+
+    corr_destroy(c);
+}
+
+void test_corr_wildcard_src_port_and_tcp_sequence(void) {
+    Correlator* c = corr_create(10);
+
+    Probe any = {0};  // sent from an unknown source port
+    any.id.protocol = IPPROTO_UDP;
+    any.id.dst_port = 33434;
+    corr_insert_probe(c, &any);
+
+    Probe syn = {0};
+    syn.id.protocol = IPPROTO_TCP;
+    syn.id.dst_port = 80;
+    syn.id.src_port = 40000;
+    syn.id.sequence = 7;
+    corr_insert_probe(c, &syn);
+
+    PacketResult res = {0};
+    res.original_req.protocol = IPPROTO_UDP;
+    res.original_req.dst_port = 33434;
+    res.original_req.src_port = 5555;
+    ASSERT_EQ_PTR(corr_match(c, &res), &c->entries[0]);
+
+    res.original_req.protocol = IPPROTO_TCP;
+    res.original_req.dst_port = 80;
+    res.original_req.src_port = 40000;
+    res.original_req.sequence = 8;
+    ASSERT_EQ_PTR(corr_match(c, &res), NULL);
+
+    res.original_req.sequence = 7;
+    ASSERT_EQ_PTR(corr_match(c, &res), &c->entries[1]);
+    ASSERT_EQ_PTR(corr_match(c, &res), &c->entries[1]);  // duplicate still matches
+
+    corr_destroy(c);
+}
+
+void test_corr_many_inflight_probes(void) {
+    const size_t n = 200000;
+    Correlator* c = corr_create(n);
+    ASSERT_TRUE(c != NULL);
+
+    for (size_t i = 0; i < n; i++) {
+        Probe p = {0};
+        p.id.protocol = IPPROTO_UDP;
+        p.id.dst_port = (uint16_t)(33434 + i % 1000);
+        p.id.src_port = (uint16_t)(1024 + i / 1000);
+        corr_insert_probe(c, &p);
+    }
+    ASSERT_EQ_U64(c->count, n);
+
+    for (size_t i = 0; i < n; i++) {
+        PacketResult res = {0};
+        res.original_req.protocol = IPPROTO_UDP;
+        res.original_req.dst_port = (uint16_t)(33434 + i % 1000);
+        res.original_req.src_port = (uint16_t)(1024 + i / 1000);
+        ASSERT_EQ_PTR(corr_match(c, &res), &c->entries[i]);
+    }
+
+    corr_destroy(c);
+}
+
+void test_corr_payloads_live_in_reused_arena_slots(void) {
+    Correlator* c = corr_create_ex(2, 16, CORR_PAYLOAD_COPY);
+
+    uint8_t data[20];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (uint8_t)i;
+
+    Probe p1 = {0};
+    p1.id.dst_port = 1;
+    p1.payload = data;
+    p1.payload_len = 8;
+    Probe p2 = {0};
+    p2.id.dst_port = 2;
+    p2.payload = data;
+    p2.payload_len = sizeof(data);  // longer than a slot
+    Probe p3 = {0};
+    p3.id.dst_port = 3;
+    p3.payload = data + 4;
+    p3.payload_len = 4;
+
+    corr_insert_probe(c, &p1);
+    corr_insert_probe(c, &p2);
+
+    ASSERT_EQ_PTR(c->entries[0].payload, c->payload_arena);
+    ASSERT_EQ_PTR(c->entries[1].payload, c->payload_arena + 16);
+    ASSERT_EQ_U64(c->entries[1].payload_len, 16);
+    ASSERT_MEMEQ(c->entries[1].payload, data, 16);
+    ASSERT_TRUE(corr_payload_equal(c, &c->entries[1], data, sizeof(data)));
+
+    // Same first bytes, but not the same payload
+    uint8_t other[24];
+    memcpy(other, data, sizeof(data));
+    memset(other + sizeof(data), 0, sizeof(other) - sizeof(data));
+    ASSERT_TRUE(!corr_payload_equal(c, &c->entries[1], other, sizeof(other)));
+    other[18] ^= 1;
+    ASSERT_TRUE(!corr_payload_equal(c, &c->entries[1], other, sizeof(data)));
+    ASSERT_TRUE(!corr_payload_equal(c, &c->entries[1], data, 16));
+
+    corr_insert_probe(c, &p3);  // Should evict p1 and take over its slot
+    ASSERT_EQ_PTR(c->entries[0].payload, c->payload_arena);
+    ASSERT_MEMEQ(c->entries[0].payload, data + 4, 4);
+    ASSERT_TRUE(corr_payload_equal(c, &c->entries[0], data + 4, 4));
+    ASSERT_TRUE(!corr_payload_equal(c, &c->entries[0], data, 4));
+
+    corr_destroy(c);
+}
+
+void test_corr_default_keeps_whole_payloads(void) {
+    Correlator* c = corr_create(1);
+
+    uint8_t data[300];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (uint8_t)i;
+
+    Probe p = {0};
+    p.id.dst_port = 1;
+    p.payload = data;
+    p.payload_len = sizeof(data);
+    corr_insert_probe(c, &p);
+
+    ASSERT_EQ_U64(c->entries[0].payload_len, sizeof(data));
+    ASSERT_MEMEQ(c->entries[0].payload, data, sizeof(data));
+    ASSERT_TRUE(corr_payload_equal(c, &c->entries[0], data, sizeof(data)));
+    ASSERT_TRUE(!corr_payload_equal(c, &c->entries[0], data, 128));
+
+    // A shorter one reuses the buffer of the evicted entry
+    void* buf = c->entries[0].payload;
+    p.id.dst_port = 2;
+    p.payload = data + 8;
+    p.payload_len = 8;
+    corr_insert_probe(c, &p);
+
+    ASSERT_EQ_PTR(c->entries[0].payload, buf);
+    ASSERT_EQ_U64(c->entries[0].payload_len, 8);
+    ASSERT_TRUE(corr_payload_equal(c, &c->entries[0], data + 8, 8));
+
+    corr_destroy(c);
+}
+
+void test_corr_hash_only_payloads(void) {
+    Correlator* c = corr_create_ex(4, 0, CORR_PAYLOAD_HASH);
+
+    const char payload[] = "traceroute probe";
+    Probe p = {0};
+    p.id.dst_port = 33434;
+    p.payload = (void*)payload;
+    p.payload_len = sizeof(payload);
+    corr_insert_probe(c, &p);
+
+    ASSERT_EQ_PTR(c->payload_arena, NULL);
+    ASSERT_EQ_PTR(c->entries[0].payload, NULL);
+    ASSERT_EQ_U64(c->entries[0].payload_len, sizeof(payload));
+
+    PacketResult res = {0};
+    res.original_req.dst_port = 33434;
+    Probe* matched = corr_match(c, &res);
+    ASSERT_EQ_PTR(matched, &c->entries[0]);
+    ASSERT_TRUE(corr_payload_equal(c, matched, payload, sizeof(payload)));
+    ASSERT_TRUE(!corr_payload_equal(c, matched, "traceroute probX", sizeof(payload)));
+    ASSERT_TRUE(!corr_payload_equal(c, matched, payload, sizeof(payload) - 1));
+
+    corr_destroy(c);
+}
+
 void register_test_correlator(void) {
     test_corr_insert_probe_then_match_reply_success();
     test_corr_match_reply_missing_probe_is_unknown();
     test_corr_multiple_inflight_out_of_order_replies();
     test_corr_capacity_limits_enforced_no_alloc_growth();
+    test_corr_match_refreshes_lru_before_eviction();
+    test_corr_wildcard_src_port_and_tcp_sequence();
+    test_corr_many_inflight_probes();
+    test_corr_payloads_live_in_reused_arena_slots();
+    test_corr_default_keeps_whole_payloads();
+    test_corr_hash_only_payloads();
 }
@@ -0,0 +1,81 @@
+#include "common/assert.h"
+#include "traceroute.h"
+#include <string.h>
+#include <arpa/inet.h>
+
+/*  An echo request like mod-icmp sends: header and payload   */
+static void make_packet(uint8_t* pkt, size_t len) {
+    size_t i;
+
+    memset(pkt, 0, len);
+    pkt[0] = 8; /*  ICMP_ECHO   */
+    for (i = 8; i < len; i++)
+        pkt[i] = 0x40 + (i & 0x3f);
+}
+
+void test_csum_replace2_matches_full(void) {
+    uint8_t pkt[1000];
+    uint16_t check, word;
+    unsigned int i;
+
+    make_packet(pkt, sizeof(pkt));
+    check = in_csum(pkt, sizeof(pkt));
+
+    /*  a seq field, then a payload word, as for the icmp probes   */
+    for (i = 0; i < 70000; i += 97) {
+        uint16_t old;
+
+        word = htons(i & 0xffff);
+        memcpy(&old, pkt + 6, sizeof(old));
+        memcpy(pkt + 6, &word, sizeof(word));
+        check = csum_replace2(check, old, word);
+
+        word = ~word;
+        memcpy(&old, pkt + 8, sizeof(old));
+        memcpy(pkt + 8, &word, sizeof(word));
+        check = csum_replace2(check, old, word);
+
+        ASSERT_EQ_INT(check, in_csum(pkt, sizeof(pkt)));
+    }
+}
+
+void test_csum_replace4_matches_full(void) {
+    uint8_t pkt[64];
+    uint16_t check;
+    uint32_t seq, old;
+    unsigned int i;
+
+    make_packet(pkt, sizeof(pkt));
+    check = in_csum(pkt, sizeof(pkt));
+
+    for (i = 0, seq = 0x12345678; i < 1000; i++, seq = seq * 1103515245 + 12345) {
+        memcpy(&old, pkt + 4, sizeof(old));
+        memcpy(pkt + 4, &seq, sizeof(seq));
+        check = csum_replace4(check, old, seq);
+
+        ASSERT_EQ_INT(check, in_csum(pkt, sizeof(pkt)));
+    }
+}
+
+void test_csum_replace_verifies(void) {
+    uint8_t pkt[20];
+    uint16_t check, old, word = htons(0xbeef);
+
+    make_packet(pkt, sizeof(pkt));
+    check = in_csum(pkt, sizeof(pkt));
+    memcpy(pkt + 2, &check, sizeof(check));
+
+    /*  the checksum field itself in the sum, as a receiver does   */
+    memcpy(&old, pkt + 12, sizeof(old));
+    memcpy(pkt + 12, &word, sizeof(word));
+    check = csum_replace2(check, old, word);
+    memcpy(pkt + 2, &check, sizeof(check));
+
+    ASSERT_EQ_INT(in_csum(pkt, sizeof(pkt)), 0xffff);
+}
+
+void register_test_csum(void) {
+    test_csum_replace2_matches_full();
+    test_csum_replace4_matches_full();
+    test_csum_replace_verifies();
+}
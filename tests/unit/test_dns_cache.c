@@ -90,10 +90,98 @@ void test_dns_cache_idna_or_invalid_names_handled(void) {
     dns_cache_destroy(c);
 }
 
+void test_dns_cache_names_share_suffixes(void) {
+    DNSCache* c = dns_cache_create(10);
+    sockaddr_any sa1, sa2, sa3;
+    make_addr(&sa1, "192.0.2.1");
+    make_addr(&sa2, "192.0.2.2");
+    make_addr(&sa3, "192.0.2.3");
+
+    dns_cache_insert(c, &sa1, "ae1.cr1.lon.example.net", 100, 0);
+    ASSERT_EQ_U64(c->live_nodes, 5);
+    dns_cache_insert(c, &sa2, "ae2.cr1.lon.example.net", 100, 0);
+    ASSERT_EQ_U64(c->live_nodes, 6);  // just "ae2" more
+    dns_cache_insert(c, &sa3, "ae1.cr1.lon.example.net", 100, 0);
+    ASSERT_EQ_U64(c->live_nodes, 6);  // the same name
+
+    ASSERT_EQ_STR(dns_cache_lookup(c, &sa1, 101), "ae1.cr1.lon.example.net");
+    ASSERT_EQ_STR(dns_cache_lookup(c, &sa2, 101), "ae2.cr1.lon.example.net");
+
+    // Renamed, the old leaf is still used by sa3
+    dns_cache_insert(c, &sa1, "xe-0.cr2.par.example.org", 102, 0);
+    ASSERT_EQ_STR(dns_cache_lookup(c, &sa1, 103), "xe-0.cr2.par.example.org");
+    ASSERT_EQ_STR(dns_cache_lookup(c, &sa3, 103), "ae1.cr1.lon.example.net");
+    ASSERT_EQ_U64(c->live_nodes, 11);
+
+    // The whole example.net chain goes away with its last users
+    dns_cache_insert(c, &sa2, "", 104, 0);
+    dns_cache_insert(c, &sa3, "", 104, 0);
+    ASSERT_EQ_STR(dns_cache_lookup(c, &sa3, 105), "");
+    ASSERT_EQ_U64(c->live_nodes, 6);  // "" and the five labels of sa1
+
+    dns_cache_destroy(c);
+}
+
+void test_dns_cache_ipv6_and_family_keys(void) {
+    DNSCache* c = dns_cache_create(4);
+    sockaddr_any v4, v6;
+
+    memset(&v6, 0, sizeof(v6));
+    v6.sin6.sin6_family = AF_INET6;
+    inet_pton(AF_INET6, "2001:db8::1", &v6.sin6.sin6_addr);
+    memset(&v4, 0, sizeof(v4));
+    make_addr(&v4, "32.1.13.184");  // the same leading bytes
+
+    dns_cache_insert(c, &v6, "v6.example.net", 100, 0);
+    ASSERT_EQ_PTR(dns_cache_lookup(c, &v4, 101), NULL);
+    ASSERT_EQ_STR(dns_cache_lookup(c, &v6, 101), "v6.example.net");
+
+    dns_cache_destroy(c);
+}
+
+void test_dns_cache_many_routers(void) {
+    const size_t n = 100000;
+    DNSCache* c = dns_cache_create(n / 2);
+    char name[64];
+
+    for (size_t i = 0; i < n; i++) {
+        sockaddr_any sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin.sin_family = AF_INET;
+        sa.sin.sin_addr.s_addr = htonl(0x0a000000 + (uint32_t)i);
+        snprintf(name, sizeof(name), "r%zu.pop%zu.example.net", i, i % 100);
+        dns_cache_insert(c, &sa, name, 100, 0);
+    }
+    ASSERT_EQ_U64(c->count, n / 2);
+
+    for (size_t i = 0; i < n; i++) {
+        sockaddr_any sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin.sin_family = AF_INET;
+        sa.sin.sin_addr.s_addr = htonl(0x0a000000 + (uint32_t)i);
+        const char* ret = dns_cache_lookup(c, &sa, 101);
+
+        if (i < n / 2) {
+            ASSERT_EQ_PTR(ret, NULL);  // evicted
+        }
+        else {
+            snprintf(name, sizeof(name), "r%zu.pop%zu.example.net", i, i % 100);
+            ASSERT_EQ_STR(ret, name);
+        }
+    }
+    // one leaf per entry, plus the shared pops and domain
+    ASSERT_EQ_U64(c->live_nodes, n / 2 + 100 + 2);
+
+    dns_cache_destroy(c);
+}
+
 void register_test_dns_cache(void) {
     test_dns_cache_insert_hit();
     test_dns_cache_negative_cache_hit();
     test_dns_cache_ttl_expiry();
     test_dns_cache_lru_eviction();
     test_dns_cache_idna_or_invalid_names_handled();
+    test_dns_cache_names_share_suffixes();
+    test_dns_cache_ipv6_and_family_keys();
+    test_dns_cache_many_routers();
 }
@@ -1,6 +1,7 @@
 #include "common/assert.h"
 #include "common/mocks.h"
 #include "traceroute.h"
+#include "../../bpf/probe_event.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -55,7 +56,82 @@ void test_export_jsonl_probe(void) {
     probes = NULL;
 }
 
+void test_export_jsonl_stats(void) {
+    HopStats stats[2];
+    sockaddr_any res[2];
+    trace tr;
+
+    memset(&tr, 0, sizeof(tr));
+    memset(res, 0, sizeof(res));
+    tr.addr.sa.sa_family = AF_INET;
+    tr.stats = stats;
+    tr.hop_res = res;
+
+    hop_stats_init(&stats[0]);
+    hop_stats_init(&stats[1]);
+    hop_stats_add(&stats[1], 0.004);
+    hop_stats_add(&stats[1], -1);
+    res[1].sa.sa_family = AF_INET;
+
+    start_capture();
+    tr_export_jsonl_stats(&tr, 3, 1);
+    tr_export_jsonl_stats(&tr, 3, 2);
+    stop_capture();
+
+    ASSERT_TRUE(strstr(capture_buf, "\"type\":\"stats\", \"round\":3") != NULL);
+    ASSERT_TRUE(strstr(capture_buf, "\"ttl\":1, \"sent\":0, \"received\":0, \"loss\":0.0000}") != NULL);
+    ASSERT_TRUE(strstr(capture_buf, "\"sent\":2, \"received\":1, \"loss\":0.5000") != NULL);
+    ASSERT_TRUE(strstr(capture_buf, "\"last_ms\":4.000") != NULL);
+    ASSERT_TRUE(strstr(capture_buf, "\"p99_ms\":4.000}") != NULL);
+}
+
+void test_export_jsonl_histograms(void) {
+    HdrHist hists[3];
+    trace tr;
+
+    memset(&tr, 0, sizeof(tr));
+    memset(hists, 0, sizeof(hists));
+    tr.addr.sa.sa_family = AF_INET;
+    tr.max_hops = 3;
+    tr.hists = hists;
+
+    ASSERT_OK(hdr_init(&hists[1], 3600000000ULL, 2));
+    hdr_record(&hists[1], 250, 2);
+    hdr_record(&hists[1], 1000000, 1);
+
+    start_capture();
+    tr_export_jsonl_end(&tr);
+    stop_capture();
+
+    ASSERT_TRUE(strstr(capture_buf, "\"type\":\"histogram\"") != NULL);
+    ASSERT_TRUE(strstr(capture_buf, "\"ttl\":1,") == NULL);
+    ASSERT_TRUE(strstr(capture_buf, "\"ttl\":2, \"unit\":\"us\", \"digits\":2") != NULL);
+    ASSERT_TRUE(strstr(capture_buf, "\"count\":3, \"min\":250, \"max\":1000000") != NULL);
+    ASSERT_TRUE(strstr(capture_buf, "\"buckets\":[[250,2],[999424,1]]}") != NULL);
+    ASSERT_TRUE(strstr(capture_buf, "{\"type\":\"end\"}") != NULL);
+
+    hdr_free(&hists[1]);
+}
+
+void test_export_jsonl_bpf_histogram(void) {
+    uint64_t counts[BPF_HIST_BUCKETS] = {0};
+
+    counts[bpf_hist_index(250)] = 3;
+    counts[bpf_hist_index(20000)] = 1;
+
+    start_capture();
+    tr_export_jsonl_bpf_histogram(4, counts);
+    stop_capture();
+
+    ASSERT_TRUE(strstr(capture_buf, "{\"type\":\"bpf_histogram\", \"ttl\":4, \"unit\":\"us\", \"sub_buckets\":8") != NULL);
+    ASSERT_TRUE(strstr(capture_buf, "\"count\":4, \"p50\":255, \"p90\":20479, \"p99\":20479") != NULL);
+    ASSERT_TRUE(strstr(capture_buf, "\"buckets\":[[240,3],[18432,1]]}") != NULL);
+}
+
 void register_test_export(void) {
     test_export_jsonl_header();
     test_export_jsonl_probe();
+    test_export_jsonl_stats();
+    test_export_jsonl_histograms();
+    test_export_jsonl_bpf_histogram();
 }
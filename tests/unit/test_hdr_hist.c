@@ -0,0 +1,95 @@
+#include "common/assert.h"
+#include "core/hdr_hist.h"
+
+void test_hdr_hist_layout(void) {
+    HdrHist h;
+
+    ASSERT_OK(hdr_init(&h, 3600000000ULL, 2));
+    ASSERT_EQ_INT(h.sub_bucket_count, 256);
+
+    // Exact up to the sub-bucket count, then 2 digits
+    ASSERT_EQ_U64(hdr_lowest(&h, hdr_index(&h, 1)), 1);
+    ASSERT_EQ_U64(hdr_lowest(&h, hdr_index(&h, 255)), 255);
+    ASSERT_EQ_U64(hdr_lowest(&h, hdr_index(&h, 257)), 256);
+    ASSERT_EQ_U64(hdr_highest(&h, hdr_index(&h, 257)), 257);
+    ASSERT_EQ_U64(hdr_lowest(&h, hdr_index(&h, 1000000)), 999424);
+    ASSERT_EQ_U64(hdr_highest(&h, hdr_index(&h, 1000000)), 1003519);
+    ASSERT_TRUE(hdr_index(&h, 3600000000ULL) < h.counts_len);
+
+    // Every bucket's bounds map back to it
+    for (uint32_t i = 0; i < h.counts_len; i++) {
+        ASSERT_EQ_INT(hdr_index(&h, hdr_lowest(&h, i)), i);
+        ASSERT_EQ_INT(hdr_index(&h, hdr_highest(&h, i)), i);
+    }
+
+    hdr_free(&h);
+    ASSERT_EQ_INT(hdr_init(&h, 1000, 6), -1);
+}
+
+void test_hdr_hist_percentiles(void) {
+    HdrHist h;
+
+    ASSERT_OK(hdr_init(&h, 60000000, 3));
+
+    // Sub-millisecond ones told apart: 1..1000 us
+    for (uint64_t v = 1; v <= 1000; v++)
+        hdr_record(&h, v, 1);
+    hdr_record(&h, 0, 1);          // as 1
+    hdr_record(&h, 100000000, 1);  // as max_value
+
+    ASSERT_EQ_U64(h.total, 1002);
+    ASSERT_EQ_U64(h.min, 1);
+    ASSERT_EQ_U64(h.max, 60000000);
+    ASSERT_EQ_U64(hdr_percentile(&h, 50), 500);
+    ASSERT_EQ_U64(hdr_percentile(&h, 99), 991);
+    ASSERT_EQ_U64(hdr_percentile(&h, 100), 60000000);
+
+    hdr_free(&h);
+}
+
+void test_hdr_hist_merge(void) {
+    HdrHist a, b, c;
+
+    ASSERT_OK(hdr_init(&a, 1000000, 2));
+    ASSERT_OK(hdr_init(&b, 1000000, 2));
+    ASSERT_OK(hdr_init(&c, 1000000, 3));
+
+    hdr_record(&a, 100, 3);
+    hdr_record(&b, 5000, 1);
+    hdr_record(&b, 50, 1);
+
+    ASSERT_OK(hdr_merge(&a, &b));
+    ASSERT_EQ_U64(a.total, 5);
+    ASSERT_EQ_U64(a.min, 50);
+    ASSERT_EQ_U64(a.max, 5000);
+    ASSERT_EQ_U64(a.counts[hdr_index(&a, 100)], 3);
+    ASSERT_EQ_INT(hdr_merge(&a, &c), -1);
+
+    // A bucket recorded again by its lowest value, as exported
+    hdr_record(&c, hdr_lowest(&a, hdr_index(&a, 5000)), 1);
+    ASSERT_EQ_INT(hdr_index(&a, c.max), hdr_index(&a, 5000));
+
+    hdr_free(&a);
+    hdr_free(&b);
+    hdr_free(&c);
+}
+
+void test_hdr_hist_counts_saturate(void) {
+    HdrHist h;
+
+    ASSERT_OK(hdr_init(&h, 1000000, 2));
+
+    hdr_record(&h, 100, UINT32_MAX - 1);
+    hdr_record(&h, 100, 5);
+    ASSERT_EQ_U64(h.counts[hdr_index(&h, 100)], UINT32_MAX);
+    ASSERT_EQ_U64(h.total, (uint64_t)UINT32_MAX + 4);
+
+    hdr_free(&h);
+}
+
+void register_test_hdr_hist(void) {
+    test_hdr_hist_layout();
+    test_hdr_hist_percentiles();
+    test_hdr_hist_merge();
+    test_hdr_hist_counts_saturate();
+}
@@ -0,0 +1,75 @@
+#include "common/assert.h"
+#include "core/hop_stats.h"
+#include <math.h>
+
+void test_hop_stats_basic(void) {
+    HopStats hs;
+
+    hop_stats_init(&hs);
+    hop_stats_add(&hs, 0.010);
+    hop_stats_add(&hs, -1);
+    hop_stats_add(&hs, 0.030);
+    hop_stats_add(&hs, 0.020);
+
+    ASSERT_EQ_U64(hs.sent, 4);
+    ASSERT_EQ_U64(hs.received, 3);
+    ASSERT_TRUE(fabs(hop_stats_loss(&hs) - 0.25) < 1e-9);
+    ASSERT_TRUE(fabs(hop_stats_mean(&hs) - 0.020) < 1e-9);
+    ASSERT_TRUE(hs.last == 0.020);
+    ASSERT_TRUE(hs.min == 0.010);
+    ASSERT_TRUE(hs.max == 0.030);
+
+    // ewma: 10, then 10 + (30 - 10) / 8 = 12.5, then 12.5 + (20 - 12.5) / 8
+    ASSERT_TRUE(fabs(hs.ewma - 0.0134375) < 1e-9);
+    // jitter: (20 / 16), then that + (10 - that) / 16
+    ASSERT_TRUE(fabs(hs.jitter - (0.00125 + (0.010 - 0.00125) / 16)) < 1e-9);
+
+    ASSERT_TRUE(hop_stats_quantile(&hs, 0) == 0.020);  // exact while few
+}
+
+void test_hop_stats_ring_rolls(void) {
+    HopStats hs;
+    int i;
+
+    hop_stats_init(&hs);
+    for (i = 0; i < HOP_STATS_RING; i++)
+        hop_stats_add(&hs, -1);
+    ASSERT_TRUE(hop_stats_loss(&hs) == 1);
+    ASSERT_TRUE(hop_stats_mean(&hs) == 0);
+
+    // The losses are pushed out by replies
+    for (i = 0; i < HOP_STATS_RING / 2; i++)
+        hop_stats_add(&hs, 0.005);
+    ASSERT_TRUE(fabs(hop_stats_loss(&hs) - 0.5) < 1e-9);
+
+    for (i = 0; i < HOP_STATS_RING; i++)
+        hop_stats_add(&hs, 0.001);
+    ASSERT_EQ_INT(hs.ring_lost, 0);
+    ASSERT_TRUE(fabs(hop_stats_mean(&hs) - 0.001) < 1e-9);
+    ASSERT_TRUE(hs.max == 0.005);  // the whole run
+    ASSERT_EQ_U64(hs.sent, 2 * HOP_STATS_RING + HOP_STATS_RING / 2);
+}
+
+void test_hop_stats_quantiles_converge(void) {
+    HopStats hs;
+    unsigned int x = 12345;
+    int i;
+
+    hop_stats_init(&hs);
+
+    // Uniform over 0..100 ms, in a scrambled order
+    for (i = 0; i < 10000; i++) {
+        x = x * 1103515245 + 12345;
+        hop_stats_add(&hs, ((x >> 8) % 100001) / 1e6);
+    }
+
+    ASSERT_TRUE(fabs(hop_stats_quantile(&hs, 0) - 0.050) < 0.003);
+    ASSERT_TRUE(fabs(hop_stats_quantile(&hs, 1) - 0.090) < 0.003);
+    ASSERT_TRUE(fabs(hop_stats_quantile(&hs, 2) - 0.099) < 0.002);
+}
+
+void register_test_hop_stats(void) {
+    test_hop_stats_basic();
+    test_hop_stats_ring_rolls();
+    test_hop_stats_quantiles_converge();
+}
@@ -0,0 +1,154 @@
+#include "common/assert.h"
+#include "correlate/mda.h"
+#include <arpa/inet.h>
+#include <string.h>
+
+// A diamond: 10.0.1.1, then 10.0.2.{1,2}, then two successors of each
+// at 10.0.3.{1..4}, then 10.0.4.1, then the destination 10.0.5.1.
+// `silent' hops never answer.
+static int silent_ttl = 0;
+
+static uint32_t flow_hash(int flow, uint32_t salt) {
+    uint64_t x = ((uint64_t)salt << 32 | flow) + 0x9e3779b97f4a7c15ULL;  // splitmix64
+
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return (uint32_t)((x ^ (x >> 31)) >> 32);
+}
+
+static int route(int ttl, int flow, sockaddr_any* from) {
+    uint32_t host;
+    int b = flow_hash(flow, 2) % 2;
+
+    memset(from, 0, sizeof(*from));
+    if (ttl == silent_ttl)
+        return 0;
+
+    switch (ttl) {
+    case 1:
+        host = 0x0a000101;
+        break;
+    case 2:
+        host = 0x0a000201 + b;
+        break;
+    case 3:
+        host = 0x0a000301 + 2 * b + flow_hash(flow, 3) % 2;
+        break;
+    case 4:
+        host = 0x0a000401;
+        break;
+    default:
+        host = 0x0a000501;
+        break;
+    }
+
+    from->sin.sin_family = AF_INET;
+    from->sin.sin_addr.s_addr = htonl(host);
+    return 1;
+}
+
+// Runs it with all the probes of each round answered at once
+static void run(Mda* m) {
+    int ttls[4096], flows[4096];
+
+    for (int rounds = 0; rounds < 1000; rounds++) {
+        int n = 0, r;
+
+        while (n < 4096 && (r = mda_next_probe(m, &ttls[n], &flows[n])) > 0)
+            n++;
+        if (!n) {
+            ASSERT_EQ_INT(r, -1);
+            return;
+        }
+
+        for (int i = 0; i < n; i++) {
+            sockaddr_any from;
+            int ok = route(ttls[i], flows[i], &from);
+
+            mda_record(m, ttls[i], flows[i], ok ? &from : NULL, ttls[i] == 5);
+        }
+    }
+
+    ASSERT_TRUE(0);  // should have ended
+}
+
+static int has_link(const MdaHop* h, const MdaHop* p, uint32_t from, uint32_t to) {
+    for (int i = 0; i < h->num_links; i++) {
+        const MdaLink* l = &h->links[i];
+
+        if (ntohl(p->ifaces[l->prev].addr.sin.sin_addr.s_addr) == from &&
+            ntohl(h->ifaces[l->next].addr.sin.sin_addr.s_addr) == to)
+            return 1;
+    }
+    return 0;
+}
+
+void test_mda_stopping_points(void) {
+    // As in the Paris traceroute table for 95%
+    ASSERT_EQ_INT(mda_stopping_point(1, 0.05), 6);
+    ASSERT_EQ_INT(mda_stopping_point(2, 0.05), 11);
+    ASSERT_EQ_INT(mda_stopping_point(3, 0.05), 16);
+    ASSERT_EQ_INT(mda_stopping_point(4, 0.05), 21);
+    ASSERT_EQ_INT(mda_stopping_point(5, 0.05), 27);
+    ASSERT_TRUE(mda_stopping_point(1, 0.01) > 6);
+}
+
+void test_mda_finds_the_diamond(void) {
+    silent_ttl = 0;
+
+    Mda* m = mda_create(1, 30, 1024, 0.05);
+    ASSERT_TRUE(m != NULL);
+    run(m);
+
+    ASSERT_EQ_INT(m->hops[0].num_ifaces, 1);
+    ASSERT_EQ_INT(m->hops[1].num_ifaces, 2);
+    ASSERT_EQ_INT(m->hops[2].num_ifaces, 4);
+    ASSERT_EQ_INT(m->hops[3].num_ifaces, 1);
+    ASSERT_EQ_INT(m->hops[4].num_ifaces, 1);
+    ASSERT_EQ_INT(m->hops[4].ifaces[0].final, 1);
+    ASSERT_EQ_INT(m->hops[5].num_ifaces, 0);  // stopped at the destination
+
+    ASSERT_EQ_INT(m->hops[2].num_links, 4);
+    ASSERT_TRUE(has_link(&m->hops[2], &m->hops[1], 0x0a000201, 0x0a000301));
+    ASSERT_TRUE(has_link(&m->hops[2], &m->hops[1], 0x0a000201, 0x0a000302));
+    ASSERT_TRUE(has_link(&m->hops[2], &m->hops[1], 0x0a000202, 0x0a000303));
+    ASSERT_TRUE(has_link(&m->hops[2], &m->hops[1], 0x0a000202, 0x0a000304));
+    ASSERT_EQ_INT(m->hops[3].num_links, 4);
+
+    // Far fewer than 64 flows for every hop
+    ASSERT_TRUE(m->num_probes < 150);
+
+    mda_destroy(m);
+}
+
+void test_mda_goes_past_silent_hop(void) {
+    silent_ttl = 2;
+
+    Mda* m = mda_create(1, 30, 1024, 0.05);
+    run(m);
+
+    ASSERT_EQ_INT(m->hops[1].num_ifaces, 0);
+    ASSERT_EQ_INT(m->hops[2].num_ifaces, 4);
+    ASSERT_EQ_INT(m->hops[4].ifaces[0].final, 1);
+
+    mda_destroy(m);
+    silent_ttl = 0;
+}
+
+void test_mda_flow_budget(void) {
+    Mda* m = mda_create(1, 30, 8, 0.05);
+    run(m);
+
+    // Not enough flows to tell much, but it ends
+    ASSERT_TRUE(m->next_flow <= 8);
+    ASSERT_EQ_PTR(mda_create(2, 1, 8, 0.05), NULL);
+
+    mda_destroy(m);
+}
+
+void register_test_mda(void) {
+    test_mda_stopping_points();
+    test_mda_finds_the_diamond();
+    test_mda_goes_past_silent_hop();
+    test_mda_flow_budget();
+}
@@ -0,0 +1,101 @@
+#include "common/assert.h"
+#include "traceroute.h"
+#include <string.h>
+#include <stdlib.h>
+
+void test_probe_index_basic(void) {
+    probe_index idx = {0};
+    probe pbs[3];
+
+    ASSERT_EQ_PTR(index_find(&idx, 1), NULL);
+
+    index_add(&idx, 33434, &pbs[0]);
+    index_add(&idx, 33435, &pbs[1]);
+    index_add(&idx, 0, &pbs[2]); /* invalid keys are not indexed */
+    index_add(&idx, -1, &pbs[2]);
+
+    ASSERT_EQ_INT(idx.count, 2);
+    ASSERT_EQ_PTR(index_find(&idx, 33434), &pbs[0]);
+    ASSERT_EQ_PTR(index_find(&idx, 33435), &pbs[1]);
+    ASSERT_EQ_PTR(index_find(&idx, 33436), NULL);
+    ASSERT_EQ_PTR(index_find(&idx, 0), NULL);
+
+    index_del(&idx, 33434, &pbs[0]);
+    ASSERT_EQ_PTR(index_find(&idx, 33434), NULL);
+    ASSERT_EQ_PTR(index_find(&idx, 33435), &pbs[1]);
+
+    /* deleting with a wrong probe is a no-op */
+    index_del(&idx, 33435, &pbs[0]);
+    ASSERT_EQ_PTR(index_find(&idx, 33435), &pbs[1]);
+    ASSERT_EQ_INT(idx.count, 1);
+
+    index_free(&idx);
+    ASSERT_EQ_INT(idx.size, 0);
+}
+
+void test_probe_index_grow_and_churn(void) {
+    enum { NUM = 5000 };
+    probe_index idx = {0};
+    probe* pbs = calloc(NUM, sizeof(probe));
+    int i;
+
+    ASSERT_TRUE(pbs != NULL);
+
+    for (i = 0; i < NUM; i++)
+        index_add(&idx, i + 1, &pbs[i]);
+
+    ASSERT_EQ_INT(idx.count, NUM);
+    ASSERT_TRUE(idx.size >= 2 * NUM);
+
+    /* retire every third one, the rest must stay reachable */
+    for (i = 0; i < NUM; i += 3)
+        index_del(&idx, i + 1, &pbs[i]);
+
+    for (i = 0; i < NUM; i++) {
+        if (i % 3 == 0)
+            ASSERT_EQ_PTR(index_find(&idx, i + 1), NULL);
+        else
+            ASSERT_EQ_PTR(index_find(&idx, i + 1), &pbs[i]);
+    }
+
+    /* reuse the keys, as sequences wrap around */
+    for (i = 0; i < NUM; i += 3)
+        index_add(&idx, i + 1, &pbs[i]);
+    for (i = 0; i < NUM; i++)
+        ASSERT_EQ_PTR(index_find(&idx, i + 1), &pbs[i]);
+
+    index_free(&idx);
+    free(pbs);
+}
+
+void test_probe_index_delete_in_runs(void) {
+    enum { NUM = 30 };
+    probe_index idx = {0};
+    probe pbs[NUM];
+    int i;
+
+    /* 30 keys in 64 slots: some runs of colliding entries are certain */
+    for (i = 0; i < NUM; i++)
+        index_add(&idx, 1000 + i * 7, &pbs[i]);
+    ASSERT_EQ_INT(idx.size, 64);
+
+    /* delete from the middle of runs, in an order unlike insertion */
+    for (i = NUM - 2; i >= 0; i -= 2)
+        index_del(&idx, 1000 + i * 7, &pbs[i]);
+
+    for (i = 0; i < NUM; i++) {
+        if (i % 2)
+            ASSERT_EQ_PTR(index_find(&idx, 1000 + i * 7), &pbs[i]);
+        else
+            ASSERT_EQ_PTR(index_find(&idx, 1000 + i * 7), NULL);
+    }
+    ASSERT_EQ_INT(idx.count, NUM / 2);
+
+    index_free(&idx);
+}
+
+void register_test_probe_index(void) {
+    test_probe_index_basic();
+    test_probe_index_grow_and_churn();
+    test_probe_index_delete_in_runs();
+}
@@ -0,0 +1,63 @@
+#include "common/assert.h"
+#include "common/mocks.h"
+#include <arpa/inet.h>
+#include <string.h>
+
+static void make_addr(sockaddr_any* sa, const char* ip) {
+    memset(sa, 0, sizeof(*sa));
+    sa->sin.sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &sa->sin.sin_addr);
+}
+
+void test_ratelimit_layers_hold_back_probes(void) {
+    static const double global[2] = {10, 4}, dest[2] = {4, 2}, router[2] = {2, 1};
+    sockaddr_any r1, r2;
+    double t = 1000.0;
+
+    make_addr(&r1, "192.0.2.1");
+    make_addr(&r2, "192.0.2.2");
+
+    ratelimit_init(3, global, dest, router, t);
+
+    // Per destination: a burst of 2, then 4 per second
+    ASSERT_TRUE(ratelimit_send(0, NULL, t) == 0);
+    ASSERT_TRUE(ratelimit_send(0, NULL, t) == 0);
+    ASSERT_TRUE(ratelimit_send(0, NULL, t) == t + 0.25);
+
+    // Others go on, until the global burst of 4 is spent
+    ASSERT_TRUE(ratelimit_send(1, NULL, t) == 0);
+    ASSERT_TRUE(ratelimit_send(2, NULL, t) == 0);
+    ASSERT_TRUE(ratelimit_send(2, NULL, t) == t + 0.1);
+
+    // A refused probe takes no tokens from the other layers
+    t += 0.1;
+    ASSERT_TRUE(ratelimit_send(0, NULL, t) > t);
+    ASSERT_TRUE(ratelimit_send(1, NULL, t) == 0);
+
+    // The router budget is spent by its replies
+    t += 1.0;
+    ratelimit_reply(&r1, t);
+    ASSERT_TRUE(ratelimit_send(0, &r2, t) == 0);  // not heard of yet
+    ASSERT_TRUE(ratelimit_send(1, &r1, t) == t + 0.5);
+    ASSERT_TRUE(ratelimit_send(1, &r1, t + 0.5) == 0);
+
+    // ...even beyond it
+    ratelimit_reply(&r2, t);
+    ratelimit_reply(&r2, t);
+    ASSERT_TRUE(ratelimit_send(2, &r2, t) == t + 1.0);
+
+    // An unsent probe gives its tokens back
+    t += 10.0;
+    ASSERT_TRUE(ratelimit_send(0, NULL, t) == 0);
+    ASSERT_TRUE(ratelimit_send(0, NULL, t) == 0);
+    ASSERT_TRUE(ratelimit_send(0, NULL, t) == t + 0.25);
+    ratelimit_refund(0, t);
+    ASSERT_TRUE(ratelimit_send(0, NULL, t) == 0);
+    ASSERT_TRUE(ratelimit_send(1, NULL, t) == 0);
+    ASSERT_TRUE(ratelimit_send(2, NULL, t) == 0);
+    ASSERT_TRUE(ratelimit_send(1, NULL, t) == t + 0.1);
+}
+
+void register_test_ratelimit(void) {
+    test_ratelimit_layers_hold_back_probes();
+}
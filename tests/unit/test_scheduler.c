@@ -24,6 +24,21 @@ void test_rate_limit_burst_then_refill(void) {
     ASSERT_EQ_INT(token_bucket_consume(&tb, 1.0, 101.0), 1);
 }
 
+void test_rate_limit_delay_and_debt(void) {
+    TokenBucket tb;
+    token_bucket_init(&tb, 4.0, 1.0, 100.0);
+
+    ASSERT_TRUE(token_bucket_delay(&tb, 1.0, 100.0) == 0);
+    ASSERT_EQ_INT(token_bucket_consume(&tb, 1.0, 100.0), 1);
+    ASSERT_TRUE(token_bucket_delay(&tb, 1.0, 100.0) == 0.25);
+
+    // Charged beyond the tokens there are: two more tokens to wait for
+    token_bucket_charge(&tb, 2.0, 100.0);
+    ASSERT_TRUE(token_bucket_delay(&tb, 1.0, 100.0) == 0.75);
+    ASSERT_EQ_INT(token_bucket_consume(&tb, 1.0, 100.5), 0);
+    ASSERT_EQ_INT(token_bucket_consume(&tb, 1.0, 100.75), 1);
+}
+
 void test_schedule_ttl_step_sequence_correct(void) {
     ProbeScheduler s;
     scheduler_init(&s, 2, 2, 1, 0);  // 2 TTLs, 2 probes per TTL
@@ -81,10 +96,60 @@ void test_schedule_deadline_stops_new_probes(void) {
     ASSERT_EQ_INT(scheduler_next_probe(&s, &ttl, &probe_idx, 201.0), 0);
 }
 
+void test_window_grows_on_replies_and_halves_on_loss(void) {
+    ProbeScheduler s;
+    scheduler_init(&s, 30, 3, 4, 0);
+    scheduler_set_window_limits(&s, 1, 64);
+
+    ASSERT_EQ_INT(scheduler_window(&s), 4);
+
+    // Slow start: one more per reply
+    for (int i = 0; i < 4; i++)
+        scheduler_on_reply(&s);
+    ASSERT_EQ_INT(scheduler_window(&s), 8);
+
+    // The losses of one event cut it once
+    scheduler_on_loss(&s, 10.0, 11.0);
+    ASSERT_EQ_INT(scheduler_window(&s), 4);
+    scheduler_on_loss(&s, 10.5, 11.2);
+    ASSERT_EQ_INT(scheduler_window(&s), 4);
+
+    // Congestion avoidance: about one more per window of replies
+    for (int i = 0; i < 4; i++)
+        scheduler_on_reply(&s);
+    ASSERT_EQ_INT(scheduler_window(&s), 4);
+    for (int i = 0; i < 2; i++)
+        scheduler_on_reply(&s);
+    ASSERT_EQ_INT(scheduler_window(&s), 5);
+
+    // A later loss is a new event, and the window stays within its limits
+    for (int i = 0; i < 10; i++)
+        scheduler_on_loss(&s, 12.0 + i, 12.0 + i);
+    ASSERT_EQ_INT(scheduler_window(&s), 1);
+    for (int i = 0; i < 1000; i++)
+        scheduler_on_reply(&s);
+    ASSERT_TRUE(scheduler_window(&s) <= 64);
+}
+
+void test_window_fixed_by_equal_limits(void) {
+    ProbeScheduler s;
+    scheduler_init(&s, 30, 3, 1, 0);
+    scheduler_set_window_limits(&s, 1, 1);
+
+    scheduler_on_reply(&s);
+    scheduler_on_reply(&s);
+    ASSERT_EQ_INT(scheduler_window(&s), 1);
+    scheduler_on_loss(&s, 1.0, 2.0);
+    ASSERT_EQ_INT(scheduler_window(&s), 1);
+}
+
 void register_test_scheduler(void) {
     test_rate_limit_tokens_basic();
     test_rate_limit_burst_then_refill();
+    test_rate_limit_delay_and_debt();
     test_schedule_ttl_step_sequence_correct();
     test_schedule_parallel_probes_per_ttl_respected();
     test_schedule_deadline_stops_new_probes();
+    test_window_grows_on_replies_and_halves_on_loss();
+    test_window_fixed_by_equal_limits();
 }
@@ -0,0 +1,342 @@
+#define _GNU_SOURCE
+
+#include "common/assert.h"
+#include "common/mocks.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+/*  Each sendmmsg() call takes the next step of the script: a positive
+   one accepts that many messages at most, a negative one fails with
+   that errno, zero (or the end of the script) accepts all.
+*/
+static int send_script[8];
+static unsigned int send_step = 0;
+static int send_calls = 0;
+static unsigned int send_msgs = 0;
+static int sent_ttls[128];
+static unsigned short sent_ports[128];
+
+static void script_reset(const int* steps, unsigned int num) {
+    memset(send_script, 0, sizeof(send_script));
+    if (num)
+        memcpy(send_script, steps, num * sizeof(*steps));
+    send_step = 0;
+    send_calls = 0;
+    send_msgs = 0;
+}
+
+static int mock_socket(int domain, int type, int protocol) {
+    (void)domain;
+    (void)type;
+    (void)protocol;
+    return 42;
+}
+
+/*  For the sockets per probe of the non-default udp methods   */
+static unsigned short next_local_port = 0;
+
+static int mock_connect(int fd, const struct sockaddr* addr, socklen_t len) {
+    (void)fd;
+    (void)addr;
+    (void)len;
+    return 0;
+}
+
+static int mock_getsockname(int fd, struct sockaddr* addr, socklen_t* len) {
+    struct sockaddr_in* sin = (struct sockaddr_in*)addr;
+
+    (void)fd;
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(next_local_port++);
+    *len = sizeof(*sin);
+    return 0;
+}
+
+static ssize_t mock_send(int fd, const void* buf, size_t len, int flags) {
+    (void)fd;
+    (void)buf;
+    (void)flags;
+    return len;
+}
+
+static int mock_sendmmsg(int fd, struct mmsghdr* msgs, unsigned int vlen, int flags) {
+    int step = send_step < sizeof(send_script) / sizeof(*send_script) ? send_script[send_step++] : 0;
+    unsigned int i;
+
+    (void)fd;
+    (void)flags;
+    send_calls++;
+
+    if (step < 0) {
+        errno = -step;
+        return -1;
+    }
+    if (step && vlen > (unsigned int)step)
+        vlen = step;
+
+    for (i = 0; i < vlen; i++) {
+        struct msghdr* msg = &msgs[i].msg_hdr;
+        struct cmsghdr* cm = CMSG_FIRSTHDR(msg);
+
+        if (send_msgs < sizeof(sent_ttls) / sizeof(*sent_ttls)) {
+            memcpy(&sent_ttls[send_msgs], CMSG_DATA(cm), sizeof(int));
+            sent_ports[send_msgs] = ntohs(((const struct sockaddr_in*)msg->msg_name)->sin_port);
+        }
+        send_msgs++;
+        msgs[i].msg_len = msg->msg_iov[0].iov_len;
+    }
+
+    return vlen;
+}
+
+#define socket(domain, type, protocol) mock_socket(domain, type, protocol)
+#define sendmmsg(fd, msgs, vlen, flags) mock_sendmmsg(fd, msgs, vlen, flags)
+#define connect(fd, addr, len) mock_connect(fd, addr, len)
+#define getsockname(fd, addr, len) mock_getsockname(fd, addr, len)
+#define send(fd, buf, len, flags) mock_send(fd, buf, len, flags)
+
+#include "../../traceroute/send.c"
+#include "../../traceroute/mod-udp.c"
+
+#undef socket
+#undef sendmmsg
+#undef connect
+#undef getsockname
+#undef send
+
+#define NUM_ADDRS 100
+
+static sockaddr_any batch_addrs[NUM_ADDRS];
+static int batch_ttls[NUM_ADDRS];
+
+static void fill_addrs(void) {
+    unsigned int i;
+
+    for (i = 0; i < NUM_ADDRS; i++) {
+        memset(&batch_addrs[i], 0, sizeof(batch_addrs[i]));
+        batch_addrs[i].sin.sin_family = AF_INET;
+        batch_addrs[i].sin.sin_addr.s_addr = htonl(0xc0000201 + i); /*  192.0.2.1 on   */
+        batch_addrs[i].sin.sin_port = htons(33434 + i);
+        batch_ttls[i] = i % 30 + 1;
+    }
+}
+
+void test_send_batch_chunks(void) {
+    unsigned int i;
+
+    fill_addrs();
+    script_reset(NULL, 0);
+
+    ASSERT_EQ_INT(do_send_batch(1, "x", 1, batch_addrs, batch_ttls, NULL, NUM_ADDRS), NUM_ADDRS);
+    ASSERT_EQ_INT(send_calls, (NUM_ADDRS + SEND_BATCH - 1) / SEND_BATCH);
+    ASSERT_EQ_INT(send_msgs, NUM_ADDRS);
+
+    for (i = 0; i < NUM_ADDRS; i++) {
+        ASSERT_EQ_INT(sent_ttls[i], batch_ttls[i]);
+        ASSERT_EQ_INT(sent_ports[i], 33434 + i);
+    }
+}
+
+void test_send_batch_partial(void) {
+    static const int steps[] = {10, -ENOBUFS};
+
+    fill_addrs();
+    script_reset(steps, 2);
+
+    /*  the rest is left for later, not lost   */
+    ASSERT_EQ_INT(do_send_batch(1, "x", 1, batch_addrs, batch_ttls, NULL, 20), 10);
+    ASSERT_EQ_INT(send_calls, 2);
+    ASSERT_EQ_INT(send_msgs, 10);
+}
+
+void test_send_batch_retry(void) {
+    static const int once[] = {-ECONNREFUSED};
+    static const int twice[] = {-ECONNREFUSED, -EHOSTUNREACH};
+    static const int full[] = {-ENOBUFS};
+
+    fill_addrs();
+
+    /*  an error of some previous probe, reported instead of sending   */
+    script_reset(once, 1);
+    ASSERT_EQ_INT(do_send_batch(1, "x", 1, batch_addrs, batch_ttls, NULL, 5), 5);
+    ASSERT_EQ_INT(send_calls, 2);
+    ASSERT_EQ_INT(sent_ports[0], 33434);
+
+    /*  still failing: the first one is skipped, the error queue tells   */
+    script_reset(twice, 2);
+    ASSERT_EQ_INT(do_send_batch(1, "x", 1, batch_addrs, batch_ttls, NULL, 5), 5);
+    ASSERT_EQ_INT(send_calls, 3);
+    ASSERT_EQ_INT(send_msgs, 4);
+    ASSERT_EQ_INT(sent_ports[0], 33435);
+
+    /*  no retry when the queue is full   */
+    script_reset(full, 1);
+    ASSERT_EQ_INT(do_send_batch(1, "x", 1, batch_addrs, batch_ttls, NULL, 5), 0);
+    ASSERT_EQ_INT(send_calls, 1);
+}
+
+void test_send_batch_udp(void) {
+    static const int steps[] = {2, -ENOBUFS};
+    probe* table = calloc(100, sizeof(probe)); /*  as the mocks look up   */
+    probe* pbs[4];
+    int ttls[4] = {1, 2, 3, 4};
+    size_t len = 12;
+    sockaddr_any dest;
+    unsigned int i;
+
+    memset(&dest, 0, sizeof(dest));
+    dest.sin.sin_family = AF_INET;
+    dest.sin.sin_addr.s_addr = htonl(0xc0000201);
+
+    probes = table;
+    probe_trace(NULL)->addr = dest;
+    for (i = 0; i < 4; i++)
+        pbs[i] = &table[i];
+
+    ASSERT_OK(default_ops.init(&dest, 0, &len));
+
+    script_reset(steps, 2);
+    default_ops.send_batch(pbs, ttls, 4);
+
+    /*  each probe has its own port, the unsent ones no seq yet   */
+    ASSERT_EQ_INT(send_msgs, 2);
+    ASSERT_EQ_INT(sent_ports[0], DEF_START_PORT);
+    ASSERT_EQ_INT(sent_ports[1], DEF_START_PORT + 1);
+    ASSERT_EQ_INT(sent_ttls[0], 1);
+    ASSERT_EQ_INT(sent_ttls[1], 2);
+    ASSERT_EQ_INT(table[0].seq, htons(DEF_START_PORT));
+    ASSERT_EQ_INT(table[1].seq, htons(DEF_START_PORT + 1));
+    ASSERT_EQ_INT(table[2].seq, 0);
+    ASSERT_EQ_INT(table[3].seq, 0);
+
+    /*  sent again later, with fresh ports   */
+    script_reset(NULL, 0);
+    default_ops.send_batch(&pbs[2], &ttls[2], 2);
+
+    ASSERT_EQ_INT(send_msgs, 2);
+    ASSERT_EQ_INT(sent_ports[0], DEF_START_PORT + 4);
+    ASSERT_EQ_INT(sent_ttls[1], 4);
+    ASSERT_EQ_INT(table[3].seq, htons(DEF_START_PORT + 5));
+
+    /*  the ports of the probes still in flight are skipped   */
+    table[10].seq = htons(DEF_START_PORT + 7);
+    script_reset(NULL, 0);
+    default_ops.send_batch(pbs, ttls, 2);
+
+    ASSERT_EQ_INT(sent_ports[0], DEF_START_PORT + 6);
+    ASSERT_EQ_INT(sent_ports[1], DEF_START_PORT + 8);
+
+    free(table);
+    probes = NULL;
+}
+
+/*  A quote got by AF_XDP for the `-U' method, as recv_quote() passes it   */
+void test_udp_quote_by_source_port(void) {
+    probe* table = calloc(100, sizeof(probe)); /*  as the mocks look up   */
+    size_t len = 12;
+    sockaddr_any dest, quoted_dest;
+    struct udphdr quote;
+
+    memset(&dest, 0, sizeof(dest));
+    dest.sin.sin_family = AF_INET;
+    dest.sin.sin_addr.s_addr = htonl(0xc0000201);
+
+    probes = table;
+    probe_trace(NULL)->addr = dest;
+
+    curr_port = 0; /*  left by the default method tests   */
+    free(data);
+    ASSERT_OK(udp_ops.init(&dest, 0, &len));
+
+    next_local_port = 40000;
+    udp_ops.send_probe(&table[0], 1);
+    udp_ops.send_probe(&table[1], 2);
+    ASSERT_EQ_INT(table[0].seq, htons(40000));
+    ASSERT_EQ_INT(table[1].seq, htons(40001));
+
+    quoted_dest = dest;
+    quoted_dest.sin.sin_port = htons(DEF_UDP_PORT);
+    memset(&quote, 0, sizeof(quote));
+    quote.source = htons(40001);
+    quote.dest = htons(DEF_UDP_PORT);
+
+    ASSERT_EQ_PTR(udp_ops.check_reply(-1, 1, &quoted_dest, (char*)&quote, sizeof(quote)), &table[1]);
+    ASSERT_EQ_PTR(udp_ops.check_reply(-1, 1, &quoted_dest, (char*)&quote, 4), NULL);
+
+    /*  not ours: another source port, dest port or address   */
+    quote.source = htons(40002);
+    ASSERT_EQ_PTR(udp_ops.check_reply(-1, 1, &quoted_dest, (char*)&quote, sizeof(quote)), NULL);
+
+    quote.source = htons(40000);
+    quoted_dest.sin.sin_port = htons(DEF_UDP_PORT + 1);
+    ASSERT_EQ_PTR(udp_ops.check_reply(-1, 1, &quoted_dest, (char*)&quote, sizeof(quote)), NULL);
+
+    quoted_dest.sin.sin_port = htons(DEF_UDP_PORT);
+    quoted_dest.sin.sin_addr.s_addr = htonl(0xc0000202);
+    ASSERT_EQ_PTR(udp_ops.check_reply(-1, 1, &quoted_dest, (char*)&quote, sizeof(quote)), NULL);
+
+    quoted_dest.sin.sin_addr.s_addr = dest.sin.sin_addr.s_addr;
+    ASSERT_EQ_PTR(udp_ops.check_reply(-1, 1, &quoted_dest, (char*)&quote, sizeof(quote)), &table[0]);
+
+    free(table);
+    probes = NULL;
+}
+
+/*  A send timestamp from the error queue: no address, the packet looped   */
+void test_udp_send_timestamp(void) {
+    probe* table = calloc(100, sizeof(probe));
+    size_t len = 12;
+    sockaddr_any dest, none;
+    char pkt[14 + 20 + sizeof(struct udphdr) + 12]; /*  ethernet and ipv4 in front   */
+    struct udphdr udp;
+
+    memset(&dest, 0, sizeof(dest));
+    dest.sin.sin_family = AF_INET;
+    dest.sin.sin_addr.s_addr = htonl(0xc0000201);
+    memset(&none, 0, sizeof(none));
+
+    probes = table;
+    probe_trace(NULL)->addr = dest;
+
+    free(data);
+    ASSERT_OK(default_ops.init(&dest, 0, &len));
+    table[5].seq = htons(DEF_START_PORT + 5);
+
+    memset(pkt, 0, sizeof(pkt));
+    memset(&udp, 0, sizeof(udp));
+    udp.dest = htons(DEF_START_PORT + 5);
+    udp.len = htons(sizeof(udp) + len);
+    memcpy(pkt + 34, &udp, sizeof(udp));
+    memcpy(pkt + 34 + sizeof(udp), data, len);
+
+    ASSERT_EQ_PTR(default_ops.check_reply(1, 1, &none, pkt, sizeof(pkt)), &table[5]);
+    ASSERT_EQ_PTR(default_ops.check_reply(1, 1, &none, pkt, 16), NULL);
+
+    /*  not our data   */
+    pkt[sizeof(pkt) - 1] ^= 1;
+    ASSERT_EQ_PTR(default_ops.check_reply(1, 1, &none, pkt, sizeof(pkt)), NULL);
+    pkt[sizeof(pkt) - 1] ^= 1;
+
+    /*  the `-U' method tells by the socket of the probe   */
+    curr_port = 0;
+    free(data);
+    ASSERT_OK(udp_ops.init(&dest, 0, &len));
+    table[7].sk = 77;
+    ASSERT_EQ_PTR(udp_ops.check_reply(77, 1, &none, pkt, sizeof(pkt)), &table[7]);
+
+    free(table);
+    probes = NULL;
+}
+
+void register_test_send_batch(void) {
+    test_send_batch_chunks();
+    test_send_batch_partial();
+    test_send_batch_retry();
+    test_send_batch_udp();
+    test_udp_quote_by_source_port();
+    test_udp_send_timestamp();
+}
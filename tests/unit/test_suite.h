@@ -11,15 +11,27 @@ void register_test_match(void);
 void register_test_cmsg(void);
 void register_test_correlator(void);
 void register_test_flow(void);
+void register_test_mda(void);
 void register_test_rtt(void);
 void register_test_scheduler(void);
+void register_test_hop_stats(void);
+void register_test_hdr_hist(void);
+void register_test_ratelimit(void);
 void register_test_dns_cache(void);
+void register_test_annot_cache(void);
+void register_test_as_db(void);
 void register_test_json_writer(void);
 void register_test_render(void);
 void register_test_cli(void);
 void register_test_bpf(void);
+void register_test_xdp(void);
 void register_test_extension(void);
 void register_test_export(void);
 void register_test_property(void);
+void register_test_batch(void);
+void register_test_send_batch(void);
+void register_test_probe_index(void);
+void register_test_as_lookups(void);
+void register_test_csum(void);
 
 #endif /* TEST_UNIT_TEST_SUITE_H */
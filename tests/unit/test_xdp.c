@@ -0,0 +1,303 @@
+#include "common/assert.h"
+#include "common/fixtures.h"
+#include "common/mocks.h"
+#include "traceroute.h"
+#include "../../bpf/xdp_probe.h"
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+#include <netinet/ether.h>
+
+/*  Ethernet and the outer ip header in front of an icmp fixture   */
+static uint32_t make_frame(unsigned char* frame, int v6, const char* icmp_hex) {
+    struct ethhdr* eth = (struct ethhdr*)frame;
+    unsigned char* l3 = frame + sizeof(*eth);
+    size_t hlen = v6 ? sizeof(struct ip6_hdr) : sizeof(struct iphdr);
+    int n;
+
+    memset(frame, 0, 256);
+    n = hex_decode(icmp_hex, l3 + hlen, 256 - sizeof(*eth) - hlen);
+    ASSERT_TRUE(n > 0);
+
+    if (v6) {
+        struct ip6_hdr* ip6 = (struct ip6_hdr*)l3;
+
+        eth->h_proto = htons(ETH_P_IPV6);
+        ip6->ip6_vfc = 0x60;
+        ip6->ip6_plen = htons(n);
+        ip6->ip6_nxt = IPPROTO_ICMPV6;
+        inet_pton(AF_INET6, "2001:db8::1", &ip6->ip6_src);
+    }
+    else {
+        struct iphdr* ip = (struct iphdr*)l3;
+
+        eth->h_proto = htons(ETH_P_IP);
+        ip->version = 4;
+        ip->ihl = 5;
+        ip->tot_len = htons(sizeof(*ip) + n);
+        ip->protocol = IPPROTO_ICMP;
+        ip->saddr = inet_addr("192.0.2.1");
+    }
+
+    return sizeof(*eth) + hlen + n;
+}
+
+void test_xdp_decode_ipv4_udp_quote(void) {
+    unsigned char frame[256];
+    uint32_t len = make_frame(frame, 0, FIXTURE_IPV4_ICMP_TIME_EXCEEDED);
+
+    mock_quote_calls = 0;
+    ASSERT_OK(xdp_decode_frame(frame, len, 12.5));
+    ASSERT_EQ_INT(mock_quote_calls, 1);
+    ASSERT_EQ_INT(mock_quote_type, ICMP_TIME_EXCEEDED);
+    ASSERT_EQ_INT(mock_quote_from.sin.sin_addr.s_addr, inet_addr("192.0.2.1"));
+    ASSERT_EQ_INT(mock_quote_dest.sa.sa_family, AF_INET);
+    ASSERT_EQ_INT(mock_quote_dest.sin.sin_addr.s_addr, inet_addr("10.0.0.2"));
+    ASSERT_EQ_INT(ntohs(mock_quote_dest.sin.sin_port), 33434);
+    ASSERT_EQ_INT(mock_quote_len, 8); /*  the quoted udp header   */
+    ASSERT_TRUE(mock_quote_time == 12.5);
+}
+
+void test_xdp_decode_ipv4_tcp_quote(void) {
+    unsigned char frame[256];
+    uint32_t len = make_frame(frame, 0, FIXTURE_IPV4_ICMP_QUOTING_TCP);
+
+    mock_quote_calls = 0;
+    ASSERT_OK(xdp_decode_frame(frame, len, 1));
+    ASSERT_EQ_INT(mock_quote_calls, 1);
+    ASSERT_EQ_INT(ntohs(mock_quote_dest.sin.sin_port), 80);
+    ASSERT_EQ_INT(mock_quote_len, 20);
+}
+
+void test_xdp_decode_ipv6_udp_quote(void) {
+    unsigned char frame[256];
+    uint32_t len = make_frame(frame, 1, FIXTURE_IPV6_ICMPV6_TIME_EXCEEDED);
+    struct in6_addr addr;
+
+    mock_quote_calls = 0;
+    ASSERT_OK(xdp_decode_frame(frame, len, 1));
+    ASSERT_EQ_INT(mock_quote_calls, 1);
+    ASSERT_EQ_INT(mock_quote_type, ICMP6_TIME_EXCEEDED);
+    ASSERT_EQ_INT(mock_quote_from.sa.sa_family, AF_INET6);
+    inet_pton(AF_INET6, "::2", &addr);
+    ASSERT_TRUE(memcmp(&mock_quote_dest.sin6.sin6_addr, &addr, sizeof(addr)) == 0);
+    ASSERT_EQ_INT(ntohs(mock_quote_dest.sin6.sin6_port), 33434);
+}
+
+void test_xdp_decode_ignores_other_frames(void) {
+    unsigned char frame[256];
+    uint32_t len = make_frame(frame, 0, FIXTURE_IPV4_ICMP_TIME_EXCEEDED);
+
+    mock_quote_calls = 0;
+
+    frame[sizeof(struct ethhdr) + sizeof(struct iphdr)] = ICMP_ECHOREPLY;
+    ASSERT_OK(xdp_decode_frame(frame, len, 1));
+
+    ((struct ethhdr*)frame)->h_proto = htons(ETH_P_ARP);
+    ASSERT_OK(xdp_decode_frame(frame, len, 1));
+
+    ASSERT_ERR_CODE(xdp_decode_frame(frame, 10, 1), EINVAL);
+    ASSERT_EQ_INT(mock_quote_calls, 0);
+}
+
+/*  With the ip header 4 byte aligned, as NET_IP_ALIGN does   */
+static uint32_t tmpl_buf[(XDP_TX_HDR_MAX + 2 + 3) / 4];
+static uint32_t frame_buf[256 / 4];
+#define TMPL ((uint8_t*)tmpl_buf + 2)
+#define FRAME ((uint8_t*)frame_buf + 2)
+
+static const uint8_t src_mac[6] = {0x02, 0, 0, 0, 0, 1};
+static const uint8_t dst_mac[6] = {0x02, 0, 0, 0, 0, 2};
+
+/*  in_csum() over the pseudo header and the transport packet   */
+static uint16_t l4_csum(int v6, const uint8_t* l3, const uint8_t* l4, size_t len, int protocol) {
+    unsigned char buf[256];
+    size_t alen = v6 ? 16 : 4;
+    size_t off = 2 * alen;
+
+    memcpy(buf, l3 + (v6 ? 8 : 12), off);
+    buf[off++] = 0;
+    buf[off++] = protocol;
+    buf[off++] = len >> 8;
+    buf[off++] = len & 0xff;
+    memcpy(buf + off, l4, len);
+
+    return in_csum(buf, off + len);
+}
+
+void test_xdp_build_ipv4_udp_frame(void) {
+    uint8_t *tmpl = TMPL, *frame = FRAME;
+    sockaddr_any src = {{0}}, dest = {{0}}, local = {{0}};
+    const char payload[] = "SUPERMAN";
+    struct iphdr* ip = (struct iphdr*)(frame + sizeof(struct ethhdr));
+    struct udphdr* uh = (struct udphdr*)(ip + 1);
+    size_t len;
+
+    src.sin.sin_family = AF_INET;
+    src.sin.sin_addr.s_addr = inet_addr("192.0.2.10");
+    dest.sin.sin_family = AF_INET;
+    dest.sin.sin_addr.s_addr = inet_addr("198.51.100.1");
+    dest.sin.sin_port = htons(33434);
+    local.sin.sin_family = AF_INET;
+    local.sin.sin_port = htons(40000);
+
+    ASSERT_EQ_INT(xdp_build_template(tmpl, src_mac, dst_mac, &src, &dest), sizeof(struct ethhdr) + sizeof(*ip));
+
+    len = xdp_build_frame(frame, sizeof(frame_buf) - 2, tmpl, IPPROTO_UDP, 7, 0x10, &local, &dest, payload, 8);
+    ASSERT_EQ_INT(len, sizeof(struct ethhdr) + sizeof(*ip) + sizeof(*uh) + 8);
+
+    ASSERT_TRUE(memcmp(frame, dst_mac, 6) == 0);
+    ASSERT_TRUE(memcmp(frame + 6, src_mac, 6) == 0);
+    ASSERT_EQ_INT(ip->ttl, 7);
+    ASSERT_EQ_INT(ip->tos, 0x10);
+    ASSERT_EQ_INT(ip->protocol, IPPROTO_UDP);
+    ASSERT_EQ_INT(ntohs(ip->tot_len), sizeof(*ip) + sizeof(*uh) + 8);
+    ASSERT_EQ_INT(ip->saddr, inet_addr("192.0.2.10"));
+    ASSERT_EQ_INT(in_csum(ip, sizeof(*ip)), 0xffff); /*  sums to zero   */
+
+    ASSERT_EQ_INT(ntohs(uh->source), 40000);
+    ASSERT_EQ_INT(ntohs(uh->dest), 33434);
+    ASSERT_EQ_INT(ntohs(uh->len), sizeof(*uh) + 8);
+    ASSERT_TRUE(memcmp(uh + 1, payload, 8) == 0);
+    ASSERT_EQ_INT(l4_csum(0, (uint8_t*)ip, (uint8_t*)uh, sizeof(*uh) + 8, IPPROTO_UDP), 0xffff);
+
+    /*  a bound address wins over the route's one   */
+    local.sin.sin_addr.s_addr = inet_addr("192.0.2.20");
+    xdp_build_frame(frame, sizeof(frame_buf) - 2, tmpl, IPPROTO_UDP, 7, 0, &local, &dest, payload, 8);
+    ASSERT_EQ_INT(ip->saddr, inet_addr("192.0.2.20"));
+    ASSERT_EQ_INT(in_csum(ip, sizeof(*ip)), 0xffff);
+
+    ASSERT_EQ_INT(xdp_build_frame(frame, 40, tmpl, IPPROTO_UDP, 7, 0, &local, &dest, payload, 8), 0);
+}
+
+void test_xdp_build_ipv6_icmp_frame(void) {
+    uint8_t *tmpl = TMPL, *frame = FRAME;
+    sockaddr_any src = {{0}}, dest = {{0}}, local = {{0}};
+    struct ip6_hdr* ip6 = (struct ip6_hdr*)(frame + sizeof(struct ethhdr));
+    struct icmp6_hdr echo, *icmp6 = (struct icmp6_hdr*)(ip6 + 1);
+    size_t len;
+
+    src.sin6.sin6_family = AF_INET6;
+    inet_pton(AF_INET6, "2001:db8::10", &src.sin6.sin6_addr);
+    dest.sin6.sin6_family = AF_INET6;
+    inet_pton(AF_INET6, "2001:db8:1::1", &dest.sin6.sin6_addr);
+    dest.sin6.sin6_flowinfo = htonl((0x20 << 20) | 0x12345);
+    local.sin6.sin6_family = AF_INET6;
+
+    memset(&echo, 0, sizeof(echo));
+    echo.icmp6_type = ICMP6_ECHO_REQUEST;
+    echo.icmp6_id = htons(77);
+    echo.icmp6_seq = htons(3);
+
+    ASSERT_EQ_INT(xdp_build_template(tmpl, src_mac, dst_mac, &src, &dest), sizeof(struct ethhdr) + sizeof(*ip6));
+
+    len = xdp_build_frame(frame, sizeof(frame_buf) - 2, tmpl, IPPROTO_ICMPV6, 5, 0, &local, &dest, &echo, sizeof(echo));
+    ASSERT_EQ_INT(len, sizeof(struct ethhdr) + sizeof(*ip6) + sizeof(echo));
+
+    ASSERT_EQ_INT(ntohs(((struct ethhdr*)frame)->h_proto), ETH_P_IPV6);
+    ASSERT_EQ_INT(ntohl(ip6->ip6_flow), (6U << 28) | (0x20 << 20) | 0x12345);
+    ASSERT_EQ_INT(ntohs(ip6->ip6_plen), sizeof(echo));
+    ASSERT_EQ_INT(ip6->ip6_nxt, IPPROTO_ICMPV6);
+    ASSERT_EQ_INT(ip6->ip6_hlim, 5);
+    ASSERT_TRUE(memcmp(&ip6->ip6_src, &src.sin6.sin6_addr, 16) == 0);
+    ASSERT_TRUE(memcmp(&ip6->ip6_dst, &dest.sin6.sin6_addr, 16) == 0);
+    ASSERT_EQ_INT(ntohs(icmp6->icmp6_seq), 3);
+    ASSERT_EQ_INT(l4_csum(1, (uint8_t*)ip6, (uint8_t*)icmp6, sizeof(echo), IPPROTO_ICMPV6), 0xffff);
+}
+
+void test_xdp_send_needs_init(void) {
+    sockaddr_any dest = {{0}};
+
+    dest.sin.sin_family = AF_INET;
+    ASSERT_EQ_INT(xdp_send(0, "", 1, &dest, 1), -1);
+    ASSERT_EQ_INT(errno, EOPNOTSUPP);
+    ASSERT_TRUE(xdp_tx_flush() == 0);
+}
+
+void test_xdp_key_udp(void) {
+    struct xdp_probe_key key;
+    sockaddr_any local = {{0}}, dest = {{0}};
+
+    local.sin.sin_family = AF_INET;
+    local.sin.sin_port = htons(40000);
+    dest.sin.sin_family = AF_INET;
+    dest.sin.sin_addr.s_addr = inet_addr("198.51.100.1");
+    dest.sin.sin_port = htons(33435);
+
+    xdp_make_key(&key, IPPROTO_UDP, 1, &local, &dest, "", 0);
+    ASSERT_EQ_INT(key.family, AF_INET);
+    ASSERT_EQ_INT(key.protocol, IPPROTO_UDP);
+    ASSERT_EQ_INT(key.daddr[0], inet_addr("198.51.100.1"));
+    ASSERT_EQ_INT(key.daddr[1] | key.daddr[2] | key.daddr[3] | key.pad, 0);
+    ASSERT_EQ_INT(ntohs(key.sport), 40000);
+    ASSERT_EQ_INT(ntohs(key.dport), 33435);
+}
+
+void test_xdp_key_raw(void) {
+    struct xdp_probe_key key;
+    sockaddr_any local = {{0}}, dest = {{0}};
+    uint8_t tcp[20] = {0x9c, 0x40, 0x00, 0x50}; /*  40000 -> 80   */
+    struct icmp echo;
+
+    local.sin.sin_family = AF_INET;
+    local.sin.sin_port = htons(IPPROTO_TCP); /*  what raw sockets say   */
+    dest.sin.sin_family = AF_INET;
+    dest.sin.sin_addr.s_addr = inet_addr("198.51.100.1");
+
+    xdp_make_key(&key, IPPROTO_TCP, 0, &local, &dest, tcp, sizeof(tcp));
+    ASSERT_EQ_INT(ntohs(key.sport), 40000);
+    ASSERT_EQ_INT(ntohs(key.dport), 80);
+
+    memset(&echo, 0, sizeof(echo));
+    echo.icmp_type = ICMP_ECHO;
+    echo.icmp_id = htons(1234);
+    echo.icmp_seq = htons(7);
+
+    xdp_make_key(&key, IPPROTO_ICMP, 0, &local, &dest, &echo, 8);
+    ASSERT_EQ_INT(ntohs(key.sport), 1234);
+    ASSERT_EQ_INT(ntohs(key.dport), 7);
+
+    /*  too short to say   */
+    xdp_make_key(&key, IPPROTO_TCP, 0, &local, &dest, tcp, 2);
+    ASSERT_EQ_INT(key.sport | key.dport, 0);
+}
+
+void test_xdp_key_ping_ipv6(void) {
+    struct xdp_probe_key key;
+    sockaddr_any local = {{0}}, dest = {{0}};
+    struct icmp6_hdr echo;
+
+    local.sin6.sin6_family = AF_INET6;
+    local.sin6.sin6_port = htons(555); /*  the kernel's id   */
+    dest.sin6.sin6_family = AF_INET6;
+    inet_pton(AF_INET6, "2001:db8::1", &dest.sin6.sin6_addr);
+
+    memset(&echo, 0, sizeof(echo));
+    echo.icmp6_type = ICMP6_ECHO_REQUEST;
+    echo.icmp6_id = htons(1);
+    echo.icmp6_seq = htons(9);
+
+    xdp_make_key(&key, IPPROTO_ICMPV6, 1, &local, &dest, &echo, sizeof(echo));
+    ASSERT_EQ_INT(key.family, AF_INET6);
+    ASSERT_TRUE(memcmp(key.daddr, &dest.sin6.sin6_addr, 16) == 0);
+    ASSERT_EQ_INT(ntohs(key.sport), 555);
+    ASSERT_EQ_INT(ntohs(key.dport), 9);
+}
+
+void register_test_xdp(void) {
+    test_xdp_decode_ipv4_udp_quote();
+    test_xdp_decode_ipv4_tcp_quote();
+    test_xdp_decode_ipv6_udp_quote();
+    test_xdp_decode_ignores_other_frames();
+    test_xdp_build_ipv4_udp_frame();
+    test_xdp_build_ipv6_icmp_frame();
+    test_xdp_send_needs_init();
+    test_xdp_key_udp();
+    test_xdp_key_raw();
+    test_xdp_key_ping_ipv6();
+}
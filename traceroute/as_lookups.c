@@ -11,12 +11,31 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 
 #include "traceroute.h"
 
+/*  All the lookups go over one persistent connection to the whois
+   server (IRRd `!!' mode), pipelined: queries are written as soon as
+   the hop addresses are known, and the framed answers are matched to
+   them in order. Each answer gives the best (longest) route prefix
+   covering the address, the origins found are cached per prefix,
+   so that other addresses in the same prefix need no query at all.
+
+   The cache is hashed by the (masked) prefix, a lookup tries only the
+   prefix lengths seen so far, longest first. A query in progress has
+   an entry of the whole address too, marked pending till its answer.
+   The queries wait for their answers in a ring. The ones lost with
+   the connection (or never sent) are asked again by the next lookup.
+
+   The server is resolved once, by as_init() at startup.
+*/
+
 #define DEF_RADB_SERVER "whois.radb.net"
 #define DEF_RADB_SERVICE "nicname"
 #define MAX_BUF_SIZE 512
@@ -25,118 +44,493 @@
 #define ROUTE_PREFIX "route:"
 #define ROUTE6_PREFIX "route6:"
 #define ORIGIN_PREFIX "origin:"
-#define IFACE_NAME_LEN 64
+
+struct as_entry {
+    sockaddr_any net;
+    unsigned int bits;
+    int pending;  /*  queried, the path is not known yet   */
+    int failed;   /*  no answer by the connection, to be asked again   */
+    double until; /*  the answer is waited for till, when pending   */
+    char path[MAX_RA_BUF_SIZE];
+};
 
 static sockaddr_any ra_addr = {0};
-static char ra_buf[MAX_RA_BUF_SIZE] = {0};
+static int ra_sk = -1;
 
-const char* get_as_path(const char* query) {
-    int sk, n;
-    char buf[MAX_BUF_SIZE];
-    FILE* fp;
-    int prefix = 0, best_prefix = 0;
-    char *rb, *re = &ra_buf[MAX_RA_BUF_SIZE - 1];
-
-    if (!ra_addr.sa.sa_family) {
-        const char *server, *service;
-        struct addrinfo* res;
-        int ret;
-
-        server = getenv("RA_SERVER") ? getenv("RA_SERVER") : DEF_RADB_SERVER;
-        service = getenv("RA_SERVICE") ? getenv("RA_SERVICE") : DEF_RADB_SERVICE;
-
-        ret = getaddrinfo(server, service, NULL, &res);
-        if (ret) {
-            fprintf(stderr, "%s/%s: %s\n", server, service, gai_strerror(ret));
-            exit(2);
-        }
+static struct as_entry* entries = NULL; /*  the cache   */
+static unsigned int num_entries = 0;
+static unsigned int max_entries = 0;
 
-        memcpy(&ra_addr, res->ai_addr, res->ai_addrlen);
-        freeaddrinfo(res);
-    }
+static unsigned int* entry_hash = NULL; /*  index + 1 into entries, 0 when free   */
+static unsigned int entry_hash_size = 0; /*  a power of two   */
+static unsigned char bits_used[2][129];  /*  prefix lengths in the cache, per family   */
 
-    // Create socket
-    sk = socket(ra_addr.sa.sa_family, SOCK_STREAM, 0);
-    if (sk < 0) {
-        perror("socket");
-        return "!!";
-    }
+static unsigned int* queries = NULL; /*  pending entries waiting for answers, a ring   */
+static unsigned int first_query = 0;
+static unsigned int num_queries = 0;
+static unsigned int max_queries = 0;
 
-    // Connect to the remote server
-    if (connect(sk, &ra_addr.sa, sizeof(ra_addr)) < 0) {
-        perror("connect");
-        close(sk);
-        return "!!";
+static char* wbuf = NULL;
+static size_t wlen = 0;
+static size_t wmax = 0;
+static char* rbuf = NULL;
+static size_t rlen = 0;
+static size_t rmax = 0;
+
+static unsigned int addr_bits(const sockaddr_any* addr) {
+    return addr->sa.sa_family == AF_INET6 ? 128 : 32;
+}
+
+static const unsigned char* addr_bytes(const sockaddr_any* addr) {
+    if (addr->sa.sa_family == AF_INET6)
+        return (const unsigned char*)&addr->sin6.sin6_addr;
+    return (const unsigned char*)&addr->sin.sin_addr;
+}
+
+static int in_prefix(const sockaddr_any* addr, const sockaddr_any* net, unsigned int bits) {
+    const unsigned char *a, *n;
+    unsigned int full = bits / 8, rest = bits % 8;
+
+    if (addr->sa.sa_family != net->sa.sa_family)
+        return 0;
+
+    a = addr_bytes(addr);
+    n = addr_bytes(net);
+
+    if (memcmp(a, n, full))
+        return 0;
+
+    return !rest || !((a[full] ^ n[full]) & (0xff << (8 - rest)));
+}
+
+static unsigned int prefix_hash(const sockaddr_any* addr, unsigned int bits) {
+    const unsigned char* a = addr_bytes(addr);
+    unsigned int full = bits / 8, rest = bits % 8;
+    unsigned int h = 2166136261U; /*  FNV-1a   */
+    unsigned int i;
+
+    h = (h ^ addr->sa.sa_family) * 16777619U;
+    h = (h ^ bits) * 16777619U;
+
+    for (i = 0; i < full; i++)
+        h = (h ^ a[i]) * 16777619U;
+    if (rest)
+        h = (h ^ (a[full] & (0xff << (8 - rest)))) * 16777619U;
+
+    return h & (entry_hash_size - 1);
+}
+
+/*  Returns the slot of the entry of exactly that prefix, or the free one to take   */
+static unsigned int* find_slot(const sockaddr_any* addr, unsigned int bits) {
+    unsigned int mask = entry_hash_size - 1;
+    unsigned int i;
+
+    for (i = prefix_hash(addr, bits); entry_hash[i]; i = (i + 1) & mask) {
+        struct as_entry* e = &entries[entry_hash[i] - 1];
+
+        if (e->bits == bits && in_prefix(addr, &e->net, bits))
+            return &entry_hash[i];
     }
 
-    // Send query
-    n = snprintf(buf, sizeof(buf), "%s\r\n", query);
-    if (n < 0 || (size_t)n >= sizeof(buf)) {
-        fprintf(stderr, "Query buffer overflow\n");
-        close(sk);
-        return "!!";
+    return &entry_hash[i];
+}
+
+static struct as_entry* find_entry(const sockaddr_any* addr) {
+    const unsigned char* used = bits_used[addr->sa.sa_family == AF_INET6];
+    int bits;
+
+    if (!num_entries)
+        return NULL;
+
+    for (bits = addr_bits(addr); bits >= 0; bits--) {
+        unsigned int* slot;
+
+        if (!used[bits])
+            continue;
+
+        slot = find_slot(addr, bits);
+        if (*slot)
+            return &entries[*slot - 1];
     }
 
-    if (write(sk, buf, n) < n) {
-        perror("write");
-        close(sk);
-        return "!!";
+    return NULL;
+}
+
+static void hash_grow(void) {
+    unsigned int i;
+
+    entry_hash_size = entry_hash_size ? entry_hash_size * 2 : 128;
+    free(entry_hash);
+    entry_hash = calloc(entry_hash_size, sizeof(*entry_hash));
+    if (!entry_hash)
+        error("calloc");
+
+    for (i = 0; i < num_entries; i++)
+        *find_slot(&entries[i].net, entries[i].bits) = i + 1;
+}
+
+/*  The first one of a prefix stays, as the first found did before   */
+static struct as_entry* add_entry(const sockaddr_any* net, unsigned int bits, const char* path) {
+    struct as_entry* e;
+    unsigned int* slot;
+
+    if ((num_entries + 1) * 4 > entry_hash_size * 3)
+        hash_grow();
+
+    slot = find_slot(net, bits);
+    if (*slot)
+        return &entries[*slot - 1];
+
+    if (num_entries == max_entries) {
+        max_entries = max_entries ? max_entries * 2 : 64;
+        entries = realloc(entries, max_entries * sizeof(*entries));
+        if (!entries)
+            error("realloc");
     }
 
-    fp = fdopen(sk, "r");
-    if (!fp) {
-        perror("fdopen");
-        close(sk);
-        return "!!";
+    e = &entries[num_entries++];
+    memcpy(&e->net, net, sizeof(e->net));
+    e->bits = bits;
+    e->pending = 0;
+    e->failed = 0;
+    e->until = 0;
+    snprintf(e->path, sizeof(e->path), "%s", path);
+
+    *slot = num_entries;
+    bits_used[net->sa.sa_family == AF_INET6][bits] = 1;
+
+    return e;
+}
+
+/*  The answer (or the failure) for the oldest query in progress   */
+static void answer_done(const char* path) {
+    struct as_entry* e = &entries[queries[first_query]];
+
+    e->pending = 0;
+    snprintf(e->path, sizeof(e->path), "%s", path);
+
+    first_query = (first_query + 1) % max_queries;
+    num_queries--;
+}
+
+static void buf_append(char** buf, size_t* len, size_t* max, const void* data, size_t n) {
+    if (*len + n > *max) {
+        size_t m = *max ? *max : 4096;
+
+        while (m < *len + n)
+            m *= 2;
+        *buf = realloc(*buf, m);
+        if (!*buf)
+            error("realloc");
+        *max = m;
     }
 
-    // Initialize buffer and read data
+    memcpy(*buf + *len, data, n);
+    *len += n;
+}
+
+/*  Parse the route objects answered for `addr', and cache the best origins   */
+static void parse_answer(const sockaddr_any* addr, char* data, size_t len) {
+    char ra_buf[MAX_RA_BUF_SIZE];
+    char *rb = ra_buf, *re = &ra_buf[MAX_RA_BUF_SIZE - 1];
+    sockaddr_any net, best_net;
+    unsigned int prefix = 0, best_prefix = 0;
+    int have_best = 0;
+    char *line, *save;
+
     strcpy(ra_buf, "*");
-    rb = ra_buf;
-
-    while (fgets(buf, sizeof(buf), fp) != NULL) {
-        if (strncmp(buf, ROUTE_PREFIX, strlen(ROUTE_PREFIX)) == 0 ||
-            strncmp(buf, ROUTE6_PREFIX, strlen(ROUTE6_PREFIX)) == 0) {
-            char* p = strchr(buf, '/');
-            if (p) {
-                prefix = strtoul(++p, NULL, 10);
-            }
-            else {
-                prefix = 0;
+    memset(&net, 0, sizeof(net));
+    memset(&best_net, 0, sizeof(best_net));
+    data[len] = '\0'; /*  the frame's end, already consumed   */
+
+    for (line = strtok_r(data, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        if (strncmp(line, ROUTE_PREFIX, strlen(ROUTE_PREFIX)) == 0 ||
+            strncmp(line, ROUTE6_PREFIX, strlen(ROUTE6_PREFIX)) == 0) {
+            char* p = strchr(line, ':') + 1;
+            char* slash;
+
+            while (isspace((unsigned char)*p))
+                p++;
+
+            memset(&net, 0, sizeof(net));
+            prefix = 0;
+
+            slash = strchr(p, '/');
+            if (slash) {
+                *slash = '\0';
+                prefix = strtoul(slash + 1, NULL, 10);
+
+                if (inet_pton(AF_INET, p, &net.sin.sin_addr) > 0)
+                    net.sa.sa_family = AF_INET;
+                else if (inet_pton(AF_INET6, p, &net.sin6.sin6_addr) > 0)
+                    net.sa.sa_family = AF_INET6;
             }
         }
-        else if (strncmp(buf, ORIGIN_PREFIX, strlen(ORIGIN_PREFIX)) == 0) {
-            char* p = buf + strlen(ORIGIN_PREFIX);
-            while (isspace(*p))
+        else if (strncmp(line, ORIGIN_PREFIX, strlen(ORIGIN_PREFIX)) == 0) {
+            char* p = line + strlen(ORIGIN_PREFIX);
+            char* as;
+
+            while (isspace((unsigned char)*p))
                 p++;
 
-            char* as = p;
-            while (*p && !isspace(*p))
+            as = p;
+            while (*p && !isspace((unsigned char)*p))
                 p++;
             *p = '\0';
 
-            // If prefix is better or equal, store the result
-            if (prefix > best_prefix) {
+            /*  If prefix is better or equal, store the result   */
+            if (prefix > best_prefix || !have_best) {
                 best_prefix = prefix;
+                best_net = net;
+                have_best = 1;
                 rb = ra_buf;
                 while (rb < re && (*rb++ = *as++))
                     ;
+                *rb = '\0';
             }
             else if (prefix == best_prefix) {
-                // Handle multiple equal prefix origins
-                char* q = strstr(ra_buf, as);
-                if (!q || (*(q += strlen(as)) != '\0' && *q != '/')) {
+                /*  Handle multiple equal prefix origins   */
+                char* r = strstr(ra_buf, as);
+
+                if (!r || (*(r += strlen(as)) != '\0' && *r != '/')) {
                     if (rb > ra_buf)
                         rb[-1] = '/';
                     while (rb < re && (*rb++ = *as++))
                         ;
+                    *rb = '\0';
                 }
             }
         }
     }
 
-    fclose(fp);
-    close(sk);
+    /*  else no route, or something odd: just for this address   */
+    if (have_best && best_prefix < addr_bits(addr) && in_prefix(addr, &best_net, best_prefix))
+        add_entry(&best_net, best_prefix, ra_buf);
+
+    answer_done(ra_buf);
+}
+
+/*  Process the complete answers in rbuf, return the bytes used   */
+static size_t parse_frames(void) {
+    size_t pos = 0;
+
+    while (num_queries) {
+        char* start = rbuf + pos;
+        char* nl = memchr(start, '\n', rlen - pos);
+        sockaddr_any addr = entries[queries[first_query]].net; /*  entries can move   */
+
+        if (!nl)
+            break;
+
+        if (*start == 'A') {
+            /*  A<len>\n<len bytes of data>C\n   */
+            size_t len = strtoul(start + 1, NULL, 10);
+            char* data = nl + 1;
+            char* term;
+
+            if ((size_t)(rbuf + rlen - data) < len)
+                break;
+            term = memchr(data + len, '\n', rbuf + rlen - (data + len));
+            if (!term)
+                break;
+
+            parse_answer(&addr, data, len);
+            pos = term + 1 - rbuf;
+        }
+        else {
+            /*  C: nothing, D: not found, E: no data, F: error   */
+            answer_done(*start == 'F' ? "!!" : "*");
+            pos = nl + 1 - rbuf;
+        }
+    }
+
+    return pos;
+}
+
+static void as_close(void) {
+    /*  No answers anymore for the ones in progress   */
+    while (num_queries) {
+        entries[queries[first_query]].failed = 1;
+        answer_done("!!");
+    }
+
+    if (ra_sk >= 0) {
+        del_poll(ra_sk);
+        close(ra_sk);
+    }
+    ra_sk = -1;
+    wlen = 0;
+    rlen = 0;
+}
+
+static void as_poll(int fd, int revents, void* data) {
+    (void)data;
+
+    if (revents & POLLOUT) {
+        while (wlen) {
+            ssize_t n = send(fd, wbuf, wlen, MSG_NOSIGNAL);
+
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                perror("whois send");
+                as_close();
+                return;
+            }
+            memmove(wbuf, wbuf + n, wlen - n);
+            wlen -= n;
+        }
+
+        if (!wlen)
+            add_poll_handler(fd, POLLIN, as_poll, NULL);
+    }
+
+    if (revents & (POLLIN | POLLERR | POLLHUP)) {
+        int eof = 0;
+
+        for (;;) {
+            char buf[MAX_BUF_SIZE * 8];
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n <= 0) {
+                if (n < 0)
+                    perror("whois recv");
+                eof = 1;
+                break;
+            }
+
+            buf_append(&rbuf, &rlen, &rmax, buf, n);
+        }
+
+        if (rlen) {
+            size_t used = parse_frames();
+
+            memmove(rbuf, rbuf + used, rlen - used);
+            rlen -= used;
+        }
+
+        if (eof)
+            as_close();
+    }
+}
+
+/*  Resolve the whois server, once and before any probe is sent,
+   as getaddrinfo() blocks. Returns -1 (with a warning) on failure.
+*/
+int as_init(void) {
+    const char *server, *service;
+    struct addrinfo* res;
+    int ret;
+
+    server = getenv("RA_SERVER") ? getenv("RA_SERVER") : DEF_RADB_SERVER;
+    service = getenv("RA_SERVICE") ? getenv("RA_SERVICE") : DEF_RADB_SERVICE;
+
+    ret = getaddrinfo(server, service, NULL, &res);
+    if (ret) {
+        fprintf(stderr, "%s/%s: %s, no AS path lookups\n", server, service, gai_strerror(ret));
+        return -1;
+    }
+
+    memcpy(&ra_addr, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+
+    return 0;
+}
+
+static int as_connect(void) {
+    static const char persistent[] = "!!\n";
+
+    if (!ra_addr.sa.sa_family)
+        return -1; /*  as_init() failed or not called   */
+
+    ra_sk = socket(ra_addr.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ra_sk < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if (connect(ra_sk, &ra_addr.sa, sizeof(ra_addr)) < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        close(ra_sk);
+        ra_sk = -1;
+        return -1;
+    }
+
+    /*  keep the connection open between the queries   */
+    buf_append(&wbuf, &wlen, &wmax, persistent, sizeof(persistent) - 1);
+    add_poll_handler(ra_sk, POLLIN | POLLOUT, as_poll, NULL);
+
+    return 0;
+}
+
+/*  Start an AS path lookup of `addr' (unless it is known or in progress),
+   the answer will be waited for no longer than till `until'.
+*/
+void as_query(const sockaddr_any* addr, double until) {
+    char buf[MAX_BUF_SIZE];
+    char str[INET6_ADDRSTRLEN];
+    struct as_entry* e;
+    int n;
+
+    e = find_entry(addr);
+    if (e && !e->failed)
+        return; /*  known, or in progress   */
+
+    if (ra_sk < 0 && as_connect() < 0) {
+        e = add_entry(addr, addr_bits(addr), "!!");
+        e->failed = 1;
+        return;
+    }
+
+    inet_ntop(addr->sa.sa_family, addr_bytes(addr), str, sizeof(str));
+
+    /*  all the less specific routes, the exact one included   */
+    n = snprintf(buf, sizeof(buf), "!r%s/%u,L\n", str, addr_bits(addr));
+    buf_append(&wbuf, &wlen, &wmax, buf, n);
+    add_poll_handler(ra_sk, POLLIN | POLLOUT, as_poll, NULL);
+
+    if (num_queries == max_queries) {
+        unsigned int old_max = max_queries;
+
+        max_queries = max_queries ? max_queries * 2 : 64;
+        queries = realloc(queries, max_queries * sizeof(*queries));
+        if (!queries)
+            error("realloc");
+
+        /*  unwrap the ring into the new space   */
+        if (first_query + num_queries > old_max) {
+            unsigned int wrapped = first_query + num_queries - old_max;
+
+            memcpy(queries + old_max, queries, wrapped * sizeof(*queries));
+        }
+    }
+
+    e = add_entry(addr, addr_bits(addr), ""); /*  or the failed one   */
+    e->pending = 1;
+    e->failed = 0;
+    e->until = until;
+
+    queries[(first_query + num_queries++) % max_queries] = e - entries;
+}
+
+/*  Returns the AS path of `addr' ("*" when none), or NULL when it is not
+   known (yet). In the latter case `*until_p' is set to the time the
+   answer is still expected till, or 0 when it is not expected at all.
+*/
+const char* as_path(const sockaddr_any* addr, double* until_p) {
+    struct as_entry* e = find_entry(addr);
+
+    *until_p = 0;
+
+    if (!e)
+        return NULL;
+
+    if (e->pending) {
+        *until_p = e->until;
+        return NULL;
+    }
 
-    return ra_buf;
+    return e->path;
 }
@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "traceroute.h"
+
+/*  Parse one line of a batch targets file:
+
+        host [first_ttl [max_ttl]]   # comment
+
+    Returns 1 when a target is found, 0 for empty and comment lines,
+    and -1 on a malformed line. Zero ttl values mean "use the default".
+    The line is modified in place, `*host_p' points into it.
+*/
+
+static char* next_token(char** pp) {
+    char *p = *pp, *tok;
+
+    while (isspace((unsigned char)*p))
+        p++;
+    if (!*p)
+        return NULL;
+
+    tok = p;
+    while (*p && !isspace((unsigned char)*p))
+        p++;
+    if (*p)
+        *p++ = '\0';
+
+    *pp = p;
+    return tok;
+}
+
+static int parse_ttl(const char* str, unsigned int* value) {
+    char* q;
+    unsigned long v = strtoul(str, &q, 10);
+
+    if (q == str || *q || !v || v > 255)
+        return -1;
+
+    *value = v;
+    return 0;
+}
+
+int parse_target_line(char* line, char** host_p, unsigned int* first_hop_p, unsigned int* max_hops_p) {
+    char *p, *tok;
+
+    p = strchr(line, '#');
+    if (p)
+        *p = '\0';
+
+    p = line;
+    *first_hop_p = 0;
+    *max_hops_p = 0;
+
+    tok = next_token(&p);
+    if (!tok)
+        return 0;
+    *host_p = tok;
+
+    tok = next_token(&p);
+    if (tok && parse_ttl(tok, first_hop_p) < 0)
+        return -1;
+
+    tok = next_token(&p);
+    if (tok && parse_ttl(tok, max_hops_p) < 0)
+        return -1;
+
+    if (next_token(&p))
+        return -1; /*  garbage at the end   */
+
+    if (*first_hop_p && *max_hops_p && *first_hop_p > *max_hops_p)
+        return -1;
+
+    return 1;
+}
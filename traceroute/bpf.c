@@ -5,43 +5,80 @@
 #include <unistd.h>
 #include <sys/resource.h>
 #include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
 #include <bpf/libbpf.h>
 #include <bpf/bpf.h>
 
 #include "traceroute.h"
+#include "../bpf/probe_event.h"
 
 static struct bpf_object* obj = NULL;
 static struct ring_buffer* ringbuf = NULL;
 static int ringbuf_fd = -1;
 
-/*
- * Note: struct probe_event is shared between BPF and userspace.
- * We keep it here but could move it to a shared header if more files needed it.
- */
-struct probe_event {
-    uint32_t saddr[4];
-    uint32_t daddr[4];
-    uint16_t sport;
-    uint16_t dport;
-    uint8_t protocol;
-    uint8_t ttl;
-    uint64_t send_time_ns;
-    uint64_t recv_time_ns;
-    uint8_t icmp_type;
-    uint8_t icmp_code;
-    uint32_t ifindex;
-    uint8_t is_reply; /* 1 for reply, 0 for sent probe */
-};
+/*  Realtime minus monotonic, as the bpf side stamps by the latter   */
+static double clock_offset = 0;
+
+static int echo_ident = -1; /*  of our icmp echo probes, when known   */
+
+/*  The kprobes see the whole host, pings and other traceroutes too   */
+void bpf_set_echo_ident(unsigned int ident) {
+    echo_ident = ident;
+}
+
+static int event_to(const struct probe_event* ev, const sockaddr_any* addr) {
+    if (ev->family != addr->sa.sa_family)
+        return 0;
+    if (ev->family == AF_INET6)
+        return !memcmp(ev->daddr, &addr->sin6.sin6_addr, sizeof(addr->sin6.sin6_addr));
+
+    return ev->daddr[0] == addr->sin.sin_addr.s_addr;
+}
+
+/*  The probe the event is for, by what each module keeps as `seq',
+   and by where it was sent to.
+*/
+static probe* event_probe(const struct probe_event* ev) {
+    probe* pb = NULL;
+
+    switch (ev->protocol) {
+        case IPPROTO_UDP:
+            pb = probe_by_seq(htons(ev->dport));
+            /*  a socket per probe means the same port for all   */
+            if (pb && pb->sk)
+                return NULL;
+            break;
+
+        case IPPROTO_TCP:
+            pb = probe_by_seq(htons(ev->sport));
+            break;
+
+        case IPPROTO_ICMP:
+        case IPPROTO_ICMPV6:
+            if (echo_ident >= 0 && ev->sport != echo_ident)
+                return NULL;
+            pb = probe_by_seq(ev->dport);
+            break;
+    }
+
+    if (pb && !event_to(ev, &probe_trace(pb)->addr))
+        return NULL;
+
+    return pb;
+}
 
 int bpf_decode_event(void* data, size_t data_sz) {
     if (data_sz < sizeof(struct probe_event))
         return -EINVAL;
 
     struct probe_event* ev = data;
+    sockaddr_any from = {{0}};
     probe* pb;
 
-    /* Find probe by dport (seq) */
-    pb = probe_by_seq(ev->dport);
+    pb = event_probe(ev);
     if (!pb)
         return 0;
 
@@ -50,23 +87,32 @@ int bpf_decode_event(void* data, size_t data_sz) {
 
     if (!ev->is_reply) {
         /* Probe sent event */
-        pb->send_time = ev->send_time_ns / 1e9;
+        pb->send_time = ev->send_time_ns / 1e9 + clock_offset;
         return 0;
     }
 
     /* Hop reply event */
-    pb->send_time = ev->send_time_ns / 1e9;
-    pb->recv_time = ev->recv_time_ns / 1e9;
+    pb->send_time = ev->send_time_ns / 1e9 + clock_offset;
+    pb->recv_time = ev->recv_time_ns / 1e9 + clock_offset;
     pb->recv_ttl = 0;
 
-    if (ev->protocol == 17) {  // UDP
-        sockaddr_any from = {{0}};
-        from.sin.sin_family = AF_INET;  // Assuming IPv4 for now
+    if (ev->family == AF_INET6) {
+        from.sin6.sin6_family = AF_INET6;
+        memcpy(&from.sin6.sin6_addr, ev->saddr, sizeof(from.sin6.sin6_addr));
+    }
+    else {
+        from.sin.sin_family = AF_INET;
         from.sin.sin_addr.s_addr = ev->saddr[0];
-        memcpy(&pb->res, &from, sizeof(pb->res));
     }
+    memcpy(&pb->res, &from, sizeof(pb->res));
 
-    parse_icmp_res(pb, ev->icmp_type, ev->icmp_code, 0);
+    /*  the destination answering an echo request, or a tcp SYN   */
+    if ((ev->protocol == IPPROTO_ICMP && ev->icmp_type == ICMP_ECHOREPLY) ||
+        (ev->protocol == IPPROTO_ICMPV6 && ev->icmp_type == ICMP6_ECHO_REPLY) ||
+        (ev->protocol == IPPROTO_TCP && !ev->icmp_type))
+        pb->final = 1;
+    else
+        parse_icmp_res(pb, ev->icmp_type, ev->icmp_code, 0);
     probe_done(pb);
 
     return 0;
@@ -76,9 +122,14 @@ static int handle_event(void* ctx, void* data, size_t data_sz) {
     return bpf_decode_event(data, data_sz);
 }
 
+static void bpf_poll(int fd, int revents, void* data) {
+    ring_buffer__consume(data);
+}
+
 int bpf_init(const char* obj_path) {
     struct bpf_program* prog;
     struct bpf_map* events_map;
+    struct timespec real, mono;
 
     if (!debug) {
         libbpf_set_print(NULL);
@@ -120,53 +171,124 @@ int bpf_init(const char* obj_path) {
         return -1;
     }
 
-    add_poll(ringbuf_fd, POLLIN);
+    add_poll_handler(ringbuf_fd, POLLIN, bpf_poll, ringbuf);
+
+    if (clock_gettime(CLOCK_REALTIME, &real) == 0 && clock_gettime(CLOCK_MONOTONIC, &mono) == 0)
+        clock_offset = (real.tv_sec - mono.tv_sec) + (real.tv_nsec - mono.tv_nsec) / 1e9;
 
     return 0;
 }
 
-void bpf_poll(int fd, int revents) {
-    if (fd == ringbuf_fd) {
-        ring_buffer__poll(ringbuf, 0);
+/*  All the hop histograms, the per-cpu slices summed up:
+   BPF_HIST_HOPS * BPF_HIST_BUCKETS counts, indexed by ttl. NULL if none.
+*/
+static uint64_t* read_histograms(void) {
+    LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    uint32_t keys[BPF_HIST_HOPS];
+    struct probe_hist* values;
+    uint32_t count = BPF_HIST_HOPS;
+    uint32_t out_batch;
+    uint64_t* sums;
+    uint32_t i;
+    int fd, ncpus, err, cpu, b;
+
+    if (!obj)
+        return NULL;
+
+    fd = bpf_object__find_map_fd_by_name(obj, "hop_histograms");
+    ncpus = libbpf_num_possible_cpus();
+    if (fd < 0 || ncpus <= 0)
+        return NULL;
+
+    /*  a per-cpu value is all the cpus' slices in a row   */
+    values = calloc((size_t)BPF_HIST_HOPS * ncpus, sizeof(*values));
+    sums = calloc((size_t)BPF_HIST_HOPS * BPF_HIST_BUCKETS, sizeof(*sums));
+    if (!values || !sums) {
+        free(values);
+        free(sums);
+        return NULL;
+    }
+
+    /*  One syscall for the whole map. ENOENT just says it is all read.
+       Kernels before 5.6 have no batch ops: one lookup per hop then.
+    */
+    err = bpf_map_lookup_batch(fd, NULL, &out_batch, keys, values, &count, &opts);
+    if (err < 0 && errno != ENOENT) {
+        for (i = 0; i < BPF_HIST_HOPS; i++) {
+            keys[i] = i;
+            if (bpf_map_lookup_elem(fd, &keys[i], values + (size_t)i * ncpus) < 0)
+                memset(values + (size_t)i * ncpus, 0, ncpus * sizeof(*values));
+        }
+        count = BPF_HIST_HOPS;
     }
+
+    for (i = 0; i < count && i < BPF_HIST_HOPS; i++) {
+        uint64_t* hop = sums + (size_t)(keys[i] % BPF_HIST_HOPS) * BPF_HIST_BUCKETS;
+
+        for (cpu = 0; cpu < ncpus; cpu++) {
+            const struct probe_hist* hist = &values[(size_t)i * ncpus + cpu];
+
+            for (b = 0; b < BPF_HIST_BUCKETS; b++)
+                hop[b] += hist->counts[b];
+        }
+    }
+
+    free(values);
+
+    return sums;
+}
+
+static int hist_empty(const uint64_t* counts) {
+    int b;
+
+    for (b = 0; b < BPF_HIST_BUCKETS; b++)
+        if (counts[b])
+            return 0;
+
+    return 1;
 }
 
 void bpf_print_histograms(void) {
+    uint64_t* sums = read_histograms();
     uint32_t hop;
-    struct histogram {
-        uint64_t buckets[64];
-    } hist;
-    struct bpf_map* hist_map;
-    int fd;
+    int b;
 
-    if (!obj)
+    if (!sums)
         return;
 
-    hist_map = bpf_object__find_map_by_name(obj, "hop_histograms");
-    if (!hist_map)
-        return;
+    printf("\nBPF Per-hop RTT Histograms (us):\n");
+    for (hop = 1; hop < BPF_HIST_HOPS; hop++) {
+        const uint64_t* counts = sums + (size_t)hop * BPF_HIST_BUCKETS;
 
-    fd = bpf_map__fd(hist_map);
-
-    printf("\nBPF Per-hop RTT Histograms (ms):\n");
-    for (hop = 1; hop < 256; hop++) {
-        if (bpf_map_lookup_elem(fd, &hop, &hist) == 0) {
-            int found = 0;
-            for (int i = 0; i < 64; i++) {
-                if (hist.buckets[i] > 0)
-                    found = 1;
-            }
-            if (found) {
-                printf("  Hop %u: ", hop);
-                for (int i = 0; i < 64; i++) {
-                    if (hist.buckets[i] > 0) {
-                        printf("%llu:%llu ", (unsigned long long)(1ULL << i), (unsigned long long)hist.buckets[i]);
-                    }
-                }
-                printf("\n");
-            }
+        if (hist_empty(counts))
+            continue;
+
+        printf("  Hop %u: ", hop);
+        for (b = 0; b < BPF_HIST_BUCKETS; b++) {
+            if (counts[b])
+                printf("%llu:%llu ", (unsigned long long)bpf_hist_lowest(b), (unsigned long long)counts[b]);
         }
+        printf("\n");
+    }
+
+    free(sums);
+}
+
+void bpf_export_histograms(void) {
+    uint64_t* sums = read_histograms();
+    uint32_t hop;
+
+    if (!sums)
+        return;
+
+    for (hop = 1; hop < BPF_HIST_HOPS; hop++) {
+        const uint64_t* counts = sums + (size_t)hop * BPF_HIST_BUCKETS;
+
+        if (!hist_empty(counts))
+            tr_export_jsonl_bpf_histogram(hop, counts);
     }
+
+    free(sums);
 }
 
 void bpf_cleanup(void) {
@@ -34,3 +34,26 @@ uint16_t in_csum(const void* ptr, size_t len) {
     res = ~sum;
     return res ? res : ~0;  // Return 0xFFFF if checksum is 0 (special case)
 }
+
+// Incremental update (RFC 1624, eqn. 3) of a checksum for one 16-bit
+// word changed `from` one value `to` another, all as they are in the packet:
+//   HC' = ~(~HC + ~m + m')
+// So a probe built once needs no sum over its whole length again.
+uint16_t csum_replace2(uint16_t check, uint16_t from, uint16_t to) {
+    uint32_t sum = (uint16_t)~check + (uint16_t)~from + to;
+    uint16_t res;
+
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum += (sum >> 16);
+
+    // The same as in_csum() for the zero result
+    res = ~sum;
+    return res ? res : ~0;
+}
+
+// The same for a 32-bit field, as two words
+uint16_t csum_replace4(uint16_t check, uint32_t from, uint32_t to) {
+    check = csum_replace2(check, from >> 16, to >> 16);
+
+    return csum_replace2(check, from & 0xFFFF, to & 0xFFFF);
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "traceroute.h"
+#include "../bpf/probe_event.h"
 
 static void json_escape(const char* s) {
     if (!s) {
@@ -55,11 +56,10 @@ void tr_export_jsonl_header(const char* dst_name,
     fflush(stdout);
 }
 
-extern probe* probes;
 extern unsigned int probes_per_hop;
 
 void tr_export_jsonl_probe(probe* pb) {
-    unsigned int idx = (pb - probes);
+    unsigned int idx = (pb - probe_trace(pb)->probes);
     unsigned int ttl = idx / probes_per_hop + 1;
     unsigned int probe_idx = idx % probes_per_hop + 1;
 
@@ -103,7 +103,127 @@ void tr_export_jsonl_probe(probe* pb) {
     fflush(stdout);
 }
 
-void tr_export_jsonl_end(void) {
+/*  The RTT histogram of each hop answered, its non-empty buckets as
+   [lowest value, count] pairs: recording each lowest value `count' times
+   into a histogram of the same digits and max_value restores it,
+   and so merges several runs.
+*/
+static void export_histograms(const trace* tr) {
+    unsigned int ttl;
+    uint32_t i;
+
+    for (ttl = 1; ttl <= tr->max_hops; ttl++) {
+        const HdrHist* h = &tr->hists[ttl - 1];
+        const char* sep = "";
+
+        if (!h->total)
+            continue;
+
+        printf("{\"type\":\"histogram\", \"dst_addr\":");
+        json_escape(addr2str(&tr->addr));
+        printf(", \"ttl\":%u, \"unit\":\"us\", \"digits\":%d, \"max_value\":%llu", ttl, h->digits,
+               (unsigned long long)h->max_value);
+        printf(", \"count\":%llu, \"min\":%llu, \"max\":%llu", (unsigned long long)h->total,
+               (unsigned long long)h->min, (unsigned long long)h->max);
+        printf(", \"p50\":%llu, \"p90\":%llu, \"p99\":%llu", (unsigned long long)hdr_percentile(h, 50),
+               (unsigned long long)hdr_percentile(h, 90), (unsigned long long)hdr_percentile(h, 99));
+
+        printf(", \"buckets\":[");
+        for (i = 0; i < h->counts_len; i++) {
+            if (h->counts[i]) {
+                printf("%s[%llu,%llu]", sep, (unsigned long long)hdr_lowest(h, i), (unsigned long long)h->counts[i]);
+                sep = ",";
+            }
+        }
+        printf("]}\n");
+    }
+}
+
+void tr_export_jsonl_end(const trace* tr) {
+    if (tr->hists)
+        export_histograms(tr);
+
     printf("{\"type\":\"end\"}\n");
     fflush(stdout);
 }
+
+/*  The rolling stats of one hop in continuous mode, RTTs in ms   */
+void tr_export_jsonl_stats(const trace* tr, unsigned int round, unsigned int ttl) {
+    const HopStats* hs = &tr->stats[ttl - 1];
+    const sockaddr_any* res = &tr->hop_res[ttl - 1];
+    int i;
+
+    printf("{\"type\":\"stats\", \"round\":%u, \"dst_addr\":", round);
+    json_escape(addr2str(&tr->addr));
+    printf(", \"ttl\":%u", ttl);
+
+    if (res->sa.sa_family) {
+        printf(", \"addr\":");
+        json_escape(addr2str(res));
+    }
+
+    printf(", \"sent\":%llu, \"received\":%llu, \"loss\":%.4f", (unsigned long long)hs->sent,
+           (unsigned long long)hs->received, hop_stats_loss(hs));
+
+    if (hs->received) {
+        printf(", \"last_ms\":%.3f, \"mean_ms\":%.3f, \"ewma_ms\":%.3f, \"jitter_ms\":%.3f", hs->last * 1000,
+               hop_stats_mean(hs) * 1000, hs->ewma * 1000, hs->jitter * 1000);
+        printf(", \"min_ms\":%.3f, \"max_ms\":%.3f", hs->min * 1000, hs->max * 1000);
+
+        for (i = 0; i < HOP_STATS_QUANTILES; i++)
+            printf(", \"p%g_ms\":%.3f", hop_stats_quantile_p[i] * 100, hop_stats_quantile(hs, i) * 1000);
+    }
+
+    printf("}\n");
+    fflush(stdout);
+}
+
+/*  The value below which `percentile' percent of the counts are,
+   as the highest value of its bucket.
+*/
+static uint64_t bpf_hist_percentile(const uint64_t* counts, uint64_t total, double percentile) {
+    uint64_t wanted = (uint64_t)(percentile / 100 * total + 0.5);
+    uint64_t seen = 0;
+    int b;
+
+    if (wanted < 1)
+        wanted = 1;
+
+    for (b = 0; b < BPF_HIST_BUCKETS - 1; b++) {
+        seen += counts[b];
+        if (seen >= wanted)
+            return bpf_hist_lowest(b + 1) - 1;
+    }
+
+    return bpf_hist_lowest(BPF_HIST_BUCKETS - 1);
+}
+
+/*  The in-kernel RTT histogram of one hop, over the whole run and all
+   the destinations, its non-empty buckets as [lowest value, count] pairs.
+*/
+void tr_export_jsonl_bpf_histogram(unsigned int ttl, const uint64_t* counts) {
+    uint64_t total = 0;
+    const char* sep = "";
+    int b;
+
+    for (b = 0; b < BPF_HIST_BUCKETS; b++)
+        total += counts[b];
+
+    printf("{\"type\":\"bpf_histogram\", \"ttl\":%u, \"unit\":\"us\", \"sub_buckets\":%d", ttl, BPF_HIST_SUB);
+    printf(", \"count\":%llu", (unsigned long long)total);
+    if (total)
+        printf(", \"p50\":%llu, \"p90\":%llu, \"p99\":%llu",
+               (unsigned long long)bpf_hist_percentile(counts, total, 50),
+               (unsigned long long)bpf_hist_percentile(counts, total, 90),
+               (unsigned long long)bpf_hist_percentile(counts, total, 99));
+
+    printf(", \"buckets\":[");
+    for (b = 0; b < BPF_HIST_BUCKETS; b++) {
+        if (counts[b]) {
+            printf("%s[%llu,%llu]", sep, (unsigned long long)bpf_hist_lowest(b), (unsigned long long)counts[b]);
+            sep = ",";
+        }
+    }
+    printf("]}\n");
+    fflush(stdout);
+}
@@ -0,0 +1,66 @@
+#include <stdlib.h>
+
+#include "traceroute.h"
+
+#include "../src/correlate/mda.h"
+
+/*  The glue between the probing loop and the MDA engine, which
+   chooses the ttl and the flow of each probe and keeps the diamond
+   found so far.
+*/
+
+static Mda* mda = NULL;
+
+/*  `confidence' is a fraction, like 0.95   */
+void mda_init(unsigned int first_hop, unsigned int max_hops, unsigned int max_flows, double confidence) {
+    mda = mda_create(first_hop, max_hops, max_flows, 1 - confidence);
+    if (!mda)
+        error("mda_create");
+}
+
+/*  Returns 1 with the next probe's ttl and flow set, 0 when replies
+   are to be waited for, -1 when the whole path is done.
+*/
+int mda_next(int* ttl_p, unsigned int* flow_p) {
+    int flow, ret;
+
+    ret = mda_next_probe(mda, ttl_p, &flow);
+    if (ret > 0)
+        *flow_p = flow;
+
+    return ret;
+}
+
+/*  The probe sent with `ttl' is done, either answered or expired   */
+void mda_result(int ttl, const probe* pb) {
+    const sockaddr_any* from = pb->res.sa.sa_family ? &pb->res : NULL;
+
+    mda_record(mda, ttl, pb->flow, from, pb->final);
+}
+
+unsigned int mda_num_ifaces(int ttl) {
+    return mda->hops[ttl - 1].num_ifaces;
+}
+
+const sockaddr_any* mda_iface(int ttl, unsigned int i) {
+    return (const sockaddr_any*)&mda->hops[ttl - 1].ifaces[i].addr;
+}
+
+/*  Whether some flow has gone through the interface `prev' of the hop
+   before, and then through the interface `i' of `ttl'.
+*/
+int mda_linked(int ttl, unsigned int prev, unsigned int i) {
+    const MdaHop* h = &mda->hops[ttl - 1];
+    int l;
+
+    for (l = 0; l < h->num_links; l++) {
+        if (h->links[l].prev == (int)prev && h->links[l].next == (int)i)
+            return 1;
+    }
+
+    return 0;
+}
+
+unsigned int mda_probes_sent(void) {
+    return mda->num_probes;
+}
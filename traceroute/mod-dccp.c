@@ -151,6 +151,9 @@ static int dccp_init(const sockaddr_any* dest, unsigned int port_seq, size_t* pa
     *lenp = htons(len);
     dh->dccph_doff = len >> 2;
 
+    /*  Summed once, the probes update it for their port and seq   */
+    dh->dccph_checksum = in_csum(buf, csum_len);
+
     *packet_len_p = len;
 
     return 0;
@@ -161,6 +164,8 @@ static void dccp_send_probe(probe* pb, int ttl) {
     int af = dest_addr.sa.sa_family;
     sockaddr_any addr;
     socklen_t len = sizeof(addr);
+    uint32_t dseq;
+    uint16_t sum;
 
     /*  To make sure we have chosen a free unused "source port",
        just create, (auto)bind and hold a socket while the port is needed.
@@ -186,12 +191,14 @@ static void dccp_send_probe(probe* pb, int ttl) {
       send Reset in such a situation automatically (we have to do nothing).
     */
 
+    sum = csum_replace2(dh->dccph_checksum, dh->dccph_sport, addr.sin.sin_port);
     dh->dccph_sport = addr.sin.sin_port;
 
-    dhe->dccph_seq_low = random_seq();
+    dseq = random_seq();
+    sum = csum_replace4(sum, dhe->dccph_seq_low, dseq);
+    dhe->dccph_seq_low = dseq;
 
-    dh->dccph_checksum = 0;
-    dh->dccph_checksum = in_csum(buf, csum_len);
+    dh->dccph_checksum = sum;
 
     if (ttl != last_ttl) {
         set_ttl(raw_sk, ttl);
@@ -263,6 +270,7 @@ static tr_module dccp_ops = {
     .send_probe = dccp_send_probe,
     .recv_probe = dccp_recv_probe,
     .expire_probe = dccp_expire_probe,
+    .check_reply = dccp_check_reply,
     .options = dccp_options,
 };
 
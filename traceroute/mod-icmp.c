@@ -7,6 +7,7 @@
 */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <poll.h>
@@ -28,6 +29,7 @@ static uint16_t ident = 0;
 
 static char* data;
 static size_t* length_p;
+static size_t tmpl_len = 0; /*  of the echo request built, 0 for none yet   */
 
 static int icmp_sk = -1;
 static int last_ttl = 0;
@@ -108,21 +110,19 @@ static int icmp_init(const sockaddr_any* dest, unsigned int port_seq, size_t* pa
     }
     else
         ident = getpid() & 0xffff;
+    bpf_set_echo_ident(ident);
 
     add_poll(icmp_sk, POLLIN | POLLERR);
 
     return 0;
 }
 
-static void icmp_send_probe(probe* pb, int ttl) {
-    int af = dest_addr.sa.sa_family;
-
-    if (ttl != last_ttl) {
-        set_ttl(icmp_sk, ttl);
-
-        last_ttl = ttl;
-    }
-
+/*  The echo request is built once (and again when the length changes,
+   by the mtu discovery). The probes then patch just their seq and the
+   first payload word, updating the checksum incrementally instead of
+   summing all the (up to MAX_PACKET_LEN) data again.
+*/
+static void build_template(int af) {
     if (af == AF_INET) {
         struct icmp* icmp = (struct icmp*)data;
 
@@ -130,7 +130,7 @@ static void icmp_send_probe(probe* pb, int ttl) {
         icmp->icmp_code = 0;
         icmp->icmp_cksum = 0;
         icmp->icmp_id = htons(ident);
-        icmp->icmp_seq = htons(seq);
+        icmp->icmp_seq = 0;
 
         icmp->icmp_cksum = in_csum(data, *length_p);
     }
@@ -141,11 +141,68 @@ static void icmp_send_probe(probe* pb, int ttl) {
         icmp6->icmp6_code = 0;
         icmp6->icmp6_cksum = 0;
         icmp6->icmp6_id = htons(ident);
-        icmp6->icmp6_seq = htons(seq);
+        icmp6->icmp6_seq = 0;
 
         /*  icmp6->icmp6_cksum always computed by kernel internally   */
     }
 
+    tmpl_len = *length_p;
+}
+
+/*  Change a 16-bit word of the packet, and the checksum with it if any  */
+static void patch_word(void* ptr, uint16_t word, uint16_t* cksum) {
+    uint16_t old;
+
+    memcpy(&old, ptr, sizeof(old));
+    memcpy(ptr, &word, sizeof(word));
+
+    if (cksum)
+        *cksum = csum_replace2(*cksum, old, word);
+}
+
+/*  Load balancers hash the checksum along with the ports' place of
+   udp/tcp, so the checksum is kept the same for all the probes of a
+   flow, whatever seq they have: the first payload word compensates the
+   seq in the one's complement sum (Paris traceroute way).
+*/
+static void keep_checksum(const probe* pb, uint16_t seq_word, uint16_t* cksum) {
+    uint16_t word;
+    uint32_t sum;
+
+    if (*length_p < sizeof(struct icmphdr) + sizeof(word))
+        return;
+
+    sum = (uint32_t)(flow_index(pb) + 1) + (uint16_t)~seq_word;
+    word = (sum & 0xffff) + (sum >> 16);
+
+    patch_word(data + sizeof(struct icmphdr), word, cksum);
+}
+
+static void icmp_send_probe(probe* pb, int ttl) {
+    int af = dest_addr.sa.sa_family;
+
+    if (ttl != last_ttl) {
+        set_ttl(icmp_sk, ttl);
+
+        last_ttl = ttl;
+    }
+
+    if (*length_p != tmpl_len)
+        build_template(af);
+
+    if (af == AF_INET) {
+        struct icmp* icmp = (struct icmp*)data;
+
+        patch_word(&icmp->icmp_seq, htons(seq), &icmp->icmp_cksum);
+        keep_checksum(pb, icmp->icmp_seq, &icmp->icmp_cksum);
+    }
+    else if (af == AF_INET6) {
+        struct icmp6_hdr* icmp6 = (struct icmp6_hdr*)data;
+
+        patch_word(&icmp6->icmp6_seq, htons(seq), NULL);
+        keep_checksum(pb, icmp6->icmp6_seq, NULL);
+    }
+
     pb->send_time = get_time();
 
     if (do_send(icmp_sk, data, *length_p, &dest_addr) < 0) {
@@ -220,6 +277,7 @@ static tr_module icmp_ops = {
     .send_probe = icmp_send_probe,
     .recv_probe = icmp_recv_probe,
     .expire_probe = icmp_expire_probe,
+    .check_reply = icmp_check_reply,
     .options = icmp_options,
 };
 
@@ -139,6 +139,7 @@ static tr_module raw_ops = {
     .send_probe = raw_send_probe,
     .recv_probe = raw_recv_probe,
     .expire_probe = raw_expire_probe,
+    .check_reply = raw_check_reply,
     .options = raw_options,
     .one_per_time = 1,
 };
@@ -478,6 +478,11 @@ static int tcp_init(const sockaddr_any* dest, unsigned int port_seq, size_t* pac
     *lenp = htons(len);
     TCPHDR_DOFF(th) = len >> 2;
 
+    /*  Summed once here, with zero port and seq. Each probe then just
+       updates it for its own ones (RFC 1624), see tcp_send_probe().
+    */
+    TCPHDR_SUM(th) = in_csum(buf, csum_len);
+
     *packet_len_p = len;
 
     return 0;
@@ -488,6 +493,8 @@ static void tcp_send_probe(probe* pb, int ttl) {
     int af = dest_addr.sa.sa_family;
     sockaddr_any addr;
     socklen_t len = sizeof(addr);
+    uint32_t tseq;
+    uint16_t sum;
 
     /*  To make sure we have chosen a free unused "source port",
        just create, (auto)bind and hold a socket while the port is needed.
@@ -516,12 +523,14 @@ static void tcp_send_probe(probe* pb, int ttl) {
       send RST in such a situation automatically (we have to do nothing).
     */
 
+    sum = csum_replace2(TCPHDR_SUM(th), TCPHDR_SPORT(th), addr.sin.sin_port);
     TCPHDR_SPORT(th) = addr.sin.sin_port;
 
-    TCPHDR_SEQ(th) = random_seq();
+    tseq = random_seq();
+    sum = csum_replace4(sum, TCPHDR_SEQ(th), tseq);
+    TCPHDR_SEQ(th) = tseq;
 
-    TCPHDR_SUM(th) = 0;
-    TCPHDR_SUM(th) = in_csum(buf, csum_len);
+    TCPHDR_SUM(th) = sum;
 
     if (ttl != last_ttl) {
         set_ttl(raw_sk, ttl);
@@ -610,6 +619,7 @@ static tr_module tcp_ops = {
     .send_probe = tcp_send_probe,
     .recv_probe = tcp_recv_probe,
     .expire_probe = tcp_expire_probe,
+    .check_reply = tcp_check_reply,
     .options = tcp_options,
 };
 
@@ -32,6 +32,7 @@ static sockaddr_any dest_addr = {
 };
 static unsigned int curr_port = 0;
 static unsigned int protocol = IPPROTO_UDP;
+static int shared_sk[MAX_PROBES]; /*  per ecmp flow, for the default method   */
 
 static char* data = NULL;
 static size_t* length_p;
@@ -108,9 +109,130 @@ static int udplite_init(const sockaddr_any* dest, unsigned int port_seq, size_t*
     return 0;
 }
 
+/*  For the default method, each probe has its own dest port, which
+   comes back in the error queue. Thus probes can be told apart without
+   a socket per probe: one unconnected socket (per ecmp flow) is used
+   for everything, with the ttl passed by cmsg on each send.
+*/
+static int udp_shared_socket(probe* pb) {
+    unsigned int flow = flow_index(pb);
+    int sk = shared_sk[flow];
+
+    if (sk <= 0) {
+        sk = socket(dest_addr.sa.sa_family, SOCK_DGRAM, protocol);
+        if (sk < 0)
+            error("socket");
+
+        tune_socket(sk, pb); /*  common stuff   */
+
+        use_recverr(sk);
+
+        add_poll(sk, POLLIN | POLLERR);
+
+        shared_sk[flow] = sk;
+    }
+
+    lease_flowlabel(sk, pb); /*  for other destinations, in batch mode   */
+
+    return sk;
+}
+
+/*  On to the next port, skipping the ones of the probes still in flight
+   (all the traces share the same range, and it can wrap around).
+*/
+static void next_port(void) {
+    unsigned int n;
+
+    for (n = DEF_START_PORT; n <= 0xffff; n++) {
+        if (++curr_port > 0xffff)
+            curr_port = DEF_START_PORT;
+        if (!probe_by_seq(htons(curr_port)))
+            break;
+    }
+}
+
+static void udp_send_shared(probe* pb, int ttl) {
+    int sk = udp_shared_socket(pb);
+
+    pb->send_time = get_time();
+
+    if (do_send_ttl(sk, data, *length_p, &dest_addr, ttl) < 0) {
+        pb->send_time = 0;
+        return;
+    }
+
+    pb->seq = dest_addr.sin.sin_port;
+
+    next_port();
+    dest_addr.sin.sin_port = htons(curr_port); /* both ipv4 and ipv6 */
+}
+
+/*  The same for a whole window of probes, grouped by the shared sockets,
+   each group in as few syscalls as possible.
+*/
+static void udp_send_batch(probe** pbs, const int* ttls, unsigned int num) {
+    static probe** grp_probes = NULL;
+    static sockaddr_any* grp_addrs = NULL;
+    static int* grp_ttls = NULL;
+    static unsigned int grp_max = 0;
+    unsigned int flow, i;
+
+    if (num > grp_max) {
+        grp_max = num;
+        grp_probes = realloc(grp_probes, grp_max * sizeof(*grp_probes));
+        grp_addrs = realloc(grp_addrs, grp_max * sizeof(*grp_addrs));
+        grp_ttls = realloc(grp_ttls, grp_max * sizeof(*grp_ttls));
+        if (!grp_probes || !grp_addrs || !grp_ttls)
+            error("realloc");
+    }
+
+    for (flow = 0; flow < MAX_PROBES; flow++) {
+        unsigned int n = 0, sent;
+        double send_time;
+        int sk = 0;
+
+        for (i = 0; i < num; i++) {
+            probe* pb = pbs[i];
+
+            if (flow_index(pb) != flow)
+                continue;
+
+            sk = udp_shared_socket(pb);
+
+            grp_probes[n] = pb;
+            grp_addrs[n] = probe_trace(pb)->addr;
+            grp_addrs[n].sin.sin_port = htons(curr_port); /* both ipv4 and ipv6 */
+            grp_ttls[n] = ttls[i];
+            n++;
+
+            next_port();
+        }
+
+        if (!n)
+            continue;
+
+        send_time = get_time();
+        sent = do_send_batch(sk, data, *length_p, grp_addrs, grp_ttls, grp_probes, n);
+
+        for (i = 0; i < sent; i++) {
+            grp_probes[i]->send_time = send_time;
+            grp_probes[i]->seq = grp_addrs[i].sin.sin_port;
+        }
+    }
+
+    dest_addr.sin.sin_port = htons(curr_port);
+}
+
 static void udp_send_probe(probe* pb, int ttl) {
     int sk;
     int af = dest_addr.sa.sa_family;
+    sockaddr_any local;
+    socklen_t local_len = sizeof(local);
+
+    if (curr_port) { /*  traditional udp method   */
+        udp_send_shared(pb, ttl);
+        return;
+    }
 
     sk = socket(af, SOCK_DGRAM, protocol);
     if (sk < 0)
@@ -126,6 +248,9 @@ static void udp_send_probe(probe* pb, int ttl) {
     if (connect(sk, &dest_addr.sa, sizeof(dest_addr)) < 0)
         error("connect");
 
+    if (getsockname(sk, &local.sa, &local_len) < 0)
+        error("getsockname");
+
     use_recverr(sk);
 
     pb->send_time = get_time();
@@ -140,26 +265,66 @@ static void udp_send_probe(probe* pb, int ttl) {
 
     add_poll(sk, POLLIN | POLLERR);
 
-    pb->seq = dest_addr.sin.sin_port;
-
-    if (curr_port) { /*  traditional udp method   */
-        curr_port++;
-        dest_addr.sin.sin_port = htons(curr_port); /* both ipv4 and ipv6 */
-    }
+    /*  the dest port is the same for all, the source one is not   */
+    pb->seq = local.sin.sin_port; /* both ipv4 and ipv6 */
 
     return;
 }
 
+/*  A send timestamp comes with no address, but with the whole packet
+   looped back (from the link layer header on), the udp header of
+   which is just in front of our data at the end.
+*/
+static probe* looped_probe(const char* buf, size_t len) {
+    struct udphdr udp;
+
+    if (len < *length_p + sizeof(udp))
+        return NULL;
+
+    memcpy(&udp, buf + len - *length_p - sizeof(udp), sizeof(udp));
+    if (ntohs(udp.len) != *length_p + sizeof(udp) || (*length_p && memcmp(buf + len - *length_p, data, *length_p)))
+        return NULL;
+
+    return probe_by_seq(udp.dest);
+}
+
+/*  A quote got below the sockets (AF_XDP) comes with sk -1, and `buf'
+   at its udp header. A send timestamp comes with `from' cleared.
+*/
 static probe* udp_check_reply(int sk, int err, sockaddr_any* from, char* buf, size_t len) {
     probe* pb;
 
-    pb = probe_by_sk(sk);
+    if (curr_port) {
+        if (!from->sa.sa_family)
+            pb = looped_probe(buf, len);
+        else {
+            /*  shared socket: the (quoted) dest port is the probe's seq   */
+            pb = probe_by_seq(from->sin.sin_port);
+            if (!pb || !equal_addr(&probe_trace(pb)->addr, from))
+                return NULL;
+        }
+    }
+    else {
+        if (from->sa.sa_family && from->sin.sin_port != dest_addr.sin.sin_port)
+            return NULL;
+
+        if (sk < 0) {
+            /*  no socket to tell, but the source port is the probe's seq   */
+            const struct udphdr* udp = (const struct udphdr*)buf;
+
+            if (len < sizeof(*udp))
+                return NULL;
+
+            pb = probe_by_seq(udp->source);
+            if (!pb || !equal_addr(&probe_trace(pb)->addr, from))
+                return NULL;
+        }
+        else
+            pb = probe_by_sk(sk);
+    }
     if (!pb)
         return NULL;
 
-    if (pb->seq != from->sin.sin_port)
-        return NULL;
-
     if (!err)
         pb->final = 1;
 
@@ -177,6 +342,13 @@ static void udp_expire_probe(probe* pb) {
     probe_done(pb);
 }
 
+static void udp_set_dest(const sockaddr_any* dest) {
+    in_port_t port = dest_addr.sin.sin_port; /*  keep the current one   */
+
+    dest_addr = *dest;
+    dest_addr.sin.sin_port = port;
+}
+
 /*  All three modules share the same methods except the init...  */
 
 static tr_module default_ops = {
@@ -185,6 +357,9 @@ static tr_module default_ops = {
     .send_probe = udp_send_probe,
     .recv_probe = udp_recv_probe,
     .expire_probe = udp_expire_probe,
+    .check_reply = udp_check_reply,
+    .set_dest = udp_set_dest,
+    .send_batch = udp_send_batch,
     .header_len = sizeof(struct udphdr),
 };
 
@@ -196,6 +371,8 @@ static tr_module udp_ops = {
     .send_probe = udp_send_probe,
     .recv_probe = udp_recv_probe,
     .expire_probe = udp_expire_probe,
+    .check_reply = udp_check_reply,
+    .set_dest = udp_set_dest,
     .header_len = sizeof(struct udphdr),
 };
 
@@ -207,6 +384,8 @@ static tr_module udplite_ops = {
     .send_probe = udp_send_probe,
     .recv_probe = udp_recv_probe,
     .expire_probe = udp_expire_probe,
+    .check_reply = udp_check_reply,
+    .set_dest = udp_set_dest,
     .header_len = sizeof(struct udphdr),
     .options = udplite_options,
 };
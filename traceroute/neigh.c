@@ -0,0 +1,333 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
+
+#include "traceroute.h"
+
+#define NL_BUFSIZE 32768
+#define NEIGH_CACHE 64       // hash buckets of the next hops
+#define NEIGH_POKE_SECS 1.0  // before asking the kernel to resolve a next hop again
+
+// Neighbour states with a usable link layer address
+#define NUD_USABLE (NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE | NUD_PERMANENT | NUD_NOARP)
+
+// A next hop, once resolved its address is kept for the whole run
+struct neigh {
+    struct neigh* next;
+    int ifindex;
+    sockaddr_any addr;
+    int ok;
+    uint8_t mac[6];
+    double poked;  // when the kernel was last asked to resolve it
+};
+
+static struct neigh* neighs[NEIGH_CACHE];
+static int nl_sk = -1;  // kept open, for the destinations coming later
+static uint32_t nl_portid = 0;
+static uint32_t nl_seq = 0;
+
+static size_t addr_len(int family) {
+    return family == AF_INET6 ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+}
+
+static const void* addr_bytes(const sockaddr_any* addr) {
+    return addr->sa.sa_family == AF_INET6 ? (const void*)&addr->sin6.sin6_addr : (const void*)&addr->sin.sin_addr;
+}
+
+static void set_addr(sockaddr_any* addr, int family, const void* bytes) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sa.sa_family = family;
+    memcpy(family == AF_INET6 ? (void*)&addr->sin6.sin6_addr : (void*)&addr->sin.sin_addr, bytes, addr_len(family));
+}
+
+static int nl_open(void) {
+    struct timeval tv = {1, 0};
+    struct sockaddr_nl sa;
+    socklen_t len = sizeof(sa);
+    int nl = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+
+    if (nl < 0)
+        return -1;
+
+    // The kernel picks the port id, the replies are to be sent to
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    if (bind(nl, (struct sockaddr*)&sa, sizeof(sa)) < 0 || getsockname(nl, (struct sockaddr*)&sa, &len) < 0) {
+        close(nl);
+        return -1;
+    }
+    nl_portid = sa.nl_pid;
+
+    // A silent kernel must not hang us
+    setsockopt(nl, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    return nl;
+}
+
+/*
+ * Send the request `nh' and read its reply into `buf'. The late replies
+ * of the requests timed out before are dropped. Returns the reply's length.
+ */
+static ssize_t nl_request(int nl, struct nlmsghdr* nh, char* buf, size_t size) {
+    nh->nlmsg_seq = ++nl_seq;
+    nh->nlmsg_pid = 0;  // to the kernel
+
+    if (send(nl, nh, nh->nlmsg_len, 0) < 0)
+        return -1;
+
+    for (;;) {
+        const struct nlmsghdr* reply = (const struct nlmsghdr*)buf;
+        ssize_t n = recv(nl, buf, size, 0);
+
+        if (n < 0)
+            return -1;
+
+        if (NLMSG_OK(reply, n) && reply->nlmsg_seq == nh->nlmsg_seq && reply->nlmsg_pid == nl_portid)
+            return n;
+    }
+}
+
+// The route to `dest': the gateway (if any), the preferred source and the interface
+static int route_get(int nl, const sockaddr_any* dest, sockaddr_any* gw, sockaddr_any* src, int* oif) {
+    struct {
+        struct nlmsghdr nh;
+        struct rtmsg rt;
+        char attrs[RTA_SPACE(sizeof(struct in6_addr))];
+    } req;
+    static char buf[NL_BUFSIZE];
+    int family = dest->sa.sa_family;
+    struct rtattr* rta;
+    struct nlmsghdr* nh;
+    ssize_t n;
+
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.rt));
+    req.nh.nlmsg_type = RTM_GETROUTE;
+    req.nh.nlmsg_flags = NLM_F_REQUEST;
+    req.rt.rtm_family = family;
+    req.rt.rtm_dst_len = addr_len(family) * 8;
+
+    rta = (struct rtattr*)((char*)&req + NLMSG_ALIGN(req.nh.nlmsg_len));
+    rta->rta_type = RTA_DST;
+    rta->rta_len = RTA_LENGTH(addr_len(family));
+    memcpy(RTA_DATA(rta), addr_bytes(dest), addr_len(family));
+    req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+
+    n = nl_request(nl, &req.nh, buf, sizeof(buf));
+    if (n < 0)
+        return -1;
+
+    memset(gw, 0, sizeof(*gw));
+    memset(src, 0, sizeof(*src));
+    *oif = 0;
+
+    for (nh = (struct nlmsghdr*)buf; NLMSG_OK(nh, n); nh = NLMSG_NEXT(nh, n)) {
+        struct rtmsg* rt;
+        int len;
+
+        if (nh->nlmsg_type == NLMSG_ERROR) {
+            errno = -((struct nlmsgerr*)NLMSG_DATA(nh))->error;
+            return -1;
+        }
+        if (nh->nlmsg_type != RTM_NEWROUTE)
+            continue;
+
+        rt = NLMSG_DATA(nh);
+        len = RTM_PAYLOAD(nh);
+
+        for (rta = RTM_RTA(rt); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+            if (rta->rta_type == RTA_GATEWAY && RTA_PAYLOAD(rta) == addr_len(family))
+                set_addr(gw, family, RTA_DATA(rta));
+            else if (rta->rta_type == RTA_PREFSRC && RTA_PAYLOAD(rta) == addr_len(family))
+                set_addr(src, family, RTA_DATA(rta));
+            else if (rta->rta_type == RTA_OIF)
+                *oif = *(int*)RTA_DATA(rta);
+        }
+
+        return 0;
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+// Ask the neighbour table of `ifindex' about `addr' alone. Returns 0 when it has a usable entry.
+static int neigh_get(int nl, int ifindex, const sockaddr_any* addr, uint8_t mac[6]) {
+    struct {
+        struct nlmsghdr nh;
+        struct ndmsg nd;
+        char attrs[RTA_SPACE(sizeof(struct in6_addr))];
+    } req;
+    static char buf[NL_BUFSIZE];
+    int family = addr->sa.sa_family;
+    struct rtattr* rta;
+    struct nlmsghdr* nh;
+    ssize_t n;
+
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.nd));
+    req.nh.nlmsg_type = RTM_GETNEIGH;
+    req.nh.nlmsg_flags = NLM_F_REQUEST;
+    req.nd.ndm_family = family;
+    req.nd.ndm_ifindex = ifindex;
+
+    rta = (struct rtattr*)((char*)&req + NLMSG_ALIGN(req.nh.nlmsg_len));
+    rta->rta_type = NDA_DST;
+    rta->rta_len = RTA_LENGTH(addr_len(family));
+    memcpy(RTA_DATA(rta), addr_bytes(addr), addr_len(family));
+    req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+
+    n = nl_request(nl, &req.nh, buf, sizeof(buf));
+    if (n < 0)
+        return -1;
+
+    for (nh = (struct nlmsghdr*)buf; NLMSG_OK(nh, n); nh = NLMSG_NEXT(nh, n)) {
+        struct ndmsg* nd;
+        int len;
+
+        if (nh->nlmsg_type == NLMSG_ERROR) {
+            errno = -((struct nlmsgerr*)NLMSG_DATA(nh))->error;
+            return -1;
+        }
+        if (nh->nlmsg_type != RTM_NEWNEIGH)
+            continue;
+
+        nd = NLMSG_DATA(nh);
+        if (!(nd->ndm_state & NUD_USABLE))
+            break;
+
+        len = RTM_PAYLOAD(nh);
+        for (rta = (struct rtattr*)((char*)nd + NLMSG_ALIGN(sizeof(*nd))); RTA_OK(rta, len);
+             rta = RTA_NEXT(rta, len)) {
+            if (rta->rta_type == NDA_LLADDR && RTA_PAYLOAD(rta) == 6) {
+                memcpy(mac, RTA_DATA(rta), 6);
+                return 0;
+            }
+        }
+
+        break;
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+// The cache entry of the next hop `addr' on `ifindex', a new one if not there yet
+static struct neigh* neigh_entry(int ifindex, const sockaddr_any* addr) {
+    const uint8_t* p = addr_bytes(addr);
+    size_t i, len = addr_len(addr->sa.sa_family);
+    uint32_t h = 2166136261U;
+    struct neigh* ne;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ p[i]) * 16777619U;
+    h %= NEIGH_CACHE;
+
+    for (ne = neighs[h]; ne; ne = ne->next) {
+        if (ne->ifindex == ifindex && ne->addr.sa.sa_family == addr->sa.sa_family &&
+            !memcmp(addr_bytes(&ne->addr), p, len))
+            return ne;
+    }
+
+    ne = calloc(1, sizeof(*ne));
+    if (!ne)
+        return NULL;
+
+    ne->ifindex = ifindex;
+    set_addr(&ne->addr, addr->sa.sa_family, p);
+    ne->next = neighs[h];
+    neighs[h] = ne;
+
+    return ne;
+}
+
+// Make the kernel resolve `addr' on `ifindex', by a datagram to the discard port
+static void neigh_poke(int ifindex, const sockaddr_any* addr) {
+    char ifname[IF_NAMESIZE];
+    sockaddr_any to = *addr;
+    int sk = socket(addr->sa.sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+    if (sk < 0)
+        return;
+
+    if (if_indextoname(ifindex, ifname))
+        setsockopt(sk, SOL_SOCKET, SO_BINDTODEVICE, ifname, strlen(ifname) + 1);
+
+    to.sin.sin_port = htons(9);  // same offset for sin6
+    sendto(sk, "", 0, MSG_DONTWAIT, &to.sa, sizeof(to));
+
+    close(sk);
+}
+
+/*
+ * The link layer address of the next hop to `dest' through `ifindex'
+ * into `mac', the source address to use into `src'. Returns 0, or -1
+ * when the route goes elsewhere, or with EAGAIN while the neighbour
+ * is being resolved (never waited for here, it is the send path).
+ */
+int neigh_lookup(int ifindex, const sockaddr_any* dest, uint8_t mac[6], sockaddr_any* src) {
+    sockaddr_any gw;
+    const sockaddr_any* next_hop;
+    struct neigh* ne;
+    int oif;
+
+    if (nl_sk < 0 && (nl_sk = nl_open()) < 0)
+        return -1;
+
+    if (route_get(nl_sk, dest, &gw, src, &oif) < 0)
+        return -1;
+    if (oif != ifindex) {
+        errno = ENETUNREACH;
+        return -1;
+    }
+
+    // Most of the destinations are behind the same gateway
+    next_hop = gw.sa.sa_family ? &gw : dest;
+    ne = neigh_entry(ifindex, next_hop);
+    if (!ne)
+        return -1;
+
+    if (!ne->ok) {
+        if (neigh_get(nl_sk, ifindex, next_hop, ne->mac) < 0) {
+            double now = get_time();
+
+            if (now - ne->poked >= NEIGH_POKE_SECS) {
+                neigh_poke(ifindex, next_hop);
+                ne->poked = now;
+            }
+
+            errno = EAGAIN;
+            return -1;
+        }
+        ne->ok = 1;
+    }
+
+    memcpy(mac, ne->mac, 6);
+
+    return 0;
+}
+
+void neigh_cleanup(void) {
+    unsigned int i;
+
+    for (i = 0; i < NEIGH_CACHE; i++) {
+        while (neighs[i]) {
+            struct neigh* ne = neighs[i];
+
+            neighs[i] = ne->next;
+            free(ne);
+        }
+    }
+
+    if (nl_sk >= 0) {
+        close(nl_sk);
+        nl_sk = -1;
+    }
+    nl_portid = 0;
+}
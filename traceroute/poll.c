@@ -7,99 +7,152 @@
 */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <poll.h>
 #include <errno.h>
-#include <math.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include "traceroute.h"
 
-static struct pollfd* pfd = NULL;
-static unsigned int num_polls = 0;
-static unsigned int max_polls = 0;  // Track the allocated size to optimize reallocations
+/*  epoll(7) based. Every fd registered carries its own handler (or the
+   default one of do_poll() if none), looked up by the fd number directly,
+   so that both registration and dispatch are O(1) regardless of how many
+   sockets are in flight. Timeouts are armed on a timerfd with nanosecond
+   precision, instead of being rounded up to milliseconds.
 
-void add_poll(int fd, int events) {
-    unsigned int i;
-
-    // Look for the first empty spot
-    for (i = 0; i < num_polls && pfd[i].fd > 0; i++)
-        ;
-
-    if (i == num_polls) {
-        // Double the allocated size if more space is needed
-        if (num_polls == max_polls) {
-            max_polls = max_polls ? max_polls * 2 : 4;  // Start with a reasonable initial size
-            pfd = realloc(pfd, max_polls * sizeof(*pfd));
-            if (!pfd)
-                error("realloc");
-        }
-        num_polls++;
-    }
+   POLL* and EPOLL* event bits have the same values.
+*/
+
+#define MAX_EVENTS 64
+
+struct poll_entry {
+    poll_handler_t handler; /*  NULL means the default callback   */
+    void* data;
+    int registered;
+};
+
+static int epfd = -1;
+static int timer_fd = -1;
+static struct poll_entry* entries = NULL;
+static unsigned int num_entries = 0; /*  indexed by fd   */
+
+static void init_poll(void) {
+    struct epoll_event ev;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        error("epoll_create1");
 
-    pfd[i].fd = fd;
-    pfd[i].events = events;
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0)
+        error("timerfd_create");
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = timer_fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &ev) < 0)
+        error("epoll_ctl");
 }
 
-void del_poll(int fd) {
-    unsigned int i;
+void add_poll_handler(int fd, int events, poll_handler_t handler, void* data) {
+    struct epoll_event ev;
+
+    if (epfd < 0)
+        init_poll();
+
+    if ((unsigned int)fd >= num_entries) {
+        unsigned int n = num_entries ? num_entries : 64;
 
-    // Look for the file descriptor to remove
-    for (i = 0; i < num_polls && pfd[i].fd != fd; i++)
-        ;
+        while (n <= (unsigned int)fd)
+            n *= 2;
 
-    if (i < num_polls) {
-        pfd[i].fd = -1;  // Mark it as invalid
+        entries = realloc(entries, n * sizeof(*entries));
+        if (!entries)
+            error("realloc");
+        memset(entries + num_entries, 0, (n - num_entries) * sizeof(*entries));
+        num_entries = n;
     }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        /*  closed without del_poll() and got the same number again...  */
+        if (errno != EEXIST || epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+            error("epoll_ctl");
+    }
+
+    entries[fd].handler = handler;
+    entries[fd].data = data;
+    entries[fd].registered = 1;
 }
 
-static unsigned int cleanup_polls(void) {
-    unsigned int i, j;
+void add_poll(int fd, int events) {
+    add_poll_handler(fd, events, NULL, NULL);
+}
 
-    // Compact the array to remove holes (invalid file descriptors)
-    for (i = 0; i < num_polls && pfd[i].fd > 0; i++)
-        ;
+void del_poll(int fd) {
+    if (fd < 0 || (unsigned int)fd >= num_entries || !entries[fd].registered)
+        return;
 
-    if (i < num_polls) {  // A hole has been found
-        for (j = i + 1; j < num_polls; j++) {
-            if (pfd[j].fd > 0) {
-                pfd[i++] = pfd[j];
-                pfd[j].fd = -1;
-            }
-        }
-    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL); /*  foo on errors, it might be closed already   */
 
-    return i;
+    memset(&entries[fd], 0, sizeof(entries[fd]));
+}
+
+static void set_timer(double timeout) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)timeout;
+    its.it_value.tv_nsec = (long)((timeout - its.it_value.tv_sec) * 1000000000.);
+    if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+        its.it_value.tv_nsec = 1; /*  zero would disarm it   */
+
+    if (timerfd_settime(timer_fd, 0, &its, NULL) < 0)
+        error("timerfd_settime");
 }
 
 void do_poll(double timeout, void (*callback)(int fd, int revents)) {
-    unsigned int nfds, i;
-    int n;
+    struct epoll_event events[MAX_EVENTS];
+    int i, n;
 
-    nfds = cleanup_polls();  // Get the number of active file descriptors
+    if (epfd < 0)
+        init_poll();
 
-    if (!nfds)
-        return;
+    if (timeout > 0)
+        set_timer(timeout);
 
-    // Poll the file descriptors with the specified timeout
-    n = poll(pfd, nfds, ceil(timeout * 1000));
+    n = epoll_wait(epfd, events, MAX_EVENTS, timeout > 0 ? -1 : 0);
     if (n < 0) {
         if (errno == EINTR)
             return;
-        error("poll");
+        error("epoll_wait");
     }
 
-    // Call the callback for each file descriptor that has events
-    for (i = 0; n && i < nfds; i++) {
-        if (pfd[i].revents) {
-            callback(pfd[i].fd, pfd[i].revents);
-            n--;
+    for (i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        struct poll_entry* e;
+
+        if (fd == timer_fd) {
+            uint64_t expirations;
+
+            if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                error("read timerfd");
+            continue;
         }
-    }
-}
 
-void cleanup() {
-    free(pfd);
-    pfd = NULL;
-    num_polls = 0;
-    max_polls = 0;
+        /*  might be removed by a handler called earlier in this loop   */
+        if ((unsigned int)fd >= num_entries || !entries[fd].registered)
+            continue;
+
+        e = &entries[fd];
+        if (e->handler)
+            e->handler(fd, events[i].events, e->data);
+        else
+            callback(fd, events[i].events);
+    }
 }
@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "traceroute.h"
+
+/*  Open addressing hash of probes by an int key (seq, socket etc.),
+   linear probing, with backward shift deletion (so no tombstones
+   accumulate as probes come and go). Key 0 marks an empty slot,
+   as no valid seq or socket is 0 here.
+*/
+
+#define INDEX_MIN_SIZE 64
+
+static unsigned int hash_key(int key) {
+    uint32_t h = (uint32_t)key;
+
+    /*  murmur3 finalizer, good enough for sequential keys   */
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static void index_insert(probe_index* idx, int key, probe* pb) {
+    unsigned int mask = idx->size - 1;
+    unsigned int i = hash_key(key) & mask;
+
+    while (idx->keys[i])
+        i = (i + 1) & mask;
+
+    idx->keys[i] = key;
+    idx->values[i] = pb;
+    idx->count++;
+}
+
+static void index_resize(probe_index* idx, unsigned int size) {
+    int* old_keys = idx->keys;
+    probe** old_values = idx->values;
+    unsigned int i, old_size = idx->size;
+
+    idx->keys = calloc(size, sizeof(*idx->keys));
+    idx->values = calloc(size, sizeof(*idx->values));
+    if (!idx->keys || !idx->values)
+        error("calloc");
+
+    idx->size = size;
+    idx->count = 0;
+
+    for (i = 0; i < old_size; i++) {
+        if (old_keys[i])
+            index_insert(idx, old_keys[i], old_values[i]);
+    }
+
+    free(old_keys);
+    free(old_values);
+}
+
+void index_add(probe_index* idx, int key, probe* pb) {
+    if (key <= 0)
+        return;
+
+    /*  keep the load under 1/2   */
+    if ((idx->count + 1) * 2 > idx->size)
+        index_resize(idx, idx->size ? idx->size * 2 : INDEX_MIN_SIZE);
+
+    index_insert(idx, key, pb);
+}
+
+probe* index_find(const probe_index* idx, int key) {
+    unsigned int mask, i;
+
+    if (key <= 0 || !idx->size)
+        return NULL;
+
+    mask = idx->size - 1;
+    for (i = hash_key(key) & mask; idx->keys[i]; i = (i + 1) & mask) {
+        if (idx->keys[i] == key)
+            return idx->values[i];
+    }
+
+    return NULL;
+}
+
+void index_del(probe_index* idx, int key, const probe* pb) {
+    unsigned int mask, i, j;
+
+    if (key <= 0 || !idx->size)
+        return;
+
+    mask = idx->size - 1;
+    for (i = hash_key(key) & mask; idx->keys[i]; i = (i + 1) & mask) {
+        if (idx->keys[i] == key && idx->values[i] == pb)
+            break;
+    }
+    if (!idx->keys[i])
+        return; /*  not there   */
+
+    /*  Move back the entries of the run which would be unreachable
+       with the hole at `i'.
+    */
+    for (j = (i + 1) & mask; idx->keys[j]; j = (j + 1) & mask) {
+        unsigned int home = hash_key(idx->keys[j]) & mask;
+
+        /*  stays if its home is cyclically within (i, j]   */
+        if (i <= j ? (home > i && home <= j) : (home > i || home <= j))
+            continue;
+
+        idx->keys[i] = idx->keys[j];
+        idx->values[i] = idx->values[j];
+        i = j;
+    }
+
+    idx->keys[i] = 0;
+    idx->values[i] = NULL;
+    idx->count--;
+}
+
+void index_free(probe_index* idx) {
+    free(idx->keys);
+    free(idx->values);
+    memset(idx, 0, sizeof(*idx));
+}
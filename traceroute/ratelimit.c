@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "traceroute.h"
+#include "../src/core/scheduler.h"
+
+/*  Rate limits for sending probes, all of them to be met for a probe
+   to go: the global one, the per destination one, and the budget of
+   ICMP replies of the router the probe is expected to reach (the one
+   which has already answered for the same hop). The routers are charged
+   by their replies, since which one answers is not known in advance.
+*/
+
+#define MIN_DELAY 0.000001 /*  not to arm a zero timer   */
+
+struct router_bucket {
+    sockaddr_any addr; /*  family 0 for a free slot   */
+    TokenBucket tb;
+};
+
+static double global_rate = 0, global_burst = 0;
+static double dest_rate = 0, dest_burst = 0;
+static double router_rate = 0, router_burst = 0;
+
+static TokenBucket global_tb;
+static TokenBucket* dest_tbs = NULL;
+static unsigned int num_dests = 0;
+
+static struct router_bucket* routers = NULL;
+static unsigned int routers_size = 0; /*  power of two   */
+static unsigned int routers_count = 0;
+
+static double def_burst(double rate) {
+    return rate >= 10 ? rate / 10 : 1; /*  a tenth of a second worth   */
+}
+
+/*  The limits are {rate, burst}, the rate in packets per second
+   (0 for no limit), the burst of 0 meaning the default one.
+*/
+void ratelimit_init(unsigned int dests, const double global[2], const double dest[2], const double router[2],
+                    double now) {
+    unsigned int i;
+
+    global_rate = global[0];
+    global_burst = global[1] ? global[1] : def_burst(global_rate);
+    dest_rate = dest[0];
+    dest_burst = dest[1] ? dest[1] : def_burst(dest_rate);
+    router_rate = router[0];
+    router_burst = router[1] ? router[1] : def_burst(router_rate);
+
+    if (global_rate)
+        token_bucket_init(&global_tb, global_rate, global_burst, now);
+
+    if (dest_rate) {
+        dest_tbs = calloc(dests, sizeof(*dest_tbs));
+        if (!dest_tbs)
+            error("calloc");
+        num_dests = dests;
+
+        for (i = 0; i < dests; i++)
+            token_bucket_init(&dest_tbs[i], dest_rate, dest_burst, now);
+    }
+}
+
+static unsigned int addr_hash(const sockaddr_any* addr) {
+    const unsigned char* p;
+    size_t len, i;
+    unsigned int h = 2166136261U; /*  FNV-1a   */
+
+    if (addr->sa.sa_family == AF_INET) {
+        p = (const unsigned char*)&addr->sin.sin_addr;
+        len = sizeof(addr->sin.sin_addr);
+    }
+    else {
+        p = (const unsigned char*)&addr->sin6.sin6_addr;
+        len = sizeof(addr->sin6.sin6_addr);
+    }
+
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+static struct router_bucket* find_router(const sockaddr_any* addr) {
+    unsigned int mask = routers_size - 1;
+    unsigned int i;
+
+    if (!routers_size)
+        return NULL;
+
+    for (i = addr_hash(addr) & mask; routers[i].addr.sa.sa_family; i = (i + 1) & mask) {
+        if (equal_addr(&routers[i].addr, addr))
+            return &routers[i];
+    }
+
+    return &routers[i]; /*  the free slot to take   */
+}
+
+static struct router_bucket* add_router(const sockaddr_any* addr, double now) {
+    struct router_bucket* rb = find_router(addr);
+
+    if (rb && rb->addr.sa.sa_family)
+        return rb;
+
+    if ((routers_count + 1) * 4 > routers_size * 3) {
+        struct router_bucket* old = routers;
+        unsigned int old_size = routers_size;
+        unsigned int i;
+
+        routers_size = routers_size ? routers_size * 2 : 256;
+        routers = calloc(routers_size, sizeof(*routers));
+        if (!routers)
+            error("calloc");
+
+        for (i = 0; i < old_size; i++) {
+            if (old[i].addr.sa.sa_family)
+                *find_router(&old[i].addr) = old[i];
+        }
+        free(old);
+
+        rb = find_router(addr);
+    }
+
+    memset(rb, 0, sizeof(*rb));
+    memcpy(&rb->addr, addr, sizeof(rb->addr));
+    token_bucket_init(&rb->tb, router_rate, router_burst, now);
+    routers_count++;
+
+    return rb;
+}
+
+/*  Returns 0 (and takes the tokens) if a probe to the destination number
+   `dest' can be sent at `now', else the time to try again.
+   `router' is the one expected to answer, if known.
+*/
+double ratelimit_send(unsigned int dest, const sockaddr_any* router, double now) {
+    double delay = 0, d;
+
+    if (global_rate && (d = token_bucket_delay(&global_tb, 1, now)) > delay)
+        delay = d;
+
+    if (dest_rate && dest < num_dests && (d = token_bucket_delay(&dest_tbs[dest], 1, now)) > delay)
+        delay = d;
+
+    if (router_rate && router && router->sa.sa_family) {
+        struct router_bucket* rb = find_router(router);
+
+        if (rb && rb->addr.sa.sa_family && (d = token_bucket_delay(&rb->tb, 1, now)) > delay)
+            delay = d;
+    }
+
+    if (delay > 0)
+        return now + (delay > MIN_DELAY ? delay : MIN_DELAY);
+
+    if (global_rate)
+        token_bucket_consume(&global_tb, 1, now);
+    if (dest_rate && dest < num_dests)
+        token_bucket_consume(&dest_tbs[dest], 1, now);
+
+    return 0;
+}
+
+/*  The probe let go by ratelimit_send() has not been sent after all   */
+void ratelimit_refund(unsigned int dest, double now) {
+    if (global_rate)
+        token_bucket_refund(&global_tb, 1, now);
+    if (dest_rate && dest < num_dests)
+        token_bucket_refund(&dest_tbs[dest], 1, now);
+}
+
+/*  A reply from `router' has come   */
+void ratelimit_reply(const sockaddr_any* router, double now) {
+    if (!router_rate || !router->sa.sa_family)
+        return;
+
+    token_bucket_charge(&add_router(router, now)->tb, 1, now);
+}
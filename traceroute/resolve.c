@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/eventfd.h>
+
+#include "traceroute.h"
+
+#include "../src/core/dns_cache.h"
+#include "../src/core/annot_cache.h"
+#include "../src/core/as_db.h"
+
+#ifndef NI_IDN
+#define NI_IDN 0
+#endif
+
+/*  Reverse lookups are done by a small pool of worker threads calling
+   getnameinfo(), so that a slow PTR query never blocks the probe loop.
+   Workers report through an eventfd registered in the main poll set,
+   the results are moved into a DNSCache by the main thread only.
+   Failed lookups are cached as an empty name, to not retry them.
+
+   With --cache, names and AS paths are kept in a file shared by all
+   the runs, and looked up there first.
+
+   With --as-db, AS paths are the origins from a local prefix table,
+   no registry is asked at all.
+*/
+
+#define NUM_RESOLVERS 8
+#define CACHE_SIZE 4096 /*  at least   */
+#define CACHE_TTL 3600 /*  seconds, a run is much shorter anyway   */
+#define FILE_TTL 86400  /*  for the shared cache file   */
+
+struct resolve_req {
+    sockaddr_any addr;
+    char name[NI_MAXHOST];
+    double until; /*  no use to wait for it after that   */
+    struct resolve_req* next;
+    struct resolve_req* pending_next; /*  hash chain, main thread only   */
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct resolve_req* queue_head = NULL; /*  waiting for a worker   */
+static struct resolve_req** queue_tail = &queue_head;
+static struct resolve_req* done_list = NULL; /*  waiting for the main thread   */
+
+/*  Main thread only   */
+static DNSCache* cache = NULL;
+static size_t cache_size = CACHE_SIZE;
+static struct resolve_req** pending = NULL; /*  requested, yet not in the cache, hashed by address   */
+static unsigned int num_pending = 0;
+static unsigned int pending_size = 0; /*  a power of two   */
+static int event_fd = -1;
+static AnnotCache* annot = NULL;
+static AsDb* as_db = NULL;
+
+static void* resolve_worker(void* arg) {
+    (void)arg;
+
+    for (;;) {
+        struct resolve_req* req;
+        uint64_t one = 1;
+
+        pthread_mutex_lock(&lock);
+        while (!queue_head)
+            pthread_cond_wait(&cond, &lock);
+        req = queue_head;
+        queue_head = req->next;
+        if (!queue_head)
+            queue_tail = &queue_head;
+        pthread_mutex_unlock(&lock);
+
+        if (getnameinfo(&req->addr.sa, sizeof(req->addr), req->name, sizeof(req->name), 0, 0, NI_IDN) != 0)
+            req->name[0] = '\0';
+
+        pthread_mutex_lock(&lock);
+        req->next = done_list;
+        done_list = req;
+        pthread_mutex_unlock(&lock);
+
+        if (write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            break; /*  cannot happen with eventfd   */
+    }
+
+    return NULL;
+}
+
+static unsigned int pending_hash(const sockaddr_any* addr) {
+    const unsigned char* p;
+    size_t len, i;
+    unsigned int h = 2166136261U; /*  FNV-1a   */
+
+    if (addr->sa.sa_family == AF_INET) {
+        p = (const unsigned char*)&addr->sin.sin_addr;
+        len = sizeof(addr->sin.sin_addr);
+    }
+    else {
+        p = (const unsigned char*)&addr->sin6.sin6_addr;
+        len = sizeof(addr->sin6.sin6_addr);
+    }
+
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619U;
+    }
+
+    return h & (pending_size - 1);
+}
+
+/*  Returns the link to the pending request for `addr', to unlink it by   */
+static struct resolve_req** find_pending(const sockaddr_any* addr) {
+    struct resolve_req** pp;
+
+    if (!num_pending)
+        return NULL;
+
+    for (pp = &pending[pending_hash(addr)]; *pp; pp = &(*pp)->pending_next) {
+        if (equal_addr(&(*pp)->addr, addr))
+            return pp;
+    }
+
+    return NULL;
+}
+
+static void add_pending(struct resolve_req* req) {
+    struct resolve_req** pp;
+
+    if (num_pending >= pending_size) {
+        struct resolve_req** old = pending;
+        unsigned int old_size = pending_size;
+        unsigned int i;
+
+        pending_size = pending_size ? pending_size * 2 : 64;
+        pending = calloc(pending_size, sizeof(*pending));
+        if (!pending)
+            error("calloc");
+
+        for (i = 0; i < old_size; i++) {
+            struct resolve_req* r;
+
+            while ((r = old[i]) != NULL) {
+                old[i] = r->pending_next;
+                pp = &pending[pending_hash(&r->addr)];
+                r->pending_next = *pp;
+                *pp = r;
+            }
+        }
+        free(old);
+    }
+
+    pp = &pending[pending_hash(&req->addr)];
+    req->pending_next = *pp;
+    *pp = req;
+    num_pending++;
+}
+
+static void resolve_poll(int fd, int revents, void* data) {
+    struct resolve_req *list, *req;
+    uint64_t cnt;
+    uint64_t now = (uint64_t)get_time();
+
+    (void)revents;
+    (void)data;
+
+    if (read(fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        error("read eventfd");
+
+    pthread_mutex_lock(&lock);
+    list = done_list;
+    done_list = NULL;
+    pthread_mutex_unlock(&lock);
+
+    while ((req = list) != NULL) {
+        struct resolve_req** pp = find_pending(&req->addr);
+
+        list = req->next;
+
+        dns_cache_insert(cache, &req->addr, req->name, now, CACHE_TTL);
+        if (annot)
+            annot_store(annot, &req->addr, req->name, NULL, now, FILE_TTL);
+
+        if (pp) {
+            *pp = (*pp)->pending_next;
+            num_pending--;
+        }
+        free(req);
+    }
+}
+
+static void resolve_init(void) {
+    unsigned int i;
+
+    cache = dns_cache_create(cache_size);
+    if (!cache)
+        error("dns_cache_create");
+
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0)
+        error("eventfd");
+
+    add_poll_handler(event_fd, POLLIN, resolve_poll, NULL);
+
+    for (i = 0; i < NUM_RESOLVERS; i++) {
+        pthread_t thr;
+        int err = pthread_create(&thr, NULL, resolve_worker, NULL);
+
+        if (err) {
+            if (i)
+                break; /*  enough to go on   */
+            errno = err;
+            error("pthread_create");
+        }
+        pthread_detach(thr);
+    }
+}
+
+/*  Room for a name per hop of all the traces, as none of them is to be
+   evicted before its hop is printed (which can take all the run).
+*/
+void resolve_size(unsigned int num_hops) {
+    if (num_hops > cache_size)
+        cache_size = num_hops;
+}
+
+/*  Start a reverse lookup of `addr' (unless it is known or in progress),
+   the name will be waited for no longer than till `until'.
+*/
+void resolve_addr(const sockaddr_any* addr, double until) {
+    struct resolve_req* req;
+    uint64_t now = (uint64_t)get_time();
+    const char* name;
+
+    if (!cache)
+        resolve_init();
+
+    if (find_pending(addr) || dns_cache_lookup(cache, addr, now))
+        return;
+
+    if (annot && annot_lookup(annot, addr, now, &name, NULL) && name) {
+        dns_cache_insert(cache, addr, name, now, CACHE_TTL);
+        return;
+    }
+
+    req = calloc(1, sizeof(*req));
+    if (!req)
+        error("calloc");
+    memcpy(&req->addr, addr, sizeof(req->addr));
+    req->until = until;
+
+    add_pending(req);
+
+    pthread_mutex_lock(&lock);
+    *queue_tail = req;
+    queue_tail = &req->next;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/*  Returns the name of `addr' ("" when it has none), or NULL when it is
+   not known (yet). In the latter case `*until_p' is set to the time
+   the name is still expected till, or 0 when it is not expected at all.
+*/
+const char* resolve_lookup(const sockaddr_any* addr, double* until_p) {
+    struct resolve_req** pp;
+    const char* name;
+
+    *until_p = 0;
+
+    if (!cache)
+        return NULL;
+
+    name = dns_cache_lookup(cache, addr, (uint64_t)get_time());
+    if (name)
+        return name;
+
+    pp = find_pending(addr);
+    if (pp)
+        *until_p = (*pp)->until;
+
+    return NULL;
+}
+
+void resolve_cache(const char* path) {
+    annot = annot_open(path, 1);
+    if (!annot)
+        error(path);
+}
+
+void resolve_as_db(const char* path) {
+    as_db = as_db_open(path);
+    if (!as_db)
+        error(path);
+}
+
+/*  Start an AS path lookup of `addr', unless the cache file has it   */
+void resolve_as(const sockaddr_any* addr, double until) {
+    const char* path;
+
+    if (as_db)
+        return; /*  always at hand   */
+
+    if (annot && annot_lookup(annot, addr, (uint64_t)get_time(), NULL, &path) && path)
+        return;
+
+    as_query(addr, until);
+}
+
+/*  AS path of `addr', from the cache file if there, else as for as_path()   */
+const char* resolve_as_path(const sockaddr_any* addr, double* until_p) {
+    const char* path;
+    uint64_t now = (uint64_t)get_time();
+
+    *until_p = 0;
+
+    if (as_db) {
+        static char buf[sizeof("AS4294967295")];
+        uint32_t asn = as_db_lookup(as_db, addr);
+
+        if (!asn)
+            return "*";
+        snprintf(buf, sizeof(buf), "AS%u", asn);
+        return buf;
+    }
+
+    if (annot && annot_lookup(annot, addr, now, NULL, &path) && path)
+        return path;
+
+    path = as_path(addr, until_p);
+
+    if (path && annot && strcmp(path, "!!") != 0) /*  not a failure   */
+        annot_store(annot, addr, NULL, path, now, FILE_TTL);
+
+    return path;
+}
@@ -0,0 +1,159 @@
+/*
+    Copyright (c)  2006, 2007		Dmitry Butskoy
+                                        <dmitry@butskoy.name>
+    License:  GPL v2 or any later
+
+    See COPYING for the status of this software.
+*/
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "traceroute.h"
+#include "../src/io/parse.h"
+
+/*  The probes leave through here, by the AF_XDP ring when `--xdp-tx'
+   has it set up (xdp_send() says EOPNOTSUPP otherwise), else by the
+   socket. An error worth to go on with returns 0, a full queue -1
+   (with ENOBUFS or EAGAIN), anything else is fatal.
+*/
+
+#define SEND_BATCH 64 /*  messages per sendmmsg() call   */
+
+extern double wait_secs;
+
+int do_send(int sk, const void* data, size_t len, const sockaddr_any* addr) {
+    int res;
+
+    xdp_track(sk, data, len, addr, wait_secs);
+
+    if (addr) {
+        res = xdp_send(sk, data, len, addr, -1);
+        if (res >= 0 || errno != EOPNOTSUPP)
+            return res;
+    }
+
+    if (!addr || raw_can_connect())
+        res = send(sk, data, len, 0);
+    else
+        res = sendto(sk, data, len, 0, &addr->sa, sizeof(*addr));
+
+    if (res < 0) {
+        if (errno == ENOBUFS || errno == EAGAIN)
+            return res;
+        if (errno == EMSGSIZE || errno == EHOSTUNREACH)
+            return 0;  /*  recverr will say more...  */
+        error("send"); /*  not recoverable   */
+    }
+
+    return res;
+}
+
+/*  Like do_send(), but the ttl (hop limit) is passed per packet,
+   so that one unconnected socket can serve all the hops and destinations.
+*/
+int do_send_ttl(int sk, const void* data, size_t len, const sockaddr_any* addr, int ttl) {
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+    int res;
+
+    xdp_track(sk, data, len, addr, wait_secs);
+
+    res = xdp_send(sk, data, len, addr, ttl);
+    if (res >= 0 || errno != EOPNOTSUPP)
+        return res;
+
+    memset(&msg, 0, sizeof(msg));
+
+    iov.iov_base = (void*)data;
+    iov.iov_len = len;
+    msg.msg_name = (void*)addr;
+    msg.msg_namelen = sizeof(*addr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    put_ttl_cmsg(&msg, control, sizeof(control), addr->sa.sa_family, ttl);
+
+    res = sendmsg(sk, &msg, 0);
+
+    /*  An unconnected socket still gets the error of some previous probe
+       reported here once (and the packet not sent), so try again.
+    */
+    if (res < 0 && errno != ENOBUFS && errno != EAGAIN)
+        res = sendmsg(sk, &msg, 0);
+
+    if (res < 0) {
+        if (errno == ENOBUFS || errno == EAGAIN)
+            return res;
+        if (errno == EMSGSIZE || errno == EHOSTUNREACH || errno == ECONNREFUSED)
+            return 0;  /*  recverr will say more...  */
+        error("send"); /*  not recoverable   */
+    }
+
+    return res;
+}
+
+/*  Send the same data to several addresses at once, each one with its
+   own ttl, for the probes of `pbs' (NULL when there are none). Returns
+   how many were actually sent, the rest can be tried later (as for
+   ENOBUFS in do_send()).
+*/
+int do_send_batch(int sk, const void* data, size_t len, const sockaddr_any* addrs, const int* ttls, probe* const* pbs,
+                  unsigned int num) {
+    static struct mmsghdr msgs[SEND_BATCH];
+    static char controls[SEND_BATCH][CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    unsigned int i, done = 0;
+
+    xdp_track_batch(sk, data, len, addrs, pbs, num, wait_secs);
+
+    while (done < num && xdp_send(sk, data, len, &addrs[done], ttls[done]) >= 0)
+        done++;
+    if (done == num || errno != EOPNOTSUPP)
+        return done;
+
+    iov.iov_base = (void*)data;
+    iov.iov_len = len;
+
+    while (done < num) {
+        unsigned int n = num - done;
+        int res;
+
+        if (n > SEND_BATCH)
+            n = SEND_BATCH;
+
+        for (i = 0; i < n; i++) {
+            struct msghdr* msg = &msgs[i].msg_hdr;
+
+            memset(msg, 0, sizeof(*msg));
+            msg->msg_name = (void*)&addrs[done + i];
+            msg->msg_namelen = sizeof(addrs[done + i]);
+            msg->msg_iov = &iov;
+            msg->msg_iovlen = 1;
+            put_ttl_cmsg(msg, controls[i], sizeof(controls[i]), addrs[done + i].sa.sa_family, ttls[done + i]);
+        }
+
+        res = sendmmsg(sk, msgs, n, 0);
+
+        /*  an error of some previous probe, see do_send_ttl()   */
+        if (res < 0 && errno != ENOBUFS && errno != EAGAIN)
+            res = sendmmsg(sk, msgs, n, 0);
+
+        if (res < 0) {
+            if (errno == ENOBUFS || errno == EAGAIN)
+                break;
+            if (errno == EMSGSIZE || errno == EHOSTUNREACH || errno == ECONNREFUSED) {
+                done++; /*  recverr will say more...  */
+                continue;
+            }
+            error("send"); /*  not recoverable   */
+        }
+
+        done += res;
+    }
+
+    return done;
+}
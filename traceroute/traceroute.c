@@ -15,6 +15,7 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <poll.h>
 #include <sched.h>
 #ifndef CLONE_NEWNET
@@ -68,7 +69,6 @@
 #endif
 
 #define MAX_HOPS 255
-#define MAX_PROBES 10
 #define MAX_GATEWAYS_4 8
 #define MAX_GATEWAYS_6 127
 #define DEF_HOPS 30
@@ -83,6 +83,13 @@
 #endif
 #define DEF_SEND_SECS 0
 #define DEF_DATA_LEN 40 /*  all but IP header...  */
+#define DEF_CONCURRENCY 64
+#define DEF_RESOLVE_WAIT 5.0
+#define DEF_MDA_CONFIDENCE 95
+#define DEF_INTERVAL 1.0
+#define DEF_HIST_DIGITS 2
+#define MAX_HIST_US 3600000000ULL /*  an hour   */
+#define MAX_MDA_FLOWS 1024 /*  per path, the source ports used for udp and tcp   */
 #define MAX_PACKET_LEN 65000
 
 #define ttl2hops(X) (((X) <= 64 ? 65 : ((X) <= 128 ? 129 : 256)) - (X))
@@ -99,8 +106,16 @@ static int bpf_mode = 0; /* 0=auto, 1=on, 2=off */
 static unsigned int first_hop = 1;
 unsigned int max_hops = DEF_HOPS;
 static unsigned int sim_probes = DEF_SIM_PROBES;
+static int fixed_window = 0;
 unsigned int probes_per_hop = DEF_NUM_PROBES;
 static unsigned int ecmp = 0;
+static int mda = 0;
+static double mda_confidence = DEF_MDA_CONFIDENCE;
+static int continuous = 0;
+static double interval = DEF_INTERVAL;
+static unsigned int rounds = 0;
+static unsigned int round_num = 0;
+static int hist_digits = DEF_HIST_DIGITS;
 
 static char** gateways = NULL;
 static int num_gateways = 0;
@@ -113,19 +128,27 @@ static size_t data_len = 0;
 
 static int dontfrag = 0;
 static int noresolve = 0;
+static double resolve_wait = DEF_RESOLVE_WAIT;
+static char* cache_file = NULL;
 static int extension = 0;
 static int as_lookups = 0;
+static char* as_db_file = NULL;
 static unsigned int dst_port_seq = 0;
 static unsigned int tos = 0;
 static unsigned int flow_label = 0;
 static int noroute = 0;
 static unsigned int fwmark = 0;
 static int packet_len = -1;
-static double wait_secs = DEF_WAIT_SECS;
+double wait_secs = DEF_WAIT_SECS;
 static double deadline = 0;
+static double run_start = 0;
 static double here_factor = DEF_HERE_FACTOR;
 static double near_factor = DEF_NEAR_FACTOR;
 static double send_secs = DEF_SEND_SECS;
+static double rate_limit[2] = {0, 0}; /*  {pps, burst}   */
+static double dest_rate_limit[2] = {0, 0};
+static double router_rate_limit[2] = {0, 0};
+static int rate_limited = 0;
 static int mtudisc = 0;
 static int backward = 0;
 
@@ -136,6 +159,9 @@ static sockaddr_any dst_addr = {
 };
 static char* dst_name = NULL;
 static char* device = NULL;
+static int xdp_tx = 0;
+static unsigned int xdp_queues = 0;
+static unsigned int xdp_busy_poll = 0;
 static sockaddr_any src_addr = {
     {
         0,
@@ -158,6 +184,14 @@ static int af = 0;
 probe* probes = NULL;
 static unsigned int num_probes = 0;
 
+static trace* traces = NULL;
+static unsigned int num_traces = 0;
+static unsigned int reported_traces = 0;
+static char** target_names = NULL;
+static unsigned int num_target_names = 0;
+static char* targets_file = NULL;
+static unsigned int concurrency = DEF_CONCURRENCY;
+
 typedef enum { TS_USERSPACE = 0, TS_KERNEL_SW, TS_KERNEL_HW } ts_mode_t;
 
 static ts_mode_t ts_mode = TS_KERNEL_SW; /* Default to kernel-sw as it was effectively the default */
@@ -458,6 +492,15 @@ static int add_gateway(CLIF_option* optn, char* arg) {
     return 0;
 }
 
+static int add_target(CLIF_option* optn, char* arg) {
+    target_names = realloc(target_names, (num_target_names + 1) * sizeof(*target_names));
+    if (!target_names)
+        error("malloc");
+    target_names[num_target_names++] = strdup(arg);
+
+    return 0;
+}
+
 static int set_source(CLIF_option* optn, char* arg) {
     return getaddr(arg, &src_addr);
 }
@@ -545,6 +588,25 @@ static int set_wait_specs(CLIF_option* optn, char* arg) {
     return 0;
 }
 
+static int set_rate(CLIF_option* optn, char* arg) {
+    double* limit = optn->data;
+    char *p, *q;
+
+    limit[1] = 0;
+
+    limit[0] = strtod(p = arg, &q);
+    if (q == p || limit[0] < 0)
+        return -1;
+    if (!*q++)
+        return 0;
+
+    limit[1] = strtod(p = q, &q);
+    if (q == p || *q || limit[1] < 1)
+        return -1;
+
+    return 0;
+}
+
 static int set_bpf(CLIF_option* optn, char* arg) {
     if (!arg || !strcasecmp(arg, "auto"))
         bpf_mode = 0;
@@ -576,6 +638,11 @@ static CLIF_option option_list[] = {
     {"d", "debug", 0, "Enable socket level debugging", CLIF_set_flag, &debug, 0, 0},
     {0, "jsonl", 0, "Use JSONL streaming output", CLIF_set_flag, &jsonl, 0, 0},
     {0, "quiet", 0, "Do not print human-readable output", CLIF_set_flag, &quiet, 0, 0},
+    {0, "hist-digits", "num",
+     "Keep the per hop RTT histograms of the JSONL output "
+     "with %s significant digits (" _TEXT(HDR_MIN_DIGITS) " to " _TEXT(HDR_MAX_DIGITS) ", default " _TEXT(
+         DEF_HIST_DIGITS) ")",
+     CLIF_set_int, &hist_digits, 0, CLIF_EXTRA},
     {0, "bpf", "mode", "Enable eBPF correlation (auto|on|off)", set_bpf, 0, 0, 0},
     {"F", "dont-fragment", 0, "Do not fragment packets", CLIF_set_flag, &dontfrag, 0, CLIF_ABBREV},
     {"f", "first", "first_ttl", "Start from the %s hop (instead from 1)", CLIF_set_uint, &first_hop, 0, 0},
@@ -592,6 +659,19 @@ static CLIF_option option_list[] = {
      "Specify a network interface "
      "to operate with",
      CLIF_set_string, &device, 0, 0},
+    {0, "xdp-tx", 0,
+     "Send the probes by an AF_XDP socket on the interface "
+     "specified by `-i', bypassing the kernel's stack "
+     "(default, icmp and tcp methods)",
+     CLIF_set_flag, &xdp_tx, 0, CLIF_EXTRA},
+    {0, "xdp-queues", "num",
+     "Receive by AF_XDP on the first %s rx queues of the interface "
+     "(default is all of them)",
+     CLIF_set_uint, &xdp_queues, 0, CLIF_EXTRA},
+    {0, "xdp-busy-poll", "usecs",
+     "Busy poll the AF_XDP queues for up to %s microseconds, "
+     "instead of waiting for the interrupts",
+     CLIF_set_uint, &xdp_busy_poll, 0, CLIF_EXTRA},
     {0, "netns", "path",
      "Switch to the network namespace specified by %s "
      "before starting",
@@ -602,9 +682,19 @@ static CLIF_option option_list[] = {
      CLIF_set_uint, &max_hops, 0, 0},
     {"N", "sim-queries", "squeries",
      "Set the number of probes "
-     "to be tried simultaneously (default is " _TEXT(DEF_SIM_PROBES) ")",
+     "to be tried simultaneously at first (default is " _TEXT(DEF_SIM_PROBES) "). "
+     "It grows while replies come and shrinks on losses",
      CLIF_set_uint, &sim_probes, 0, 0},
     {"n", 0, 0, "Do not resolve IP addresses to their domain names", CLIF_set_flag, &noresolve, 0, 0},
+    {0, "resolve-wait", "seconds",
+     "Wait for a domain name (or AS path) no more than %s "
+     "(default " _TEXT(DEF_RESOLVE_WAIT) "), then print "
+     "just the address (float point values allowed too)",
+     CLIF_set_double, &resolve_wait, 0, CLIF_EXTRA},
+    {0, "cache", "file",
+     "Keep the domain names and AS paths found in %s, "
+     "to be reused by later (or concurrent) runs",
+     CLIF_set_string, &cache_file, 0, CLIF_EXTRA},
     {"p", "port", "port",
      "Set the destination port to use. "
      "It is either initial udp port value for "
@@ -647,6 +737,29 @@ static CLIF_option option_list[] = {
      "Default is " _TEXT(DEF_NUM_PROBES),
      CLIF_set_uint, &probes_per_hop, 0, 0},
     {0, "ecmp", "num", "Run %s distinct flow identities per TTL", CLIF_set_uint, &ecmp, 0, 0},
+    {0, "mda", 0,
+     "Discover all the load balanced paths (Paris traceroute's "
+     "Multipath Detection Algorithm) and print the diamonds "
+     "found, hop by hop. The header fields hashed are kept "
+     "constant per flow (source port for udp and tcp, checksum for icmp), "
+     "the default method is `-U'",
+     CLIF_set_flag, &mda, 0, CLIF_EXTRA},
+    {0, "continuous", 0,
+     "Keep probing all the hops in rounds (like mtr), "
+     "printing the rolling per hop stats (loss, RTTs, "
+     "jitter and percentiles) after each round",
+     CLIF_set_flag, &continuous, 0, CLIF_EXTRA},
+    {0, "interval", "seconds",
+     "Start a new round each %s in continuous mode "
+     "(default " _TEXT(DEF_INTERVAL) ", float point values allowed too)",
+     CLIF_set_double, &interval, 0, CLIF_EXTRA},
+    {0, "rounds", "num", "Stop after %s rounds in continuous mode (default is to go on)", CLIF_set_uint, &rounds, 0,
+     CLIF_EXTRA},
+    {0, "mda-confidence", "percent",
+     "Stop looking for more next hops of an interface "
+     "when one more would have been found with %s "
+     "confidence (default " _TEXT(DEF_MDA_CONFIDENCE) ")",
+     CLIF_set_double, &mda_confidence, 0, CLIF_EXTRA},
     {"r", 0, 0,
      "Bypass the normal routing and send directly to a host "
      "on an attached network",
@@ -659,6 +772,18 @@ static CLIF_option option_list[] = {
                                       "in milliseconds, else it is a number of seconds "
                                       "(float point values allowed too)",
      CLIF_set_double, &send_secs, 0, 0},
+    {0, "rate", "PPS[,BURST]",
+     "Send no more than PPS probes per second in total, "
+     "with bursts of up to BURST probes (default is "
+     "a tenth of a second worth)",
+     set_rate, rate_limit, 0, CLIF_EXTRA},
+    {0, "dest-rate", "PPS[,BURST]", "The same as `--rate', but for each destination",
+     set_rate, dest_rate_limit, 0, CLIF_EXTRA},
+    {0, "router-rate", "PPS[,BURST]",
+     "Do not provoke more than PPS replies per second "
+     "from any router. Probes are held back while the hop "
+     "router already known has run out of its budget",
+     set_rate, router_rate_limit, 0, CLIF_EXTRA},
     {"e", "extensions", 0,
      "Show ICMP extensions (if present), "
      "including MPLS",
@@ -668,6 +793,11 @@ static CLIF_option option_list[] = {
      "registries and print results directly after "
      "the corresponding addresses",
      CLIF_set_flag, &as_lookups, 0, 0},
+    {0, "as-db", "file",
+     "Take the AS paths (just the origins) from a local "
+     "prefix table in %s instead of the registries, "
+     "implies `-A'",
+     CLIF_set_string, &as_db_file, 0, CLIF_EXTRA},
     {"M", "module", "name",
      "Use specified module (either builtin or "
      "external) for traceroute operations. Most methods "
@@ -681,7 +811,7 @@ static CLIF_option option_list[] = {
      set_mod_option, 0, 0, CLIF_SEVERAL | CLIF_EXTRA},
     {0, "sport", "num",
      "Use source port %s for outgoing packets. "
-     "Implies `-N 1'",
+     "Implies `-N 1' (with `--mda', the first of the ports used)",
      set_port, &src_port, 0, CLIF_EXTRA},
 #ifdef SO_MARK
     {0, "fwmark", "num", "Set firewall mark for outgoing packets", CLIF_set_uint, &fwmark, 0, 0},
@@ -709,12 +839,24 @@ static CLIF_option option_list[] = {
      "Guess the number of hops in the backward path "
      "and print if it differs",
      CLIF_set_flag, &backward, 0, CLIF_EXTRA},
+    {0, "target", "host",
+     "Trace %s too, concurrently with other destinations. "
+     "Several %s allowed",
+     add_target, 0, 0, CLIF_SEVERAL | CLIF_EXTRA},
+    {0, "targets-file", "file",
+     "Trace all destinations listed in %s (`-' for stdin) "
+     "concurrently. Each line is `host [first_ttl [max_ttl]]'",
+     CLIF_set_string, &targets_file, 0, CLIF_EXTRA},
+    {0, "concurrency", "num",
+     "Trace no more than %s destinations at a time "
+     "(default is " _TEXT(DEF_CONCURRENCY) ")",
+     CLIF_set_uint, &concurrency, 0, CLIF_EXTRA},
     CLIF_VERSION_OPTION(version_string),
     CLIF_HELP_OPTION,
     CLIF_END_OPTION};
 
 static CLIF_argument arg_list[] = {
-    {"host", "The host to traceroute to", set_host, 0, CLIF_STRICT},
+    {"host", "The host to traceroute to", set_host, 0, 0},
     {"packetlen",
      "The full packet length (default is the length of "
      "an IP header plus " _TEXT(DEF_DATA_LEN) "). Can be "
@@ -723,8 +865,165 @@ static CLIF_argument arg_list[] = {
     CLIF_END_ARGUMENT};
 
 static void do_it(void);
+static void do_mda(void);
+static void do_continuous(void);
+
+/*	BATCH  STUFF	    */
+
+static void add_trace(const char* name, const sockaddr_any* addr, unsigned int first, unsigned int max) {
+    trace* tr;
+
+    traces = realloc(traces, (num_traces + 1) * sizeof(*traces));
+    if (!traces)
+        error("malloc");
+
+    tr = &traces[num_traces++];
+    memset(tr, 0, sizeof(*tr));
+
+    tr->name = name;
+    tr->addr = *addr;
+    tr->first_hop = first ? first : first_hop;
+    tr->max_hops = max ? max : max_hops;
+}
+
+static int resolve_target(const char* name, unsigned int first, unsigned int max) {
+    sockaddr_any addr;
+
+    if (getaddr(name, &addr) < 0)
+        return -1;
+
+    if (!af)
+        af = addr.sa.sa_family;
+    else if (addr.sa.sa_family != af) {
+        fprintf(stderr, "%s: IP version mismatch\n", name);
+        return -1;
+    }
+
+    add_trace(name, &addr, first, max);
+
+    return 0;
+}
+
+static void read_targets_file(const char* path) {
+    FILE* fp;
+    char buf[1024];
+    unsigned int lineno = 0;
+
+    fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if (!fp)
+        ex_error("%s: %s", path, strerror(errno));
+
+    while (fgets(buf, sizeof(buf), fp)) {
+        char *host, *name;
+        unsigned int first, max;
+        int ret;
+
+        lineno++;
+
+        ret = parse_target_line(buf, &host, &first, &max);
+        if (ret < 0) {
+            fprintf(stderr, "%s:%u: bad target line\n", path, lineno);
+            continue;
+        }
+        if (ret == 0)
+            continue;
+
+        /*  the defaults are checked already, but not with the line's ones   */
+        if ((first ? first : first_hop) > (max ? max : max_hops)) {
+            fprintf(stderr, "%s:%u: first hop out of range\n", path, lineno);
+            continue;
+        }
+
+        /*  unresolvable names are just skipped, as with `--target'  */
+        name = strdup(host);
+        if (resolve_target(name, first, max) < 0)
+            free(name);
+    }
+
+    if (fp != stdin)
+        fclose(fp);
+}
+
+/*  Split the probe table into per-trace slices, each one hop-aligned,
+   so that the index inside a slice still gives the ttl.
+*/
+static void setup_traces(void) {
+    unsigned int i, n = 0;
+
+    for (i = 0; i < num_traces; i++) {
+        trace* tr = &traces[i];
+
+        tr->num_probes = tr->max_hops * probes_per_hop;
+        num_probes += tr->num_probes;
+    }
+
+    probes = calloc(num_probes, sizeof(*probes));
+    if (!probes)
+        error("calloc");
+
+    for (i = 0; i < num_traces; i++) {
+        trace* tr = &traces[i];
+
+        tr->probes = &probes[n];
+        tr->start = tr->printed = (tr->first_hop - 1) * probes_per_hop;
+        tr->end = tr->num_probes;
+        n += tr->num_probes;
+
+        if (continuous) {
+            unsigned int j;
+
+            tr->stats = calloc(tr->max_hops, sizeof(*tr->stats));
+            tr->hop_res = calloc(tr->max_hops, sizeof(*tr->hop_res));
+            if (!tr->stats || !tr->hop_res)
+                error("calloc");
+
+            for (j = 0; j < tr->max_hops; j++)
+                hop_stats_init(&tr->stats[j]);
+        }
+
+        if (jsonl && !mda) {
+            tr->hists = calloc(tr->max_hops, sizeof(*tr->hists)); /*  filled on the first reply   */
+            if (!tr->hists)
+                error("calloc");
+        }
+
+        scheduler_init(&tr->sched, tr->max_hops, probes_per_hop, sim_probes, 0);
+        if (fixed_window)
+            scheduler_set_window_limits(&tr->sched, sim_probes, sim_probes);
+        else
+            scheduler_set_window_limits(&tr->sched, 1, MAX_SIM_PROBES);
+    }
+}
+
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+
+    /*  sockets are still per probe for some methods   */
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= rl.rlim_max)
+        return;
+
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+trace* probe_trace(const probe* pb) {
+    unsigned int lo = 0, hi = num_traces;
+
+    while (hi - lo > 1) {
+        unsigned int mid = (lo + hi) / 2;
+
+        if (pb < traces[mid].probes)
+            hi = mid;
+        else
+            lo = mid;
+    }
+
+    return &traces[lo];
+}
 
 int main(int argc, char* argv[]) {
+    unsigned int i;
+
     setlocale(LC_ALL, "");
     setlocale(LC_NUMERIC, "C"); /*  avoid commas in msec printed  */
 
@@ -749,6 +1048,9 @@ int main(int argc, char* argv[]) {
         close(fd);
     }
 
+    if (mda && !strcmp(module, "default"))
+        module = "udp"; /*  the dest port must not change   */
+
     ops = tr_get_module(module);
     if (!ops)
         ex_error("Unknown traceroute module %s", module);
@@ -757,6 +1059,53 @@ int main(int argc, char* argv[]) {
         ex_error("first hop out of range");
     if (max_hops > MAX_HOPS)
         ex_error("max hops cannot be more than " _TEXT(MAX_HOPS));
+
+    if (dst_name)
+        add_trace(dst_name, &dst_addr, 0, 0);
+    for (i = 0; i < num_target_names; i++)
+        resolve_target(target_names[i], 0, 0);
+    if (targets_file)
+        read_targets_file(targets_file);
+
+    if (!num_traces)
+        ex_error("No destination to trace");
+
+    if (num_traces > 1) {
+        if (!ops->set_dest)
+            ex_error("Module %s cannot trace several destinations at once", ops->name);
+        if (num_gateways || mtudisc || src_port || auto_fallback)
+            ex_error("Gateways, `--mtu', `--sport' and `--auto-fallback' are for one destination only");
+        if (!concurrency)
+            ex_error("bad concurrency `%u' specified", concurrency);
+
+        raise_fd_limit();
+    }
+    if (mda) {
+        if (strcmp(ops->name, "udp") && strcmp(ops->name, "icmp") && strcmp(ops->name, "tcp"))
+            ex_error("`--mda' works with udp, icmp and tcp methods only");
+        if (num_traces > 1 || ecmp || mtudisc || jsonl || auto_fallback)
+            ex_error("`--mda' is for one destination, without `--ecmp', `--mtu', `--jsonl' and `--auto-fallback'");
+        if (mda_confidence <= 0 || mda_confidence >= 100)
+            ex_error("bad mda confidence `%g' specified", mda_confidence);
+        if (continuous)
+            ex_error("`--mda' cannot be continuous");
+    }
+    if ((xdp_queues || xdp_busy_poll) && !device)
+        ex_error("`--xdp-queues' and `--xdp-busy-poll' need an interface specified by `-i'");
+    if (xdp_tx) {
+        if (!device)
+            ex_error("`--xdp-tx' needs an interface specified by `-i'");
+        if (strcmp(ops->name, "default") && strcmp(ops->name, "icmp") && strcmp(ops->name, "tcp"))
+            ex_error("`--xdp-tx' works with default, icmp and tcp methods only");
+        if (num_gateways || mtudisc || dontfrag)
+            ex_error("`--xdp-tx' cannot be used with gateways, `--mtu' and `-F'");
+        if (flow_label && (ecmp || mda))
+            ex_error("`--xdp-tx' cannot vary the flow label per flow");
+    }
+    if (hist_digits < HDR_MIN_DIGITS || hist_digits > HDR_MAX_DIGITS)
+        ex_error("histogram digits must be from " _TEXT(HDR_MIN_DIGITS) " to " _TEXT(HDR_MAX_DIGITS));
+    if (continuous && interval < 0)
+        ex_error("bad interval `%g' specified", interval);
     if (!probes_per_hop || probes_per_hop > MAX_PROBES)
         ex_error("no more than " _TEXT(MAX_PROBES) " probes per hop");
     if (sim_probes > MAX_SIM_PROBES)
@@ -772,16 +1121,26 @@ int main(int argc, char* argv[]) {
     if (send_secs >= 10) /*  it is milliseconds   */
         send_secs /= 1000;
 
-    if (af == AF_INET6 && (tos || flow_label))
-        dst_addr.sin6.sin6_flowinfo = htonl(((tos & 0xff) << 20) | (flow_label & 0x000fffff));
+    if (af == AF_INET6 && (tos || flow_label)) {
+        for (i = 0; i < num_traces; i++)
+            traces[i].addr.sin6.sin6_flowinfo = htonl(((tos & 0xff) << 20) | (flow_label & 0x000fffff));
+    }
+
+    /*  the first one is used for module init and ip options   */
+    dst_addr = traces[0].addr;
 
     if (src_port) {
         src_addr.sin.sin_port = htons((uint16_t)src_port);
         src_addr.sa.sa_family = af;
     }
 
-    if (src_port || ops->one_per_time) {
+    rate_limited = rate_limit[0] || dest_rate_limit[0] || router_rate_limit[0];
+    if (rate_limited)
+        ratelimit_init(num_traces, rate_limit, dest_rate_limit, router_rate_limit, get_time());
+
+    if ((src_port && !mda) || ops->one_per_time) {
         sim_probes = 1;
+        fixed_window = 1;
         here_factor = near_factor = 0;
     }
 
@@ -797,6 +1156,7 @@ int main(int argc, char* argv[]) {
     if (mtudisc) {
         dontfrag = 1;
         sim_probes = 1;
+        fixed_window = 1;
         if (packet_len < 0)
             packet_len = MAX_PACKET_LEN;
     }
@@ -810,10 +1170,20 @@ int main(int argc, char* argv[]) {
             data_len = (size_t)packet_len - header_len;
     }
 
-    num_probes = max_hops * probes_per_hop;
-    probes = calloc(num_probes, sizeof(*probes));
-    if (!probes)
-        error("calloc");
+    setup_traces();
+
+    /*  a name is to be kept till its hop is printed   */
+    if (!noresolve)
+        resolve_size(num_probes / probes_per_hop);
+
+    if (cache_file)
+        resolve_cache(cache_file);
+    if (as_db_file) {
+        resolve_as_db(as_db_file);
+        as_lookups = 1;
+    }
+    else if (as_lookups && as_init() < 0)
+        as_lookups = 0; /*  not worth to fail the trace for   */
 
     if (ops->options && opts_idx > 1) {
         opts[0] = strdup(module); /*  aka argv[0] ...  */
@@ -826,7 +1196,7 @@ int main(int argc, char* argv[]) {
 
     if (bpf_mode != 2) {
         const char* bpf_objs[] = {"probe.bpf.o", "bpf/probe.bpf.o", "/usr/share/traceroute/probe.bpf.o", NULL};
-        int i;
+
         for (i = 0; bpf_objs[i]; i++) {
             if (access(bpf_objs[i], R_OK) == 0) {
                 if (bpf_init(bpf_objs[i]) == 0) {
@@ -841,10 +1211,19 @@ int main(int argc, char* argv[]) {
     }
 
     if (device) {
-        xdp_init(device, "xdp_probe.bpf.o");
+        if (xdp_init(device, "xdp_probe.bpf.o", xdp_tx, xdp_queues, xdp_busy_poll) < 0 &&
+            (xdp_tx || xdp_queues || xdp_busy_poll))
+            ex_error("AF_XDP initialization failed on %s", device);
     }
 
-    do_it();
+    run_start = get_time();
+
+    if (mda)
+        do_mda();
+    else if (continuous)
+        do_continuous();
+    else
+        do_it();
 
     xdp_cleanup();
     bpf_cleanup();
@@ -854,10 +1233,9 @@ int main(int argc, char* argv[]) {
 
 /*	PRINT  STUFF	    */
 
-static void print_header(void) {
+static void print_header(const char* name, const sockaddr_any* addr, unsigned int hops, size_t len) {
     /*  Note, without ending new-line!  */
-    printf("traceroute to %s (%s), %u hops max, %zu byte packets", dst_name, addr2str(&dst_addr), max_hops,
-           header_len + data_len);
+    printf("traceroute to %s (%s), %u hops max, %zu byte packets", name, addr2str(addr), hops, len);
     fflush(stdout);
 }
 
@@ -872,19 +1250,24 @@ static void print_addr(sockaddr_any* res) {
     if (noresolve)
         printf(" %s", str);
     else {
-        char buf[1024];
+        double until;
+        const char* name = resolve_lookup(res, &until);
 
-        buf[0] = '\0';
-        getnameinfo(&res->sa, sizeof(*res), buf, sizeof(buf), 0, 0, NI_IDN);
-        printf(" %s (%s)", buf[0] ? buf : str, str);
+        /*  not resolved in time prints as no name   */
+        printf(" %s (%s)", name && name[0] ? name : str, str);
     }
 
-    if (as_lookups)
-        printf(" [%s]", get_as_path(str));
+    if (as_lookups) {
+        double until;
+        const char* path = resolve_as_path(res, &until);
+
+        if (path) /*  nothing when no answer in time   */
+            printf(" [%s]", path);
+    }
 }
 
 static void print_probe(probe* pb) {
-    unsigned int idx = (pb - probes);
+    unsigned int idx = (pb - probe_trace(pb)->probes);
     unsigned int ttl = idx / probes_per_hop + 1;
     unsigned int np = idx % probes_per_hop;
 
@@ -938,27 +1321,61 @@ static void print_probe(probe* pb) {
 }
 
 static void print_end(void) {
-    bpf_print_histograms();
+    if (reported_traces + 1 == num_traces) /*  totals for the whole run   */
+        bpf_print_histograms();
     printf("\n");
 }
 
 void tr_report_header(const char* dst_name, const sockaddr_any* dst_addr, unsigned int max_hops, size_t packet_len) {
+    if (continuous) { /*  the stats have their own headers   */
+        if (jsonl && round_num == 1)
+            tr_export_jsonl_header(dst_name, dst_addr, max_hops, packet_len);
+        return;
+    }
+
     if (jsonl)
         tr_export_jsonl_header(dst_name, dst_addr, max_hops, packet_len);
     if (!quiet)
-        print_header();
+        print_header(dst_name, dst_addr, max_hops, packet_len);
 }
 
+static void add_stats(probe* pb);
+
 void tr_report_probe(probe* pb) {
+    if (continuous) {
+        add_stats(pb);
+        return;
+    }
+
     if (jsonl)
         tr_export_jsonl_probe(pb);
     if (!quiet)
         print_probe(pb);
 }
 
-void tr_report_end(void) {
-    if (jsonl)
-        tr_export_jsonl_end();
+/*  Once exported, the histograms are of no use anymore   */
+static void free_hists(trace* tr) {
+    unsigned int i;
+
+    if (!tr->hists)
+        return;
+
+    for (i = 0; i < tr->max_hops; i++)
+        hdr_free(&tr->hists[i]);
+    free(tr->hists);
+    tr->hists = NULL; /*  late replies are not recorded then   */
+}
+
+void tr_report_end(trace* tr) {
+    if (continuous)
+        return;
+
+    if (jsonl) {
+        if (reported_traces + 1 == num_traces) /*  totals for the whole run   */
+            bpf_export_histograms();
+        tr_export_jsonl_end(tr);
+        free_hists(tr);
+    }
     if (!quiet)
         print_end();
 }
@@ -966,13 +1383,14 @@ void tr_report_end(void) {
 /*	Compute  timeout  stuff		*/
 
 static double get_timeout(probe* pb) {
+    trace* tr = probe_trace(pb);
     double value;
 
     if (here_factor) {
         /*  check for already replied from the same hop   */
         unsigned int i;
-        int idx = (pb - probes);
-        probe* p = &probes[idx - (idx % probes_per_hop)];
+        int idx = (pb - tr->probes);
+        probe* p = &tr->probes[idx - (idx % probes_per_hop)];
 
         for (i = 0; i < probes_per_hop; i++, p++) {
             /*   `p == pb' skipped since  !pb->done   */
@@ -987,7 +1405,7 @@ static double get_timeout(probe* pb) {
 
     if (near_factor) {
         /*  check forward for already replied   */
-        probe *p, *endp = probes + num_probes;
+        probe *p, *endp = tr->probes + tr->num_probes;
 
         for (p = pb + 1; p < endp && p->send_time; p++) {
             if (p->done && (value = p->recv_time - p->send_time) > 0) {
@@ -1001,6 +1419,12 @@ static double get_timeout(probe* pb) {
     return wait_secs;
 }
 
+/*  Get the probe slot ready for another probe   */
+static void clear_probe(probe* pb) {
+    free(pb->ext);
+    memset(pb, 0, sizeof(*pb));
+}
+
 /*	Check  expiration  stuff	*/
 
 static void check_expired(probe* pb) {
@@ -1012,153 +1436,403 @@ static void check_expired(probe* pb) {
     return;
 }
 
+/*  Probes in flight are indexed by their seq and socket, from the time
+   they are sent until probe_done().
+*/
+static probe_index seq_index = {0};
+static probe_index sk_index = {0};
+
+static void index_probe(probe* pb) {
+    index_add(&seq_index, pb->seq, pb);
+    index_add(&sk_index, pb->sk, pb);
+}
+
 probe* probe_by_seq(int seq) {
-    unsigned int n;
+    return index_find(&seq_index, seq);
+}
+
+probe* probe_by_sk(int sk) {
+    return index_find(&sk_index, sk);
+}
+
+static void poll_callback(int fd, int revents) {
+    ops->recv_probe(fd, revents);
+}
+
+/*  Whether the name (or AS path) for `pb' is still worth to wait for
+   before printing, `*until_p' is the time to wait till.
+*/
+static int wait_lookups(const probe* pb, double* until_p) {
+    double until;
+
+    *until_p = 0;
+
+    if (quiet || !pb->res.sa.sa_family)
+        return 0;
+
+    if (!noresolve && !resolve_lookup(&pb->res, &until) && until > *until_p)
+        *until_p = until;
+
+    if (as_lookups && !resolve_as_path(&pb->res, &until) && until > *until_p)
+        *until_p = until;
+
+    return *until_p > get_time();
+}
+
+/*  Set by report_traces() when it has stopped on a lookup in progress   */
+static double report_wait = 0;
+
+/*  Print whatever is ready, in the order of traces. Only the first
+   unfinished trace is printed as it goes, others wait for their turn.
+   A probe is printed once the name (and AS path) of its hop is known
+   (or no more expected), so that the lookups never delay the probing.
+*/
+static void report_traces(int flush) {
+    report_wait = 0;
+
+    while (reported_traces < num_traces) {
+        trace* tr = &traces[reported_traces];
+
+        if (tr->state == TRACE_PENDING && !flush)
+            return;
+
+        if (!tr->reported) {
+            tr_report_header(tr->name, &tr->addr, tr->max_hops, header_len + data_len);
+            tr->reported = 1;
+        }
+
+        while (tr->printed < tr->start) {
+            probe* pb = &tr->probes[tr->printed];
+
+            if (!flush && wait_lookups(pb, &report_wait))
+                return;
 
-    if (seq <= 0)
-        return NULL;
+            tr_report_probe(pb);
+            tr->printed++;
+        }
+
+        if (tr->state != TRACE_DONE && !flush)
+            return;
 
-    for (n = 0; n < num_probes; n++) {
-        if (probes[n].seq == seq)
-            return &probes[n];
+        tr_report_end(tr);
+        reported_traces++;
     }
+}
 
-    return NULL;
+static double last_send = 0;
+
+/*  With ops->send_batch, probes of the whole window (of all the traces)
+   are collected here first and then sent by one call. Only the default
+   method has it: its probes differ by the dest port alone, so all share
+   one buffer, while icmp, tcp etc. build each probe in place and are
+   still sent one by one.
+*/
+static probe** batch_probes = NULL;
+static int* batch_ttls = NULL;
+static unsigned int batch_num = 0;
+static unsigned int batch_max = 0;
+
+static void queue_probe(probe* pb, int ttl) {
+    if (batch_num == batch_max) {
+        batch_max = batch_max ? batch_max * 2 : 64;
+        batch_probes = realloc(batch_probes, batch_max * sizeof(*batch_probes));
+        batch_ttls = realloc(batch_ttls, batch_max * sizeof(*batch_ttls));
+        if (!batch_probes || !batch_ttls)
+            error("realloc");
+    }
+
+    batch_probes[batch_num] = pb;
+    batch_ttls[batch_num] = ttl;
+    batch_num++;
 }
 
-probe* probe_by_sk(int sk) {
-    unsigned int n;
+/*  Probes put on the AF_XDP ring leave at xdp_tx_flush(), so they
+   are stamped by it rather than by the module. The ring is flushed
+   once per scheduling round (see flush_xmit()), or each XMIT_BATCH
+   probes, to not stamp the first ones much too late.
+*/
+#define XMIT_BATCH 64
+
+static probe* xmit_probes[XMIT_BATCH];
+static unsigned int xmit_num = 0;
 
-    if (sk <= 0)
-        return NULL;
+static void flush_xmit(void) {
+    double xmit_time = xdp_tx_flush();
+    unsigned int i;
 
-    for (n = 0; n < num_probes; n++) {
-        if (probes[n].sk == sk)
-            return &probes[n];
+    for (i = 0; i < xmit_num; i++) {
+        if (xmit_time && xmit_probes[i]->send_time)
+            xmit_probes[i]->send_time = xmit_time;
     }
 
-    return NULL;
+    xmit_num = 0;
 }
 
-static void poll_callback(int fd, int revents) {
-    bpf_poll(fd, revents);
-    xdp_poll(fd, revents);
-    ops->recv_probe(fd, revents);
+static void send_probe(probe* pb, int ttl) {
+    unsigned int count = xdp_tx ? xdp_tx_count() : 0;
+
+    xdp_track_probe(pb);
+    ops->send_probe(pb, ttl);
+    xdp_track_probe(NULL);
+
+    if (!xdp_tx || !pb->send_time || xdp_tx_count() == count)
+        return; /*  the kernel way, sent already   */
+
+    xmit_probes[xmit_num++] = pb;
+    if (xmit_num == XMIT_BATCH)
+        flush_xmit();
 }
 
-static void do_it(void) {
-    unsigned int start = (first_hop - 1) * probes_per_hop;
-    unsigned int end = num_probes;
-    double last_send = 0;
-    double start_time = get_time();
-    int consecutive_losses = 0;
+static double flush_batch(void) {
+    unsigned int i;
+    double next_time = 0;
+    double xmit_time = 0;
 
-    tr_report_header(dst_name, &dst_addr, max_hops, header_len + data_len);
+    ops->send_batch(batch_probes, batch_ttls, batch_num);
 
-    while (start < end) {
-        unsigned int n, num = 0;
-        double next_time = 0;
-        double now_time = get_time();
+    if (xdp_tx)
+        xmit_time = xdp_tx_flush();
 
-        if (deadline > 0 && now_time - start_time > deadline) {
-            /* Deadline reached - terminate immediately */
-            break;
+    for (i = 0; i < batch_num; i++) {
+        probe* pb = batch_probes[i];
+        double expire_time;
+
+        if (!pb->send_time) {
+            /*  have chances later, with the tokens taken again then   */
+            if (rate_limited)
+                ratelimit_refund(probe_trace(pb) - traces, get_time());
+            continue;
         }
+        if (xmit_time)
+            pb->send_time = xmit_time;
 
-        for (n = start; n < end; n++) {
-            probe* pb = &probes[n];
+        index_probe(pb);
+        last_send = pb->send_time;
 
-            if (n == start &&              /*  probably time to print...  */
-                !pb->done && pb->send_time /*  ...but yet not replied   */
-            ) {
-                double expire_time = pb->send_time + get_timeout(pb);
+        expire_time = pb->send_time + get_timeout(pb);
+        if (!next_time || expire_time < next_time)
+            next_time = expire_time;
+    }
 
-                if (expire_time > now_time)
-                    next_time = expire_time;
-                else {
-                    ops->expire_probe(pb);
-                    check_expired(pb);
-                }
+    batch_num = 0;
+
+    return next_time;
+}
+
+/*  The router which has answered for the hop of probe `n', if any   */
+static const sockaddr_any* hop_router(const trace* tr, unsigned int n) {
+    unsigned int i = n - n % probes_per_hop;
+
+    for (; i < n; i++) {
+        if (tr->probes[i].res.sa.sa_family)
+            return &tr->probes[i].res;
+    }
+
+    return NULL;
+}
+
+/*  Probes sent beyond the final hop are not waited for, but still
+   have to leave the indexes (and close their sockets).
+*/
+static void expire_beyond(trace* tr) {
+    unsigned int n;
+
+    for (n = tr->end; n < tr->num_probes; n++) {
+        probe* pb = &tr->probes[n];
+
+        if (pb->send_time && !pb->done)
+            ops->expire_probe(pb);
+    }
+}
+
+static double trace_step(trace* tr, double now_time) {
+    unsigned int n, num = 0;
+    unsigned int window = scheduler_window(&tr->sched);
+    double next_time = 0;
+
+    for (n = tr->start; n < tr->end; n++) {
+        probe* pb = &tr->probes[n];
+
+        if (n == tr->start &&          /*  probably time to print...  */
+            !pb->done && pb->send_time /*  ...but yet not replied   */
+        ) {
+            double expire_time = pb->send_time + get_timeout(pb);
+
+            if (expire_time > now_time)
+                next_time = expire_time;
+            else {
+                ops->expire_probe(pb);
+                check_expired(pb);
             }
+        }
 
-            if (pb->done) {
-                if (n == start) { /*  can print it now   */
-                    tr_report_probe(pb);
-                    start++;
-
-                    if (start % probes_per_hop == 0) {
-                        /* Check if the whole hop failed */
-                        int hop_failed = 1;
-                        unsigned int i;
-                        for (i = start - probes_per_hop; i < start; i++) {
-                            if (probes[i].res.sa.sa_family) {
-                                hop_failed = 0;
-                                break;
-                            }
+        if (pb->done) {
+            if (n == tr->start) { /*  can print it now   */
+                tr->start++;
+                report_traces(0);
+
+                if (tr->start % probes_per_hop == 0) {
+                    /* Check if the whole hop failed */
+                    int hop_failed = 1;
+                    unsigned int i;
+                    for (i = tr->start - probes_per_hop; i < tr->start; i++) {
+                        if (tr->probes[i].res.sa.sa_family) {
+                            hop_failed = 0;
+                            break;
                         }
+                    }
 
-                        if (hop_failed)
-                            consecutive_losses++;
-                        else
-                            consecutive_losses = 0;
-
-                        if (auto_fallback && consecutive_losses >= 3 && strcmp(ops->name, "tcp") != 0) {
-                            const tr_module* next_ops = tr_get_module("tcp");
-                            if (next_ops) {
-                                size_t dummy_len = data_len;
-                                if (next_ops->init(&dst_addr, 0, &dummy_len) == 0) {
-                                    ops = next_ops;
-                                    if (!quiet)
-                                        printf("\n[Fallback to TCP SYN probes at hop %u]", start / probes_per_hop + 1);
-                                }
+                    if (hop_failed)
+                        tr->consecutive_losses++;
+                    else
+                        tr->consecutive_losses = 0;
+
+                    if (auto_fallback && tr->consecutive_losses >= 3 && strcmp(ops->name, "tcp") != 0) {
+                        const tr_module* next_ops = tr_get_module("tcp");
+                        if (next_ops) {
+                            size_t dummy_len = data_len;
+                            if (next_ops->init(&tr->addr, 0, &dummy_len) == 0) {
+                                ops = next_ops;
+                                if (!quiet)
+                                    printf("\n[Fallback to TCP SYN probes at hop %u]",
+                                           tr->start / probes_per_hop + 1);
                             }
                         }
                     }
                 }
+            }
 
-                if (pb->final)
-                    end = (n / probes_per_hop + 1) * probes_per_hop;
+            if (pb->final)
+                tr->end = (n / probes_per_hop + 1) * probes_per_hop;
 
+            continue;
+        }
+
+        if (!pb->send_time) {
+            int ttl;
+            double next;
+
+            if (send_secs && (next = last_send + send_secs) > now_time) {
+                next_time = next;
+                break;
+            }
+
+            if (rate_limited && (next = ratelimit_send(tr - traces, hop_router(tr, n), now_time)) != 0) {
+                if (!next_time || next < next_time)
+                    next_time = next;
+                break;
+            }
+
+            ttl = (int)(n / probes_per_hop + 1);
+
+            if (ops->send_batch && !send_secs) {
+                queue_probe(pb, ttl);
+
+                num++;
+                if (num >= window)
+                    break;
                 continue;
             }
 
+            if (num_traces > 1)
+                ops->set_dest(&tr->addr);
+
+            send_probe(pb, ttl);
+
             if (!pb->send_time) {
-                int ttl;
-                double next;
+                if (rate_limited)
+                    ratelimit_refund(tr - traces, now_time);
+                if (next_time)
+                    break; /*  have chances later   */
+                else
+                    error("send probe");
+            }
 
-                if (send_secs && (next = last_send + send_secs) > now_time) {
-                    next_time = next;
-                    break;
-                }
+            index_probe(pb);
+            last_send = pb->send_time;
+        }
 
-                ttl = (int)(n / probes_per_hop + 1);
+        if (!next_time)
+            next_time = pb->send_time + get_timeout(pb);
 
-                ops->send_probe(pb, ttl);
+        num++;
+        if (num >= window)
+            break;
+    }
 
-                if (!pb->send_time) {
-                    if (next_time)
-                        break; /*  have chances later   */
-                    else
-                        error("send probe");
-                }
+    if (tr->start >= tr->end) {
+        expire_beyond(tr);
+        tr->state = TRACE_DONE;
+        report_traces(0);
+    }
+
+    return next_time;
+}
+
+static void do_it(void) {
+    unsigned int first_active = 0; /*  all before are done   */
+    unsigned int next_pending = 0;
+    unsigned int running = 0;
+
+    while (reported_traces < num_traces) {
+        unsigned int i;
+        double next_time = 0;
+        double now_time = get_time();
 
-                last_send = pb->send_time;
+        if (deadline > 0 && now_time - run_start > deadline) {
+            /* Deadline reached - terminate immediately */
+            break;
+        }
+
+        while (next_pending < num_traces && running < concurrency) {
+            traces[next_pending++].state = TRACE_RUNNING;
+            running++;
+        }
+
+        report_traces(0);
+
+        for (i = first_active; i < next_pending; i++) {
+            trace* tr = &traces[i];
+            double t;
+
+            if (tr->state != TRACE_RUNNING) {
+                if (i == first_active)
+                    first_active++;
+                continue;
             }
 
-            if (!next_time)
-                next_time = pb->send_time + get_timeout(pb);
+            t = trace_step(tr, now_time);
 
-            num++;
-            if (num >= sim_probes)
-                break;
+            if (tr->state == TRACE_DONE) {
+                running--;
+                continue;
+            }
+
+            if (t && (!next_time || t < next_time))
+                next_time = t;
+        }
+
+        if (xmit_num)
+            flush_xmit();
+
+        if (batch_num) {
+            double t = flush_batch();
+
+            if (t && (!next_time || t < next_time))
+                next_time = t;
+            if (!next_time)
+                error("send probe");
         }
 
+        if (report_wait && (!next_time || report_wait < next_time))
+            next_time = report_wait;
+
         if (next_time) {
             double now = get_time();
             double timeout = next_time - now;
 
             if (deadline > 0) {
-                double remaining = deadline - (now - start_time);
+                double remaining = deadline - (now - run_start);
                 if (remaining < 0)
                     remaining = 0;
                 if (remaining < timeout)
@@ -1172,11 +1846,365 @@ static void do_it(void) {
         }
     }
 
-    tr_report_end();
+    report_traces(1);
 
     return;
 }
 
+/*	MULTIPATH  DETECTION	*/
+
+/*  The latest time to wait till for the names (and AS paths)
+   of the interfaces found, if still worth to wait.
+*/
+static double mda_lookups_until(unsigned int first, unsigned int last) {
+    unsigned int ttl, i;
+    double until, max = 0;
+
+    for (ttl = first; ttl <= last; ttl++) {
+        for (i = 0; i < mda_num_ifaces(ttl); i++) {
+            const sockaddr_any* addr = mda_iface(ttl, i);
+
+            if (!noresolve && !resolve_lookup(addr, &until) && until > max)
+                max = until;
+            if (as_lookups && !resolve_as_path(addr, &until) && until > max)
+                max = until;
+        }
+    }
+
+    return max > get_time() ? max : 0;
+}
+
+/*  Each interface is followed by the ones of the previous hop it has
+   been reached through, unless there was just one.
+*/
+static void print_mda(unsigned int first, unsigned int last) {
+    unsigned int ttl, i, j;
+
+    for (ttl = first; ttl <= last; ttl++) {
+        unsigned int num = mda_num_ifaces(ttl);
+        unsigned int prev_num = ttl > first ? mda_num_ifaces(ttl - 1) : 0;
+
+        printf("\n%2u ", ttl);
+
+        if (!num)
+            printf(" *");
+
+        for (i = 0; i < num; i++) {
+            sockaddr_any addr = *mda_iface(ttl, i);
+            const char* sep = " <-";
+
+            if (i)
+                printf("\n   ");
+
+            print_addr(&addr);
+
+            if (prev_num < 2)
+                continue;
+
+            for (j = 0; j < prev_num; j++) {
+                if (mda_linked(ttl, j, i)) {
+                    printf("%s %s", sep, addr2str(mda_iface(ttl - 1, j)));
+                    sep = ",";
+                }
+            }
+        }
+    }
+
+    printf("\n%u probes sent", mda_probes_sent());
+    fflush(stdout);
+}
+
+/*  The probes of the (only) trace's slice are used as a pool of
+   `sim_probes' slots, the engine choosing the ttl and the flow
+   for each one to send, and taking each one done back.
+*/
+static void do_mda(void) {
+    trace* tr = &traces[0];
+    unsigned int pool = sim_probes < tr->num_probes ? sim_probes : tr->num_probes;
+    unsigned int last_ttl = tr->first_hop;
+    int* ttls;
+    int ret = 1;
+    double until;
+
+    ttls = calloc(pool, sizeof(*ttls));
+    if (!ttls)
+        error("calloc");
+
+    mda_init(tr->first_hop, tr->max_hops, MAX_MDA_FLOWS, mda_confidence / 100);
+
+    tr->state = TRACE_RUNNING;
+    tr_report_header(tr->name, &tr->addr, tr->max_hops, header_len + data_len);
+
+    while (ret >= 0) {
+        unsigned int i;
+        double next_time = 0;
+        double now_time = get_time();
+
+        if (deadline > 0 && now_time - run_start > deadline)
+            break;
+
+        for (i = 0; i < pool; i++) {
+            probe* pb = &tr->probes[i];
+
+            if (!pb->send_time)
+                continue;
+
+            if (!pb->done) {
+                double expire_time = pb->send_time + wait_secs;
+
+                if (expire_time > now_time) {
+                    if (!next_time || expire_time < next_time)
+                        next_time = expire_time;
+                    continue;
+                }
+
+                ops->expire_probe(pb);
+            }
+
+            mda_result(ttls[i], pb);
+            clear_probe(pb);
+        }
+
+        for (i = 0; i < pool; i++) {
+            probe* pb = &tr->probes[i];
+            double next;
+            int ttl;
+
+            if (pb->send_time)
+                continue;
+
+            if (send_secs && (next = last_send + send_secs) > now_time) {
+                if (!next_time || next < next_time)
+                    next_time = next;
+                break;
+            }
+
+            if (rate_limited && (next = ratelimit_send(0, NULL, now_time)) != 0) {
+                if (!next_time || next < next_time)
+                    next_time = next;
+                break;
+            }
+
+            ret = mda_next(&ttl, &pb->flow);
+            if (ret <= 0)
+                break;
+
+            send_probe(pb, ttl);
+            if (!pb->send_time)
+                error("send probe");
+
+            index_probe(pb);
+            last_send = pb->send_time;
+            ttls[i] = ttl;
+            if ((unsigned int)ttl > last_ttl)
+                last_ttl = ttl;
+
+            if (!next_time || pb->send_time + wait_secs < next_time)
+                next_time = pb->send_time + wait_secs;
+        }
+
+        if (xmit_num)
+            flush_xmit();
+
+        if (ret >= 0 && next_time) {
+            double timeout = next_time - get_time();
+
+            do_poll(timeout > 0 ? timeout : 0, poll_callback);
+        }
+    }
+
+    tr->state = TRACE_DONE;
+
+    if (!quiet) {
+        while ((until = mda_lookups_until(tr->first_hop, last_ttl)) != 0)
+            do_poll(until - get_time(), poll_callback);
+
+        print_mda(tr->first_hop, last_ttl);
+    }
+
+    tr_report_end(tr);
+    reported_traces++;
+
+    free(ttls);
+}
+
+/*	CONTINUOUS  STUFF	*/
+
+/*  In continuous mode the probes go to the stats of their hops
+   instead of printing (see tr_report_probe()).
+*/
+static void add_stats(probe* pb) {
+    trace* tr = probe_trace(pb);
+    unsigned int hop = (pb - tr->probes) / probes_per_hop;
+
+    if (!pb->send_time)
+        return; /*  never sent, at the deadline   */
+
+    if (pb->res.sa.sa_family)
+        tr->hop_res[hop] = pb->res;
+
+    hop_stats_add(&tr->stats[hop], pb->recv_time ? pb->recv_time - pb->send_time : -1);
+}
+
+static void print_stats(const trace* tr, unsigned int last) {
+    unsigned int ttl;
+    int i;
+
+    print_header(tr->name, &tr->addr, tr->max_hops, header_len + data_len);
+    printf(", round %u", round_num);
+
+    for (ttl = tr->first_hop; ttl <= last; ttl++) {
+        const HopStats* hs = &tr->stats[ttl - 1];
+        sockaddr_any res = tr->hop_res[ttl - 1];
+
+        printf("\n%2u ", ttl);
+
+        if (!res.sa.sa_family)
+            printf(" *");
+        else
+            print_addr(&res);
+
+        printf("  loss %.1f%%", hop_stats_loss(hs) * 100);
+
+        if (!hs->received)
+            continue;
+
+        printf("  last %.3f  avg %.3f  ewma %.3f  jitter %.3f  min %.3f  max %.3f", hs->last * 1000,
+               hop_stats_mean(hs) * 1000, hs->ewma * 1000, hs->jitter * 1000, hs->min * 1000, hs->max * 1000);
+
+        for (i = 0; i < HOP_STATS_QUANTILES; i++)
+            printf("  p%g %.3f", hop_stats_quantile_p[i] * 100, hop_stats_quantile(hs, i) * 1000);
+
+        printf(" ms");
+    }
+
+    printf("\n\n");
+    fflush(stdout);
+}
+
+/*  The snapshot after a round, up to the hops reached this time   */
+static void report_stats(void) {
+    unsigned int i, ttl;
+
+    for (i = 0; i < num_traces; i++) {
+        const trace* tr = &traces[i];
+        unsigned int last = tr->end / probes_per_hop;
+
+        if (last > tr->max_hops)
+            last = tr->max_hops;
+
+        if (jsonl) {
+            for (ttl = tr->first_hop; ttl <= last; ttl++)
+                tr_export_jsonl_stats(tr, round_num, ttl);
+        }
+        if (!quiet)
+            print_stats(tr, last);
+    }
+}
+
+/*  Get all the traces ready for one more round, the stats kept   */
+static void reset_traces(void) {
+    unsigned int i;
+
+    for (i = 0; i < num_probes; i++) {
+        probe* pb = &probes[i];
+
+        if (pb->send_time && !pb->done)
+            ops->expire_probe(pb); /*  sent beyond the final hop   */
+
+        clear_probe(pb);
+    }
+
+    for (i = 0; i < num_traces; i++) {
+        trace* tr = &traces[i];
+
+        tr->start = tr->printed = (tr->first_hop - 1) * probes_per_hop;
+        tr->end = tr->num_probes;
+        tr->consecutive_losses = 0;
+        tr->state = TRACE_PENDING;
+        tr->reported = 0;
+    }
+
+    reported_traces = 0;
+}
+
+/*  The whole run again each `interval' seconds, with the same sockets,
+   BPF programs and name caches, until `rounds' or the deadline.
+*/
+static void do_continuous(void) {
+    for (round_num = 1;; round_num++) {
+        double round_start = get_time();
+        double now;
+
+        do_it();
+        report_stats();
+
+        if (rounds && round_num >= rounds)
+            break;
+        if (deadline > 0 && get_time() - run_start > deadline)
+            break;
+
+        reset_traces();
+
+        while ((now = get_time()) < round_start + interval) {
+            double timeout = round_start + interval - now;
+
+            if (deadline > 0 && run_start + deadline - now < timeout)
+                timeout = run_start + deadline - now;
+            if (timeout <= 0)
+                break;
+
+            do_poll(timeout, poll_callback); /*  late replies and lookups   */
+        }
+    }
+
+    if (jsonl) {
+        unsigned int i;
+
+        bpf_export_histograms();
+        for (i = 0; i < num_traces; i++) {
+            tr_export_jsonl_end(&traces[i]);
+            free_hists(&traces[i]);
+        }
+    }
+    if (!quiet)
+        bpf_print_histograms();
+}
+
+static void get_flowlabel(int sk, unsigned int label, const sockaddr_any* dest) {
+    struct in6_flowlabel_req flr;
+
+    memset(&flr, 0, sizeof(flr));
+    flr.flr_label = htonl(label & 0x000fffff);
+    flr.flr_action = IPV6_FL_A_GET;
+    flr.flr_flags = IPV6_FL_F_CREATE;
+    flr.flr_share = IPV6_FL_S_ANY;
+    memcpy(&flr.flr_dst, &dest->sin6.sin6_addr, sizeof(flr.flr_dst));
+
+    if (setsockopt(sk, IPPROTO_IPV6, IPV6_FLOWLABEL_MGR, &flr, sizeof(flr)) < 0)
+        error("setsockopt IPV6_FLOWLABEL_MGR");
+}
+
+/*  tune_socket() leases the flow label for the destination of the probe
+   it is given. A socket shared by all the traces needs a lease for each
+   destination as well, taken here on its first probe to it.
+*/
+void lease_flowlabel(int sk, probe* pb) {
+    trace* tr;
+    unsigned int flow;
+
+    if (af != AF_INET6 || !flow_label)
+        return;
+
+    tr = probe_trace(pb);
+    flow = flow_index(pb);
+    if (tr->leased & (1U << flow))
+        return;
+
+    get_flowlabel(sk, flow_label + flow, &tr->addr);
+    tr->leased |= 1U << flow;
+}
+
 void tune_socket(int sk, probe* pb) {
     int i = 0;
 
@@ -1224,26 +2252,8 @@ void tune_socket(int sk, probe* pb) {
             (!dontfrag || (i = IPV6_PMTUDISC_DO, setsockopt(sk, SOL_IPV6, IPV6_MTU_DISCOVER, &i, sizeof(i)) < 0)))
             error("setsockopt IPV6_MTU_DISCOVER");
 
-        if (flow_label) {
-            struct in6_flowlabel_req flr;
-            unsigned int label = flow_label;
-
-            if (ecmp && pb) {
-                unsigned int np = (pb - probes) % probes_per_hop;
-                unsigned int flow_idx = np % ecmp;
-                label += flow_idx;
-            }
-
-            memset(&flr, 0, sizeof(flr));
-            flr.flr_label = htonl(label & 0x000fffff);
-            flr.flr_action = IPV6_FL_A_GET;
-            flr.flr_flags = IPV6_FL_F_CREATE;
-            flr.flr_share = IPV6_FL_S_ANY;
-            memcpy(&flr.flr_dst, &dst_addr.sin6.sin6_addr, sizeof(flr.flr_dst));
-
-            if (setsockopt(sk, IPPROTO_IPV6, IPV6_FLOWLABEL_MGR, &flr, sizeof(flr)) < 0)
-                error("setsockopt IPV6_FLOWLABEL_MGR");
-        }
+        if (flow_label)
+            get_flowlabel(sk, flow_label + (pb ? flow_index(pb) : 0), pb ? &probe_trace(pb)->addr : &dst_addr);
 
         if (tos) {
             i = tos;
@@ -1388,9 +2398,61 @@ static void parse_local_res(probe* pb, int ee_errno, int info) {
     error("local recverr");
 }
 
+/*  Whether some other probe of the same hop has been answered   */
+static int hop_answered(const trace* tr, const probe* pb) {
+    unsigned int n = pb - tr->probes;
+    unsigned int i, start = n - n % probes_per_hop;
+
+    for (i = start; i < start + probes_per_hop; i++) {
+        if (i != n && tr->probes[i].res.sa.sa_family)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*  Histograms are allocated on their first value, only the hops
+   answered need the room.
+*/
+static void record_hist(trace* tr, const probe* pb) {
+    HdrHist* h = &tr->hists[(pb - tr->probes) / probes_per_hop];
+    double rtt = pb->recv_time - pb->send_time;
+
+    if (!h->counts && hdr_init(h, MAX_HIST_US, hist_digits) < 0)
+        error("hdr_init");
+
+    hdr_record(h, rtt > 0 ? (uint64_t)(rtt * 1000000 + 0.5) : 0, 1);
+}
+
 void probe_done(probe* pb) {
+    trace* tr = probe_trace(pb);
+
+    if (rate_limited && pb->res.sa.sa_family)
+        ratelimit_reply(&pb->res, get_time());
+
+    /*  A silent hop is no congestion, a lost probe of an answering one is   */
+    if (pb->res.sa.sa_family)
+        scheduler_on_reply(&tr->sched);
+    else if (pb->send_time && hop_answered(tr, pb))
+        scheduler_on_loss(&tr->sched, pb->send_time, get_time());
+
+    if (tr->hists && pb->recv_time)
+        record_hist(tr, pb);
+
+    /*  look it up while the rest are being probed   */
+    if (!noresolve && !quiet && pb->res.sa.sa_family)
+        resolve_addr(&pb->res, get_time() + resolve_wait);
+    if (as_lookups && !quiet && pb->res.sa.sa_family)
+        resolve_as(&pb->res, get_time() + resolve_wait);
+
+    index_del(&seq_index, pb->seq, pb);
+    index_del(&sk_index, pb->sk, pb);
+    xdp_untrack(pb);
+
     if (pb->sk) {
         del_poll(pb->sk);
+        if (xdp_tx)
+            xdp_tx_forget(pb->sk);
         close(pb->sk);
         pb->sk = 0;
     }
@@ -1400,15 +2462,11 @@ void probe_done(probe* pb) {
     pb->done = 1;
 }
 
-void recv_reply(int sk, int err, check_reply_t check_reply) {
-    struct msghdr msg;
-    sockaddr_any from;
-    struct iovec iov;
-    int n;
+/*  Process one message received by recv_reply()   */
+static void handle_reply(int sk, int err, check_reply_t check_reply, struct msghdr* msg, char* buf, int n) {
+    sockaddr_any* from = msg->msg_name;
     probe* pb;
-    char buf[1280]; /*  min mtu for ipv6 ( >= 576 for ipv4)  */
     char* bufp = buf;
-    char control[1024];
     struct cmsghdr* cm;
     double recv_time = 0;
     int recv_ttl = 0;
@@ -1416,19 +2474,9 @@ void recv_reply(int sk, int err, check_reply_t check_reply) {
     int ifindex_out = 0;
     struct sock_extended_err* ee = NULL;
 
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = &from;
-    msg.msg_namelen = sizeof(from);
-    msg.msg_control = control;
-    msg.msg_controllen = sizeof(control);
-    iov.iov_base = buf;
-    iov.iov_len = sizeof(buf);
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-
-    n = recvmsg(sk, &msg, err ? MSG_ERRQUEUE : 0);
-    if (n < 0)
-        return;
+    /*  no address with the send timestamps, do not leave a previous one   */
+    if (!msg->msg_namelen)
+        memset(from, 0, sizeof(*from));
 
     /*  when not MSG_ERRQUEUE, AF_INET returns full ipv4 header
         on raw sockets...
@@ -1453,13 +2501,13 @@ void recv_reply(int sk, int err, check_reply_t check_reply) {
         n -= hlen;
     }
 
-    pb = check_reply(sk, err, &from, bufp, n);
+    pb = check_reply(sk, err, from, bufp, n);
     if (!pb) {
         /*  for `frag needed' case at the local host,
             kernel >= 3.13 sends local error (no more icmp)
         */
         if (!n && err && dontfrag) {
-            pb = &probes[(first_hop - 1) * probes_per_hop];
+            pb = &traces[0].probes[(traces[0].first_hop - 1) * probes_per_hop];
             if (pb->done)
                 return;
         }
@@ -1469,7 +2517,7 @@ void recv_reply(int sk, int err, check_reply_t check_reply) {
 
     /*  Parse CMSG stuff   */
 
-    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+    for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
         void* ptr = CMSG_DATA(cm);
 
         if (cm->cmsg_level == SOL_SOCKET) {
@@ -1535,7 +2583,7 @@ void recv_reply(int sk, int err, check_reply_t check_reply) {
         recv_time = get_time();
 
     if (!err)
-        memcpy(&pb->res, &from, sizeof(pb->res));
+        memcpy(&pb->res, from, sizeof(pb->res));
 
     pb->recv_time = recv_time;
 
@@ -1569,7 +2617,7 @@ void recv_reply(int sk, int err, check_reply_t check_reply) {
         /*  clear this probe (as actually the previous hop answers here)
           but fill its `err_str' by the info obtained. Ugly, but easy...
         */
-        memset(pb, 0, sizeof(*pb));
+        clear_probe(pb);
         pb->mtu = ee->ee_info;
         put_err(pb, "F=%d", ee->ee_info);
 
@@ -1595,6 +2643,73 @@ void recv_reply(int sk, int err, check_reply_t check_reply) {
     probe_done(pb);
 }
 
+#define RECV_BATCH 32
+
+static struct recv_slot {
+    sockaddr_any from;
+    struct iovec iov;
+    char buf[1280]; /*  min mtu for ipv6 ( >= 576 for ipv4)  */
+    char control[1024];
+} recv_ring[RECV_BATCH];
+static struct mmsghdr recv_msgs[RECV_BATCH];
+
+/*  Drain the queue (or the error queue) by recvmmsg(2), up to RECV_BATCH
+   messages per syscall, rather than one poll() round per reply.
+*/
+void recv_reply(int sk, int err, check_reply_t check_reply) {
+    int i, n;
+
+    do {
+        for (i = 0; i < RECV_BATCH; i++) {
+            struct recv_slot* slot = &recv_ring[i];
+            struct msghdr* msg = &recv_msgs[i].msg_hdr;
+
+            memset(msg, 0, sizeof(*msg));
+            msg->msg_name = &slot->from;
+            msg->msg_namelen = sizeof(slot->from);
+            msg->msg_control = slot->control;
+            msg->msg_controllen = sizeof(slot->control);
+            slot->iov.iov_base = slot->buf;
+            slot->iov.iov_len = sizeof(slot->buf);
+            msg->msg_iov = &slot->iov;
+            msg->msg_iovlen = 1;
+        }
+
+        n = recvmmsg(sk, recv_msgs, RECV_BATCH, MSG_DONTWAIT | (err ? MSG_ERRQUEUE : 0), NULL);
+        if (n <= 0)
+            return;
+
+        for (i = 0; i < n; i++)
+            handle_reply(sk, err, check_reply, &recv_msgs[i].msg_hdr, recv_ring[i].buf, recv_msgs[i].msg_len);
+
+    } while (n == RECV_BATCH);
+}
+
+/*  An icmp error got below the sockets (AF_XDP), so never seen by them.
+   `dest' and `buf' are what the error queue would have given: the quoted
+   destination (with the port) and the quoted transport header, still with
+   the module's header_len in front.
+*/
+void recv_quote(const sockaddr_any* from, sockaddr_any* dest, char* buf, size_t len, int type, int code, int info,
+                double recv_time) {
+    probe* pb;
+
+    if (!ops->check_reply || from->sa.sa_family != af || len < ops->header_len)
+        return;
+
+    pb = ops->check_reply(-1, 1, dest, buf, len); /*  with the header, see check_reply_t   */
+    if (!pb || pb->done)
+        return;
+
+    memcpy(&pb->res, from, sizeof(pb->res));
+    pb->recv_time = recv_time;
+    pb->recv_ttl = 0;
+
+    parse_icmp_res(pb, type, code, info);
+
+    probe_done(pb);
+}
+
 int equal_addr(const sockaddr_any* a, const sockaddr_any* b) {
     if (!a->sa.sa_family)
         return 0;
@@ -1609,6 +2724,16 @@ int equal_addr(const sockaddr_any* a, const sockaddr_any* b) {
     return 0; /*  not reached   */
 }
 
+/*  Which of the flow identities the probe uses (0 without ecmp or mda)  */
+unsigned int flow_index(const probe* pb) {
+    if (mda)
+        return pb->flow;
+    if (!ecmp)
+        return 0;
+
+    return ((pb - probes) % probes_per_hop) % ecmp;
+}
+
 void bind_socket(int sk, probe* pb) {
     sockaddr_any *addr, tmp;
 
@@ -1625,15 +2750,18 @@ void bind_socket(int sk, probe* pb) {
     else
         addr = &src_addr;
 
-    if (ecmp && pb) {
-        unsigned int np = (pb - probes) % probes_per_hop;
-        unsigned int flow_idx = np % ecmp;
+    if ((ecmp || mda) && pb) {
+        unsigned int flow_idx = flow_index(pb);
         uint16_t port = ntohs(addr->sin.sin_port); /* same offset for sin6 */
 
         if (port || (module && (!strcmp(module, "udp") || !strcmp(module, "tcp") || !strcmp(module, "default")))) {
             if (!port)
                 port = DEF_START_PORT; /* arbitrary base for rotation if not specified */
             port += flow_idx;
+            if (addr != &tmp) { /* keep src_addr's port as the base */
+                tmp = *addr;
+                addr = &tmp;
+            }
             if (addr->sa.sa_family == AF_INET6)
                 addr->sin6.sin6_port = htons(port);
             else
@@ -1699,6 +2827,9 @@ void use_recverr(int sk) {
 }
 
 void set_ttl(int sk, int ttl) {
+    if (xdp_tx)
+        xdp_tx_set_ttl(sk, ttl);
+
     if (af == AF_INET) {
         if (setsockopt(sk, SOL_IP, IP_TTL, &ttl, sizeof(ttl)) < 0)
             error("setsockopt IP_TTL");
@@ -1709,25 +2840,6 @@ void set_ttl(int sk, int ttl) {
     }
 }
 
-int do_send(int sk, const void* data, size_t len, const sockaddr_any* addr) {
-    int res;
-
-    if (!addr || raw_can_connect())
-        res = send(sk, data, len, 0);
-    else
-        res = sendto(sk, data, len, 0, &addr->sa, sizeof(*addr));
-
-    if (res < 0) {
-        if (errno == ENOBUFS || errno == EAGAIN)
-            return res;
-        if (errno == EMSGSIZE || errno == EHOSTUNREACH)
-            return 0;  /*  recverr will say more...  */
-        error("send"); /*  not recoverable   */
-    }
-
-    return res;
-}
-
 int raw_can_connect(void) {
     return 1;
 }
@@ -13,12 +13,10 @@
 
 #include <clif.h>
 
-union common_sockaddr {
-    struct sockaddr sa;
-    struct sockaddr_in sin;
-    struct sockaddr_in6 sin6;
-};
-typedef union common_sockaddr sockaddr_any;
+#include "../src/core/types.h" /*  sockaddr_any   */
+#include "../src/core/scheduler.h"
+#include "../src/core/hop_stats.h"
+#include "../src/core/hdr_hist.h"
 
 struct probe_struct {
     int done;
@@ -32,11 +30,50 @@ struct probe_struct {
     int ifindex_out;
     int sk;
     int seq;
+    unsigned int flow; /*  multipath detection's flow   */
     char* ext;
     char err_str[32]; /*  assume enough   */
 };
 typedef struct probe_struct probe;
 
+struct trace_struct {
+    const char* name;
+    sockaddr_any addr;
+    probe* probes; /*  slice of the global probe table   */
+    unsigned int num_probes;
+    unsigned int first_hop;
+    unsigned int max_hops;
+    unsigned int start;   /*  first probe not done yet   */
+    unsigned int end;     /*  after the final hop, once known   */
+    unsigned int printed; /*  first probe not reported yet   */
+    int consecutive_losses;
+    ProbeScheduler sched;  /*  the in-flight window   */
+    HopStats* stats;       /*  per hop, in continuous mode   */
+    sockaddr_any* hop_res; /*  the latest to answer, ditto   */
+    HdrHist* hists;        /*  per hop RTTs in us, for JSONL   */
+    int state;             /*  TRACE_PENDING etc.   */
+    int reported; /*  header already printed   */
+    unsigned int leased; /*  flows with the flow label leased on their shared socket   */
+};
+typedef struct trace_struct trace;
+
+struct probe_index_struct {
+    int* keys;
+    probe** values;
+    unsigned int size; /*  power of two   */
+    unsigned int count;
+};
+typedef struct probe_index_struct probe_index;
+
+#define TRACE_PENDING 0
+#define TRACE_RUNNING 1
+#define TRACE_DONE 2
+
+/*  For a quote got below the sockets, `sk' is -1 and `buf' at the
+   quoted transport header, the module's `header_len' not skipped.
+*/
+typedef probe* (*check_reply_t)(int sk, int err, sockaddr_any* from, char* buf, size_t len);
+
 struct tr_module_struct {
     struct tr_module_struct* next;
     const char* name;
@@ -44,6 +81,9 @@ struct tr_module_struct {
     void (*send_probe)(probe* pb, int ttl);
     void (*recv_probe)(int fd, int revents);
     void (*expire_probe)(probe* pb);
+    check_reply_t check_reply; /*  for errors got below the sockets (AF_XDP), if supported   */
+    void (*set_dest)(const sockaddr_any* dest); /*  batch mode, if supported   */
+    void (*send_batch)(probe** pbs, const int* ttls, unsigned int num); /*  all at once, if supported   */
     CLIF_option* options; /*  per module options, if any   */
     int one_per_time;     /*  no simultaneous probes   */
     size_t header_len;    /*  additional header length (aka for udp)   */
@@ -59,6 +99,8 @@ typedef struct tr_module_struct tr_module;
 #define DEF_DCCP_PORT DEF_START_PORT /*  is it a good choice?...  */
 #define DEF_RAW_PROT 253             /*  for experimentation and testing, rfc3692  */
 
+#define MAX_PROBES 10 /*  per hop   */
+
 extern int debug;
 
 void error(const char* str) __attribute__((noreturn));
@@ -68,60 +110,127 @@ const char* addr2str(const sockaddr_any* addr);
 
 double get_time(void);
 void tune_socket(int sk, probe* pb);
+void lease_flowlabel(int sk, probe* pb);
 void parse_icmp_res(probe* pb, int type, int code, int info);
 void probe_done(probe* pb);
 
-typedef probe* (*check_reply_t)(int sk, int err, sockaddr_any* from, char* buf, size_t len);
 void recv_reply(int sk, int err, check_reply_t check_reply);
+void recv_quote(const sockaddr_any* from, sockaddr_any* dest, char* buf, size_t len, int type, int code, int info,
+                double recv_time);
 
 int equal_addr(const sockaddr_any* a, const sockaddr_any* b);
 
 probe* probe_by_seq(int seq);
 probe* probe_by_sk(int sk);
+trace* probe_trace(const probe* pb);
 
+void index_add(probe_index* idx, int key, probe* pb);
+probe* index_find(const probe_index* idx, int key);
+void index_del(probe_index* idx, int key, const probe* pb);
+void index_free(probe_index* idx);
+
+int parse_target_line(char* line, char** host_p, unsigned int* first_hop_p, unsigned int* max_hops_p);
+
+unsigned int flow_index(const probe* pb);
 void bind_socket(int sk, probe* pb);
 void use_timestamp(int sk);
 void use_recv_ttl(int sk);
 void use_recverr(int sk);
 void set_ttl(int sk, int ttl);
 int do_send(int sk, const void* data, size_t len, const sockaddr_any* addr);
+int do_send_ttl(int sk, const void* data, size_t len, const sockaddr_any* addr, int ttl);
+int do_send_batch(int sk, const void* data, size_t len, const sockaddr_any* addrs, const int* ttls, probe* const* pbs,
+                  unsigned int num);
 
+typedef void (*poll_handler_t)(int fd, int revents, void* data);
 void add_poll(int fd, int events);
+void add_poll_handler(int fd, int events, poll_handler_t handler, void* data);
 void del_poll(int fd);
 void do_poll(double timeout, void (*callback)(int fd, int revents));
 
 void handle_extensions(probe* pb, char* buf, int len, int step);
-const char* get_as_path(const char* query);
+int as_init(void);
+void as_query(const sockaddr_any* addr, double until);
+const char* as_path(const sockaddr_any* addr, double* until_p);
+
+void resolve_size(unsigned int num_hops);
+void resolve_addr(const sockaddr_any* addr, double until);
+const char* resolve_lookup(const sockaddr_any* addr, double* until_p);
+void resolve_cache(const char* path);
+void resolve_as_db(const char* path);
+void resolve_as(const sockaddr_any* addr, double until);
+const char* resolve_as_path(const sockaddr_any* addr, double* until_p);
+
+void ratelimit_init(unsigned int dests, const double global[2], const double dest[2], const double router[2],
+                    double now);
+double ratelimit_send(unsigned int dest, const sockaddr_any* router, double now);
+void ratelimit_refund(unsigned int dest, double now);
+void ratelimit_reply(const sockaddr_any* router, double now);
+
+void mda_init(unsigned int first_hop, unsigned int max_hops, unsigned int max_flows, double confidence);
+int mda_next(int* ttl_p, unsigned int* flow_p);
+void mda_result(int ttl, const probe* pb);
+unsigned int mda_num_ifaces(int ttl);
+const sockaddr_any* mda_iface(int ttl, unsigned int i);
+int mda_linked(int ttl, unsigned int prev, unsigned int i);
+unsigned int mda_probes_sent(void);
 
 int raw_can_connect(void);
 
 unsigned int random_seq(void);
 uint16_t in_csum(const void* ptr, size_t len);
+uint16_t csum_replace2(uint16_t check, uint16_t from, uint16_t to);
+uint16_t csum_replace4(uint16_t check, uint32_t from, uint32_t to);
 
 void tr_register_module(tr_module* module);
 const tr_module* tr_get_module(const char* name);
 
 void tr_report_header(const char* dst_name, const sockaddr_any* dst_addr, unsigned int max_hops, size_t packet_len);
 void tr_report_probe(probe* pb);
-void tr_report_end(void);
+void tr_report_end(trace* tr);
 
 void tr_export_jsonl_header(const char* dst_name,
                             const sockaddr_any* dst_addr,
                             unsigned int max_hops,
                             size_t packet_len);
 void tr_export_jsonl_probe(probe* pb);
-void tr_export_jsonl_end(void);
+void tr_export_jsonl_end(const trace* tr);
+void tr_export_jsonl_stats(const trace* tr, unsigned int round, unsigned int ttl);
+void tr_export_jsonl_bpf_histogram(unsigned int ttl, const uint64_t* counts);
 
 int bpf_init(const char* obj_path);
 int bpf_decode_event(void* data, size_t data_sz);
-void bpf_poll(int fd, int revents);
+void bpf_set_echo_ident(unsigned int ident);
 void bpf_print_histograms(void);
+void bpf_export_histograms(void);
 void bpf_cleanup(void);
 
-int xdp_init(const char* ifname, const char* obj_path);
-void xdp_poll(int fd, int revents);
+#define XDP_TX_HDR_MAX (14 + 40) /*  ethernet and ipv6   */
+
+int xdp_init(const char* ifname, const char* obj_path, int tx, unsigned int queues, unsigned int busy_poll);
+int xdp_decode_frame(const uint8_t* frame, uint32_t len, double recv_time);
+size_t xdp_build_template(uint8_t* hdr, const uint8_t src_mac[6], const uint8_t dst_mac[6], const sockaddr_any* src,
+                          const sockaddr_any* dest);
+size_t xdp_build_frame(uint8_t* frame, size_t size, const uint8_t* tmpl, int protocol, int ttl, int tos,
+                       const sockaddr_any* local, const sockaddr_any* dest, const void* data, size_t len);
+struct xdp_probe_key;
+void xdp_make_key(struct xdp_probe_key* key, int protocol, int dgram, const sockaddr_any* local,
+                  const sockaddr_any* dest, const void* data, size_t len);
+void xdp_track(int sk, const void* data, size_t len, const sockaddr_any* dest, double timeout);
+void xdp_track_batch(int sk, const void* data, size_t len, const sockaddr_any* dests, probe* const* pbs,
+                     unsigned int num, double timeout);
+void xdp_track_probe(const probe* pb);
+void xdp_untrack(const probe* pb);
+int xdp_send(int sk, const void* data, size_t len, const sockaddr_any* dest, int ttl);
+void xdp_tx_set_ttl(int sk, int ttl);
+void xdp_tx_forget(int sk);
+double xdp_tx_flush(void);
+unsigned int xdp_tx_count(void);
 void xdp_cleanup(void);
 
+int neigh_lookup(int ifindex, const sockaddr_any* dest, uint8_t mac[6], sockaddr_any* src);
+void neigh_cleanup(void);
+
 #define TR_MODULE(MOD)                                           \
     static void __init_##MOD(void) __attribute__((constructor)); \
     static void __init_##MOD(void) {                             \
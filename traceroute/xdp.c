@@ -5,57 +5,264 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <net/if.h>
+#include <net/if_arp.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+#include <netinet/ether.h>
 #include <xdp/xsk.h>
 #include <xdp/libxdp.h>
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 
 #include "traceroute.h"
+#include "../src/io/parse.h"
+#include "../bpf/xdp_probe.h"
 
-#define NUM_FRAMES 4096
 #define FRAME_SIZE XSK_UMEM__DEFAULT_FRAME_SIZE
-#define UMEM_SIZE (NUM_FRAMES * FRAME_SIZE)
+#define RX_FRAMES 512  /*  per queue, all in its fill ring   */
+#define TX_FRAMES 2048 /*  after the rx ones   */
+#define HUGE_PAGE (2 << 20)
+#define RX_BATCH 64
 
-struct xsk_socket_info {
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+#define TX_SOCKS 1024     /*  by fd   */
+#define TX_TEMPLATES 1024 /*  hash buckets, by destination   */
+#define TX_SPIN 0.001     /*  for the completions, in seconds   */
+#define TX_RETRY 0.05     /*  for an unresolved neighbour, in seconds   */
+#define TRACK_BATCH 64    /*  keys per bpf map batch syscall   */
+
+/*  An XSK bound to one rx queue, all of them sharing the UMEM   */
+struct xsk_queue {
     struct xsk_ring_prod fq;
     struct xsk_ring_cons cq;
-    struct xsk_ring_prod tx;
     struct xsk_ring_cons rx;
+    struct xsk_socket* xsk;
+    uint64_t refill[RX_FRAMES]; /*  received, not back in the fill ring yet   */
+    unsigned int refill_num;
+    int busy_poll;
+};
+
+struct xsk_socket_info {
     struct xsk_umem* umem;
     void* buffer;
-    struct xsk_socket* xsk;
+    size_t size;
+    unsigned int num_queues;
+    struct xsk_queue* queues;
+
+    struct xsk_ring_prod tx;     /*  of the first queue   */
+    uint64_t tx_free[TX_FRAMES]; /*  frames not in the tx or completion rings   */
+    unsigned int tx_free_num;
+    unsigned int tx_pending; /*  submitted, not completed yet   */
+};
+
+/*  What the kernel would put in the packets of a sending socket   */
+struct tx_sock {
+    int known; /*  1 ok, -1 unsuitable   */
+    int dgram;
+    int protocol;
+    int ttl;
+    int tos;
+    sockaddr_any local;
+};
+
+/*  The headers in front of the packets to a destination   */
+struct tx_template {
+    struct tx_template* next;
+    sockaddr_any dest;
+    int ok;       /*  0 when the route or the neighbour are not there   */
+    double retry; /*  when to look again, while the neighbour resolves   */
+    uint8_t hdr[XDP_TX_HDR_MAX];
 };
 
 static struct xsk_socket_info* xsk_info = NULL;
 static struct xdp_program* xdp_prog = NULL;
 
-static struct xsk_socket_info* xsk_configure_umem(void) {
+static int tx_ifindex = 0; /*  non-zero when transmitting   */
+static uint8_t tx_mac[ETH_ALEN];
+static struct tx_sock tx_socks[TX_SOCKS];
+static struct tx_template* tx_templates[TX_TEMPLATES];
+static uint16_t tx_ip_id = 0;
+static unsigned int tx_count = 0; /*  frames put on the tx ring so far   */
+
+static int inflight_fd = -1; /*  the xdp program's `inflight' map   */
+
+/*  The key each probe got in the `inflight' map, by probe index   */
+struct tracked {
+    int set;
+    struct xdp_probe_key key;
+};
+
+extern probe* probes;
+
+static struct tracked* tracked = NULL;
+static unsigned int tracked_max = 0;
+static const probe* track_pb = NULL; /*  whom the xdp_track() calls are for   */
+static struct xdp_probe_key untrack_keys[TRACK_BATCH];
+static unsigned int untrack_num = 0;
+
+/*  Realtime minus monotonic, as the xdp program stamps by the latter   */
+static double clock_offset = 0;
+
+static void xdp_poll(int fd, int revents, void* data);
+
+/*  Backed by huge pages when there are some, to save the TLB misses
+   on the way through the frames.
+*/
+static void* umem_alloc(size_t* size) {
+    size_t huge = (*size + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+    void* area;
+
+    area = mmap(NULL, huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (area != MAP_FAILED) {
+        *size = huge;
+        return area;
+    }
+
+    area = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+    return area != MAP_FAILED ? area : NULL;
+}
+
+static struct xsk_socket_info* xsk_configure_umem(unsigned int num_queues) {
     struct xsk_socket_info* info;
-    void* packet_buffer;
-    int ret;
+    struct xsk_umem_config cfg = {
+        .fill_size = RX_FRAMES,
+        .comp_size = TX_FRAMES,
+        .frame_size = FRAME_SIZE,
+        .frame_headroom = XSK_UMEM__DEFAULT_FRAME_HEADROOM,
+        .flags = XSK_UMEM__DEFAULT_FLAGS,
+    };
 
     info = calloc(1, sizeof(*info));
     if (!info)
         return NULL;
 
-    ret = posix_memalign(&packet_buffer, getpagesize(), UMEM_SIZE);
-    if (ret)
-        return NULL;
+    info->queues = calloc(num_queues, sizeof(*info->queues));
+    if (!info->queues)
+        return info;
+    info->num_queues = num_queues;
 
-    ret = xsk_umem__create(&info->umem, packet_buffer, UMEM_SIZE, &info->fq, &info->cq, NULL);
-    if (ret)
-        return NULL;
+    info->size = (size_t)(num_queues * RX_FRAMES + TX_FRAMES) * FRAME_SIZE;
+    info->buffer = umem_alloc(&info->size);
+    if (!info->buffer)
+        return info;
+
+    /*  the first queue's rings are the UMEM's ones   */
+    if (xsk_umem__create(&info->umem, info->buffer, info->size, &info->queues[0].fq, &info->queues[0].cq, &cfg))
+        info->umem = NULL;
 
-    info->buffer = packet_buffer;
     return info;
 }
 
-int xdp_init(const char* ifname, const char* obj_path) {
+/*  Give the whole fill ring of queue `n' its own RX_FRAMES frames,
+   they are recycled in the same ring. The TX frames are after all of them.
+*/
+static int xsk_populate(struct xsk_socket_info* info, unsigned int n) {
+    struct xsk_queue* q = &info->queues[n];
+    uint64_t base = (uint64_t)n * RX_FRAMES * FRAME_SIZE;
+    uint32_t idx;
+    unsigned int i;
+
+    if (xsk_ring_prod__reserve(&q->fq, RX_FRAMES, &idx) != RX_FRAMES)
+        return -1;
+
+    for (i = 0; i < RX_FRAMES; i++)
+        *xsk_ring_prod__fill_addr(&q->fq, idx + i) = base + (uint64_t)i * FRAME_SIZE;
+
+    xsk_ring_prod__submit(&q->fq, RX_FRAMES);
+
+    if (n == 0) {
+        base = (uint64_t)info->num_queues * RX_FRAMES * FRAME_SIZE;
+
+        for (i = 0; i < TX_FRAMES; i++)
+            info->tx_free[i] = base + (uint64_t)i * FRAME_SIZE;
+        info->tx_free_num = TX_FRAMES;
+    }
+
+    return 0;
+}
+
+/*  Replies are spread over all the rx queues by RSS   */
+static unsigned int rx_queues(const char* ifname) {
+    struct ethtool_channels ch = {.cmd = ETHTOOL_GCHANNELS};
+    struct ifreq ifr;
+    unsigned int num = 1;
+    int sk;
+
+    sk = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sk < 0)
+        return num;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    ifr.ifr_data = (void*)&ch;
+
+    if (ioctl(sk, SIOCETHTOOL, &ifr) == 0 && ch.combined_count + ch.rx_count > 0)
+        num = ch.combined_count + ch.rx_count;
+    close(sk);
+
+    return num < XDP_MAX_QUEUES ? num : XDP_MAX_QUEUES;
+}
+
+/*  The napi of the queue is run from our recvfrom() and poll() then,
+   rather than from the interrupts.
+*/
+static void set_busy_poll(int fd, unsigned int usecs) {
+    int val = 1;
+
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val, sizeof(val));
+    val = usecs;
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val));
+    val = RX_BATCH;
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &val, sizeof(val));
+    /*  foo on errors, it just is not as fast   */
+}
+
+static int get_hwaddr(const char* ifname, uint8_t mac[ETH_ALEN]) {
+    struct ifreq ifr;
+    int sk, ret;
+
+    sk = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sk < 0)
+        return -1;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+
+    ret = ioctl(sk, SIOCGIFHWADDR, &ifr);
+    close(sk);
+
+    if (ret < 0 || ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)
+        return -1;
+
+    memcpy(mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+    return 0;
+}
+
+int xdp_init(const char* ifname, const char* obj_path, int tx, unsigned int queues, unsigned int busy_poll) {
     const char* xdp_objs[] = {obj_path, "xdp_probe.bpf.o", "bpf/xdp_probe.bpf.o",
                               "/usr/share/traceroute/xdp_probe.bpf.o", NULL};
     int i;
+    unsigned int n;
     const char* found_path = NULL;
+    struct timespec real, mono;
 
     for (i = 0; xdp_objs[i]; i++) {
         if (access(xdp_objs[i], R_OK) == 0) {
@@ -92,101 +299,826 @@ int xdp_init(const char* ifname, const char* obj_path) {
         }
     }
 
-    xsk_info = xsk_configure_umem();
-    if (!xsk_info)
+    if (!queues)
+        queues = rx_queues(ifname);
+    if (queues > XDP_MAX_QUEUES)
         return -1;
 
-    struct xsk_socket_config xsk_cfg = {
-        .rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
-        .tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
-        .libxdp_flags = XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD,
-        .bind_flags = XDP_USE_NEED_WAKEUP,
-    };
-
-    int ret = xsk_socket__create(&xsk_info->xsk, ifname, 0, xsk_info->umem, &xsk_info->rx, &xsk_info->tx, &xsk_cfg);
-    if (ret)
+    xsk_info = xsk_configure_umem(queues);
+    if (!xsk_info || !xsk_info->umem)
         return -1;
 
-    // We also need to add the XSK to the XSKMAP in the BPF program
+    // The XSK of each queue goes to the XSKMAP, by rx_queue_index
     int xsk_map_fd = bpf_object__find_map_fd_by_name(bpf_obj, "xsks");
     if (xsk_map_fd < 0)
         return -1;
 
-    int key = 0;  // rx_queue_index, simplified
-    int fd = xsk_socket__fd(xsk_info->xsk);
-    ret = bpf_map_update_elem(xsk_map_fd, &key, &fd, 0);
-    if (ret)
+    // Without it (an older object), all the icmp errors are redirected
+    inflight_fd = bpf_object__find_map_fd_by_name(bpf_obj, "inflight");
+
+    for (n = 0; n < queues; n++) {
+        struct xsk_queue* q = &xsk_info->queues[n];
+        struct xsk_socket_config xsk_cfg = {
+            .rx_size = RX_FRAMES,
+            .tx_size = n == 0 ? TX_FRAMES : 0,
+            .libxdp_flags = XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD,
+            .bind_flags = XDP_USE_NEED_WAKEUP,
+        };
+
+        // Only the first queue transmits
+        int ret = xsk_socket__create_shared(&q->xsk, ifname, n, xsk_info->umem, &q->rx, n == 0 ? &xsk_info->tx : NULL,
+                                            &q->fq, &q->cq, &xsk_cfg);
+        if (ret)
+            return -1;
+
+        if (xsk_populate(xsk_info, n) < 0)
+            return -1;
+
+        int fd = xsk_socket__fd(q->xsk);
+
+        if (busy_poll) {
+            set_busy_poll(fd, busy_poll);
+            q->busy_poll = 1;
+        }
+
+        if (bpf_map_update_elem(xsk_map_fd, &n, &fd, 0))
+            return -1;
+
+        add_poll_handler(fd, POLLIN, xdp_poll, q);
+    }
+
+    if (clock_gettime(CLOCK_REALTIME, &real) == 0 && clock_gettime(CLOCK_MONOTONIC, &mono) == 0)
+        clock_offset = (real.tv_sec - mono.tv_sec) + (real.tv_nsec - mono.tv_nsec) / 1e9;
+
+    if (tx) {
+        if (get_hwaddr(ifname, tx_mac) < 0)
+            return -1;
+        tx_ifindex = ifindex;
+    }
+
+    return 0;
+}
+
+/*  Feed an icmp error frame from the XSK to the probe it quotes.
+   The frame is parsed in place, in the UMEM.
+*/
+int xdp_decode_frame(const uint8_t* frame, uint32_t len, double recv_time) {
+    const struct ethhdr* eth = (const struct ethhdr*)frame;
+    const uint8_t* l3 = frame + sizeof(*eth);
+    sockaddr_any from = {{0}};
+    sockaddr_any dest = {{0}};
+    QuotedPacket quote;
+    const uint8_t* quoted;
+    size_t l3_len, quoted_len;
+    int type, code, info = 0;
+    uint16_t port = 0;
+
+    if (len < sizeof(*eth))
+        return -EINVAL;
+    l3_len = len - sizeof(*eth);
+
+    if (eth->h_proto == htons(ETH_P_IP)) {
+        IPv4Packet ip;
+        ICMPPacket icmp;
+
+        if (parse_ipv4(l3, l3_len, &ip) < 0 || ip.hdr->protocol != IPPROTO_ICMP)
+            return 0;
+        if (parse_icmp(ip.payload, ip.payload_len, &icmp) < 0)
+            return 0;
+
+        type = icmp.hdr->type;
+        code = icmp.hdr->code;
+        if (type != ICMP_TIME_EXCEEDED && type != ICMP_DEST_UNREACH)
+            return 0;
+        if (type == ICMP_DEST_UNREACH && code == ICMP_FRAG_NEEDED)
+            info = ntohs(icmp.hdr->un.frag.mtu);
+
+        if (parse_icmp_quote(icmp.payload, icmp.payload_len, 0, &quote) < 0)
+            return 0;
+
+        from.sin.sin_family = AF_INET;
+        from.sin.sin_addr.s_addr = ip.hdr->saddr;
+        dest.sin.sin_family = AF_INET;
+        dest.sin.sin_addr.s_addr = quote.ip.ipv4.hdr->daddr;
+
+        quoted = quote.ip.ipv4.payload;
+        quoted_len = quote.ip.ipv4.payload_len;
+    }
+    else if (eth->h_proto == htons(ETH_P_IPV6)) {
+        const struct ip6_hdr* ip6 = (const struct ip6_hdr*)l3;
+        const uint8_t* l4;
+        size_t l4_len;
+        uint8_t proto;
+        ICMPv6Packet icmp6;
+
+        if (ipv6_find_payload(l3, l3_len, &proto, &l4, &l4_len) < 0 || proto != IPPROTO_ICMPV6)
+            return 0;
+        if (parse_icmpv6(l4, l4_len, &icmp6) < 0)
+            return 0;
+
+        type = icmp6.hdr->icmp6_type;
+        code = icmp6.hdr->icmp6_code;
+        if (type != ICMP6_TIME_EXCEEDED && type != ICMP6_DST_UNREACH)
+            return 0;
+
+        if (parse_icmp_quote(icmp6.payload, icmp6.payload_len, 1, &quote) < 0)
+            return 0;
+        /*  past the quoted extension headers, if any   */
+        if (ipv6_find_payload(icmp6.payload, icmp6.payload_len, &proto, &quoted, &quoted_len) < 0)
+            return 0;
+
+        from.sin6.sin6_family = AF_INET6;
+        memcpy(&from.sin6.sin6_addr, &ip6->ip6_src, sizeof(from.sin6.sin6_addr));
+        dest.sin6.sin6_family = AF_INET6;
+        memcpy(&dest.sin6.sin6_addr, &quote.ip.ipv6.hdr->ip6_dst, sizeof(dest.sin6.sin6_addr));
+    }
+    else
+        return 0;
+
+    if (quote.transport_proto == IPPROTO_UDP)
+        port = quote.transport.udp.hdr->dest;
+    else if (quote.transport_proto == IPPROTO_TCP)
+        port = quote.transport.tcp.hdr->dest;
+
+    if (from.sa.sa_family == AF_INET6)
+        dest.sin6.sin6_port = port;
+    else
+        dest.sin.sin_port = port;
+
+    recv_quote(&from, &dest, (char*)quoted, quoted_len, type, code, info, recv_time);
+
+    return 0;
+}
+
+/*  The driver's receive time, if the xdp program could put it   */
+static double frame_time(uint8_t* pkt) {
+    struct xdp_rx_meta* meta = (struct xdp_rx_meta*)(pkt - sizeof(*meta));
+    double recv_time;
+
+    if (meta->magic != XDP_RX_META_MAGIC)
+        return get_time();
+
+    recv_time = meta->rx_time_ns / 1e9 + clock_offset;
+    meta->magic = 0; /*  the frame is reused   */
+
+    return recv_time;
+}
+
+/*  Frames go back to the fill ring as much as it takes them now, the
+   rest waits for the next poll instead of spinning here. As each queue
+   has exactly as many frames as its fill ring, it always takes them
+   all in the end.
+*/
+static void xsk_refill(struct xsk_queue* q) {
+    uint32_t idx;
+    unsigned int i, n;
+
+    n = xsk_ring_prod__reserve(&q->fq, q->refill_num, &idx);
+    if (!n)
+        return;
+
+    for (i = 0; i < n; i++)
+        *xsk_ring_prod__fill_addr(&q->fq, idx + i) = q->refill[--q->refill_num];
+
+    xsk_ring_prod__submit(&q->fq, n);
+}
+
+static void xdp_poll(int fd, int revents, void* data) {
+    struct xsk_queue* q = data;
+    uint32_t idx_rx;
+    unsigned int i, rcvd;
+
+    rcvd = xsk_ring_cons__peek(&q->rx, RX_BATCH, &idx_rx);
+
+    for (i = 0; i < rcvd; i++) {
+        const struct xdp_desc* desc = xsk_ring_cons__rx_desc(&q->rx, idx_rx + i);
+        uint64_t addr = desc->addr;
+        uint8_t* pkt = xsk_umem__get_data(xsk_info->buffer, addr);
+
+        xdp_decode_frame(pkt, desc->len, frame_time(pkt));
+
+        q->refill[q->refill_num++] = addr;
+    }
+
+    if (rcvd)
+        xsk_ring_cons__release(&q->rx, rcvd);
+
+    if (q->refill_num)
+        xsk_refill(q);
+
+    /*  the driver sleeps until told there are frames to fill again   */
+    if (q->busy_poll || xsk_ring_prod__needs_wakeup(&q->fq))
+        recvfrom(fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+static uint32_t csum_add(uint32_t sum, const void* ptr, size_t len) {
+    const uint8_t* p = ptr;
+    uint16_t word;
+
+    for (; len > 1; p += 2, len -= 2) {
+        memcpy(&word, p, sizeof(word));
+        sum += word;
+    }
+    if (len)
+        sum += htons(*p << 8);
+
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum) {
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum += sum >> 16;
+
+    return ~sum & 0xffff;
+}
+
+/*  Ethernet and ip headers from `src' to `dest', the per packet fields
+   left zero. Returns the length.
+*/
+size_t xdp_build_template(uint8_t* hdr, const uint8_t src_mac[ETH_ALEN], const uint8_t dst_mac[ETH_ALEN],
+                          const sockaddr_any* src, const sockaddr_any* dest) {
+    struct ethhdr* eth = (struct ethhdr*)hdr;
+
+    memset(hdr, 0, XDP_TX_HDR_MAX);
+    memcpy(eth->h_dest, dst_mac, ETH_ALEN);
+    memcpy(eth->h_source, src_mac, ETH_ALEN);
+
+    if (dest->sa.sa_family == AF_INET6) {
+        struct ip6_hdr* ip6 = (struct ip6_hdr*)(eth + 1);
+
+        eth->h_proto = htons(ETH_P_IPV6);
+        /*  traffic class and flow label, as with IPV6_FLOWINFO_SEND   */
+        ip6->ip6_flow = htonl(6 << 28) | (dest->sin6.sin6_flowinfo & htonl(0x0fffffff));
+        ip6->ip6_src = src->sin6.sin6_addr;
+        ip6->ip6_dst = dest->sin6.sin6_addr;
+
+        return sizeof(*eth) + sizeof(*ip6);
+    }
+    else {
+        struct iphdr* ip = (struct iphdr*)(eth + 1);
+
+        eth->h_proto = htons(ETH_P_IP);
+        ip->version = 4;
+        ip->ihl = sizeof(*ip) >> 2;
+        ip->saddr = src->sin.sin_addr.s_addr;
+        ip->daddr = dest->sin.sin_addr.s_addr;
+
+        return sizeof(*eth) + sizeof(*ip);
+    }
+}
+
+/*  The whole frame of `data' sent to `dest' by a socket of `protocol',
+   as the kernel would build it: udp sockets get their header (from the
+   `local' port) here, other ones (raw and ping) send the transport
+   header in `data' already, icmpv6 still needs its checksum. A local
+   address, if any, replaces the template's source. `tos' is for IPv4,
+   for IPv6 the template has the traffic class.
+   Returns the length, or 0 if it does not fit in `size'.
+*/
+size_t xdp_build_frame(uint8_t* frame, size_t size, const uint8_t* tmpl, int protocol, int ttl, int tos,
+                       const sockaddr_any* local, const sockaddr_any* dest, const void* data, size_t len) {
+    const struct ethhdr* eth = (const struct ethhdr*)tmpl;
+    int v6 = eth->h_proto == htons(ETH_P_IPV6);
+    size_t ip_len = v6 ? sizeof(struct ip6_hdr) : sizeof(struct iphdr);
+    size_t l4_hdr = protocol == IPPROTO_UDP ? sizeof(struct udphdr) : 0;
+    size_t l4_len = l4_hdr + len;
+    uint8_t* l3 = frame + sizeof(*eth);
+    uint8_t* l4 = l3 + ip_len;
+    uint16_t* l4_sum = NULL;
+    uint32_t sum;
+
+    if (sizeof(*eth) + ip_len + l4_len > size || l4_len > 0xffff - ip_len)
+        return 0;
+
+    memcpy(frame, tmpl, sizeof(*eth) + ip_len);
+    memcpy(l4 + l4_hdr, data, len);
+
+    if (v6) {
+        struct ip6_hdr* ip6 = (struct ip6_hdr*)l3;
+
+        if (!IN6_IS_ADDR_UNSPECIFIED(&local->sin6.sin6_addr))
+            ip6->ip6_src = local->sin6.sin6_addr;
+        ip6->ip6_plen = htons(l4_len);
+        ip6->ip6_nxt = protocol;
+        ip6->ip6_hlim = ttl;
+
+        sum = csum_add(0, &ip6->ip6_src, 2 * sizeof(ip6->ip6_src));
+    }
+    else {
+        struct iphdr* ip = (struct iphdr*)l3;
+
+        if (local->sin.sin_addr.s_addr)
+            ip->saddr = local->sin.sin_addr.s_addr;
+        ip->tos = tos;
+        ip->tot_len = htons(ip_len + l4_len);
+        ip->id = htons(++tx_ip_id);
+        ip->ttl = ttl;
+        ip->protocol = protocol;
+        ip->check = 0;
+        ip->check = csum_fold(csum_add(0, ip, ip_len));
+
+        sum = csum_add(0, &ip->saddr, 2 * sizeof(ip->saddr));
+    }
+
+    if (protocol == IPPROTO_UDP) {
+        struct udphdr* uh = (struct udphdr*)l4;
+
+        uh->source = local->sin.sin_port; /*  same offset for sin6   */
+        uh->dest = dest->sin.sin_port;
+        uh->len = htons(l4_len);
+        uh->check = 0;
+        l4_sum = &uh->check;
+    }
+    else if (protocol == IPPROTO_ICMPV6) {
+        struct icmp6_hdr* icmp6 = (struct icmp6_hdr*)l4;
+
+        if (len < sizeof(*icmp6))
+            return 0;
+        icmp6->icmp6_cksum = 0;
+        l4_sum = &icmp6->icmp6_cksum;
+    }
+
+    if (l4_sum) {
+        uint16_t check;
+
+        sum += htons(protocol) + htons(l4_len);
+        check = csum_fold(csum_add(sum, l4, l4_len));
+        *l4_sum = check ? check : 0xffff;
+    }
+
+    return sizeof(*eth) + ip_len + l4_len;
+}
+
+/*  What the kernel would put in the packets sent by `sk'   */
+static int sock_info(int sk, struct tx_sock* ts) {
+    socklen_t len;
+    int type;
+
+    len = sizeof(type);
+    if (getsockopt(sk, SOL_SOCKET, SO_TYPE, &type, &len) < 0)
+        return -1;
+    len = sizeof(ts->protocol);
+    if (getsockopt(sk, SOL_SOCKET, SO_PROTOCOL, &ts->protocol, &len) < 0)
+        return -1;
+    len = sizeof(ts->local);
+    if (getsockname(sk, &ts->local.sa, &len) < 0)
+        return -1;
+
+    /*  udp, ping, or raw but without the ip header   */
+    ts->dgram = type == SOCK_DGRAM;
+    if (ts->dgram) {
+        if (ts->protocol != IPPROTO_UDP && ts->protocol != IPPROTO_UDPLITE && ts->protocol != IPPROTO_ICMP &&
+            ts->protocol != IPPROTO_ICMPV6)
+            return -1;
+    }
+    else if (type != SOCK_RAW || ts->protocol == IPPROTO_RAW)
         return -1;
 
-    add_poll(fd, POLLIN);
+    if (ts->local.sa.sa_family == AF_INET6) {
+        len = sizeof(ts->ttl);
+        getsockopt(sk, SOL_IPV6, IPV6_UNICAST_HOPS, &ts->ttl, &len);
+    }
+    else {
+        len = sizeof(ts->ttl);
+        getsockopt(sk, SOL_IP, IP_TTL, &ts->ttl, &len);
+        len = sizeof(ts->tos);
+        getsockopt(sk, SOL_IP, IP_TOS, &ts->tos, &len);
+    }
 
     return 0;
 }
 
-#include <netinet/ip.h>
-#include <netinet/ip6.h>
-#include <netinet/icmp6.h>
-#include <netinet/ip_icmp.h>
-#include <netinet/udp.h>
-#include <netinet/ether.h>
+/*  Cached by fd, for the sockets which live for the whole run
+   (see xdp_tx_forget() for the others).
+*/
+static struct tx_sock* tx_sock_get(int sk) {
+    struct tx_sock* ts;
+
+    if (sk < 0 || sk >= TX_SOCKS)
+        return NULL;
+
+    ts = &tx_socks[sk];
+    if (!ts->known)
+        ts->known = sock_info(sk, ts) == 0 ? 1 : -1;
+
+    return ts->known > 0 ? ts : NULL;
+}
+
+/*  Sockets ttls are cached, as do_send() takes the socket's one   */
+void xdp_tx_set_ttl(int sk, int ttl) {
+    struct tx_sock* ts;
 
-void xdp_poll(int fd, int revents) {
-    if (!xsk_info || fd != xsk_socket__fd(xsk_info->xsk))
+    if (!tx_ifindex)
         return;
 
-    uint32_t idx_rx, idx_fq;
-    unsigned int rcvd = xsk_ring_cons__peek(&xsk_info->rx, 16, &idx_rx);
-    if (!rcvd)
+    /*  not cached yet: sock_info() will find it   */
+    ts = sk >= 0 && sk < TX_SOCKS ? &tx_socks[sk] : NULL;
+    if (ts && ts->known > 0)
+        ts->ttl = ttl;
+}
+
+/*  The fd of a closed socket is reused by the next one   */
+void xdp_tx_forget(int sk) {
+    if (sk >= 0 && sk < TX_SOCKS)
+        tx_socks[sk].known = 0;
+}
+
+static unsigned int tx_hash(const sockaddr_any* addr) {
+    uint32_t h;
+
+    if (addr->sa.sa_family == AF_INET6) {
+        const uint32_t* w = (const uint32_t*)&addr->sin6.sin6_addr;
+
+        h = w[0] ^ w[1] ^ w[2] ^ w[3];
+    }
+    else
+        h = addr->sin.sin_addr.s_addr;
+
+    h ^= h >> 16;
+
+    return (h ^ (h >> 8)) % TX_TEMPLATES;
+}
+
+static int same_host(const sockaddr_any* a, const sockaddr_any* b) {
+    if (a->sa.sa_family != b->sa.sa_family)
+        return 0;
+    if (a->sa.sa_family == AF_INET6)
+        return !memcmp(&a->sin6.sin6_addr, &b->sin6.sin6_addr, sizeof(a->sin6.sin6_addr));
+
+    return a->sin.sin_addr.s_addr == b->sin.sin_addr.s_addr;
+}
+
+/*  Found once per destination, the failures are kept as well, to go
+   the kernel way at once. While the neighbour is being resolved,
+   it is looked up again each TX_RETRY seconds.
+*/
+static struct tx_template* tx_template_get(const sockaddr_any* dest) {
+    unsigned int h = tx_hash(dest);
+    struct tx_template* t;
+    uint8_t mac[ETH_ALEN];
+    sockaddr_any src;
+
+    for (t = tx_templates[h]; t; t = t->next) {
+        if (same_host(&t->dest, dest))
+            break;
+    }
+
+    if (t && (t->ok || !t->retry || get_time() < t->retry))
+        return t->ok ? t : NULL;
+
+    if (!t) {
+        t = calloc(1, sizeof(*t));
+        if (!t)
+            return NULL;
+
+        t->dest = *dest;
+        t->next = tx_templates[h];
+        tx_templates[h] = t;
+    }
+
+    if (neigh_lookup(tx_ifindex, dest, mac, &src) < 0) {
+        t->retry = errno == EAGAIN ? get_time() + TX_RETRY : 0;
+        return NULL;
+    }
+
+    xdp_build_template(t->hdr, tx_mac, mac, &src, dest);
+    t->ok = 1;
+
+    return t;
+}
+
+static void tx_reap(struct xsk_socket_info* info) {
+    uint32_t idx;
+    unsigned int i, n;
+
+    n = xsk_ring_cons__peek(&info->queues[0].cq, TX_FRAMES, &idx);
+    if (!n)
         return;
 
-    uint32_t ret = xsk_ring_prod__reserve(&xsk_info->fq, rcvd, &idx_fq);
-    while (ret != rcvd) {
-        ret = xsk_ring_prod__reserve(&xsk_info->fq, rcvd, &idx_fq);
+    for (i = 0; i < n; i++)
+        info->tx_free[info->tx_free_num++] = *xsk_ring_cons__comp_addr(&info->queues[0].cq, idx + i);
+
+    xsk_ring_cons__release(&info->queues[0].cq, n);
+    info->tx_pending -= n;
+}
+
+/*  The key of the `inflight' map for a probe of `data', sent from
+   `local' to `dest' by a socket of `protocol' (a datagram one if `dgram').
+*/
+void xdp_make_key(struct xdp_probe_key* key, int protocol, int dgram, const sockaddr_any* local,
+                  const sockaddr_any* dest, const void* data, size_t len) {
+    const uint8_t* p = data;
+
+    memset(key, 0, sizeof(*key));
+    key->protocol = protocol;
+    key->family = dest->sa.sa_family;
+
+    if (dest->sa.sa_family == AF_INET6)
+        memcpy(key->daddr, &dest->sin6.sin6_addr, sizeof(key->daddr));
+    else
+        key->daddr[0] = dest->sin.sin_addr.s_addr;
+
+    if (protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6) {
+        if (len < 8)
+            return;
+        /*  ping sockets put their port as the id   */
+        if (dgram)
+            key->sport = local->sin.sin_port;
+        else
+            memcpy(&key->sport, p + 4, sizeof(key->sport));
+        memcpy(&key->dport, p + 6, sizeof(key->dport));
+    }
+    else if (dgram) {
+        key->sport = local->sin.sin_port; /*  same offset for sin6   */
+        key->dport = dest->sin.sin_port;
     }
+    else if (protocol == IPPROTO_UDP || protocol == IPPROTO_TCP || protocol == IPPROTO_DCCP ||
+             protocol == IPPROTO_UDPLITE) {
+        if (len < 4)
+            return;
+        memcpy(&key->sport, p, sizeof(key->sport));
+        memcpy(&key->dport, p + 2, sizeof(key->dport));
+    }
+}
 
-    for (unsigned int i = 0; i < rcvd; i++) {
-        const struct xdp_desc* desc = xsk_ring_cons__rx_desc(&xsk_info->rx, idx_rx + i);
-        uint64_t addr = desc->addr;
-        uint32_t len = desc->len;
-        uint8_t* pkt = xsk_umem__get_data(xsk_info->buffer, addr);
+static uint64_t track_expires(double timeout) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec + (uint64_t)(timeout * 1e9);
+}
+
+/*  Remember the key of `pb', for xdp_untrack()   */
+static void track_set(const probe* pb, const struct xdp_probe_key* key) {
+    unsigned int i;
+
+    if (!pb || !probes || pb < probes)
+        return;
+
+    i = pb - probes;
+    if (i >= tracked_max) {
+        unsigned int n = tracked_max ? tracked_max : 256;
+        struct tracked* t;
+
+        while (n <= i)
+            n *= 2;
 
-        if (len > sizeof(struct ethhdr)) {
-            struct ethhdr* eth = (struct ethhdr*)pkt;
-            uint8_t* payload = pkt + sizeof(struct ethhdr);
-            uint32_t paylen = len - sizeof(struct ethhdr);
-
-            if (eth->h_proto == htons(ETH_P_IP) && paylen >= sizeof(struct iphdr)) {
-                struct iphdr* ip = (struct iphdr*)payload;
-                uint32_t ip_hlen = ip->ihl * 4;
-
-                if (paylen >= ip_hlen + sizeof(struct icmphdr) && ip->protocol == IPPROTO_ICMP) {
-                    struct icmphdr* icmp = (struct icmphdr*)(payload + ip_hlen);
-                    if (icmp->type == ICMP_TIME_EXCEEDED || icmp->type == ICMP_DEST_UNREACH) {
-                        // Original packet starts after ICMP header (8 bytes)
-                        // uint8_t* quoted = (uint8_t*)icmp + 8;
-                        // uint32_t quoted_len = paylen - (uintptr_t)((uint8_t*)quoted - payload);
-
-                        // We'd need to find the probe and call parse_icmp_res
-                        // But finding the probe from RAW data is what mod-udp does too.
-                    }
-                }
-            }
+        t = realloc(tracked, n * sizeof(*tracked));
+        if (!t)
+            return;
+
+        memset(t + tracked_max, 0, (n - tracked_max) * sizeof(*t));
+        tracked = t;
+        tracked_max = n;
+    }
+
+    tracked[i].key = *key;
+    tracked[i].set = 1;
+}
+
+/*  Delete the keys of the probes done meanwhile, before any new one
+   is put (the same key can come again, by a port wrapping around).
+*/
+static void untrack_flush(void) {
+    unsigned int done = 0;
+
+    while (done < untrack_num) {
+        uint32_t count = untrack_num - done;
+
+        if (bpf_map_delete_batch(inflight_fd, &untrack_keys[done], &count, NULL) == 0)
+            break;
+        done += count;
+
+        /*  already deleted by the xdp program, which got the reply   */
+        if (errno == ENOENT) {
+            done++;
+            continue;
         }
 
-        *xsk_ring_prod__fill_addr(&xsk_info->fq, idx_fq + i) = addr;
+        /*  no batches in this kernel   */
+        for (; done < untrack_num; done++)
+            bpf_map_delete_elem(inflight_fd, &untrack_keys[done]);
+    }
+
+    untrack_num = 0;
+}
+
+/*  The probe the following xdp_track() calls are for (NULL when none)   */
+void xdp_track_probe(const probe* pb) {
+    track_pb = pb;
+}
+
+/*  Tell the xdp program that the errors quoting this probe are ours,
+   for `timeout' seconds. `dest' is NULL for a connected socket.
+*/
+void xdp_track(int sk, const void* data, size_t len, const sockaddr_any* dest, double timeout) {
+    struct xdp_probe_key key;
+    struct tx_sock info, *ts;
+    sockaddr_any peer;
+    socklen_t alen = sizeof(peer);
+    uint64_t expires;
+
+    if (inflight_fd < 0)
+        return;
+
+    if (dest)
+        ts = tx_sock_get(sk);
+    else {
+        /*  a socket per probe, not to be cached by fd   */
+        memset(&info, 0, sizeof(info));
+        ts = sock_info(sk, &info) == 0 && getpeername(sk, &peer.sa, &alen) == 0 ? &info : NULL;
+        dest = &peer;
     }
+    if (!ts)
+        return;
+
+    xdp_make_key(&key, ts->protocol, ts->dgram, &ts->local, dest, data, len);
 
-    xsk_ring_prod__submit(&xsk_info->fq, rcvd);
-    xsk_ring_cons__release(&xsk_info->rx, rcvd);
+    if (untrack_num)
+        untrack_flush();
+
+    expires = track_expires(timeout);
+    bpf_map_update_elem(inflight_fd, &key, &expires, BPF_ANY);
+
+    track_set(track_pb, &key);
+}
+
+/*  The same for the probes of `pbs' (if not NULL) of the same `data' to
+   `num' destinations, as few bpf syscalls as possible.
+*/
+void xdp_track_batch(int sk, const void* data, size_t len, const sockaddr_any* dests, probe* const* pbs,
+                     unsigned int num, double timeout) {
+    static struct xdp_probe_key keys[TRACK_BATCH];
+    static uint64_t values[TRACK_BATCH];
+    struct tx_sock* ts;
+    unsigned int i, done = 0;
+    uint64_t expires;
+
+    if (inflight_fd < 0 || !(ts = tx_sock_get(sk)))
+        return;
+
+    if (untrack_num)
+        untrack_flush();
+
+    expires = track_expires(timeout);
+
+    while (done < num) {
+        uint32_t n = num - done, count;
+
+        if (n > TRACK_BATCH)
+            n = TRACK_BATCH;
+
+        for (i = 0; i < n; i++) {
+            xdp_make_key(&keys[i], ts->protocol, ts->dgram, &ts->local, &dests[done + i], data, len);
+            values[i] = expires;
+            if (pbs)
+                track_set(pbs[done + i], &keys[i]);
+        }
+
+        count = n;
+        if (bpf_map_update_batch(inflight_fd, keys, values, &count, NULL) < 0) {
+            /*  no batches in this kernel, or the map is full   */
+            for (i = count; i < n; i++)
+                bpf_map_update_elem(inflight_fd, &keys[i], &values[i], BPF_ANY);
+        }
+
+        done += n;
+    }
+}
+
+/*  The probe is done, its key has no use in the map anymore (the xdp
+   program deletes it by itself only for the replies it gets).
+*/
+void xdp_untrack(const probe* pb) {
+    unsigned int i;
+
+    if (inflight_fd < 0 || !probes || pb < probes)
+        return;
+
+    i = pb - probes;
+    if (i >= tracked_max || !tracked[i].set)
+        return;
+
+    if (untrack_num == TRACK_BATCH)
+        untrack_flush();
+
+    untrack_keys[untrack_num++] = tracked[i].key;
+    tracked[i].set = 0;
+}
+
+/*  Put a probe on the tx ring, instead of sending it by `sk' (the ttl
+   of which is used when `ttl' is negative). Nothing goes out until
+   xdp_tx_flush(). Returns `len', or -1 with EAGAIN when the ring is
+   full, or with EOPNOTSUPP when it has to go the kernel way.
+*/
+int xdp_send(int sk, const void* data, size_t len, const sockaddr_any* dest, int ttl) {
+    struct xsk_socket_info* info = xsk_info;
+    struct tx_sock* ts;
+    struct tx_template* t;
+    uint64_t addr;
+    size_t frame_len;
+    uint32_t idx;
+
+    if (!tx_ifindex || !info || !(ts = tx_sock_get(sk)) || (ts->dgram && ts->protocol == IPPROTO_UDPLITE) ||
+        !(t = tx_template_get(dest))) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    tx_reap(info);
+    if (!info->tx_free_num) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    addr = info->tx_free[info->tx_free_num - 1];
+    frame_len = xdp_build_frame(xsk_umem__get_data(info->buffer, addr), FRAME_SIZE, t->hdr, ts->protocol,
+                                ttl < 0 ? ts->ttl : ttl, ts->tos, &ts->local, dest, data, len);
+    if (!frame_len) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    if (xsk_ring_prod__reserve(&info->tx, 1, &idx) != 1) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    info->tx_free_num--;
+    xsk_ring_prod__tx_desc(&info->tx, idx)->addr = addr;
+    xsk_ring_prod__tx_desc(&info->tx, idx)->len = frame_len;
+    xsk_ring_prod__submit(&info->tx, 1);
+    info->tx_pending++;
+    tx_count++;
+
+    return len;
+}
+
+/*  To tell whether a probe has just been put on the ring (and so waits
+   for xdp_tx_flush()), or has gone the kernel way.
+*/
+unsigned int xdp_tx_count(void) {
+    return tx_count;
+}
+
+/*  Kick the driver for all the frames put by xdp_send(), and wait
+   (no more than TX_SPIN) for it to complete them. Returns that time,
+   to be the send time of the probes, or 0 if there was nothing to send.
+*/
+double xdp_tx_flush(void) {
+    struct xsk_socket_info* info = xsk_info;
+    double start, now;
+
+    if (!tx_ifindex || !info || !info->tx_pending)
+        return 0;
+
+    if (xsk_ring_prod__needs_wakeup(&info->tx))
+        sendto(xsk_socket__fd(info->queues[0].xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+
+    start = now = get_time();
+    for (;;) {
+        tx_reap(info);
+        if (!info->tx_pending || now - start > TX_SPIN)
+            break;
+        now = get_time();
+    }
+
+    return now;
 }
 
 void xdp_cleanup(void) {
+    unsigned int i;
+
+    neigh_cleanup();
+
+    for (i = 0; i < TX_TEMPLATES; i++) {
+        while (tx_templates[i]) {
+            struct tx_template* t = tx_templates[i];
+
+            tx_templates[i] = t->next;
+            free(t);
+        }
+    }
+
     if (xsk_info) {
-        if (xsk_info->xsk)
-            xsk_socket__delete(xsk_info->xsk);
+        for (i = 0; i < xsk_info->num_queues; i++) {
+            if (xsk_info->queues[i].xsk)
+                xsk_socket__delete(xsk_info->queues[i].xsk);
+        }
         if (xsk_info->umem)
             xsk_umem__delete(xsk_info->umem);
-        free(xsk_info->buffer);
+        if (xsk_info->buffer)
+            munmap(xsk_info->buffer, xsk_info->size);
+        free(xsk_info->queues);
         free(xsk_info);
+        xsk_info = NULL;
     }
+
+    free(tracked);
+    tracked = NULL;
+    tracked_max = 0;
+    untrack_num = 0;
+
+    inflight_fd = -1;
 }